@@ -0,0 +1,130 @@
+#include "Allocator.hpp"
+
+#include <cstdlib>
+#include <new>
+
+#ifdef NBODY_COUNT_ALLOCATIONS
+
+namespace
+{
+	// per thread, so the exporter, writer and trace threads do not show up in a measurement of the frame or step
+	// loop
+	thread_local uint64_t allocationCount = 0;
+}
+
+// Counting replacements of the global allocation functions. The default array and nothrow forms forward to these,
+// the over-aligned forms (alignas above the default new alignment) are replaced separately below.
+void* operator new(size_t size)
+{
+	dhh::memory::recordHeapAllocation();
+	if (void* pointer = std::malloc(size == 0 ? 1 : size))
+	{
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+	std::free(pointer);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	dhh::memory::recordHeapAllocation();
+	const size_t bytes = dhh::memory::alignUp(size == 0 ? 1 : size, static_cast<size_t>(alignment));
+#ifdef _WIN32
+	void* pointer = _aligned_malloc(bytes, static_cast<size_t>(alignment));
+#else
+	void* pointer = std::aligned_alloc(static_cast<size_t>(alignment), bytes);
+#endif
+	if (pointer != nullptr)
+	{
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+	dhh::memory::alignedFree(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept
+{
+	dhh::memory::alignedFree(pointer);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept
+{
+	dhh::memory::alignedFree(pointer);
+}
+
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept
+{
+	dhh::memory::alignedFree(pointer);
+}
+
+namespace dhh::memory
+{
+	void recordHeapAllocation()
+	{
+		++allocationCount;
+	}
+
+	uint64_t heapAllocationCount()
+	{
+		return allocationCount;
+	}
+
+	bool heapAllocationCountEnabled()
+	{
+		return true;
+	}
+}
+
+#else
+
+namespace dhh::memory
+{
+	void recordHeapAllocation()
+	{
+	}
+
+	uint64_t heapAllocationCount()
+	{
+		return 0;
+	}
+
+	bool heapAllocationCountEnabled()
+	{
+		return false;
+	}
+}
+
+#endif
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace dhh::memory
+{
+	constexpr size_t CacheLineSize = 64;
+	constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+	// Number of heap allocations (operator new and alignedAllocate) the calling thread made so far, only counted
+	// when built with NBODY_COUNT_ALLOCATIONS
+	uint64_t heapAllocationCount();
+	bool heapAllocationCountEnabled();
+	void recordHeapAllocation();
+
+	inline size_t alignUp(size_t value, size_t alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	// Cache-line aligned allocation. With hugePages, blocks of at least one huge page are aligned to it and
+	// marked for transparent huge pages so large body arrays need fewer TLB entries.
+	inline void* alignedAllocate(size_t bytes, bool hugePages = false)
+	{
+		bytes = std::max<size_t>(bytes, 1);
+		recordHeapAllocation();
+#ifdef _WIN32
+		void* pointer = _aligned_malloc(bytes, CacheLineSize);
+#else
+		const bool useHugePages = hugePages && bytes >= HugePageSize;
+		const size_t alignment = useHugePages ? HugePageSize : CacheLineSize;
+		void* pointer = std::aligned_alloc(alignment, alignUp(bytes, alignment));
+#ifdef MADV_HUGEPAGE
+		if (pointer != nullptr && useHugePages)
+		{
+			madvise(pointer, alignUp(bytes, alignment), MADV_HUGEPAGE);
+		}
+#endif
+#endif
+		if (pointer == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return pointer;
+	}
+
+	inline void alignedFree(void* pointer)
+	{
+#ifdef _WIN32
+		_aligned_free(pointer);
+#else
+		std::free(pointer);
+#endif
+	}
+
+	// Standard allocator returning cache-line (or huge page) aligned storage, for persistent arrays
+	template <typename T, bool HugePages = false>
+	struct AlignedAllocator
+	{
+		using value_type = T;
+
+		template <typename U>
+		struct rebind
+		{
+			using other = AlignedAllocator<U, HugePages>;
+		};
+
+		AlignedAllocator() noexcept = default;
+
+		template <typename U>
+		AlignedAllocator(const AlignedAllocator<U, HugePages>&) noexcept
+		{
+		}
+
+		T* allocate(size_t count)
+		{
+			return static_cast<T*>(alignedAllocate(count * sizeof(T), HugePages));
+		}
+
+		void deallocate(T* pointer, size_t)
+		{
+			alignedFree(pointer);
+		}
+
+		template <typename U>
+		bool operator==(const AlignedAllocator<U, HugePages>&) const noexcept
+		{
+			return true;
+		}
+
+		template <typename U>
+		bool operator!=(const AlignedAllocator<U, HugePages>&) const noexcept
+		{
+			return false;
+		}
+	};
+
+	// Fixed-size array of trivially copyable elements in aligned, optionally huge page backed storage.
+	// Pages are first touched by the thread pool workers with the same static partition that parallelFor
+	// uses later, so on NUMA machines every slice lands on the node of the worker processing it.
+	template <typename T>
+	class AlignedArray
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "AlignedArray holds plain data");
+
+	public:
+		AlignedArray() = default;
+
+		AlignedArray(size_t count, bool hugePages, dhh::thread::ThreadPool* pool = nullptr)
+		{
+			allocate(count, hugePages, pool);
+		}
+
+		~AlignedArray()
+		{
+			alignedFree(elements);
+		}
+
+		AlignedArray(const AlignedArray&) = delete;
+		AlignedArray& operator=(const AlignedArray&) = delete;
+
+		AlignedArray(AlignedArray&& other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		AlignedArray& operator=(AlignedArray&& other) noexcept
+		{
+			std::swap(elements, other.elements);
+			std::swap(count, other.count);
+			return *this;
+		}
+
+		void allocate(size_t newCount, bool hugePages, dhh::thread::ThreadPool* pool = nullptr)
+		{
+			alignedFree(elements);
+			elements = static_cast<T*>(alignedAllocate(newCount * sizeof(T), hugePages));
+			count = newCount;
+
+			T* data = elements;
+			const auto touch = [data](uint32_t, size_t begin, size_t end) {
+				memset(static_cast<void*>(data + begin), 0, (end - begin) * sizeof(T));
+			};
+			if (pool != nullptr)
+			{
+				pool->parallelFor(count, touch);
+			}
+			else
+			{
+				touch(0, 0, count);
+			}
+		}
+
+		T* data() const
+		{
+			return elements;
+		}
+
+		size_t size() const
+		{
+			return count;
+		}
+
+		T& operator[](size_t index) const
+		{
+			return elements[index];
+		}
+
+		T* begin() const
+		{
+			return elements;
+		}
+
+		T* end() const
+		{
+			return elements + count;
+		}
+
+	private:
+		T* elements = nullptr;
+		size_t count = 0;
+	};
+}
@@ -0,0 +1,432 @@
+#pragma once
+
+#include "Body.hpp"
+#include "Pipeline.hpp"
+#include "Shader.hpp"
+#include "ShaderCache.hpp"
+#include "VulkanBase.h"
+#include "VulkanInitializer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Push constants of tile.comp
+	struct TileParams
+	{
+		uint32_t targetCount;
+		uint32_t sourceCount;
+		uint32_t targetOffset;
+		uint32_t sourceOffset;
+	};
+
+	// Implementations of the tile force kernel, with identical bindings and push constants
+	enum class ForceKernel
+	{
+		Tiled,     // tile.comp, source bodies staged in shared memory
+		Subgroup,  // tile_subgroup.comp, source bodies passed around the subgroup with shuffles
+	};
+
+	inline const char* forceKernelName(ForceKernel kernel)
+	{
+		return kernel == ForceKernel::Subgroup ? "subgroup" : "tiled";
+	}
+
+	// Launch shape of the force kernel, applied as its specialization constants
+	struct KernelTuning
+	{
+		uint32_t workgroupSize = 32;
+		uint32_t sharedTile = 32;  // source bodies staged in shared memory per pass, tiled kernel only
+		uint32_t unroll = 1;
+		ForceKernel kernel = ForceKernel::Tiled;
+
+		const char* shaderName() const
+		{
+			return kernel == ForceKernel::Subgroup ? "tile_subgroup.comp" : "tile.comp";
+		}
+
+		dhh::shader::Specialization specialization() const
+		{
+			if (kernel == ForceKernel::Subgroup)
+			{
+				return dhh::shader::Specialization().set(0, workgroupSize).set(2, unroll);
+			}
+			return dhh::shader::Specialization().set(0, workgroupSize).set(1, sharedTile).set(2, unroll);
+		}
+
+		uint32_t groupCount(uint32_t targetCount) const
+		{
+			return (targetCount + workgroupSize - 1) / workgroupSize;
+		}
+	};
+
+	inline std::ostream& operator<<(std::ostream& stream, const KernelTuning& tuning)
+	{
+		stream << forceKernelName(tuning.kernel) << " kernel, workgroup " << tuning.workgroupSize;
+		if (tuning.kernel == ForceKernel::Tiled)
+		{
+			stream << ", shared tile " << tuning.sharedTile;
+		}
+		return stream << ", unroll " << tuning.unroll;
+	}
+
+	// Subgroup size when compute shaders support subgroup shuffles, 0 otherwise
+	inline uint32_t subgroupShuffleSize(VkPhysicalDevice physicalDevice)
+	{
+		VkPhysicalDeviceSubgroupProperties subgroup = {};
+		subgroup.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+		VkPhysicalDeviceProperties2 properties = {};
+		properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		properties.pNext = &subgroup;
+		vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+		const bool supported = (subgroup.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+			(subgroup.supportedOperations & VK_SUBGROUP_FEATURE_SHUFFLE_BIT);
+		return supported ? subgroup.subgroupSize : 0;
+	}
+
+	// Launch shape on a device that was never tuned: the subgroup kernel where shuffles are supported, the
+	// shared memory kernel otherwise
+	inline KernelTuning defaultKernel(VkPhysicalDevice physicalDevice)
+	{
+		KernelTuning tuning;
+		const uint32_t subgroupSize = subgroupShuffleSize(physicalDevice);
+		if (subgroupSize > 0)
+		{
+			tuning.kernel = ForceKernel::Subgroup;
+			tuning.workgroupSize = std::max(tuning.workgroupSize, subgroupSize);
+		}
+		return tuning;
+	}
+
+	// Fastest launch shape measured for one body count
+	struct TunedKernel
+	{
+		uint32_t bodyCount;
+		KernelTuning tuning;
+		double interactionsPerSecond;
+	};
+
+	// Measurements only hold for the device and driver they were taken on, so the file is named after the device
+	// UUID and driver version. It lives in the shader cache directory.
+	inline std::filesystem::path tuningPath(VkPhysicalDevice physicalDevice)
+	{
+		VkPhysicalDeviceIDProperties id = {};
+		id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+		VkPhysicalDeviceProperties2 properties = {};
+		properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		properties.pNext = &id;
+		vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+		std::ostringstream name;
+		name << "tuning-" << std::hex << std::setfill('0');
+		for (uint8_t byte : id.deviceUUID)
+		{
+			name << std::setw(2) << static_cast<unsigned>(byte);
+		}
+		name << "-" << std::dec << properties.properties.driverVersion << ".txt";
+		return dhh::shader::ShaderCache::instance().directory() / name.str();
+	}
+
+	// One line per body count: bodies kernel workgroup sharedTile unroll interactions/s
+	inline std::vector<TunedKernel> loadTuning(VkPhysicalDevice physicalDevice)
+	{
+		std::vector<TunedKernel> results;
+		if (!dhh::shader::ShaderCache::instance().enabled())
+		{
+			return results;
+		}
+		std::ifstream file(tuningPath(physicalDevice));
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (line.empty() || line[0] == '#')
+			{
+				continue;
+			}
+			std::istringstream fields(line);
+			TunedKernel result;
+			std::string kernel;
+			if (fields >> result.bodyCount >> kernel >> result.tuning.workgroupSize >> result.tuning.sharedTile >>
+				result.tuning.unroll >> result.interactionsPerSecond &&
+				(kernel == "tiled" || kernel == "subgroup"))
+			{
+				result.tuning.kernel = kernel == "subgroup" ? ForceKernel::Subgroup : ForceKernel::Tiled;
+				results.push_back(result);
+			}
+		}
+		return results;
+	}
+
+	inline void saveTuning(VkPhysicalDevice physicalDevice, const std::vector<TunedKernel>& results)
+	{
+		if (!dhh::shader::ShaderCache::instance().enabled())
+		{
+			std::cerr << "Shader cache disabled, tuning results are not saved\n";
+			return;
+		}
+		std::ostringstream data;
+		data << "# bodies kernel workgroup sharedTile unroll interactions/s\n";
+		for (const auto& result : results)
+		{
+			data << result.bodyCount << " " << forceKernelName(result.tuning.kernel) << " "
+				<< result.tuning.workgroupSize << " " << result.tuning.sharedTile << " " << result.tuning.unroll << " "
+				<< result.interactionsPerSecond << "\n";
+		}
+		const std::string text = data.str();
+		dhh::shader::ShaderCache::instance().store(
+			tuningPath(physicalDevice).filename().string(), std::vector<char>(text.begin(), text.end()));
+	}
+
+	// Result tuned for the body count closest on a log scale, none when the device was never tuned
+	inline std::optional<TunedKernel> findTunedKernel(VkPhysicalDevice physicalDevice, size_t bodyCount)
+	{
+		const bool subgroupSupported = subgroupShuffleSize(physicalDevice) > 0;
+		std::optional<TunedKernel> best;
+		for (const auto& result : loadTuning(physicalDevice))
+		{
+			if (result.tuning.kernel == ForceKernel::Subgroup && !subgroupSupported)
+			{
+				continue;
+			}
+			const auto distance = [&](const TunedKernel& tuned) {
+				return std::abs(std::log(static_cast<double>(tuned.bodyCount) / std::max<size_t>(bodyCount, 1)));
+			};
+			if (!best || distance(result) < distance(*best))
+			{
+				best = result;
+			}
+		}
+		return best;
+	}
+
+	// Benchmarks both force kernels over every launch shape the device supports, one resident body set as both
+	// targets and sources. Wall-clock time per dispatch, the minimum of several runs after a warm-up.
+	class Autotuner
+	{
+	public:
+		explicit Autotuner(VulkanBase& base)
+			: base(base), device(base.device), subgroupSize(subgroupShuffleSize(base.physicalDevice))
+		{
+			dhh::shader::Shader tileShader = dhh::shader::loadShader("tile.comp");
+			tilePipe = new dhh::shader::Pipeline(
+				device, &tileShader, base.descriptorPool, base.pipelineCache, KernelTuning().specialization());
+			if (subgroupSize > 0)
+			{
+				dhh::shader::Shader subgroupShader = dhh::shader::loadShader("tile_subgroup.comp");
+				subgroupPipe = new dhh::shader::Pipeline(device, &subgroupShader, base.descriptorPool,
+					base.pipelineCache, defaultKernel(base.physicalDevice).specialization());
+			}
+
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+			poolInfo.queueFamilyIndex = base.queueFamilyIndex.graphicsFamily.value();
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create autotuner command pool!");
+			}
+			VkCommandBufferAllocateInfo info =
+				dhh::vk::initializer::commandBufferAllocateInfo(commandPool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+			vkAllocateCommandBuffers(device, &info, &commandBuffer);
+			VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+			vkCreateFence(device, &fenceCreateInfo, nullptr, &fence);
+		}
+
+		~Autotuner()
+		{
+			vkDeviceWaitIdle(device);
+			releaseBuffers();
+			vkDestroyFence(device, fence, nullptr);
+			vkDestroyCommandPool(device, commandPool, nullptr);
+			delete tilePipe;
+			delete subgroupPipe;
+		}
+
+		Autotuner(const Autotuner&) = delete;
+		Autotuner& operator=(const Autotuner&) = delete;
+
+		// Launch shapes within the device limits: workgroup sizes, shared tiles of 1, 2 or 4 workgroups and
+		// unroll factors for the tiled kernel, workgroups of whole subgroups for the subgroup kernel
+		std::vector<KernelTuning> candidates() const
+		{
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(base.physicalDevice, &properties);
+			const VkPhysicalDeviceLimits& limits = properties.limits;
+
+			std::vector<KernelTuning> shapes;
+			for (uint32_t workgroupSize : {32u, 64u, 128u, 256u, 512u})
+			{
+				if (workgroupSize > limits.maxComputeWorkGroupSize[0] ||
+					workgroupSize > limits.maxComputeWorkGroupInvocations)
+				{
+					continue;
+				}
+				for (uint32_t factor : {1u, 2u, 4u})
+				{
+					const uint32_t sharedTile = workgroupSize * factor;
+					if (sharedTile * sizeof(glm::dvec4) > limits.maxComputeSharedMemorySize)
+					{
+						continue;
+					}
+					for (uint32_t unroll : {1u, 2u, 4u, 8u})
+					{
+						shapes.push_back({workgroupSize, sharedTile, unroll, ForceKernel::Tiled});
+					}
+				}
+				if (subgroupSize > 0 && workgroupSize % subgroupSize == 0)
+				{
+					for (uint32_t unroll : {1u, 2u, 4u, 8u})
+					{
+						shapes.push_back({workgroupSize, 0, unroll, ForceKernel::Subgroup});
+					}
+				}
+			}
+			return shapes;
+		}
+
+		TunedKernel tune(const BodyArray& bodies, std::ostream& log)
+		{
+			upload(bodies);
+			const uint32_t count = static_cast<uint32_t>(bodies.size());
+			const double interactions = static_cast<double>(count) * count;
+
+			// fastest shape of each kernel, for comparing them at this body count
+			TunedKernel best[2] = {{count, {}, 0}, {count, {}, 0}};
+			for (const KernelTuning& tuning : candidates())
+			{
+				const double rate = interactions / measure(tuning, count);
+				log << "  " << std::setw(8) << count << " bodies  " << tuning << ": " << std::scientific
+					<< std::setprecision(3) << rate << " interactions/s\n" << std::defaultfloat;
+				TunedKernel& kernelBest = best[static_cast<int>(tuning.kernel)];
+				if (rate > kernelBest.interactionsPerSecond)
+				{
+					kernelBest.tuning = tuning;
+					kernelBest.interactionsPerSecond = rate;
+				}
+			}
+
+			const TunedKernel& tiled = best[static_cast<int>(ForceKernel::Tiled)];
+			const TunedKernel& subgroup = best[static_cast<int>(ForceKernel::Subgroup)];
+			log << std::setw(8) << count << " bodies  tiled " << std::scientific << std::setprecision(3)
+				<< tiled.interactionsPerSecond << " interactions/s";
+			if (subgroupPipe != nullptr)
+			{
+				log << ", subgroup " << subgroup.interactionsPerSecond << " interactions/s (" << std::fixed
+					<< std::setprecision(2) << subgroup.interactionsPerSecond / tiled.interactionsPerSecond << "x)";
+			}
+			else
+			{
+				log << ", no subgroup shuffle support";
+			}
+			log << "\n" << std::defaultfloat;
+			return subgroup.interactionsPerSecond > tiled.interactionsPerSecond ? subgroup : tiled;
+		}
+
+	private:
+		static constexpr uint32_t MinRuns = 3;
+		static constexpr uint32_t MaxRuns = 20;
+		static constexpr double RunBudget = 0.25;  // seconds of timed runs per candidate beyond MinRuns
+
+		VulkanBase& base;
+		VkDevice device;
+		uint32_t subgroupSize;  // 0 without subgroup shuffles
+		dhh::shader::Pipeline* tilePipe;
+		dhh::shader::Pipeline* subgroupPipe = nullptr;
+		VkCommandPool commandPool;
+		VkCommandBuffer commandBuffer;
+		VkFence fence;
+
+		VkBuffer bodyBuffer = VK_NULL_HANDLE;
+		VmaAllocation bodyMemory = VK_NULL_HANDLE;
+		VkBuffer accelerationBuffer = VK_NULL_HANDLE;
+		VmaAllocation accelerationMemory = VK_NULL_HANDLE;
+
+		void releaseBuffers()
+		{
+			if (bodyBuffer != VK_NULL_HANDLE)
+			{
+				base.destroyBuffer(bodyBuffer, bodyMemory);
+				base.destroyBuffer(accelerationBuffer, accelerationMemory);
+				bodyBuffer = VK_NULL_HANDLE;
+			}
+		}
+
+		void upload(const BodyArray& bodies)
+		{
+			releaseBuffers();
+			const VkDeviceSize bytes = sizeof(Body) * bodies.size();
+			base.createBuffer(bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, bodyBuffer,
+				bodyMemory, dhh::memory::Tag::Bodies);
+			base.createBuffer(sizeof(glm::dvec4) * bodies.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+				VMA_MEMORY_USAGE_GPU_ONLY, accelerationBuffer, accelerationMemory, dhh::memory::Tag::Bodies);
+
+			void* mapped;
+			vmaMapMemory(base.allocator, bodyMemory, &mapped);
+			memcpy(mapped, bodies.data(), bytes);
+			vmaFlushAllocation(base.allocator, bodyMemory, 0, VK_WHOLE_SIZE);
+			vmaUnmapMemory(base.allocator, bodyMemory);
+
+			for (dhh::shader::Pipeline* pipe : {tilePipe, subgroupPipe})
+			{
+				if (pipe != nullptr)
+				{
+					VkDescriptorSet set = pipe->descriptorSets[0];
+					pipe->writeStorageBuffer(set, 0, bodyBuffer);
+					pipe->writeStorageBuffer(set, 1, bodyBuffer);
+					pipe->writeStorageBuffer(set, 2, accelerationBuffer);
+				}
+			}
+		}
+
+		// seconds per dispatch
+		double measure(const KernelTuning& tuning, uint32_t count)
+		{
+			VkCommandBufferBeginInfo beginInfo = dhh::vk::initializer::commandBufferBeginInfo();
+			vkBeginCommandBuffer(commandBuffer, &beginInfo);
+			dhh::shader::Pipeline* pipe = tuning.kernel == ForceKernel::Subgroup ? subgroupPipe : tilePipe;
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipe->variant(tuning.specialization()));
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipe->pipelineLayout, 0, 1,
+				pipe->descriptorSets.data(), 0, nullptr);
+			pipe->pushConstants(commandBuffer, TileParams{count, count, 0, 0});
+			vkCmdDispatch(commandBuffer, tuning.groupCount(count), 1, 1);
+			vkEndCommandBuffer(commandBuffer);
+
+			const auto run = [&] {
+				VkSubmitInfo submitInfo = {};
+				submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+				submitInfo.commandBufferCount = 1;
+				submitInfo.pCommandBuffers = &commandBuffer;
+				const auto start = std::chrono::steady_clock::now();
+				{
+					auto lock = base.lockQueue(base.computeQueue);
+					vkQueueSubmit(base.computeQueue, 1, &submitInfo, fence);
+				}
+				vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+				vkResetFences(device, 1, &fence);
+				return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			};
+
+			run();  // warm-up, software drivers compile the pipeline on first use
+			double fastest = run();
+			double spent = fastest;
+			for (uint32_t i = 1; i < MaxRuns && (i < MinRuns || spent < RunBudget); ++i)
+			{
+				const double seconds = run();
+				fastest = std::min(fastest, seconds);
+				spent += seconds;
+			}
+			return fastest;
+		}
+	};
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Allocator.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Matches the std430 layout of `struct Body` in the compute shaders
+	struct Body
+	{
+		glm::dvec3 position;
+		alignas(16) glm::dvec3 velocity;
+		alignas(8) double mass;
+	};
+
+	static_assert(sizeof(Body) == 64, "Body must match the std430 layout used by the shaders");
+
+	// Bodies in cache-line aligned storage, one Body per line
+	using BodyArray = std::vector<Body, dhh::memory::AlignedAllocator<Body>>;
+}
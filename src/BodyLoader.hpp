@@ -0,0 +1,701 @@
+#pragma once
+
+#include "Body.hpp"
+#include "Filesystem.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Initial conditions from other codes: a CSV (or whitespace separated) table, or a raw array of fixed-size
+	// records of doubles or floats, mapped to bodies column by column with unit conversion.
+	//
+	// The file is memory-mapped and cut into one chunk per worker at line boundaries. Each worker counts the rows
+	// of its chunk, and after a prefix sum parses them straight into their place in the body array, so loading
+	// scales with the threads until the disk or the page cache is the limit. Numbers are parsed without the C
+	// library: eight digits at a time with SWAR arithmetic on a 64-bit word, and converted exactly when the
+	// mantissa and power of ten are both exact doubles; longer or extreme numbers, such as the 17 digits of a
+	// round-tripped double, go to std::from_chars (strtod on standard libraries without it).
+	enum class LoadFormat
+	{
+		Auto,    // binary for .bin, .raw, .f32 and .f64, CSV otherwise
+		Csv,
+		Binary,
+	};
+
+	struct LoadConfig
+	{
+		LoadFormat format = LoadFormat::Auto;
+		// Comma separated fields in column order: mass, x, y, z, vx, vy, vz, or - to skip a column; or
+		// field=COLUMN with a header name or a 0-based index. Empty maps a CSV header by those names, and is
+		// mass,x,y,z,vx,vy,vz without one. Unmapped velocities and masses are 0.
+		std::string columns;
+		double lengthUnit = 1;    // metres per unit of the file
+		double velocityUnit = 1;  // m/s per unit
+		double massUnit = 1;      // simulation mass per unit, the gravitational constant is folded into the masses
+		// binary records
+		bool singlePrecision = false;  // float instead of double values
+		uint32_t recordFields = 7;     // values per record
+		uint64_t headerBytes = 0;      // skipped at the start of the file
+	};
+
+	struct LoadStats
+	{
+		size_t bodies = 0;
+		size_t bytes = 0;  // of the file
+		double seconds = 0;
+
+		double bytesPerSecond() const
+		{
+			return seconds > 0 ? bytes / seconds : 0;
+		}
+	};
+
+	namespace load
+	{
+		constexpr size_t FieldCount = 7;
+		constexpr const char* FieldNames[FieldCount] = {"mass", "x", "y", "z", "vx", "vy", "vz"};
+		constexpr size_t Unmapped = ~size_t(0);
+
+		inline size_t fieldIndex(const std::string& name)
+		{
+			for (size_t field = 0; field < FieldCount; ++field)
+			{
+				if (name == FieldNames[field])
+				{
+					return field;
+				}
+			}
+			return Unmapped;
+		}
+
+		// Scale of a unit name; "au,km/s,msun" style lists are split by the caller
+		inline double lengthUnit(const std::string& name)
+		{
+			const std::pair<const char*, double> units[] = {{"m", 1}, {"km", 1e3}, {"au", 1.495978707e11},
+				{"pc", 3.0856775814913673e16}, {"kpc", 3.0856775814913673e19}};
+			for (const auto& unit : units)
+			{
+				if (name == unit.first)
+				{
+					return unit.second;
+				}
+			}
+			throw std::runtime_error("Unknown length unit " + name + ", expected m, km, au, pc or kpc");
+		}
+
+		inline double velocityUnit(const std::string& name)
+		{
+			if (name == "m/s")
+			{
+				return 1;
+			}
+			if (name == "km/s")
+			{
+				return 1e3;
+			}
+			if (name == "au/day")
+			{
+				return 1.495978707e11 / 86400;
+			}
+			throw std::runtime_error("Unknown velocity unit " + name + ", expected m/s, km/s or au/day");
+		}
+
+		// native masses are used as they are, kg and solar masses are multiplied by G
+		inline double massUnit(const std::string& name)
+		{
+			if (name == "native")
+			{
+				return 1;
+			}
+			if (name == "kg")
+			{
+				return 6.67430e-11;
+			}
+			if (name == "msun")
+			{
+				return 1.32712440018e20;
+			}
+			throw std::runtime_error("Unknown mass unit " + name + ", expected native, kg or msun");
+		}
+
+		inline bool isDigit(char c)
+		{
+			return c >= '0' && c <= '9';
+		}
+
+		inline bool isSeparator(char c)
+		{
+			return c == ',' || c == ';' || c == ' ' || c == '\t';
+		}
+
+		inline bool isLineEnd(char c)
+		{
+			return c == '\n' || c == '\r' || c == '#';
+		}
+
+		// Value of eight ASCII digits at p, or false when they are not all digits. The word is read little
+		// endian, so the first digit is the low byte; pairs, then quads, are combined by multiply and shift.
+		inline bool eightDigits(const char* p, uint64_t& value)
+		{
+			uint64_t word;
+			std::memcpy(&word, p, sizeof(word));
+			if (((word & 0xF0F0F0F0F0F0F0F0) | (((word + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+				!= 0x3333333333333333)
+			{
+				return false;
+			}
+			word -= 0x3030303030303030;
+			word = word * 10 + (word >> 8);
+			value = (((word & 0x000000FF000000FF) * (100 + (1000000ULL << 32)))
+				+ (((word >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+			return true;
+		}
+
+		// Parses a decimal number at p, advancing p past it; false when there is none
+		inline bool parseNumber(const char*& p, const char* end, double& value)
+		{
+			static constexpr double Powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+				1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+			const char* start = p;
+			bool negative = false;
+			if (p < end && (*p == '-' || *p == '+'))
+			{
+				negative = *p == '-';
+				++p;
+			}
+
+			uint64_t mantissa = 0;
+			int digits = 0;     // significant digits in the mantissa
+			int exponent = 0;   // of ten
+			bool any = false;
+			bool overflow = false;
+			const auto digitRun = [&](bool fraction) {
+				while (end - p >= 8 && digits <= 11)
+				{
+					uint64_t eight;
+					if (!eightDigits(p, eight))
+					{
+						break;
+					}
+					mantissa = mantissa * 100000000 + eight;
+					digits += mantissa != 0 ? 8 : 0;
+					exponent -= fraction ? 8 : 0;
+					any = true;
+					p += 8;
+				}
+				while (p < end && isDigit(*p))
+				{
+					if (digits < 19)
+					{
+						mantissa = mantissa * 10 + (*p - '0');
+						digits += mantissa != 0;
+						exponent -= fraction;
+					}
+					else
+					{
+						overflow = true;
+					}
+					any = true;
+					++p;
+				}
+			};
+			digitRun(false);
+			if (p < end && *p == '.')
+			{
+				++p;
+				digitRun(true);
+			}
+			if (!any)
+			{
+				p = start;
+				return false;
+			}
+			if (p < end && (*p == 'e' || *p == 'E'))
+			{
+				const char* mark = p++;
+				bool negativeExponent = false;
+				if (p < end && (*p == '-' || *p == '+'))
+				{
+					negativeExponent = *p == '-';
+					++p;
+				}
+				if (p == end || !isDigit(*p))
+				{
+					p = mark;
+				}
+				else
+				{
+					int written = 0;
+					while (p < end && isDigit(*p))
+					{
+						written = std::min(written * 10 + (*p - '0'), 100000);
+						++p;
+					}
+					exponent += negativeExponent ? -written : written;
+				}
+			}
+
+			if (!overflow && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+			{
+				// both factors are exact, so the one rounding of the product or quotient is correct
+				const double magnitude = static_cast<double>(mantissa);
+				value = exponent < 0 ? magnitude / Powers[-exponent] : magnitude * Powers[exponent];
+			}
+			else
+			{
+#if defined(__cpp_lib_to_chars)
+				// out of range leaves value unchanged, strtod below gives the infinity or zero
+				if (std::from_chars(start + (*start == '+'), p, value).ec == std::errc())
+				{
+					return true;
+				}
+#endif
+				char buffer[128];
+				const size_t length = p - start;
+				if (length < sizeof(buffer))
+				{
+					std::memcpy(buffer, start, length);
+					buffer[length] = 0;
+					value = std::strtod(buffer, nullptr);
+				}
+				else
+				{
+					value = std::strtod(std::string(start, p).c_str(), nullptr);
+				}
+				return true;
+			}
+			if (negative)
+			{
+				value = -value;
+			}
+			return true;
+		}
+
+		inline const char* lineEnd(const char* p, const char* end)
+		{
+			const void* found = std::memchr(p, '\n', end - p);
+			return found != nullptr ? static_cast<const char*>(found) : end;
+		}
+
+		// whether the line holds data, not only blanks or a comment
+		inline bool hasData(const char* p, const char* end)
+		{
+			while (p < end && (*p == ' ' || *p == '\t'))
+			{
+				++p;
+			}
+			return p < end && !isLineEnd(*p);
+		}
+
+		// next token of a header line, without quotes
+		inline std::vector<std::string> splitHeader(const char* p, const char* end)
+		{
+			std::vector<std::string> names;
+			while (p < end && !isLineEnd(*p))
+			{
+				while (p < end && isSeparator(*p))
+				{
+					++p;
+				}
+				const char* begin = p;
+				while (p < end && !isSeparator(*p) && !isLineEnd(*p))
+				{
+					++p;
+				}
+				std::string name(begin, p);
+				name.erase(std::remove(name.begin(), name.end(), '"'), name.end());
+				std::transform(name.begin(), name.end(), name.begin(), [](char c) {
+					return static_cast<char>(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+				});
+				if (!name.empty())
+				{
+					names.push_back(name);
+				}
+			}
+			return names;
+		}
+
+		// column of each field from the column spec, and the header names when the file has them
+		inline std::array<size_t, FieldCount> mapColumns(const std::string& spec,
+			const std::vector<std::string>& header)
+		{
+			std::array<size_t, FieldCount> columns;
+			columns.fill(Unmapped);
+			if (spec.empty() && !header.empty())
+			{
+				for (size_t column = 0; column < header.size(); ++column)
+				{
+					const size_t field = fieldIndex(header[column] == "m" ? "mass" : header[column]);
+					if (field != Unmapped && columns[field] == Unmapped)
+					{
+						columns[field] = column;
+					}
+				}
+			}
+			else
+			{
+				const std::string list = spec.empty() ? "mass,x,y,z,vx,vy,vz" : spec;
+				size_t position = 0;
+				size_t column = 0;
+				while (position <= list.size())
+				{
+					const size_t comma = std::min(list.find(',', position), list.size());
+					const std::string entry = list.substr(position, comma - position);
+					position = comma + 1;
+					const size_t equals = entry.find('=');
+					const std::string name = entry.substr(0, equals);
+					if (name == "-" && equals == std::string::npos)
+					{
+						++column;
+						continue;
+					}
+					const size_t field = fieldIndex(name);
+					if (field == Unmapped)
+					{
+						throw std::runtime_error("Unknown column field " + name
+							+ ", expected mass, x, y, z, vx, vy, vz or -");
+					}
+					if (equals == std::string::npos)
+					{
+						columns[field] = column++;
+						continue;
+					}
+					const std::string source = entry.substr(equals + 1);
+					if (!source.empty() && std::all_of(source.begin(), source.end(), isDigit))
+					{
+						columns[field] = std::stoul(source);
+						continue;
+					}
+					const auto found = std::find(header.begin(), header.end(), source);
+					if (found == header.end())
+					{
+						throw std::runtime_error("No column named " + source + " in the header");
+					}
+					columns[field] = found - header.begin();
+				}
+			}
+			for (size_t field = 1; field <= 3; ++field)
+			{
+				if (columns[field] == Unmapped)
+				{
+					throw std::runtime_error(std::string("No column for ") + FieldNames[field]);
+				}
+			}
+			return columns;
+		}
+
+		inline void store(Body& body, const double (&values)[FieldCount], const LoadConfig& config)
+		{
+			body.mass = values[0] * config.massUnit;
+			body.position = glm::dvec3(values[1], values[2], values[3]) * config.lengthUnit;
+			body.velocity = glm::dvec3(values[4], values[5], values[6]) * config.velocityUnit;
+		}
+	}
+
+	class BodyLoader
+	{
+	public:
+		BodyLoader(const std::filesystem::path& path, const LoadConfig& config) : path(path), config(config)
+		{
+			if (this->config.format == LoadFormat::Auto)
+			{
+				const std::string extension = path.extension().string();
+				this->config.format = extension == ".bin" || extension == ".raw" || extension == ".f32"
+						|| extension == ".f64"
+					? LoadFormat::Binary
+					: LoadFormat::Csv;
+			}
+		}
+
+		LoadStats load(BodyArray& bodies, dhh::thread::ThreadPool& pool)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			dhh::filesystem::MappedFile file(path, false);
+			const char* begin = static_cast<const char*>(file.data());
+			const char* end = begin + file.size();
+			if (config.format == LoadFormat::Binary)
+			{
+				loadBinary(begin, end, bodies, pool);
+			}
+			else
+			{
+				file.prefetch(0, file.size());
+				loadCsv(begin, end, bodies, pool);
+			}
+
+			LoadStats stats;
+			stats.bodies = bodies.size();
+			stats.bytes = file.size();
+			stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			return stats;
+		}
+
+	private:
+		// rows and lines of one chunk, and the first error in it
+		struct Chunk
+		{
+			const char* begin = nullptr;
+			const char* end = nullptr;
+			size_t rows = 0;
+			size_t lines = 0;
+			size_t firstRow = 0;
+			size_t firstLine = 0;
+			size_t errorLine = 0;  // 1-based line of the first bad row, 0 when there is none
+			std::string error;
+		};
+
+		void loadCsv(const char* begin, const char* end, BodyArray& bodies, dhh::thread::ThreadPool& pool)
+		{
+			if (begin == nullptr)
+			{
+				fail("empty file");
+			}
+			// leading comments and blank lines, then a header when the first line does not start with a number
+			const char* data = begin;
+			size_t headerLines = 0;
+			std::vector<std::string> header;
+			while (data < end)
+			{
+				const char* next = load::lineEnd(data, end);
+				if (load::hasData(data, next))
+				{
+					const char* p = data;
+					while (*p == ' ' || *p == '\t')
+					{
+						++p;
+					}
+					if (!load::isDigit(*p) && *p != '-' && *p != '+' && *p != '.')
+					{
+						header = load::splitHeader(p, next);
+						data = std::min(next + 1, end);
+						++headerLines;
+					}
+					break;
+				}
+				data = std::min(next + 1, end);
+				++headerLines;
+			}
+			const std::array<size_t, load::FieldCount> columns = mapColumns(header);
+			const size_t lastColumn = *std::max_element(columns.begin(), columns.end(), [](size_t a, size_t b) {
+				return (a == load::Unmapped ? 0 : a + 1) < (b == load::Unmapped ? 0 : b + 1);
+			});
+			// field of each column up to the last mapped one
+			std::vector<size_t> fields(lastColumn + 1, load::Unmapped);
+			for (size_t field = 0; field < load::FieldCount; ++field)
+			{
+				if (columns[field] != load::Unmapped)
+				{
+					fields[columns[field]] = field;
+				}
+			}
+
+			std::vector<Chunk> chunks(pool.size());
+			const size_t length = end - data;
+			for (size_t i = 0; i < chunks.size(); ++i)
+			{
+				// up to the end of the line the even cut falls in, empty when the previous chunk covers it
+				chunks[i].begin = i == 0 ? data : chunks[i - 1].end;
+				const char* cut = data + length * (i + 1) / chunks.size();
+				if (i + 1 == chunks.size())
+				{
+					chunks[i].end = end;
+				}
+				else if (cut <= chunks[i].begin)
+				{
+					chunks[i].end = chunks[i].begin;
+				}
+				else
+				{
+					const char* newline = load::lineEnd(cut - 1, end);
+					chunks[i].end = newline < end ? newline + 1 : end;
+				}
+			}
+
+			pool.parallelFor(chunks.size(), [&](uint32_t, size_t first, size_t last) {
+				for (size_t i = first; i < last; ++i)
+				{
+					Chunk& chunk = chunks[i];
+					for (const char* p = chunk.begin; p < chunk.end;)
+					{
+						const char* next = load::lineEnd(p, chunk.end);
+						chunk.rows += load::hasData(p, next);
+						++chunk.lines;
+						p = next + 1;
+					}
+				}
+			});
+			size_t rows = 0;
+			size_t lines = headerLines;
+			for (Chunk& chunk : chunks)
+			{
+				chunk.firstRow = rows;
+				chunk.firstLine = lines;
+				rows += chunk.rows;
+				lines += chunk.lines;
+			}
+			if (rows == 0)
+			{
+				fail("no rows");
+			}
+
+			bodies.resize(rows);
+			Body* destination = bodies.data();
+			pool.parallelFor(chunks.size(), [&](uint32_t, size_t first, size_t last) {
+				for (size_t i = first; i < last; ++i)
+				{
+					parseChunk(chunks[i], fields, destination + chunks[i].firstRow);
+				}
+			});
+			for (const Chunk& chunk : chunks)
+			{
+				if (chunk.errorLine != 0)
+				{
+					fail("line " + std::to_string(chunk.errorLine) + ": " + chunk.error);
+				}
+			}
+		}
+
+		// workers must not throw, the first bad row is recorded in the chunk
+		void parseChunk(Chunk& chunk, const std::vector<size_t>& fields, Body* destination) const
+		{
+			size_t line = chunk.firstLine;
+			for (const char* p = chunk.begin; p < chunk.end;)
+			{
+				const char* next = load::lineEnd(p, chunk.end);
+				++line;
+				if (!load::hasData(p, next))
+				{
+					p = next + 1;
+					continue;
+				}
+
+				double values[load::FieldCount] = {};
+				for (size_t column = 0; column < fields.size(); ++column)
+				{
+					while (p < next && (*p == ' ' || *p == '\t'))
+					{
+						++p;
+					}
+					if (p == next || load::isLineEnd(*p))
+					{
+						chunk.errorLine = line;
+						chunk.error = "expected at least " + std::to_string(fields.size()) + " columns";
+						return;
+					}
+					if (fields[column] == load::Unmapped)
+					{
+						while (p < next && !load::isSeparator(*p) && !load::isLineEnd(*p))
+						{
+							++p;
+						}
+					}
+					else if (!load::parseNumber(p, next, values[fields[column]])
+						|| (p < next && !load::isSeparator(*p) && !load::isLineEnd(*p)))
+					{
+						chunk.errorLine = line;
+						chunk.error = std::string("expected a number for ") + load::FieldNames[fields[column]];
+						return;
+					}
+					while (p < next && (*p == ' ' || *p == '\t'))
+					{
+						++p;
+					}
+					if (p < next && (*p == ',' || *p == ';'))
+					{
+						++p;
+					}
+				}
+				load::store(*destination++, values, config);
+				p = next + 1;
+			}
+		}
+
+		void loadBinary(const char* begin, const char* end, BodyArray& bodies, dhh::thread::ThreadPool& pool)
+		{
+			const size_t valueBytes = config.singlePrecision ? sizeof(float) : sizeof(double);
+			const size_t recordBytes = config.recordFields * valueBytes;
+			const size_t size = end - begin;
+			if (recordBytes == 0 || size < config.headerBytes || (size - config.headerBytes) % recordBytes != 0)
+			{
+				fail("size is not the header plus whole records of " + std::to_string(recordBytes) + " bytes");
+			}
+			const std::array<size_t, load::FieldCount> columns = mapColumns({});
+			for (size_t column : columns)
+			{
+				if (column != load::Unmapped && column >= config.recordFields)
+				{
+					fail("column " + std::to_string(column) + " is past the end of the record");
+				}
+			}
+
+			const size_t rows = (size - config.headerBytes) / recordBytes;
+			if (rows == 0)
+			{
+				fail("no records");
+			}
+			bodies.resize(rows);
+			const char* records = begin + config.headerBytes;
+			Body* destination = bodies.data();
+			pool.parallelFor(rows, [&](uint32_t, size_t first, size_t last) {
+				for (size_t row = first; row < last; ++row)
+				{
+					const char* record = records + row * recordBytes;
+					double values[load::FieldCount] = {};
+					for (size_t field = 0; field < load::FieldCount; ++field)
+					{
+						if (columns[field] == load::Unmapped)
+						{
+							continue;
+						}
+						if (config.singlePrecision)
+						{
+							float value;
+							std::memcpy(&value, record + columns[field] * valueBytes, sizeof(value));
+							values[field] = value;
+						}
+						else
+						{
+							std::memcpy(&values[field], record + columns[field] * valueBytes, sizeof(double));
+						}
+					}
+					load::store(destination[row], values, config);
+				}
+			});
+		}
+
+		std::array<size_t, load::FieldCount> mapColumns(const std::vector<std::string>& header) const
+		{
+			try
+			{
+				return load::mapColumns(config.columns, header);
+			}
+			catch (const std::exception& e)
+			{
+				fail(e.what());
+			}
+		}
+
+		[[noreturn]] void fail(const std::string& reason) const
+		{
+			throw std::runtime_error("Initial conditions " + path.string() + ": " + reason);
+		}
+
+		std::filesystem::path path;
+		LoadConfig config;
+	};
+}
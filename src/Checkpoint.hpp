@@ -0,0 +1,362 @@
+#pragma once
+
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "Filesystem.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Checkpoint file, little-endian:
+	//
+	//   CheckpointHeader                 192 bytes
+	//   ChunkEntry[chunkCount]           at tableOffset
+	//   chunks                           page aligned first chunk, then 64-byte aligned
+	//
+	// A chunk holds up to chunkBodies bodies as seven columns (position x, y, z, velocity x, y, z, mass) of
+	// doubles, each column padded to 64 bytes. Chunks are checksummed independently, so they are written and
+	// verified in parallel, and a reader can map the file and gather the columns straight into a Body array
+	// without parsing anything.
+
+	enum class CheckpointIntegrator : uint32_t
+	{
+		Euler = 0,     // semi-implicit Euler, tile.comp + integrate.comp or nbody.comp
+		Leapfrog = 1,  // kick-drift-kick, nbody.comp with --leapfrog
+	};
+
+	struct CheckpointHeader
+	{
+		static constexpr char Magic[8] = {'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P'};
+		static constexpr uint32_t CurrentVersion = 1;
+		static constexpr uint32_t Columns = 7;
+
+		char magic[8];
+		uint32_t version;
+		uint32_t headerBytes;
+		uint64_t bodyCount;
+		uint64_t step;                // integration steps since the initial state
+		double time;                  // simulated time
+		double stepLength;            // of the last step
+		double softening;
+		uint32_t integrator;          // CheckpointIntegrator
+		uint32_t columnCount;
+		// SI size of the file's units, and G in them; the kernels work in metres, seconds and kilograms with the
+		// gravitational constant folded into the masses
+		double lengthUnit;
+		double timeUnit;
+		double massUnit;
+		double gravitationalConstant;
+		uint64_t chunkBodies;
+		uint64_t chunkCount;
+		uint64_t tableOffset;
+		uint64_t headerChecksum;      // of the header with this field zero, followed by the chunk table
+		uint8_t reserved[64];
+	};
+
+	static_assert(sizeof(CheckpointHeader) == 192, "CheckpointHeader is part of the file format");
+
+	struct ChunkEntry
+	{
+		uint64_t offset;
+		uint64_t bodies;
+		uint64_t checksum;  // of the chunk's columns including their padding
+		uint64_t reserved;
+	};
+
+	// Everything besides the bodies that a restart needs
+	struct CheckpointState
+	{
+		uint64_t step = 0;
+		double time = 0;
+		double stepLength = 0;
+		double softening = 0;
+		CheckpointIntegrator integrator = CheckpointIntegrator::Euler;
+	};
+
+	// XXH64-style hash over four independent lanes, fast enough to stay below disk bandwidth. Detects torn or
+	// corrupted writes, it is not cryptographic.
+	inline uint64_t checksum64(const void* data, size_t bytes, uint64_t seed = 0)
+	{
+		constexpr uint64_t Prime1 = 11400714785074694791ull;
+		constexpr uint64_t Prime2 = 14029467366897019727ull;
+		constexpr uint64_t Prime3 = 1609587929392839161ull;
+		const auto rotate = [](uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); };
+		const auto round = [&](uint64_t accumulator, uint64_t input) {
+			return rotate(accumulator + input * Prime2, 31) * Prime1;
+		};
+		const auto word = [](const char* pointer) {
+			uint64_t value;
+			std::memcpy(&value, pointer, sizeof(value));
+			return value;
+		};
+
+		const char* pointer = static_cast<const char*>(data);
+		const char* const end = pointer + bytes;
+		uint64_t lanes[4] = {seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1};
+		for (; pointer + 32 <= end; pointer += 32)
+		{
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				lanes[lane] = round(lanes[lane], word(pointer + 8 * lane));
+			}
+		}
+		uint64_t hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+		hash += bytes;
+		for (; pointer + 8 <= end; pointer += 8)
+		{
+			hash = rotate(hash ^ round(0, word(pointer)), 27) * Prime1 + Prime3;
+		}
+		for (; pointer < end; ++pointer)
+		{
+			hash = rotate(hash ^ (static_cast<uint8_t>(*pointer) * Prime3), 11) * Prime1;
+		}
+		hash ^= hash >> 33;
+		hash *= Prime2;
+		hash ^= hash >> 29;
+		hash *= Prime3;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+	namespace checkpoint
+	{
+		constexpr uint64_t ChunkBodies = 1 << 16;
+		constexpr size_t FirstChunkAlignment = 4096;
+
+		inline size_t columnBytes(uint64_t bodies)
+		{
+			return dhh::memory::alignUp(bodies * sizeof(double), dhh::memory::CacheLineSize);
+		}
+
+		// whether [offset, offset + length) lies within a file of size bytes, without overflowing
+		inline bool withinFile(uint64_t offset, uint64_t length, uint64_t size)
+		{
+			return offset <= size && length <= size - offset;
+		}
+
+		inline uint64_t tableChecksum(CheckpointHeader header, const ChunkEntry* table)
+		{
+			header.headerChecksum = 0;
+			return checksum64(table, sizeof(ChunkEntry) * header.chunkCount,
+				checksum64(&header, sizeof(header)));
+		}
+
+		// columns of one chunk, in the order of the file
+		inline void columns(const char* chunk, uint64_t bodies, const double* (&result)[CheckpointHeader::Columns])
+		{
+			for (uint32_t column = 0; column < CheckpointHeader::Columns; ++column)
+			{
+				result[column] = reinterpret_cast<const double*>(chunk + column * columnBytes(bodies));
+			}
+		}
+	}
+
+	// Writes to path.tmp and renames it over path once the data is on disk, so a crash while writing leaves the
+	// previous checkpoint intact
+	inline void writeCheckpoint(const std::filesystem::path& path, const Body* bodies, size_t count,
+		const CheckpointState& state, dhh::thread::ThreadPool& pool)
+	{
+		CheckpointHeader header = {};
+		std::memcpy(header.magic, CheckpointHeader::Magic, sizeof(header.magic));
+		header.version = CheckpointHeader::CurrentVersion;
+		header.headerBytes = sizeof(CheckpointHeader);
+		header.bodyCount = count;
+		header.step = state.step;
+		header.time = state.time;
+		header.stepLength = state.stepLength;
+		header.softening = state.softening;
+		header.integrator = static_cast<uint32_t>(state.integrator);
+		header.columnCount = CheckpointHeader::Columns;
+		header.lengthUnit = 1;
+		header.timeUnit = 1;
+		header.massUnit = 1;
+		header.gravitationalConstant = 1;
+		header.chunkBodies = checkpoint::ChunkBodies;
+		header.chunkCount = (count + checkpoint::ChunkBodies - 1) / checkpoint::ChunkBodies;
+		header.tableOffset = sizeof(CheckpointHeader);
+
+		std::vector<ChunkEntry> table(header.chunkCount);
+		size_t offset = dhh::memory::alignUp(
+			header.tableOffset + sizeof(ChunkEntry) * table.size(), checkpoint::FirstChunkAlignment);
+		for (uint64_t chunk = 0; chunk < header.chunkCount; ++chunk)
+		{
+			table[chunk].offset = offset;
+			table[chunk].bodies = std::min<uint64_t>(checkpoint::ChunkBodies, count - chunk * checkpoint::ChunkBodies);
+			offset += CheckpointHeader::Columns * checkpoint::columnBytes(table[chunk].bodies);
+		}
+
+		std::filesystem::path temporary = path;
+		temporary += ".tmp";
+		{
+			dhh::filesystem::MappedFile file(temporary, true, offset);
+			char* base = static_cast<char*>(file.data());
+			pool.parallelFor(table.size(), [&](uint32_t, size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; ++chunk)
+				{
+					ChunkEntry& entry = table[chunk];
+					const Body* source = bodies + chunk * checkpoint::ChunkBodies;
+					char* destination = base + entry.offset;
+					const size_t stride = checkpoint::columnBytes(entry.bodies);
+					double* columns[CheckpointHeader::Columns];
+					for (uint32_t column = 0; column < CheckpointHeader::Columns; ++column)
+					{
+						columns[column] = reinterpret_cast<double*>(destination + column * stride);
+					}
+					for (uint64_t i = 0; i < entry.bodies; ++i)
+					{
+						columns[0][i] = source[i].position.x;
+						columns[1][i] = source[i].position.y;
+						columns[2][i] = source[i].position.z;
+						columns[3][i] = source[i].velocity.x;
+						columns[4][i] = source[i].velocity.y;
+						columns[5][i] = source[i].velocity.z;
+						columns[6][i] = source[i].mass;
+					}
+					// the padding is zero in the freshly sized file
+					entry.checksum = checksum64(destination, CheckpointHeader::Columns * stride);
+				}
+			});
+			header.headerChecksum = checkpoint::tableChecksum(header, table.data());
+			std::memcpy(base, &header, sizeof(header));
+			std::memcpy(base + header.tableOffset, table.data(), sizeof(ChunkEntry) * table.size());
+			file.flush();
+		}
+		std::filesystem::rename(temporary, path);
+	}
+
+	// Memory-mapped checkpoint. The constructor validates the header and the chunk table; the payload is only
+	// touched by read(), which verifies every chunk while gathering it.
+	class CheckpointReader
+	{
+	public:
+		explicit CheckpointReader(const std::filesystem::path& path) : path(path), file(path, false)
+		{
+			if (file.size() < sizeof(CheckpointHeader))
+			{
+				fail("too small for a header");
+			}
+			std::memcpy(&fileHeader, file.data(), sizeof(fileHeader));
+			if (std::memcmp(fileHeader.magic, CheckpointHeader::Magic, sizeof(fileHeader.magic)) != 0)
+			{
+				fail("not a checkpoint");
+			}
+			if (fileHeader.version != CheckpointHeader::CurrentVersion
+				|| fileHeader.columnCount != CheckpointHeader::Columns)
+			{
+				fail("unsupported version " + std::to_string(fileHeader.version));
+			}
+			if (fileHeader.lengthUnit != 1 || fileHeader.timeUnit != 1 || fileHeader.massUnit != 1
+				|| fileHeader.gravitationalConstant != 1)
+			{
+				fail("units other than the kernels' metres, seconds and G-folded kilograms");
+			}
+			if (fileHeader.chunkCount > file.size() / sizeof(ChunkEntry)
+				|| fileHeader.tableOffset % alignof(ChunkEntry) != 0 || !checkpoint::withinFile(
+					fileHeader.tableOffset, sizeof(ChunkEntry) * fileHeader.chunkCount, file.size()))
+			{
+				fail("truncated chunk table");
+			}
+
+			table = reinterpret_cast<const ChunkEntry*>(static_cast<const char*>(file.data()) + fileHeader.tableOffset);
+			if (checkpoint::tableChecksum(fileHeader, table) != fileHeader.headerChecksum)
+			{
+				fail("header checksum mismatch");
+			}
+			uint64_t bodies = 0;
+			for (uint64_t chunk = 0; chunk < fileHeader.chunkCount; ++chunk)
+			{
+				const ChunkEntry& entry = table[chunk];
+				// bounded before the column size is computed from it, which would overflow
+				if (entry.bodies > file.size() / (CheckpointHeader::Columns * sizeof(double)))
+				{
+					fail("chunk " + std::to_string(chunk) + " out of bounds");
+				}
+				const uint64_t bytes = CheckpointHeader::Columns * checkpoint::columnBytes(entry.bodies);
+				const bool last = chunk + 1 == fileHeader.chunkCount;
+				if (entry.offset % dhh::memory::CacheLineSize != 0
+					|| !checkpoint::withinFile(entry.offset, bytes, file.size())
+					|| (last ? entry.bodies > fileHeader.chunkBodies : entry.bodies != fileHeader.chunkBodies))
+				{
+					fail("chunk " + std::to_string(chunk) + " out of bounds");
+				}
+				bodies += entry.bodies;
+			}
+			if (bodies != fileHeader.bodyCount)
+			{
+				fail("chunks hold " + std::to_string(bodies) + " bodies");
+			}
+			// start reading ahead at disk speed while the caller allocates the destination
+			file.prefetch(0, file.size());
+		}
+
+		const CheckpointHeader& header() const
+		{
+			return fileHeader;
+		}
+
+		CheckpointState state() const
+		{
+			CheckpointState result;
+			result.step = fileHeader.step;
+			result.time = fileHeader.time;
+			result.stepLength = fileHeader.stepLength;
+			result.softening = fileHeader.softening;
+			result.integrator = static_cast<CheckpointIntegrator>(fileHeader.integrator);
+			return result;
+		}
+
+		// Gathers the columns into bodyCount bodies at destination, e.g. a mapped upload buffer, one chunk per
+		// task; throws when a chunk does not match its checksum
+		void read(Body* destination, dhh::thread::ThreadPool& pool) const
+		{
+			std::atomic<int64_t> corrupt{-1};
+			const char* base = static_cast<const char*>(file.data());
+			pool.parallelFor(fileHeader.chunkCount, [&](uint32_t, size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; ++chunk)
+				{
+					const ChunkEntry& entry = table[chunk];
+					const char* source = base + entry.offset;
+					if (checksum64(source, CheckpointHeader::Columns * checkpoint::columnBytes(entry.bodies))
+						!= entry.checksum)
+					{
+						corrupt.store(static_cast<int64_t>(chunk), std::memory_order_relaxed);
+						continue;
+					}
+					const double* columns[CheckpointHeader::Columns];
+					checkpoint::columns(source, entry.bodies, columns);
+					Body* bodies = destination + chunk * fileHeader.chunkBodies;
+					for (uint64_t i = 0; i < entry.bodies; ++i)
+					{
+						bodies[i].position = glm::dvec3(columns[0][i], columns[1][i], columns[2][i]);
+						bodies[i].velocity = glm::dvec3(columns[3][i], columns[4][i], columns[5][i]);
+						bodies[i].mass = columns[6][i];
+					}
+				}
+			});
+			if (corrupt.load() >= 0)
+			{
+				fail("chunk " + std::to_string(corrupt.load()) + " checksum mismatch");
+			}
+		}
+
+	private:
+		[[noreturn]] void fail(const std::string& reason) const
+		{
+			throw std::runtime_error("Checkpoint " + path.string() + ": " + reason);
+		}
+
+		std::filesystem::path path;
+		dhh::filesystem::MappedFile file;
+		CheckpointHeader fileHeader;
+		const ChunkEntry* table = nullptr;
+	};
+}
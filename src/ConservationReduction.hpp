@@ -0,0 +1,162 @@
+#pragma once
+
+#include "Diagnostics.hpp"
+#include "Pipeline.hpp"
+#include "Shader.hpp"
+#include "Trace.hpp"
+#include "VulkanBase.h"
+#include "VulkanInitializer.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace dhh::nbody
+{
+	// Conserved quantities of a device-resident body buffer, summed by conservation.comp so a sample reads back
+	// twelve doubles instead of the state. One dispatch writes a row of sums per workgroup, the second reduces the
+	// rows in one workgroup. The potential energy costs one force evaluation, so sampling once per in-core
+	// dispatch of hundreds of steps is a fraction of a percent of the step time.
+	class ConservationReduction
+	{
+	public:
+		ConservationReduction(VulkanBase& base, VkBuffer bodies, uint32_t count, double softening)
+			: base(base), device(base.device), count(count), softening(softening)
+		{
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(base.physicalDevice, &properties);
+			if (groupCount() > properties.limits.maxComputeWorkGroupCount[0])
+			{
+				throw std::runtime_error("Conservation diagnostics of " + std::to_string(count) +
+					" bodies exceed the dispatch limit of the device");
+			}
+
+			base.createBuffer(sizeof(double) * Conservation::SumCount * groupCount(),
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, partials, partialsMemory,
+				dhh::memory::Tag::Other);
+			base.createBuffer(sizeof(double) * Conservation::SumCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+				VMA_MEMORY_USAGE_GPU_TO_CPU, result, resultMemory, dhh::memory::Tag::Other);
+			vmaMapMemory(base.allocator, resultMemory, &resultMapped);
+
+			dhh::shader::Shader shader = dhh::shader::loadShader("conservation.comp");
+			pipe = new dhh::shader::Pipeline(device, &shader, base.descriptorPool, base.pipelineCache);
+			VkDescriptorSet set = pipe->descriptorSets[0];
+			pipe->writeStorageBuffer(set, 0, bodies);
+			pipe->writeStorageBuffer(set, 1, partials);
+			pipe->writeStorageBuffer(set, 2, result);
+
+			recordCommandBuffer();
+		}
+
+		~ConservationReduction()
+		{
+			vkDeviceWaitIdle(device);
+			vmaUnmapMemory(base.allocator, resultMemory);
+			base.destroyBuffer(partials, partialsMemory);
+			base.destroyBuffer(result, resultMemory);
+			vkDestroyFence(device, fence, nullptr);
+			vkDestroyCommandPool(device, commandPool, nullptr);
+			delete pipe;
+		}
+
+		ConservationReduction(const ConservationReduction&) = delete;
+		ConservationReduction& operator=(const ConservationReduction&) = delete;
+
+		// Reduces the current state and waits for the result. Only while no dispatch writes the bodies.
+		Conservation sample()
+		{
+			NBODY_TRACE_SCOPE("conservation");
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &commandBuffer;
+			{
+				auto lock = base.lockQueue(base.computeQueue);
+				vkQueueSubmit(base.computeQueue, 1, &submitInfo, fence);
+			}
+			vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+			vkResetFences(device, 1, &fence);
+			vmaInvalidateAllocation(base.allocator, resultMemory, 0, VK_WHOLE_SIZE);
+			return Conservation::fromSums(static_cast<const double*>(resultMapped));
+		}
+
+	private:
+		struct ConservationParams
+		{
+			double softening;
+			uint32_t bodyCount;
+			uint32_t groupCount;
+			uint32_t stage;
+			uint32_t padding;
+		};
+
+		static constexpr uint32_t WorkgroupSize = 128;  // GROUP_SIZE of conservation.comp
+		static constexpr uint32_t StageBodies = 0;
+		static constexpr uint32_t StageGroups = 1;
+
+		VulkanBase& base;
+		VkDevice device;
+		uint32_t count;
+		double softening;
+
+		VkBuffer partials;
+		VmaAllocation partialsMemory;
+		VkBuffer result;
+		VmaAllocation resultMemory;
+		void* resultMapped;
+
+		dhh::shader::Pipeline* pipe;
+		VkCommandPool commandPool;
+		VkCommandBuffer commandBuffer;
+		VkFence fence;
+
+		uint32_t groupCount() const
+		{
+			return std::max<uint32_t>((count + WorkgroupSize - 1) / WorkgroupSize, 1);
+		}
+
+		void recordCommandBuffer()
+		{
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = base.queueFamilyIndex.graphicsFamily.value();
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create conservation command pool!");
+			}
+
+			VkCommandBufferAllocateInfo info =
+				dhh::vk::initializer::commandBufferAllocateInfo(commandPool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+			vkAllocateCommandBuffers(device, &info, &commandBuffer);
+
+			VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+			vkCreateFence(device, &fenceCreateInfo, nullptr, &fence);
+
+			VkCommandBufferBeginInfo beginInfo = dhh::vk::initializer::commandBufferBeginInfo();
+			vkBeginCommandBuffer(commandBuffer, &beginInfo);
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipe->pipeline);
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipe->pipelineLayout, 0, 1,
+				pipe->descriptorSets.data(), 0, nullptr);
+
+			// the integration dispatches were waited for on the host, so the bodies need no barrier
+			pipe->pushConstants(commandBuffer, ConservationParams{softening, count, groupCount(), StageBodies, 0});
+			vkCmdDispatch(commandBuffer, groupCount(), 1, 1);
+
+			VkMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+			pipe->pushConstants(commandBuffer, ConservationParams{softening, count, groupCount(), StageGroups, 0});
+			vkCmdDispatch(commandBuffer, 1, 1, 1);
+
+			barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+				1, &barrier, 0, nullptr, 0, nullptr);
+			vkEndCommandBuffer(commandBuffer);
+		}
+	};
+}
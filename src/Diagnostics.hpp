@@ -0,0 +1,167 @@
+#pragma once
+
+#include "Body.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// O(N²) reference diagnostics of a host copy of the body state, in the units of the force kernels (G = 1)
+	//
+	// Rows are summed in full and halved rather than over j > i, so the static slices of the pool get equal work.
+	// partials holds the sums of each worker and is reused between calls.
+
+	// Conserved quantities of a body set. Without external forces the energy, momentum and angular momentum stay
+	// constant, and the centre of mass moves in a straight line at momentum / mass.
+	struct Conservation
+	{
+		double kinetic = 0;
+		double potential = 0;  // NaN when it was not computed
+		double mass = 0;
+		glm::dvec3 momentum = glm::dvec3(0);
+		glm::dvec3 angularMomentum = glm::dvec3(0);  // about the origin
+		glm::dvec3 centerOfMass = glm::dvec3(0);
+
+		static constexpr size_t SumCount = 12;
+
+		double energy() const
+		{
+			return kinetic + potential;
+		}
+
+		// from the sums of kinetic, potential, mass, momentum, angular momentum and mass-weighted position, the
+		// layout conservation.comp reduces into
+		static Conservation fromSums(const double* sums)
+		{
+			Conservation conservation;
+			conservation.kinetic = sums[0];
+			conservation.potential = sums[1];
+			conservation.mass = sums[2];
+			conservation.momentum = glm::dvec3(sums[3], sums[4], sums[5]);
+			conservation.angularMomentum = glm::dvec3(sums[6], sums[7], sums[8]);
+			conservation.centerOfMass =
+				sums[2] != 0 ? glm::dvec3(sums[9], sums[10], sums[11]) / sums[2] : glm::dvec3(0);
+			return conservation;
+		}
+	};
+
+	// Change since an initial sample, elapsed simulated seconds later
+	struct ConservationDrift
+	{
+		double energy = 0;           // relative
+		double momentum = 0;         // absolute, of the magnitude of the difference
+		double angularMomentum = 0;  // relative, absolute when it started at 0
+		double centerOfMass = 0;     // metres away from the straight line of the initial momentum
+
+		ConservationDrift(const Conservation& initial, const Conservation& current, double elapsed)
+		{
+			const auto relative = [](double difference, double reference) {
+				return reference != 0 ? difference / reference : difference;
+			};
+			energy = relative(std::abs(current.energy() - initial.energy()), std::abs(initial.energy()));
+			momentum = glm::length(current.momentum - initial.momentum);
+			angularMomentum = relative(glm::length(current.angularMomentum - initial.angularMomentum),
+				glm::length(initial.angularMomentum));
+			const glm::dvec3 expected = initial.centerOfMass
+				+ (initial.mass != 0 ? initial.momentum / initial.mass : glm::dvec3(0)) * elapsed;
+			centerOfMass = glm::length(current.centerOfMass - expected);
+		}
+	};
+
+	// The conserved quantities on the host; the potential energy is O(N²) and only summed with withPotential.
+	// conservation.comp computes the same on the GPU.
+	inline Conservation conservation(const Body* bodies, size_t count, double softening, bool withPotential,
+		dhh::thread::ThreadPool& pool, std::vector<double>& partials)
+	{
+		partials.assign(pool.size() * Conservation::SumCount, 0);
+		const double softening2 = softening * softening;
+		pool.parallelFor(count, [&](uint32_t worker, size_t begin, size_t end) {
+			double sums[Conservation::SumCount] = {};
+			for (size_t i = begin; i < end; ++i)
+			{
+				const Body& body = bodies[i];
+				const glm::dvec3 momentum = body.mass * body.velocity;
+				const glm::dvec3 angular = glm::cross(body.position, momentum);
+				sums[0] += 0.5 * glm::dot(momentum, body.velocity);
+				sums[2] += body.mass;
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					sums[3 + axis] += momentum[axis];
+					sums[6 + axis] += angular[axis];
+					sums[9 + axis] += body.mass * body.position[axis];
+				}
+				if (!withPotential)
+				{
+					continue;
+				}
+				double potential = 0;
+				for (size_t j = 0; j < count; ++j)
+				{
+					if (j != i)
+					{
+						const glm::dvec3 d = bodies[j].position - body.position;
+						potential += bodies[j].mass / std::sqrt(glm::dot(d, d) + softening2);
+					}
+				}
+				sums[1] -= 0.5 * body.mass * potential;
+			}
+			std::copy(sums, sums + Conservation::SumCount, partials.begin() + worker * Conservation::SumCount);
+		});
+
+		double sums[Conservation::SumCount] = {};
+		for (uint32_t worker = 0; worker < pool.size(); ++worker)
+		{
+			for (size_t value = 0; value < Conservation::SumCount; ++value)
+			{
+				sums[value] += partials[worker * Conservation::SumCount + value];
+			}
+		}
+		if (!withPotential)
+		{
+			sums[1] = std::numeric_limits<double>::quiet_NaN();
+		}
+		return Conservation::fromSums(sums);
+	}
+
+	// acceleration of one body, plain double precision sum over all others; the reference for force errors
+	inline glm::dvec3 referenceAcceleration(const Body* bodies, size_t count, size_t index, double softening = 0)
+	{
+		glm::dvec3 acceleration(0);
+		for (size_t j = 0; j < count; ++j)
+		{
+			if (j != index)
+			{
+				const glm::dvec3 d = bodies[j].position - bodies[index].position;
+				const double r2 = glm::dot(d, d) + softening * softening;
+				acceleration += d * (bodies[j].mass / (r2 * std::sqrt(r2)));
+			}
+		}
+		return acceleration;
+	}
+
+	// smallest pair distance, what nbody.comp picks its step length from
+	inline double minimumSeparation(const Body* bodies, size_t count, dhh::thread::ThreadPool& pool,
+		std::vector<double>& partials)
+	{
+		partials.assign(pool.size(), std::numeric_limits<double>::infinity());
+		pool.parallelFor(count, [&](uint32_t worker, size_t begin, size_t end) {
+			double closest2 = std::numeric_limits<double>::infinity();
+			for (size_t i = begin; i < end; ++i)
+			{
+				for (size_t j = 0; j < count; ++j)
+				{
+					const glm::dvec3 d = bodies[j].position - bodies[i].position;
+					closest2 = j != i ? std::min(closest2, glm::dot(d, d)) : closest2;
+				}
+			}
+			partials[worker] = closest2;
+		});
+		return std::sqrt(*std::min_element(partials.begin(), partials.end()));
+	}
+}
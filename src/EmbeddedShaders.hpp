@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+namespace dhh::shader
+{
+    // Shader compiled to SPIR-V at build time, data holds Shader::serialize() output (SPIR-V and reflection)
+    struct EmbeddedShader
+    {
+        const char* name;
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // Defined in EmbeddedShaders.cpp, generated in the build directory by nbody-shader-embed
+    extern const EmbeddedShader embeddedShaders[];
+    extern const size_t embeddedShaderCount;
+
+    inline const EmbeddedShader* findEmbeddedShader(const std::string& name)
+    {
+        for (size_t i = 0; i < embeddedShaderCount; ++i)
+        {
+            if (name == embeddedShaders[i].name)
+            {
+                return &embeddedShaders[i];
+            }
+        }
+        return nullptr;
+    }
+}
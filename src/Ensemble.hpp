@@ -0,0 +1,549 @@
+#pragma once
+
+#include "Body.hpp"
+#include "Pipeline.hpp"
+#include "Shader.hpp"
+#include "VulkanBase.h"
+#include "VulkanInitializer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Must match MAX_BODIES in ensemble.comp
+	constexpr uint32_t EnsembleMaxBodies = 8;
+
+	enum class SystemStatus : uint32_t
+	{
+		Running,
+		Escape,
+		Collision,
+		TimeLimit,
+	};
+
+	inline const char* statusName(SystemStatus status)
+	{
+		const char* names[] = {"running", "escape", "collision", "time-limit"};
+		return names[static_cast<uint32_t>(status)];
+	}
+
+	// Matches the std430 layout of `struct System` in ensemble.comp
+	struct SystemState
+	{
+		double time;
+		SystemStatus status;
+		uint32_t steps;
+		uint32_t body;  // escaping body, or the lower index of the colliding pair
+		uint32_t flags;  // kernel state between dispatches
+	};
+
+	static_assert(sizeof(SystemState) == 24, "SystemState must match the std430 layout used by ensemble.comp");
+
+	// The terminating events have the value of the status they lead to
+	enum class EnsembleEventKind : uint32_t
+	{
+		Escape = 1,
+		Collision,
+		TimeLimit,
+		CloseApproach,
+	};
+
+	inline const char* eventName(EnsembleEventKind kind)
+	{
+		return kind == EnsembleEventKind::CloseApproach ? "close-approach"
+			: statusName(static_cast<SystemStatus>(kind));
+	}
+
+	// Matches the std430 layout of `struct Event` in ensemble.comp
+	struct EnsembleEvent
+	{
+		double time;
+		uint32_t system;
+		EnsembleEventKind kind;
+		uint32_t body;    // escaping body, or the lower index of the pair
+		uint32_t other;   // higher index of the pair, the escaping body again for an escape
+		double distance;  // of the pair, or of the escaping body from the others' centre of mass
+	};
+
+	static_assert(sizeof(EnsembleEvent) == 32, "EnsembleEvent must match the std430 layout used by ensemble.comp");
+
+	// M independent systems of n bodies each, system s owns bodies [s * n, (s + 1) * n)
+	struct Ensemble
+	{
+		uint32_t bodiesPerSystem = 0;
+		BodyArray bodies;
+
+		size_t systemCount() const
+		{
+			return bodiesPerSystem > 0 ? bodies.size() / bodiesPerSystem : 0;
+		}
+	};
+
+	struct EnsembleConfig
+	{
+		double stepLength = 0.0001;
+		double timeLimit = 10;
+		double escapeRadius = 1e13;
+		double collisionRadius = 1e9;
+		double closeApproachRadius = 0;  // pair distance recorded as a close approach, 0 records none
+		double gravity = 1;  // the presets fold G into the masses, like nbody.comp
+		uint32_t stepsPerDispatch = 1000;
+	};
+
+	// Parameter file: '#' starts a comment, the first line is "bodies N", then one system per line as N groups of
+	// "mass x y z vx vy vz"
+	inline Ensemble loadEnsemble(const std::filesystem::path& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			throw std::runtime_error("Cannot open ensemble file " + path.string());
+		}
+
+		Ensemble ensemble;
+		std::string line;
+		size_t lineNumber = 0;
+		while (std::getline(file, line))
+		{
+			++lineNumber;
+			line = line.substr(0, line.find('#'));
+			std::istringstream stream(line);
+			std::string first;
+			if (!(stream >> first))
+			{
+				continue;
+			}
+
+			const auto fail = [&](const std::string& reason) {
+				return std::runtime_error(path.string() + ":" + std::to_string(lineNumber) + ": " + reason);
+			};
+
+			if (ensemble.bodiesPerSystem == 0)
+			{
+				if (first != "bodies" || !(stream >> ensemble.bodiesPerSystem) || ensemble.bodiesPerSystem < 2 ||
+					ensemble.bodiesPerSystem > EnsembleMaxBodies)
+				{
+					throw fail("expected \"bodies N\" with 2 <= N <= " + std::to_string(EnsembleMaxBodies));
+				}
+				continue;
+			}
+
+			stream.clear();
+			stream.str(line);
+			for (uint32_t i = 0; i < ensemble.bodiesPerSystem; ++i)
+			{
+				Body body;
+				if (!(stream >> body.mass >> body.position.x >> body.position.y >> body.position.z >>
+					body.velocity.x >> body.velocity.y >> body.velocity.z))
+				{
+					throw fail("expected " + std::to_string(ensemble.bodiesPerSystem * 7) + " numbers per system");
+				}
+				ensemble.bodies.push_back(body);
+			}
+		}
+
+		if (ensemble.systemCount() == 0)
+		{
+			throw std::runtime_error("No systems in ensemble file " + path.string());
+		}
+		return ensemble;
+	}
+
+	// One line per system: index, status, time, steps, body, then the final state in the input format
+	inline void saveEnsemble(const std::filesystem::path& path, const Ensemble& ensemble,
+		const std::vector<SystemState>& systems)
+	{
+		std::ofstream file(path);
+		if (!file)
+		{
+			throw std::runtime_error("Cannot write ensemble results to " + path.string());
+		}
+
+		file << "# system status time steps body, then mass x y z vx vy vz per body\n";
+		file << "bodies " << ensemble.bodiesPerSystem << "\n";
+		file << std::setprecision(17);
+		for (size_t s = 0; s < systems.size(); ++s)
+		{
+			const SystemState& system = systems[s];
+			file << s << " " << statusName(system.status) << " " << system.time << " " << system.steps << " "
+				<< system.body;
+			for (uint32_t i = 0; i < ensemble.bodiesPerSystem; ++i)
+			{
+				const Body& body = ensemble.bodies[s * ensemble.bodiesPerSystem + i];
+				file << " " << body.mass << " " << body.position.x << " " << body.position.y << " "
+					<< body.position.z << " " << body.velocity.x << " " << body.velocity.y << " " << body.velocity.z;
+			}
+			file << "\n";
+		}
+	}
+
+	// One line per event in the order the host received them: system, event, time, body, other, distance
+	inline void saveEnsembleEvents(const std::filesystem::path& path, const std::vector<EnsembleEvent>& events)
+	{
+		std::ofstream file(path);
+		if (!file)
+		{
+			throw std::runtime_error("Cannot write ensemble events to " + path.string());
+		}
+
+		file << "# system event time body other distance\n";
+		file << std::setprecision(17);
+		for (const EnsembleEvent& event : events)
+		{
+			file << event.system << " " << eventName(event.kind) << " " << event.time << " " << event.body << " "
+				<< event.other << " " << event.distance << "\n";
+		}
+	}
+
+	// Monte Carlo ensemble around a reference system: every position and velocity component is scaled by a
+	// uniform factor in [1 - spread, 1 + spread]
+	inline Ensemble perturbEnsemble(const BodyArray& reference, size_t systems, double spread, uint64_t seed = 42)
+	{
+		std::mt19937_64 generator(seed);
+		std::uniform_real_distribution<double> factor(1 - spread, 1 + spread);
+
+		Ensemble ensemble;
+		ensemble.bodiesPerSystem = static_cast<uint32_t>(reference.size());
+		ensemble.bodies.resize(systems * reference.size());
+		for (size_t s = 0; s < systems; ++s)
+		{
+			for (size_t i = 0; i < reference.size(); ++i)
+			{
+				Body body = reference[i];
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					body.position[axis] *= factor(generator);
+					body.velocity[axis] *= factor(generator);
+				}
+				ensemble.bodies[s * reference.size() + i] = body;
+			}
+		}
+		return ensemble;
+	}
+
+	// Runs every system of an ensemble to termination, one invocation of ensemble.comp per system. The kernel appends
+	// an event when a system terminates or a pair comes close, so between dispatches the host reads only the event
+	// counter and the new records; bodies and statuses are read once the run is over.
+	class EnsembleSolver
+	{
+	public:
+		EnsembleSolver(VulkanBase& base, const Ensemble& ensemble, const EnsembleConfig& config)
+			: base(base), device(base.device), config(config), bodiesPerSystem(ensemble.bodiesPerSystem),
+			systemCount(ensemble.systemCount())
+		{
+			if (bodiesPerSystem < 2 || bodiesPerSystem > EnsembleMaxBodies)
+			{
+				throw std::runtime_error("Ensemble systems need 2 to " + std::to_string(EnsembleMaxBodies) +
+					" bodies");
+			}
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(base.physicalDevice, &properties);
+			if (groupCount() > properties.limits.maxComputeWorkGroupCount[0])
+			{
+				throw std::runtime_error("Ensemble of " + std::to_string(systemCount) +
+					" systems exceeds the dispatch limit of the device");
+			}
+
+			createBuffers(ensemble);
+			createPipeline();
+			recordCommandBuffer();
+		}
+
+		~EnsembleSolver()
+		{
+			vkDeviceWaitIdle(device);
+			vmaUnmapMemory(base.allocator, bodyMemory);
+			vmaUnmapMemory(base.allocator, systemMemory);
+			vmaUnmapMemory(base.allocator, eventMemory);
+			base.destroyBuffer(bodyBuffer, bodyMemory);
+			base.destroyBuffer(systemBuffer, systemMemory);
+			base.destroyBuffer(eventBuffer, eventMemory);
+			vkDestroyFence(device, fence, nullptr);
+			vkDestroyCommandPool(device, commandPool, nullptr);
+			delete ensemblePipe;
+		}
+
+		EnsembleSolver(const EnsembleSolver&) = delete;
+		EnsembleSolver& operator=(const EnsembleSolver&) = delete;
+
+		// Dispatches until no system is running, with a progress line about once a second
+		void run()
+		{
+			const auto start = std::chrono::steady_clock::now();
+			auto lastProgress = start;
+			size_t running = systemCount;
+			while (running > 0)
+			{
+				dispatch();
+				running = readEvents(running);
+
+				const auto now = std::chrono::steady_clock::now();
+				if (now - lastProgress >= std::chrono::seconds(1))
+				{
+					lastProgress = now;
+					std::cout << "Ensemble: " << running << " of " << systemCount << " systems running\n";
+				}
+			}
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			vmaInvalidateAllocation(base.allocator, bodyMemory, 0, VK_WHOLE_SIZE);
+			vmaInvalidateAllocation(base.allocator, systemMemory, 0, VK_WHOLE_SIZE);
+		}
+
+		void report(std::ostream& out) const
+		{
+			const auto counts = countStatus();
+			uint64_t steps = 0;
+			for (size_t s = 0; s < systemCount; ++s)
+			{
+				steps += systems()[s].steps;
+			}
+			const uint64_t pairs = bodiesPerSystem * (bodiesPerSystem - 1) / 2;
+
+			out << "Ensemble: " << systemCount << " systems of " << bodiesPerSystem << " bodies in " << seconds
+				<< " s\n";
+			for (size_t status = 0; status < counts.size(); ++status)
+			{
+				out << "  " << std::left << std::setw(12) << statusName(static_cast<SystemStatus>(status))
+					<< std::right << counts[status] << "\n";
+			}
+			const size_t closeApproaches = std::count_if(eventLog.begin(), eventLog.end(),
+				[](const EnsembleEvent& event) { return event.kind == EnsembleEventKind::CloseApproach; });
+			out << "  " << closeApproaches << " close approaches, " << eventLog.size() << " events in "
+				<< dhh::memory::formatBytes(eventBytes) << " of readback";
+			if (overflows > 0)
+			{
+				out << ", the event buffer overflowed in " << overflows << " dispatches";
+			}
+			out << "\n";
+			out << "  " << steps << " system steps, " << (seconds > 0 ? steps / seconds : 0) << " steps/s, "
+				<< (seconds > 0 ? steps * pairs / seconds : 0) << " pair interactions/s\n";
+		}
+
+		// Final state, valid after run()
+		Ensemble result() const
+		{
+			Ensemble ensemble;
+			ensemble.bodiesPerSystem = bodiesPerSystem;
+			ensemble.bodies.assign(bodies(), bodies() + systemCount * bodiesPerSystem);
+			return ensemble;
+		}
+
+		std::vector<SystemState> systemStates() const
+		{
+			return std::vector<SystemState>(systems(), systems() + systemCount);
+		}
+
+		// Every event received so far, in arrival order. Incomplete when the event buffer overflowed.
+		const std::vector<EnsembleEvent>& events() const
+		{
+			return eventLog;
+		}
+
+	private:
+		struct EnsembleParams
+		{
+			double stepLength;
+			double timeLimit;
+			double escapeRadius;
+			double collisionRadius;
+			double closeApproachRadius;
+			double gravity;
+			uint32_t systemCount;
+			uint32_t bodiesPerSystem;
+			uint32_t stepsPerDispatch;
+			uint32_t eventCapacity;
+		};
+
+		static constexpr uint32_t WorkgroupSize = 64;  // local_size_x of ensemble.comp
+		static constexpr VkDeviceSize EventsOffset = 8;  // of events[] in the event block, after the counter
+
+		VulkanBase& base;
+		VkDevice device;
+		EnsembleConfig config;
+		uint32_t bodiesPerSystem;
+		size_t systemCount;
+		double seconds = 0;
+
+		// records per dispatch; a system terminates at most once, the rest is room for close approaches
+		uint32_t eventCapacity;
+		std::vector<EnsembleEvent> eventLog;
+		uint64_t eventBytes = 0;  // read back from the event buffer
+		uint64_t overflows = 0;   // dispatches that dropped events
+
+		// host-visible, the kernel only touches them when a dispatch starts and ends
+		VkBuffer bodyBuffer;
+		VmaAllocation bodyMemory;
+		void* bodyMapped;
+		VkBuffer systemBuffer;
+		VmaAllocation systemMemory;
+		void* systemMapped;
+		VkBuffer eventBuffer;
+		VmaAllocation eventMemory;
+		void* eventMapped;
+
+		dhh::shader::Pipeline* ensemblePipe;
+		VkCommandPool commandPool;
+		VkCommandBuffer commandBuffer;
+		VkFence fence;
+
+		uint32_t groupCount() const
+		{
+			return static_cast<uint32_t>((systemCount + WorkgroupSize - 1) / WorkgroupSize);
+		}
+
+		const Body* bodies() const
+		{
+			return static_cast<const Body*>(bodyMapped);
+		}
+
+		const SystemState* systems() const
+		{
+			return static_cast<const SystemState*>(systemMapped);
+		}
+
+		std::array<size_t, 4> countStatus() const
+		{
+			std::array<size_t, 4> counts{};
+			for (size_t s = 0; s < systemCount; ++s)
+			{
+				++counts[static_cast<size_t>(systems()[s].status)];
+			}
+			return counts;
+		}
+
+		void createBuffers(const Ensemble& ensemble)
+		{
+			const VkDeviceSize bodyBytes = sizeof(Body) * ensemble.bodies.size();
+			const VkDeviceSize systemBytes = sizeof(SystemState) * systemCount;
+
+			base.createBuffer(bodyBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, bodyBuffer,
+				bodyMemory, dhh::memory::Tag::Bodies);
+			base.createBuffer(systemBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU,
+				systemBuffer, systemMemory, dhh::memory::Tag::Bodies);
+			vmaMapMemory(base.allocator, bodyMemory, &bodyMapped);
+			vmaMapMemory(base.allocator, systemMemory, &systemMapped);
+
+			eventCapacity = static_cast<uint32_t>(std::min<size_t>(2 * systemCount + 1024, UINT32_MAX));
+			base.createBuffer(EventsOffset + sizeof(EnsembleEvent) * eventCapacity,
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU,
+				eventBuffer, eventMemory, dhh::memory::Tag::Other);
+			vmaMapMemory(base.allocator, eventMemory, &eventMapped);
+
+			memcpy(bodyMapped, ensemble.bodies.data(), bodyBytes);
+			memset(systemMapped, 0, systemBytes);
+			vmaFlushAllocation(base.allocator, bodyMemory, 0, VK_WHOLE_SIZE);
+			vmaFlushAllocation(base.allocator, systemMemory, 0, VK_WHOLE_SIZE);
+		}
+
+		void createPipeline()
+		{
+			dhh::shader::Shader ensembleShader = dhh::shader::loadShader("ensemble.comp");
+			ensemblePipe = new dhh::shader::Pipeline(device, &ensembleShader, base.descriptorPool, base.pipelineCache);
+
+			VkDescriptorSet set = ensemblePipe->descriptorSets[0];
+			ensemblePipe->writeStorageBuffer(set, 0, bodyBuffer);
+			ensemblePipe->writeStorageBuffer(set, 1, systemBuffer);
+			ensemblePipe->writeStorageBuffer(set, 2, eventBuffer);
+		}
+
+		void recordCommandBuffer()
+		{
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = base.queueFamilyIndex.graphicsFamily.value();
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create ensemble command pool!");
+			}
+
+			VkCommandBufferAllocateInfo info =
+				dhh::vk::initializer::commandBufferAllocateInfo(commandPool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+			vkAllocateCommandBuffers(device, &info, &commandBuffer);
+
+			VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+			vkCreateFence(device, &fenceCreateInfo, nullptr, &fence);
+
+			VkCommandBufferBeginInfo beginInfo = dhh::vk::initializer::commandBufferBeginInfo();
+			vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+			// empty the append buffer
+			vkCmdFillBuffer(commandBuffer, eventBuffer, 0, sizeof(uint32_t), 0);
+			VkMemoryBarrier reset = {};
+			reset.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			reset.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			reset.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 1, &reset, 0, nullptr, 0, nullptr);
+
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ensemblePipe->pipeline);
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, ensemblePipe->pipelineLayout, 0, 1,
+				ensemblePipe->descriptorSets.data(), 0, nullptr);
+			ensemblePipe->pushConstants(commandBuffer,
+				EnsembleParams{config.stepLength, config.timeLimit, config.escapeRadius, config.collisionRadius,
+					config.closeApproachRadius, config.gravity, static_cast<uint32_t>(systemCount), bodiesPerSystem,
+					config.stepsPerDispatch, eventCapacity});
+			vkCmdDispatch(commandBuffer, groupCount(), 1, 1);
+
+			// the host reads the events after each dispatch
+			VkMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+				1, &barrier, 0, nullptr, 0, nullptr);
+			vkEndCommandBuffer(commandBuffer);
+		}
+
+		void dispatch()
+		{
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &commandBuffer;
+			{
+				auto lock = base.lockQueue(base.computeQueue);
+				vkQueueSubmit(base.computeQueue, 1, &submitInfo, fence);
+			}
+			vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+			vkResetFences(device, 1, &fence);
+		}
+
+		// Appends the events of the last dispatch to the log and returns how many of the running systems still run
+		size_t readEvents(size_t running)
+		{
+			vmaInvalidateAllocation(base.allocator, eventMemory, 0, sizeof(uint32_t));
+			const uint32_t count = *static_cast<const uint32_t*>(eventMapped);
+			const uint32_t stored = std::min(count, eventCapacity);
+			vmaInvalidateAllocation(base.allocator, eventMemory, EventsOffset, sizeof(EnsembleEvent) * stored);
+			const EnsembleEvent* records =
+				reinterpret_cast<const EnsembleEvent*>(static_cast<const char*>(eventMapped) + EventsOffset);
+			eventBytes += sizeof(uint32_t) + sizeof(EnsembleEvent) * stored;
+
+			for (uint32_t i = 0; i < stored; ++i)
+			{
+				eventLog.push_back(records[i]);
+				running -= records[i].kind != EnsembleEventKind::CloseApproach;
+			}
+			if (count > eventCapacity)
+			{
+				// dropped records may have been terminations, count them from the statuses instead
+				++overflows;
+				vmaInvalidateAllocation(base.allocator, systemMemory, 0, VK_WHOLE_SIZE);
+				eventBytes += sizeof(SystemState) * systemCount;
+				running = countStatus()[static_cast<size_t>(SystemStatus::Running)];
+			}
+			return running;
+		}
+	};
+}
@@ -0,0 +1,409 @@
+#pragma once
+
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "Filesystem.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Ephemeris file, little-endian:
+	//
+	//   EphemerisHeader                  128 bytes
+	//   segments                         at dataOffset, segmentCount of them
+	//
+	// Time is cut into segments of segmentLength starting at startTime. A segment holds, for every body and each
+	// of x, y, z, the coefficientCount coefficients of a Chebyshev series over the segment's interval mapped to
+	// [-1, 1]. Segment k of body i therefore starts at dataOffset + (k * bodyCount + i) * 3 * coefficientCount
+	// doubles: a query computes the segment from t and evaluates one series, whatever the file's length.
+
+	struct EphemerisHeader
+	{
+		static constexpr char Magic[8] = {'N', 'B', 'O', 'D', 'Y', 'E', 'P', 'H'};
+		static constexpr uint32_t CurrentVersion = 1;
+
+		char magic[8];
+		uint32_t version;
+		uint32_t headerBytes;
+		uint64_t bodyCount;
+		uint32_t coefficientCount;  // polynomial degree + 1
+		uint32_t reserved0;
+		double startTime;           // simulated time of the first sample
+		double segmentLength;       // simulated seconds per segment
+		double endTime;             // of the last sample that went into a segment
+		uint64_t segmentCount;      // 0 while the file is being written
+		uint64_t dataOffset;
+		uint8_t reserved[56];
+	};
+
+	static_assert(sizeof(EphemerisHeader) == 128, "EphemerisHeader is part of the file format");
+
+	struct EphemerisConfig
+	{
+		double segmentLength = 1;  // simulated seconds
+		uint32_t degree = 10;
+	};
+
+	namespace ephemeris
+	{
+		// T_k(tau) and dT_k/dtau for k < count
+		inline void chebyshev(double tau, uint32_t count, double* values, double* derivatives)
+		{
+			values[0] = 1;
+			derivatives[0] = 0;
+			if (count > 1)
+			{
+				values[1] = tau;
+				derivatives[1] = 1;
+			}
+			for (uint32_t k = 1; k + 1 < count; ++k)
+			{
+				values[k + 1] = 2 * tau * values[k] - values[k - 1];
+				derivatives[k + 1] = 2 * values[k] + 2 * tau * derivatives[k] - derivatives[k - 1];
+			}
+		}
+	}
+
+	// Fits the ephemeris while the simulation runs. Every sample's positions and velocities are folded into the
+	// least squares normal equations of the current segment; the normal matrix only depends on the sample times,
+	// so it is shared by all bodies and a segment is solved with one Cholesky factorization. Velocities enter as
+	// constraints on the derivative, which keeps neighbouring segments' series joined smoothly and halves the
+	// samples a segment needs. Memory is O(N * degree) whatever the sampling rate.
+	class EphemerisWriter
+	{
+	public:
+		EphemerisWriter(const std::filesystem::path& path, size_t bodyCount, const EphemerisConfig& config,
+			dhh::thread::ThreadPool& pool)
+			: path(path), pool(pool), bodyCount(bodyCount), coefficients(config.degree + 1),
+			segmentLength(config.segmentLength)
+		{
+			if (!(config.segmentLength > 0) || config.degree < 1 || config.degree > 30)
+			{
+				throw std::runtime_error("Ephemeris segments need a positive length and a degree from 1 to 30");
+			}
+			file.open(path, std::ios::binary | std::ios::trunc);
+			if (!file)
+			{
+				throw std::runtime_error("Cannot create ephemeris " + path.string());
+			}
+			fileHeader = {};
+			std::memcpy(fileHeader.magic, EphemerisHeader::Magic, sizeof(fileHeader.magic));
+			fileHeader.version = EphemerisHeader::CurrentVersion;
+			fileHeader.headerBytes = sizeof(EphemerisHeader);
+			fileHeader.bodyCount = bodyCount;
+			fileHeader.coefficientCount = coefficients;
+			fileHeader.segmentLength = segmentLength;
+			fileHeader.dataOffset = sizeof(EphemerisHeader);
+			file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+
+			normal.resize(coefficients * coefficients);
+			right.allocate(bodyCount * 3 * coefficients, false, &pool);
+			values.resize(coefficients);
+			derivatives.resize(coefficients);
+		}
+
+		~EphemerisWriter()
+		{
+			try
+			{
+				close();
+			}
+			catch (const std::exception&)
+			{
+			}
+		}
+
+		EphemerisWriter(const EphemerisWriter&) = delete;
+		EphemerisWriter& operator=(const EphemerisWriter&) = delete;
+
+		// Adds the state at simulated time t, later than the previous sample. A sample on the end of the current
+		// segment closes it and also opens the next one; a sample past the end closes it and only opens the next one,
+		// so no fit is extrapolated beyond its segment.
+		void sample(double time, const Body* bodies)
+		{
+			if (!file.is_open())
+			{
+				return;
+			}
+			if (samples == 0 && fileHeader.segmentCount == 0)
+			{
+				fileHeader.startTime = time;
+			}
+			const double segmentEnd = fileHeader.startTime + (fileHeader.segmentCount + 1) * segmentLength;
+			if (time >= segmentEnd + segmentLength)
+			{
+				throw std::runtime_error("Ephemeris samples are further apart than a segment, use a longer "
+					"segment or sample more often");
+			}
+			if (time <= segmentEnd)
+			{
+				accumulate(time, bodies);
+			}
+			if (time >= segmentEnd)
+			{
+				writeSegment();
+				accumulate(time, bodies);
+			}
+			fileHeader.endTime = time;
+		}
+
+		// Fits what the last segment has so far when it has enough samples, and completes the header
+		void close()
+		{
+			if (!file.is_open())
+			{
+				return;
+			}
+			if (2 * samples >= coefficients)
+			{
+				writeSegment();
+			}
+			else
+			{
+				// the samples after the last full segment are dropped
+				const double covered = fileHeader.startTime + fileHeader.segmentCount * segmentLength;
+				fileHeader.endTime = std::min(fileHeader.endTime, covered);
+			}
+			file.seekp(0);
+			file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+			file.close();
+			if (!file)
+			{
+				throw std::runtime_error("Cannot write ephemeris " + path.string());
+			}
+		}
+
+		// complete once closed
+		const EphemerisHeader& header() const
+		{
+			return fileHeader;
+		}
+
+	private:
+		// only with tau in [-1, 1], outside the basis grows quickly with the degree and the fit loses conditioning
+		void accumulate(double time, const Body* bodies)
+		{
+			const double segmentStart = fileHeader.startTime + fileHeader.segmentCount * segmentLength;
+			const double tau = 2 * (time - segmentStart) / segmentLength - 1;
+			ephemeris::chebyshev(tau, coefficients, values.data(), derivatives.data());
+			for (uint32_t row = 0; row < coefficients; ++row)
+			{
+				for (uint32_t column = 0; column < coefficients; ++column)
+				{
+					normal[row * coefficients + column] +=
+						values[row] * values[column] + derivatives[row] * derivatives[column];
+				}
+			}
+
+			// dx/dtau = v * segmentLength / 2
+			const double scale = segmentLength / 2;
+			const uint32_t count = coefficients;
+			const double* value = values.data();
+			const double* derivative = derivatives.data();
+			double* sums = right.data();
+			pool.parallelFor(bodyCount, [=](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					const double position[3] = {bodies[i].position.x, bodies[i].position.y, bodies[i].position.z};
+					const double velocity[3] = {bodies[i].velocity.x, bodies[i].velocity.y, bodies[i].velocity.z};
+					for (uint32_t axis = 0; axis < 3; ++axis)
+					{
+						double* sum = sums + (i * 3 + axis) * count;
+						for (uint32_t k = 0; k < count; ++k)
+						{
+							sum[k] += value[k] * position[axis] + derivative[k] * velocity[axis] * scale;
+						}
+					}
+				}
+			});
+			++samples;
+		}
+
+		// solves the normal equations for every body and axis and appends the segment
+		void writeSegment()
+		{
+			const uint32_t n = coefficients;
+			std::vector<double>& factor = normal;
+			for (uint32_t j = 0; j < n; ++j)
+			{
+				double diagonal = factor[j * n + j];
+				for (uint32_t k = 0; k < j; ++k)
+				{
+					diagonal -= factor[j * n + k] * factor[j * n + k];
+				}
+				if (!(diagonal > 1e-12 * samples))
+				{
+					throw std::runtime_error("Ephemeris segment " + std::to_string(fileHeader.segmentCount) + " has "
+						+ std::to_string(samples) + " samples, too few for degree " + std::to_string(n - 1)
+						+ "; use a longer segment or a lower degree");
+				}
+				factor[j * n + j] = std::sqrt(diagonal);
+				for (uint32_t i = j + 1; i < n; ++i)
+				{
+					double sum = factor[i * n + j];
+					for (uint32_t k = 0; k < j; ++k)
+					{
+						sum -= factor[i * n + k] * factor[j * n + k];
+					}
+					factor[i * n + j] = sum / factor[j * n + j];
+				}
+			}
+
+			const double* lower = factor.data();
+			double* sums = right.data();
+			pool.parallelFor(bodyCount * 3, [=](uint32_t, size_t begin, size_t end) {
+				for (size_t series = begin; series < end; ++series)
+				{
+					double* x = sums + series * n;
+					for (uint32_t i = 0; i < n; ++i)
+					{
+						for (uint32_t k = 0; k < i; ++k)
+						{
+							x[i] -= lower[i * n + k] * x[k];
+						}
+						x[i] /= lower[i * n + i];
+					}
+					for (uint32_t i = n; i-- > 0;)
+					{
+						for (uint32_t k = i + 1; k < n; ++k)
+						{
+							x[i] -= lower[k * n + i] * x[k];
+						}
+						x[i] /= lower[i * n + i];
+					}
+				}
+			});
+			file.write(reinterpret_cast<const char*>(sums), bodyCount * 3 * n * sizeof(double));
+			++fileHeader.segmentCount;
+
+			std::fill(normal.begin(), normal.end(), 0.0);
+			std::fill(right.begin(), right.end(), 0.0);
+			samples = 0;
+		}
+
+		std::filesystem::path path;
+		dhh::thread::ThreadPool& pool;
+		size_t bodyCount;
+		uint32_t coefficients;
+		double segmentLength;
+		std::ofstream file;
+		EphemerisHeader fileHeader;
+		uint64_t samples = 0;                    // in the current segment
+		std::vector<double> normal;              // normal matrix, replaced by its Cholesky factor when solved
+		dhh::memory::AlignedArray<double> right; // right-hand sides per body and axis, then the coefficients
+		std::vector<double> values;
+		std::vector<double> derivatives;
+	};
+
+	// Memory-mapped ephemeris; a query reads the coefficients of one segment and does not allocate
+	class EphemerisReader
+	{
+	public:
+		explicit EphemerisReader(const std::filesystem::path& path) : path(path), file(path, false)
+		{
+			if (file.size() < sizeof(EphemerisHeader))
+			{
+				fail("too small for a header");
+			}
+			std::memcpy(&fileHeader, file.data(), sizeof(fileHeader));
+			if (std::memcmp(fileHeader.magic, EphemerisHeader::Magic, sizeof(fileHeader.magic)) != 0)
+			{
+				fail("not an ephemeris");
+			}
+			if (fileHeader.version != EphemerisHeader::CurrentVersion)
+			{
+				fail("unsupported version " + std::to_string(fileHeader.version));
+			}
+			if (fileHeader.segmentCount == 0)
+			{
+				fail("no segments, the run was not closed or too short for one");
+			}
+			const uint64_t segmentDoubles = fileHeader.bodyCount * 3 * fileHeader.coefficientCount;
+			if (fileHeader.coefficientCount == 0 || fileHeader.coefficientCount > 32 || !(fileHeader.segmentLength > 0)
+				|| fileHeader.dataOffset % sizeof(double) != 0 || fileHeader.dataOffset > file.size()
+				|| segmentDoubles == 0
+				|| fileHeader.segmentCount > (file.size() - fileHeader.dataOffset) / sizeof(double) / segmentDoubles)
+			{
+				fail("truncated or inconsistent header");
+			}
+			data = reinterpret_cast<const double*>(static_cast<const char*>(file.data()) + fileHeader.dataOffset);
+		}
+
+		const EphemerisHeader& header() const
+		{
+			return fileHeader;
+		}
+
+		double startTime() const
+		{
+			return fileHeader.startTime;
+		}
+
+		double endTime() const
+		{
+			return fileHeader.endTime;
+		}
+
+		// Position and velocity of a body at simulated time t within [startTime(), endTime()]
+		void state(size_t body, double time, glm::dvec3& position, glm::dvec3& velocity) const
+		{
+			if (body >= fileHeader.bodyCount || !(time >= fileHeader.startTime && time <= fileHeader.endTime))
+			{
+				fail("no body " + std::to_string(body) + " at t = " + std::to_string(time));
+			}
+			const double offset = (time - fileHeader.startTime) / fileHeader.segmentLength;
+			const uint64_t segment = std::min(static_cast<uint64_t>(offset), fileHeader.segmentCount - 1);
+			const double tau = 2 * (offset - segment) - 1;
+			const uint32_t count = fileHeader.coefficientCount;
+			const double* series = data + (segment * fileHeader.bodyCount + body) * 3 * count;
+
+			double values[32];
+			double derivatives[32];
+			ephemeris::chebyshev(tau, count, values, derivatives);
+			double p[3] = {};
+			double v[3] = {};
+			for (uint32_t axis = 0; axis < 3; ++axis)
+			{
+				for (uint32_t k = 0; k < count; ++k)
+				{
+					p[axis] += series[axis * count + k] * values[k];
+					v[axis] += series[axis * count + k] * derivatives[k];
+				}
+			}
+			const double scale = 2 / fileHeader.segmentLength;
+			position = glm::dvec3(p[0], p[1], p[2]);
+			velocity = glm::dvec3(v[0] * scale, v[1] * scale, v[2] * scale);
+		}
+
+		glm::dvec3 position(size_t body, double time) const
+		{
+			glm::dvec3 position;
+			glm::dvec3 velocity;
+			state(body, time, position, velocity);
+			return position;
+		}
+
+	private:
+		[[noreturn]] void fail(const std::string& reason) const
+		{
+			throw std::runtime_error("Ephemeris " + path.string() + ": " + reason);
+		}
+
+		std::filesystem::path path;
+		dhh::filesystem::MappedFile file;
+		EphemerisHeader fileHeader;
+		const double* data = nullptr;
+	};
+}
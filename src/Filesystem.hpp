@@ -2,14 +2,30 @@
 
 #include <filesystem>
 
+#include <algorithm>
 #include <vector>
 #include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace dhh::filesystem
 {
 	inline std::vector<char> loadFile(const std::filesystem::path& filename, bool is_binary)
 	{
-		std::fstream file(filename, std::ios::ate | std::ios::in | (is_binary ? std::ios::binary : 0));
+		const std::ios::openmode mode = std::ios::ate | std::ios::in;
+		std::fstream file(filename, is_binary ? mode | std::ios::binary : mode);
 		const size_t FileSize = file.tellg();
 		std::vector<char> buffer(FileSize);
 		file.seekg(0);
@@ -17,4 +33,194 @@ namespace dhh::filesystem
 		file.close();
 		return buffer;
 	}
+
+	// Read-write or read-only memory mapping of a whole file, the pages are faulted in lazily by the OS
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+
+		MappedFile(const std::filesystem::path& path, bool writable, size_t createSize = 0)
+		{
+			open(path, writable, createSize);
+		}
+
+		~MappedFile()
+		{
+			close();
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		MappedFile(MappedFile&& other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		MappedFile& operator=(MappedFile&& other) noexcept
+		{
+			std::swap(address, other.address);
+			std::swap(fileSize, other.fileSize);
+#ifdef _WIN32
+			std::swap(fileHandle, other.fileHandle);
+			std::swap(mappingHandle, other.mappingHandle);
+#else
+			std::swap(fileDescriptor, other.fileDescriptor);
+#endif
+			return *this;
+		}
+
+		// createSize > 0 creates (or truncates) the file to that size before mapping it
+		void open(const std::filesystem::path& path, bool writable, size_t createSize = 0)
+		{
+			close();
+#ifdef _WIN32
+			fileHandle = CreateFileW(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+				FILE_SHARE_READ, nullptr, createSize > 0 ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+				nullptr);
+			if (fileHandle == INVALID_HANDLE_VALUE)
+			{
+				throw std::runtime_error("Failed to open " + path.string());
+			}
+			LARGE_INTEGER size;
+			if (createSize > 0)
+			{
+				size.QuadPart = static_cast<LONGLONG>(createSize);
+				SetFilePointerEx(fileHandle, size, nullptr, FILE_BEGIN);
+				SetEndOfFile(fileHandle);
+			}
+			GetFileSizeEx(fileHandle, &size);
+			fileSize = static_cast<size_t>(size.QuadPart);
+			if (fileSize == 0)
+			{
+				return;
+			}
+			mappingHandle = CreateFileMappingW(fileHandle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0,
+				nullptr);
+			address = mappingHandle == nullptr
+				? nullptr
+				: MapViewOfFile(mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+#else
+			int flags = writable ? O_RDWR : O_RDONLY;
+			if (createSize > 0)
+			{
+				flags |= O_CREAT | O_TRUNC;
+			}
+			fileDescriptor = ::open(path.c_str(), flags, 0644);
+			if (fileDescriptor < 0)
+			{
+				throw std::runtime_error("Failed to open " + path.string());
+			}
+			if (createSize > 0 && ftruncate(fileDescriptor, static_cast<off_t>(createSize)) != 0)
+			{
+				throw std::runtime_error("Failed to resize " + path.string());
+			}
+			struct stat status;
+			fstat(fileDescriptor, &status);
+			fileSize = static_cast<size_t>(status.st_size);
+			if (fileSize == 0)
+			{
+				return;
+			}
+			address = mmap(nullptr, fileSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+				fileDescriptor, 0);
+			if (address == MAP_FAILED)
+			{
+				address = nullptr;
+			}
+#endif
+			if (address == nullptr)
+			{
+				throw std::runtime_error("Failed to map " + path.string());
+			}
+		}
+
+		void close()
+		{
+#ifdef _WIN32
+			if (address != nullptr)
+			{
+				UnmapViewOfFile(address);
+			}
+			if (mappingHandle != nullptr)
+			{
+				CloseHandle(mappingHandle);
+			}
+			if (fileHandle != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(fileHandle);
+			}
+			mappingHandle = nullptr;
+			fileHandle = INVALID_HANDLE_VALUE;
+#else
+			if (address != nullptr)
+			{
+				munmap(address, fileSize);
+			}
+			if (fileDescriptor >= 0)
+			{
+				::close(fileDescriptor);
+			}
+			fileDescriptor = -1;
+#endif
+			address = nullptr;
+			fileSize = 0;
+		}
+
+		// Hint that the range will be read soon so the OS can start paging it in
+		void prefetch(size_t offset, size_t length) const
+		{
+			if (address == nullptr || offset >= fileSize)
+			{
+				return;
+			}
+			length = std::min(length, fileSize - offset);
+#ifdef _WIN32
+			WIN32_MEMORY_RANGE_ENTRY range;
+			range.VirtualAddress = static_cast<char*>(address) + offset;
+			range.NumberOfBytes = length;
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+			const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+			const size_t alignedOffset = offset / pageSize * pageSize;
+			madvise(static_cast<char*>(address) + alignedOffset, length + offset - alignedOffset, MADV_WILLNEED);
+#endif
+		}
+
+		// Writes the dirty pages of a writable mapping back to the file and waits for the device
+		void flush() const
+		{
+			if (address == nullptr)
+			{
+				return;
+			}
+#ifdef _WIN32
+			FlushViewOfFile(address, 0);
+			FlushFileBuffers(fileHandle);
+#else
+			msync(address, fileSize, MS_SYNC);
+#endif
+		}
+
+		void* data() const
+		{
+			return address;
+		}
+
+		size_t size() const
+		{
+			return fileSize;
+		}
+
+	private:
+		void* address = nullptr;
+		size_t fileSize = 0;
+#ifdef _WIN32
+		HANDLE fileHandle = INVALID_HANDLE_VALUE;
+		HANDLE mappingHandle = nullptr;
+#else
+		int fileDescriptor = -1;
+#endif
+	};
 }
@@ -0,0 +1,355 @@
+#pragma once
+
+#include "Trace.hpp"
+#include "VulkanBase.h"
+#include "VulkanInitializer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::profile
+{
+	// Rolling statistics of one named GPU scope over its last samples, in milliseconds
+	struct ScopeStats
+	{
+		std::string name;
+		uint64_t samples = 0;  // all samples so far, the statistics cover the last window of them
+		double min = 0;
+		double average = 0;
+		double p99 = 0;
+	};
+
+	// GPU time of named scopes of command buffers, measured with timestamp query pairs.
+	// Command buffers are prerecorded and resubmitted, so every command buffer that contains scopes owns a slot of
+	// the query pool: reset() at the start of its recording clears the slot, submitted() marks it in flight and
+	// collect() reads back the slots whose queries have all become available, without waiting for the GPU. A slot
+	// resubmitted before it was collected loses that sample, it is never mixed with the next one.
+	// While tracing, every sample is also recorded as a trace event on the given track.
+	class GpuProfiler
+	{
+	public:
+		GpuProfiler(VulkanBase& base, const char* track, uint32_t slotCount, uint32_t maxScopes = 8,
+			uint32_t window = 256)
+			: device(base.device), track(track), maxScopes(maxScopes), window(window), slots(slotCount),
+			  results(size_t(maxScopes) * 4)
+		{
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(base.physicalDevice, &properties);
+			nanosecondsPerTick = properties.limits.timestampPeriod;
+
+			// every timed queue belongs to the graphics family
+			uint32_t familyCount = 0;
+			vkGetPhysicalDeviceQueueFamilyProperties(base.physicalDevice, &familyCount, nullptr);
+			std::vector<VkQueueFamilyProperties> families(familyCount);
+			vkGetPhysicalDeviceQueueFamilyProperties(base.physicalDevice, &familyCount, families.data());
+			const uint32_t validBits = families[base.queueFamilyIndex.graphicsFamily.value()].timestampValidBits;
+			if (validBits == 0)
+			{
+				return;
+			}
+			tickMask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+
+			VkQueryPoolCreateInfo info = {};
+			info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			info.queryCount = slotCount * maxScopes * 2 + 1;  // the last one calibrates
+			if (vkCreateQueryPool(device, &info, nullptr, &queryPool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create timestamp query pool!");
+			}
+			if (dhh::trace::Tracer::instance().active())
+			{
+				calibrate(base);
+			}
+		}
+
+		~GpuProfiler()
+		{
+			if (queryPool != VK_NULL_HANDLE)
+			{
+				vkDestroyQueryPool(device, queryPool, nullptr);
+			}
+		}
+
+		GpuProfiler(const GpuProfiler&) = delete;
+		GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+		// false when the queue family has no timestamp support, scopes are then not recorded
+		bool enabled() const
+		{
+			return queryPool != VK_NULL_HANDLE;
+		}
+
+		// Recorded first into the slot's command buffer, outside a render pass
+		void reset(VkCommandBuffer commandBuffer, uint32_t slot)
+		{
+			if (!enabled())
+			{
+				return;
+			}
+			vkCmdResetQueryPool(commandBuffer, queryPool, firstQuery(slot), maxScopes * 2);
+			slots[slot].series.clear();
+			slots[slot].pending = false;
+		}
+
+		// Returns the scope to pass to end()
+		uint32_t begin(VkCommandBuffer commandBuffer, uint32_t slot, const std::string& name,
+			VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT)
+		{
+			if (!enabled())
+			{
+				return 0;
+			}
+			Slot& target = slots[slot];
+			if (target.series.size() == maxScopes)
+			{
+				throw std::runtime_error(
+					"More than " + std::to_string(maxScopes) + " GPU scopes in one command buffer");
+			}
+			const uint32_t scope = static_cast<uint32_t>(target.series.size());
+			target.series.push_back(seriesIndex(name));
+			vkCmdWriteTimestamp(commandBuffer, stage, queryPool, firstQuery(slot) + scope * 2);
+			return scope;
+		}
+
+		void end(VkCommandBuffer commandBuffer, uint32_t slot, uint32_t scope,
+			VkPipelineStageFlagBits stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT)
+		{
+			if (!enabled())
+			{
+				return;
+			}
+			vkCmdWriteTimestamp(commandBuffer, stage, queryPool, firstQuery(slot) + scope * 2 + 1);
+		}
+
+		// call after each submission of the slot's command buffer
+		void submitted(uint32_t slot)
+		{
+			slots[slot].pending = enabled() && !slots[slot].series.empty();
+		}
+
+		// Polls every slot in flight and records the durations of the completed ones. Does not allocate.
+		void collect()
+		{
+			for (uint32_t slot = 0; slot < slots.size(); ++slot)
+			{
+				Slot& source = slots[slot];
+				if (!source.pending)
+				{
+					continue;
+				}
+				// value and availability per query
+				const uint32_t queryCount = static_cast<uint32_t>(source.series.size()) * 2;
+				vkGetQueryPoolResults(device, queryPool, firstQuery(slot), queryCount,
+					sizeof(uint64_t) * 2 * queryCount, results.data(), sizeof(uint64_t) * 2,
+					VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+				bool available = true;
+				for (uint32_t query = 0; query < queryCount; ++query)
+				{
+					available = available && results[query * 2 + 1] != 0;
+				}
+				if (!available)
+				{
+					continue;
+				}
+
+				dhh::trace::Tracer& tracer = dhh::trace::Tracer::instance();
+				std::lock_guard<std::mutex> lock(mutex);
+				for (size_t scope = 0; scope < source.series.size(); ++scope)
+				{
+					const uint64_t begin = results[scope * 4] & tickMask;
+					const uint64_t ticks = (results[scope * 4 + 2] - results[scope * 4]) & tickMask;
+					Series& series = allSeries[source.series[scope]];
+					series.samples[series.count % window] = ticks * nanosecondsPerTick * 1e-6;
+					++series.count;
+					if (tracer.active())
+					{
+						const double start = traceOffset + begin * nanosecondsPerTick;
+						tracer.record(series.traceName, static_cast<uint64_t>(std::max(start, 0.0)),
+							static_cast<uint64_t>(std::max(start + ticks * nanosecondsPerTick, 0.0)), track);
+					}
+				}
+				source.pending = false;
+			}
+		}
+
+		std::vector<ScopeStats> statistics() const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::vector<ScopeStats> stats;
+			for (const Series& series : allSeries)
+			{
+				if (series.count == 0)
+				{
+					continue;
+				}
+				std::vector<double> recent(series.samples.begin(),
+					series.samples.begin() + std::min<uint64_t>(series.count, window));
+				std::sort(recent.begin(), recent.end());
+				double sum = 0;
+				for (double sample : recent)
+				{
+					sum += sample;
+				}
+				const size_t p99 = static_cast<size_t>(std::ceil(0.99 * recent.size())) - 1;
+				stats.push_back({series.name, series.count, recent.front(), sum / recent.size(), recent[p99]});
+			}
+			return stats;
+		}
+
+		void print(std::ostream& out) const
+		{
+			const std::vector<ScopeStats> stats = statistics();
+			if (stats.empty())
+			{
+				out << "GPU timing: no samples" << (enabled() ? "" : ", the queue has no timestamp support") << "\n";
+				return;
+			}
+			size_t width = 0;
+			for (const ScopeStats& scope : stats)
+			{
+				width = std::max(width, scope.name.size());
+			}
+			const auto flags = out.flags();
+			out << "GPU time per scope over the last " << window << " samples (ms):\n" << std::fixed
+				<< std::setprecision(3);
+			for (const ScopeStats& scope : stats)
+			{
+				out << "  " << std::left << std::setw(width) << scope.name << std::right << "  min "
+					<< std::setw(8) << scope.min << "  avg " << std::setw(8) << scope.average << "  p99 "
+					<< std::setw(8) << scope.p99 << "  (" << scope.samples << " samples)\n";
+			}
+			out.flags(flags);
+		}
+
+	private:
+		struct Slot
+		{
+			std::vector<uint32_t> series;  // series of each recorded scope
+			bool pending = false;
+		};
+
+		// ring of the last window durations of one scope name
+		struct Series
+		{
+			std::string name;
+			const char* traceName;
+			std::vector<double> samples;
+			uint64_t count = 0;
+		};
+
+		uint32_t firstQuery(uint32_t slot) const
+		{
+			return slot * maxScopes * 2;
+		}
+
+		uint32_t seriesIndex(const std::string& name)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			const auto found = seriesByName.find(name);
+			if (found != seriesByName.end())
+			{
+				return found->second;
+			}
+			const char* traceName = dhh::trace::Tracer::instance().intern(name);
+			allSeries.push_back({name, traceName, std::vector<double>(window), 0});
+			return seriesByName[name] = static_cast<uint32_t>(allSeries.size() - 1);
+		}
+
+		// Maps timestamps to the trace clock: one timestamp written right away is paired with the CPU time halfway
+		// between its submission and completion, which lines scopes up to within the submission latency
+		void calibrate(VulkanBase& base)
+		{
+			const uint32_t query = static_cast<uint32_t>(slots.size()) * maxScopes * 2;
+			VkCommandBufferAllocateInfo info =
+				dhh::vk::initializer::commandBufferAllocateInfo(base.commandPool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+			VkCommandBuffer commandBuffer;
+			vkAllocateCommandBuffers(device, &info, &commandBuffer);
+			VkCommandBufferBeginInfo beginInfo =
+				dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+			vkBeginCommandBuffer(commandBuffer, &beginInfo);
+			vkCmdResetQueryPool(commandBuffer, queryPool, query, 1);
+			vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, query);
+			vkEndCommandBuffer(commandBuffer);
+
+			VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+			VkFence fence;
+			vkCreateFence(device, &fenceCreateInfo, nullptr, &fence);
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &commandBuffer;
+
+			dhh::trace::Tracer& tracer = dhh::trace::Tracer::instance();
+			const uint64_t submitted = tracer.now();
+			{
+				auto lock = base.lockQueue(base.computeQueue);
+				vkQueueSubmit(base.computeQueue, 1, &submitInfo, fence);
+			}
+			vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+			const uint64_t completed = tracer.now();
+
+			uint64_t timestamp = 0;
+			vkGetQueryPoolResults(device, queryPool, query, 1, sizeof(timestamp), &timestamp, sizeof(timestamp),
+				VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+			traceOffset = (submitted + completed) / 2.0 - (timestamp & tickMask) * nanosecondsPerTick;
+
+			vkDestroyFence(device, fence, nullptr);
+			vkFreeCommandBuffers(device, base.commandPool, 1, &commandBuffer);
+		}
+
+		VkDevice device;
+		const char* track;
+		VkQueryPool queryPool = VK_NULL_HANDLE;
+		uint32_t maxScopes;
+		uint32_t window;
+		double nanosecondsPerTick = 1;
+		uint64_t tickMask = 0;
+		double traceOffset = 0;  // trace nanoseconds at timestamp 0
+		std::vector<Slot> slots;
+		std::vector<uint64_t> results;
+
+		mutable std::mutex mutex;  // guards the series, which are read by other threads
+		std::vector<Series> allSeries;
+		std::map<std::string, uint32_t> seriesByName;
+	};
+
+	// Times the commands recorded during its lifetime, a null profiler records nothing
+	class GpuScope
+	{
+	public:
+		GpuScope(GpuProfiler* profiler, VkCommandBuffer commandBuffer, uint32_t slot, const std::string& name)
+			: profiler(profiler), commandBuffer(commandBuffer), slot(slot)
+		{
+			if (profiler != nullptr)
+			{
+				scope = profiler->begin(commandBuffer, slot, name);
+			}
+		}
+
+		~GpuScope()
+		{
+			if (profiler != nullptr)
+			{
+				profiler->end(commandBuffer, slot, scope);
+			}
+		}
+
+		GpuScope(const GpuScope&) = delete;
+		GpuScope& operator=(const GpuScope&) = delete;
+
+	private:
+		GpuProfiler* profiler;
+		VkCommandBuffer commandBuffer;
+		uint32_t slot;
+		uint32_t scope = 0;
+	};
+}
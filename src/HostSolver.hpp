@@ -0,0 +1,148 @@
+#pragma once
+
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+
+namespace dhh::nbody
+{
+	// Direct-sum solver on the CPU, for machines without a usable Vulkan device and as a baseline for the GPU
+	// engines. Same force and integrator as tile.comp + integrate.comp (semi-implicit Euler, no softening).
+	// The state is kept as structure of arrays and the inner loop accumulates into Lanes independent sums, which
+	// lets the compiler vectorize it without reassociating floating point (-ffast-math).
+	class HostSolver
+	{
+	public:
+		static constexpr uint32_t Lanes = 8;
+
+		HostSolver(const BodyArray& initial, double stepLength, dhh::thread::ThreadPool& pool)
+			: pool(pool), count(initial.size()), stepLength(stepLength)
+		{
+			for (auto* array : {&x, &y, &z, &vx, &vy, &vz, &mass, &ax, &ay, &az})
+			{
+				array->allocate(count, false, &pool);
+			}
+			for (size_t i = 0; i < count; ++i)
+			{
+				x[i] = initial[i].position.x;
+				y[i] = initial[i].position.y;
+				z[i] = initial[i].position.z;
+				vx[i] = initial[i].velocity.x;
+				vy[i] = initial[i].velocity.y;
+				vz[i] = initial[i].velocity.z;
+				mass[i] = initial[i].mass;
+			}
+		}
+
+		void step()
+		{
+			pool.parallelFor(count, [this](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					accelerate(i);
+				}
+			});
+			// every acceleration is read from the old positions before any of them moves
+			pool.parallelFor(count, [this](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					vx[i] += ax[i] * stepLength;
+					vy[i] += ay[i] * stepLength;
+					vz[i] += az[i] * stepLength;
+					x[i] += vx[i] * stepLength;
+					y[i] += vy[i] * stepLength;
+					z[i] += vz[i] * stepLength;
+				}
+			});
+		}
+
+		size_t size() const
+		{
+			return count;
+		}
+
+		glm::dvec3 velocity(size_t index) const
+		{
+			return glm::dvec3(vx[index], vy[index], vz[index]);
+		}
+
+		// the current state as bodies, e.g. to record it
+		void read(Body* destination) const
+		{
+			pool.parallelFor(count, [&](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					destination[i].position = glm::dvec3(x[i], y[i], z[i]);
+					destination[i].velocity = glm::dvec3(vx[i], vy[i], vz[i]);
+					destination[i].mass = mass[i];
+				}
+			});
+		}
+
+		// host memory held by the state
+		size_t bytes() const
+		{
+			return count * sizeof(double) * 10;
+		}
+
+	private:
+		void accelerate(size_t i)
+		{
+			const double px = x[i];
+			const double py = y[i];
+			const double pz = z[i];
+			double sx[Lanes] = {};
+			double sy[Lanes] = {};
+			double sz[Lanes] = {};
+
+			size_t j = 0;
+			for (; j + Lanes <= count; j += Lanes)
+			{
+				for (uint32_t lane = 0; lane < Lanes; ++lane)
+				{
+					const double dx = x[j + lane] - px;
+					const double dy = y[j + lane] - py;
+					const double dz = z[j + lane] - pz;
+					const double r2 = dx * dx + dy * dy + dz * dz;
+					// the body itself is at distance 0 and contributes nothing, selected without a branch
+					const double factor = r2 > 0 ? mass[j + lane] / (r2 * std::sqrt(r2)) : 0;
+					sx[lane] += dx * factor;
+					sy[lane] += dy * factor;
+					sz[lane] += dz * factor;
+				}
+			}
+			for (; j < count; ++j)
+			{
+				const double dx = x[j] - px;
+				const double dy = y[j] - py;
+				const double dz = z[j] - pz;
+				const double r2 = dx * dx + dy * dy + dz * dz;
+				const double factor = r2 > 0 ? mass[j] / (r2 * std::sqrt(r2)) : 0;
+				sx[0] += dx * factor;
+				sy[0] += dy * factor;
+				sz[0] += dz * factor;
+			}
+
+			ax[i] = ay[i] = az[i] = 0;
+			for (uint32_t lane = 0; lane < Lanes; ++lane)
+			{
+				ax[i] += sx[lane];
+				ay[i] += sy[lane];
+				az[i] += sz[lane];
+			}
+		}
+
+		dhh::thread::ThreadPool& pool;
+		size_t count;
+		double stepLength;
+		dhh::memory::AlignedArray<double> x, y, z;
+		dhh::memory::AlignedArray<double> vx, vy, vz;
+		dhh::memory::AlignedArray<double> mass;
+		dhh::memory::AlignedArray<double> ax, ay, az;
+	};
+}
@@ -0,0 +1,540 @@
+#pragma once
+
+#include "Body.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Generated body sets, deterministic for a given seed. Units are those of the force kernels (G = 1).
+	//
+	// Every random number comes from a counter-based generator keyed by the seed and counted by the body index,
+	// so body i is the same whichever thread generates it and however the bodies are split between threads:
+	// generation runs on a thread pool and gives the same bodies on one thread or on a hundred.
+	enum class Distribution
+	{
+		Uniform,    // bodies at rest, uniformly spread over a cube
+		Plummer,    // Plummer sphere in virial equilibrium, strongly concentrated towards the centre
+		King,       // King (1966) model, a lowered isothermal sphere with a finite tidal radius
+		Hernquist,  // Hernquist (1990) sphere, the r^-1 cusp of elliptical galaxies and bulges
+		Disk,       // rotating exponential disk with a Hernquist bulge
+		Zeldovich,  // cubic lattice displaced by a Zel'dovich growing mode, the start of a cosmological run
+	};
+
+	inline const char* distributionName(Distribution distribution)
+	{
+		switch (distribution)
+		{
+		case Distribution::Uniform:
+			return "uniform";
+		case Distribution::Plummer:
+			return "plummer";
+		case Distribution::King:
+			return "king";
+		case Distribution::Hernquist:
+			return "hernquist";
+		case Distribution::Disk:
+			return "disk";
+		default:
+			return "zeldovich";
+		}
+	}
+
+	inline Distribution parseDistribution(const std::string& name)
+	{
+		for (Distribution distribution : {Distribution::Uniform, Distribution::Plummer, Distribution::King,
+			Distribution::Hernquist, Distribution::Disk, Distribution::Zeldovich})
+		{
+			if (name == distributionName(distribution))
+			{
+				return distribution;
+			}
+		}
+		throw std::runtime_error(
+			"Unknown distribution " + name + ", expected uniform, plummer, king, hernquist, disk or zeldovich");
+	}
+
+	// Shape parameters of the generated systems; other lengths are in scale radii
+	struct InitialConditionParameters
+	{
+		double scaleRadius = 1e11;           // Plummer, King core, Hernquist and disk scale length, in metres
+		double bodyMass = 5.5e29;            // equal masses, except in the uniform cloud
+		double kingPotential = 6;            // W0, the dimensionless central potential of the King model
+		double hernquistCutoff = 20;         // radius beyond which Hernquist bodies are drawn again
+		double diskHeight = 0.1;             // sech² scale height of the disk
+		double diskCutoff = 10;              // disk radius beyond which bodies are drawn again
+		double bulgeFraction = 0.2;          // of the bodies, in a Hernquist bulge
+		double bulgeRadius = 0.2;            // Hernquist scale radius of the bulge
+		double boxSize = 6;                  // edge of the uniform cloud and of the Zel'dovich box
+		double zeldovichDisplacement = 0.2;  // rms displacement in lattice spacings
+		double zeldovichIndex = -1;          // power spectrum P(k) ~ k^index
+		uint32_t zeldovichModes = 64;        // plane waves summed for the displacement field
+	};
+
+	// Philox4x32-10 (Salmon et al. 2011): a block of four 32-bit numbers is a function of a 128-bit counter and a
+	// 64-bit key, so any number in any stream can be computed without generating the ones before it
+	inline std::array<uint32_t, 4> philox4x32(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key)
+	{
+		for (int round = 0; round < 10; ++round)
+		{
+			const uint64_t product0 = uint64_t(0xD2511F53) * counter[0];
+			const uint64_t product1 = uint64_t(0xCD9E8D57) * counter[2];
+			counter = {static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0], static_cast<uint32_t>(product1),
+				static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1], static_cast<uint32_t>(product0)};
+			key[0] += 0x9E3779B9;
+			key[1] += 0xBB67AE85;
+		}
+		return counter;
+	}
+
+	// The random numbers of one body (or one mode), an unbounded stream keyed by seed, index and purpose
+	class BodyRandom
+	{
+	public:
+		BodyRandom(uint64_t seed, uint64_t index, uint32_t stream = 0)
+			: key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)},
+			counter{static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32), 0, stream}
+		{
+		}
+
+		// uniform in (0, 1), 53 bits
+		double uniform()
+		{
+			if (available == 0)
+			{
+				block = philox4x32(counter, key);
+				++counter[2];
+				available = 2;
+			}
+			--available;
+			const uint64_t bits = (uint64_t(block[2 * available]) << 32 | block[2 * available + 1]) >> 11;
+			return (static_cast<double>(bits) + 0.5) * 0x1p-53;
+		}
+
+		double uniform(double low, double high)
+		{
+			return low + (high - low) * uniform();
+		}
+
+		// standard normal, Box-Muller; the second value is dropped to keep the stream position simple
+		double normal()
+		{
+			const double radius = std::sqrt(-2 * std::log(uniform()));
+			return radius * std::cos(2 * Pi * uniform());
+		}
+
+		glm::dvec3 direction()
+		{
+			const double z = 2 * uniform() - 1;
+			const double phi = 2 * Pi * uniform();
+			const double s = std::sqrt(1 - z * z);
+			return glm::dvec3(s * std::cos(phi), s * std::sin(phi), z);
+		}
+
+		static constexpr double Pi = 3.14159265358979323846;
+
+	private:
+		std::array<uint32_t, 2> key;
+		std::array<uint32_t, 4> counter;
+		std::array<uint32_t, 4> block = {};
+		uint32_t available = 0;
+	};
+
+	namespace initial
+	{
+		constexpr double Pi = BodyRandom::Pi;
+
+		// Speed in [0, maximum] with density proportional to density(v) by rejection. The densities used here
+		// are single-peaked, so the envelope is the largest value on a grid refined around its best point, with
+		// a margin; near the centre of a cusp the peak is narrow.
+		template <typename F>
+		double sampleSpeed(BodyRandom& random, double maximum, F&& density)
+		{
+			constexpr int Grid = 32;
+			double peak = 0;
+			int best = 1;
+			for (int i = 1; i < Grid; ++i)
+			{
+				const double value = density(maximum * i / Grid);
+				if (value > peak)
+				{
+					peak = value;
+					best = i;
+				}
+			}
+			for (int i = 1; i < 2 * Grid; ++i)
+			{
+				peak = std::max(peak, density(maximum * (best - 1 + i / double(Grid)) / Grid));
+			}
+			peak *= 1.3;
+			while (true)
+			{
+				const double v = maximum * random.uniform();
+				if (random.uniform() * peak <= density(v))
+				{
+					return v;
+				}
+			}
+		}
+
+		// isotropic distribution function of the Hernquist sphere (Hernquist 1990, eq. 17) up to a constant, of
+		// the binding energy in units of GM/a
+		inline double hernquistDistribution(double binding)
+		{
+			if (!(binding > 0))
+			{
+				return 0;
+			}
+			const double q = std::sqrt(std::min(binding, 1 - 1e-12));
+			const double q2 = q * q;
+			return (3 * std::asin(q) + q * std::sqrt(1 - q2) * (1 - 2 * q2) * (8 * q2 * q2 - 8 * q2 - 3))
+				/ std::pow(1 - q2, 2.5);
+		}
+
+		// position and velocity of a Hernquist sphere body of scale radius a and mass M, cut at cutoff * a
+		inline void sampleHernquist(BodyRandom& random, double a, double totalMass, double cutoff, Body& body)
+		{
+			// M(r) / M = r² / (r + a)², inverted
+			const double s = cutoff / (cutoff + 1) * std::sqrt(random.uniform());
+			const double r = a * s / (1 - s);
+			const double potential = totalMass / (r + a);
+			const double speed = initial::sampleSpeed(random, std::sqrt(2 * potential), [&](double v) {
+				return v * v * hernquistDistribution((potential - v * v / 2) * a / totalMass);
+			});
+			body.position = r * random.direction();
+			body.velocity = speed * random.direction();
+		}
+
+		// Dimensionless King model: the potential W and enclosed mass m against r / r0 from the centre to the
+		// tidal radius, by integrating Poisson's equation W'' + 2 W' / r = -9 rho(W) / rho(W0)
+		struct KingProfile
+		{
+			std::vector<double> radius;
+			std::vector<double> potential;
+			std::vector<double> mass;
+
+			static double density(double w)
+			{
+				return w > 0 ? std::exp(w) * std::erf(std::sqrt(w)) - std::sqrt(4 * w / Pi) * (1 + 2 * w / 3) : 0;
+			}
+
+			explicit KingProfile(double centralPotential)
+			{
+				const double step = 1e-3;
+				const double centralDensity = density(centralPotential);
+				// W = W0 - 3/2 r² near the centre
+				double r = step;
+				double w = centralPotential - 1.5 * r * r;
+				double slope = -3 * r;
+				double m = r * r * r;
+				const auto derivatives = [&](double radius, double w, double slope, double& dw, double& dslope,
+					double& dm) {
+					const double rho = density(w) / centralDensity;
+					dw = slope;
+					dslope = -9 * rho - 2 * slope / radius;
+					dm = rho * radius * radius;
+				};
+				radius.push_back(0);
+				potential.push_back(centralPotential);
+				mass.push_back(0);
+				while (w > 0 && r < 1e4)
+				{
+					radius.push_back(r);
+					potential.push_back(w);
+					mass.push_back(m);
+
+					double k[4][3];
+					derivatives(r, w, slope, k[0][0], k[0][1], k[0][2]);
+					derivatives(r + step / 2, w + step / 2 * k[0][0], slope + step / 2 * k[0][1], k[1][0], k[1][1],
+						k[1][2]);
+					derivatives(r + step / 2, w + step / 2 * k[1][0], slope + step / 2 * k[1][1], k[2][0], k[2][1],
+						k[2][2]);
+					derivatives(r + step, w + step * k[2][0], slope + step * k[2][1], k[3][0], k[3][1], k[3][2]);
+					w += step / 6 * (k[0][0] + 2 * k[1][0] + 2 * k[2][0] + k[3][0]);
+					slope += step / 6 * (k[0][1] + 2 * k[1][1] + 2 * k[2][1] + k[3][1]);
+					m += step / 6 * (k[0][2] + 2 * k[1][2] + 2 * k[2][2] + k[3][2]);
+					r += step;
+				}
+				// the tidal radius, where W reaches 0
+				radius.push_back(r);
+				potential.push_back(0);
+				mass.push_back(m);
+			}
+
+			// radius and potential of the fraction u of the total mass
+			void atMassFraction(double u, double& r, double& w) const
+			{
+				const double target = u * mass.back();
+				const size_t i = std::min<size_t>(
+					std::lower_bound(mass.begin(), mass.end(), target) - mass.begin(), mass.size() - 1);
+				const size_t j = i == 0 ? 1 : i;
+				const double t = (target - mass[j - 1]) / std::max(mass[j] - mass[j - 1], 1e-300);
+				r = radius[j - 1] + t * (radius[j] - radius[j - 1]);
+				w = std::max(potential[j - 1] + t * (potential[j] - potential[j - 1]), 0.0);
+			}
+		};
+
+		// circular speed² of an exponential disk of scale length h and mass M (Freeman 1970)
+		inline double exponentialDiskSpeed2(double R, double h, double totalMass)
+		{
+			const double y = R / (2 * h);
+			if (y < 1e-8)
+			{
+				return 0;
+			}
+			const double surfaceDensity = totalMass / (2 * Pi * h * h);
+			return 4 * Pi * surfaceDensity * h * y * y
+				* (std::cyl_bessel_i(0.0, y) * std::cyl_bessel_k(0.0, y)
+					- std::cyl_bessel_i(1.0, y) * std::cyl_bessel_k(1.0, y));
+		}
+
+		// Runs fn(index, body) for every body, on the pool when there is one
+		template <typename F>
+		void generate(uint32_t count, BodyArray& bodies, dhh::thread::ThreadPool* pool, F&& fn)
+		{
+			bodies.resize(count);
+			Body* data = bodies.data();
+			const auto slice = [&](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					fn(i, data[i]);
+				}
+			};
+			if (pool != nullptr)
+			{
+				pool->parallelFor(count, slice);
+			}
+			else
+			{
+				slice(0, 0, count);
+			}
+		}
+	}
+
+	// deterministic cloud of bodies at rest, for large-N runs
+	inline void fillUniformCloud(uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		const double half = parameters.boxSize * parameters.scaleRadius / 2;
+		initial::generate(count, bodies, pool, [&](size_t i, Body& body) {
+			BodyRandom random(seed, i);
+			body.position = glm::dvec3(random.uniform(-half, half), random.uniform(-half, half),
+				random.uniform(-half, half));
+			body.velocity = glm::dvec3(0);
+			body.mass = random.uniform(1e29, 1e30);
+		});
+	}
+
+	// Equal masses, radii and speeds sampled as in Aarseth, Henon & Wielen (1974); the radius is cut at 10
+	// scale radii so a few outliers do not blow up the bounding box
+	inline void fillPlummerSphere(uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		const double scaleRadius = parameters.scaleRadius;
+		const double totalMass = parameters.bodyMass * count;
+		initial::generate(count, bodies, pool, [&](size_t i, Body& body) {
+			BodyRandom random(seed, i);
+			double r;
+			do
+			{
+				r = scaleRadius / std::sqrt(std::pow(random.uniform(), -2.0 / 3.0) - 1);
+			} while (!(r < 10 * scaleRadius));
+
+			// q = v / v_escape from the distribution g(q) = q² (1 - q²)^3.5, by rejection
+			double q;
+			do
+			{
+				q = random.uniform();
+			} while (0.1 * random.uniform() > q * q * std::pow(1 - q * q, 3.5));
+			const double escape = std::sqrt(2 * totalMass) * std::pow(r * r + scaleRadius * scaleRadius, -0.25);
+
+			body.position = r * random.direction();
+			body.velocity = q * escape * random.direction();
+			body.mass = parameters.bodyMass;
+		});
+	}
+
+	// King model of central potential W0 with core radius r0 = scaleRadius. The profile is integrated once, then
+	// radii come from its mass table and speeds from f(E) ~ exp(E / sigma²) - 1 by rejection.
+	inline void fillKingSphere(uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		const initial::KingProfile profile(parameters.kingPotential);
+		const double totalMass = parameters.bodyMass * count;
+		const double r0 = parameters.scaleRadius;
+		// M = 4 pi rho0 r0³ m and r0² = 9 sigma² / (4 pi rho0)
+		const double sigma2 = totalMass / (9 * r0 * profile.mass.back());
+		const double sigma = std::sqrt(sigma2);
+		initial::generate(count, bodies, pool, [&](size_t i, Body& body) {
+			BodyRandom random(seed, i);
+			double r;
+			double w;
+			profile.atMassFraction(random.uniform(), r, w);
+			const double x = initial::sampleSpeed(random, std::sqrt(2 * w), [w](double x) {
+				return x * x * (std::exp(w - x * x / 2) - 1);
+			});
+			body.position = r * r0 * random.direction();
+			body.velocity = x * sigma * random.direction();
+			body.mass = parameters.bodyMass;
+		});
+	}
+
+	// Hernquist sphere of scale radius a = scaleRadius, speeds from its isotropic distribution function
+	inline void fillHernquistSphere(uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		const double totalMass = parameters.bodyMass * count;
+		initial::generate(count, bodies, pool, [&](size_t i, Body& body) {
+			BodyRandom random(seed, i);
+			initial::sampleHernquist(random, parameters.scaleRadius, totalMass, parameters.hernquistCutoff, body);
+			body.mass = parameters.bodyMass;
+		});
+	}
+
+	// Exponential disk in the xy plane with a sech² vertical profile, rotating about z, and a Hernquist bulge of
+	// the first bulgeFraction of the bodies. Disk bodies move at the circular speed of disk plus bulge, less the
+	// asymmetric drift, with dispersions from the vertical equilibrium of an isothermal sheet.
+	inline void fillDiskGalaxy(uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		const uint32_t bulgeCount = static_cast<uint32_t>(count * std::clamp(parameters.bulgeFraction, 0.0, 1.0));
+		const double bulgeMass = parameters.bodyMass * bulgeCount;
+		const double diskMass = parameters.bodyMass * (count - bulgeCount);
+		const double h = parameters.scaleRadius;
+		const double z0 = parameters.diskHeight * h;
+		const double a = parameters.bulgeRadius * h;
+		initial::generate(count, bodies, pool, [&](size_t i, Body& body) {
+			BodyRandom random(seed, i);
+			body.mass = parameters.bodyMass;
+			if (i < bulgeCount)
+			{
+				initial::sampleHernquist(random, a, bulgeMass, parameters.hernquistCutoff, body);
+				return;
+			}
+
+			// the radial mass distribution R e^(-R/h) is a gamma distribution of shape 2
+			double R;
+			do
+			{
+				R = -h * std::log(random.uniform() * random.uniform());
+			} while (!(R < parameters.diskCutoff * h));
+			const double phi = 2 * initial::Pi * random.uniform();
+			const double z = z0 * std::atanh(2 * random.uniform() - 1);
+
+			const double speed2 = initial::exponentialDiskSpeed2(R, h, diskMass) + bulgeMass * R / ((R + a) * (R + a));
+			const double surfaceDensity = diskMass / (2 * initial::Pi * h * h) * std::exp(-R / h);
+			const double sigmaZ = std::sqrt(initial::Pi * surfaceDensity * z0);
+			const double sigmaR = sigmaZ;
+			// epicycle approximation for a flat rotation curve: sigma_phi² = sigma_R² / 2
+			const double rotation = std::sqrt(std::max(speed2 + sigmaR * sigmaR * (0.5 - 2 * R / h), 0.0));
+
+			const double vR = sigmaR * random.normal();
+			const double vPhi = rotation + sigmaR / std::sqrt(2.0) * random.normal();
+			const double vZ = sigmaZ * random.normal();
+			const double c = std::cos(phi);
+			const double s = std::sin(phi);
+			body.position = glm::dvec3(R * c, R * s, z);
+			body.velocity = glm::dvec3(vR * c - vPhi * s, vR * s + vPhi * c, vZ);
+		});
+	}
+
+	// Cubic lattice of ceil(cbrt(count))³ sites, filled in order, in a box of boxSize scale radii, each body
+	// displaced along the gradient of a random field of zeldovichModes plane waves with P(k) ~ k^index. The
+	// velocities are those of the growing mode in a matter-dominated universe of the box's mean density,
+	// v = H psi with H² = 8 pi G rho / 3. Wave vectors are multiples of the box's fundamental mode up to the
+	// lattice's Nyquist frequency, so the field is periodic over the box.
+	inline void fillZeldovichLattice(uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		const uint32_t side = static_cast<uint32_t>(std::ceil(std::cbrt(static_cast<double>(count)) - 1e-9));
+		const double box = parameters.boxSize * parameters.scaleRadius;
+		const double spacing = box / std::max(side, 1u);
+		const int nyquist = std::max<int>(side / 2, 1);
+
+		struct Mode
+		{
+			glm::dvec3 wave;       // radians per metre
+			glm::dvec3 amplitude;  // displacement along the wave vector, metres
+			double phase;
+		};
+		std::vector<Mode> modes(parameters.zeldovichModes);
+		double variance = 0;
+		for (uint32_t m = 0; m < modes.size(); ++m)
+		{
+			BodyRandom random(seed, m, 1);
+			glm::dvec3 k;
+			double length;
+			do
+			{
+				const auto component = [&] {
+					return std::floor(random.uniform(-nyquist, nyquist + 1.0));
+				};
+				k = glm::dvec3(component(), component(), component());
+				length = std::sqrt(glm::dot(k, k));
+			} while (length == 0 || length > nyquist);
+			// |psi_k| = |delta_k| / k with |delta_k|² ~ P(k)
+			const double size = std::sqrt(std::pow(length, parameters.zeldovichIndex)) / length;
+			modes[m].wave = k * (2 * initial::Pi / box);
+			modes[m].amplitude = k / length * size;
+			modes[m].phase = 2 * initial::Pi * random.uniform();
+			variance += size * size / 2;
+		}
+		const double normalization =
+			variance > 0 ? parameters.zeldovichDisplacement * spacing / std::sqrt(variance) : 0;
+		for (Mode& mode : modes)
+		{
+			mode.amplitude = mode.amplitude * normalization;
+		}
+
+		const double meanDensity = parameters.bodyMass * count / (box * box * box);
+		const double hubble = std::sqrt(8 * initial::Pi * meanDensity / 3);
+		initial::generate(count, bodies, pool, [&](size_t i, Body& body) {
+			const glm::dvec3 site(static_cast<double>(i % side), static_cast<double>(i / side % side),
+				static_cast<double>(i / side / side));
+			const glm::dvec3 q = (site + glm::dvec3(0.5)) * spacing - glm::dvec3(box / 2);
+			glm::dvec3 displacement(0);
+			for (const Mode& mode : modes)
+			{
+				displacement += mode.amplitude * std::sin(glm::dot(mode.wave, q) + mode.phase);
+			}
+			body.position = q + displacement;
+			body.velocity = displacement * hubble;
+			body.mass = parameters.bodyMass;
+		});
+	}
+
+	inline void fillBodies(Distribution distribution, uint32_t count, BodyArray& bodies, uint64_t seed = 42,
+		dhh::thread::ThreadPool* pool = nullptr, const InitialConditionParameters& parameters = {})
+	{
+		switch (distribution)
+		{
+		case Distribution::Uniform:
+			fillUniformCloud(count, bodies, seed, pool, parameters);
+			break;
+		case Distribution::Plummer:
+			fillPlummerSphere(count, bodies, seed, pool, parameters);
+			break;
+		case Distribution::King:
+			fillKingSphere(count, bodies, seed, pool, parameters);
+			break;
+		case Distribution::Hernquist:
+			fillHernquistSphere(count, bodies, seed, pool, parameters);
+			break;
+		case Distribution::Disk:
+			fillDiskGalaxy(count, bodies, seed, pool, parameters);
+			break;
+		case Distribution::Zeldovich:
+			fillZeldovichLattice(count, bodies, seed, pool, parameters);
+			break;
+		}
+	}
+}
@@ -0,0 +1,536 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace dhh::metrics
+{
+	// double stored in an atomic integer, std::atomic<double> has no fetch_add before C++20
+	class AtomicDouble
+	{
+	public:
+		double load() const
+		{
+			const uint64_t bits = value.load(std::memory_order_relaxed);
+			double result;
+			std::memcpy(&result, &bits, sizeof(result));
+			return result;
+		}
+
+		void store(double newValue)
+		{
+			value.store(toBits(newValue), std::memory_order_relaxed);
+		}
+
+		void add(double amount)
+		{
+			uint64_t expected = value.load(std::memory_order_relaxed);
+			while (true)
+			{
+				double current;
+				std::memcpy(&current, &expected, sizeof(current));
+				if (value.compare_exchange_weak(expected, toBits(current + amount), std::memory_order_relaxed))
+				{
+					return;
+				}
+			}
+		}
+
+	private:
+		static uint64_t toBits(double number)
+		{
+			uint64_t bits;
+			std::memcpy(&bits, &number, sizeof(bits));
+			return bits;
+		}
+
+		std::atomic<uint64_t> value{0};  // bits of 0.0
+	};
+
+	// Updates are single atomic operations, so the step loop and the renderer never wait for an export
+	class Metric
+	{
+	public:
+		virtual ~Metric() = default;
+		virtual const char* type() const = 0;
+		// sample lines of the exposition format, labels without braces
+		virtual void write(std::ostream& out, const std::string& name, const std::string& labels) const = 0;
+
+		static std::string braced(const std::string& labels)
+		{
+			return labels.empty() ? "" : "{" + labels + "}";
+		}
+
+		static std::string number(double value)
+		{
+			if (std::isinf(value))
+			{
+				return value > 0 ? "+Inf" : "-Inf";
+			}
+			std::ostringstream stream;
+			stream << std::setprecision(15) << value;
+			return stream.str();
+		}
+	};
+
+	// Monotonic total, e.g. steps
+	class Counter : public Metric
+	{
+	public:
+		void add(uint64_t amount = 1)
+		{
+			count.fetch_add(amount, std::memory_order_relaxed);
+		}
+
+		uint64_t value() const
+		{
+			return count.load(std::memory_order_relaxed);
+		}
+
+		const char* type() const override
+		{
+			return "counter";
+		}
+
+		void write(std::ostream& out, const std::string& name, const std::string& labels) const override
+		{
+			out << name << braced(labels) << " " << value() << "\n";
+		}
+
+	private:
+		std::atomic<uint64_t> count{0};
+	};
+
+	// Current value, e.g. memory in use
+	class Gauge : public Metric
+	{
+	public:
+		void set(double newValue)
+		{
+			current.store(newValue);
+		}
+
+		double value() const
+		{
+			return current.load();
+		}
+
+		const char* type() const override
+		{
+			return "gauge";
+		}
+
+		void write(std::ostream& out, const std::string& name, const std::string& labels) const override
+		{
+			out << name << braced(labels) << " " << number(value()) << "\n";
+		}
+
+	private:
+		AtomicDouble current;
+	};
+
+	// Distribution over fixed buckets, exported with interpolated quantiles next to the cumulative buckets
+	class Histogram : public Metric
+	{
+	public:
+		// upper bounds in increasing order, +Inf is implied
+		explicit Histogram(std::vector<double> bounds)
+			: bounds(std::move(bounds)), counts(new std::atomic<uint64_t>[this->bounds.size() + 1])
+		{
+			for (size_t i = 0; i <= this->bounds.size(); ++i)
+			{
+				counts[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		// bounds start, start * factor, ... for count buckets
+		static std::vector<double> exponentialBounds(double start, double factor, uint32_t count)
+		{
+			std::vector<double> result;
+			for (uint32_t i = 0; i < count; ++i, start *= factor)
+			{
+				result.push_back(start);
+			}
+			return result;
+		}
+
+		void observe(double value)
+		{
+			const size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+			counts[bucket].fetch_add(1, std::memory_order_relaxed);
+			sum.add(value);
+		}
+
+		// Linear interpolation inside the bucket holding the quantile, the largest bound for the overflow bucket
+		double quantile(double q) const
+		{
+			std::vector<uint64_t> snapshot(bounds.size() + 1);
+			uint64_t total = 0;
+			for (size_t i = 0; i <= bounds.size(); ++i)
+			{
+				snapshot[i] = counts[i].load(std::memory_order_relaxed);
+				total += snapshot[i];
+			}
+			if (total == 0)
+			{
+				return 0;
+			}
+			const double rank = q * total;
+			uint64_t below = 0;
+			for (size_t i = 0; i < bounds.size(); ++i)
+			{
+				if (below + snapshot[i] >= rank)
+				{
+					const double lower = i == 0 ? 0 : bounds[i - 1];
+					const double fraction = snapshot[i] > 0 ? (rank - below) / snapshot[i] : 0;
+					return lower + (bounds[i] - lower) * fraction;
+				}
+				below += snapshot[i];
+			}
+			return bounds.empty() ? 0 : bounds.back();
+		}
+
+		const char* type() const override
+		{
+			return "histogram";
+		}
+
+		void write(std::ostream& out, const std::string& name, const std::string& labels) const override
+		{
+			const std::string prefix = labels.empty() ? "" : labels + ",";
+			uint64_t cumulative = 0;
+			for (size_t i = 0; i <= bounds.size(); ++i)
+			{
+				cumulative += counts[i].load(std::memory_order_relaxed);
+				const double bound = i < bounds.size() ? bounds[i] : std::numeric_limits<double>::infinity();
+				out << name << "_bucket{" << prefix << "le=\"" << number(bound) << "\"} " << cumulative << "\n";
+			}
+			out << name << "_sum" << braced(labels) << " " << number(sum.load()) << "\n";
+			out << name << "_count" << braced(labels) << " " << cumulative << "\n";
+		}
+
+	private:
+		std::vector<double> bounds;
+		std::unique_ptr<std::atomic<uint64_t>[]> counts;  // one per bound plus the overflow bucket
+		AtomicDouble sum;
+	};
+
+	// Process-wide set of metrics rendered in the Prometheus text exposition format. Metrics are registered at
+	// setup and live as long as the process; collectors refresh gauges that are sampled rather than updated
+	// (memory usage, rates) right before each export.
+	class Registry
+	{
+	public:
+		static Registry& instance()
+		{
+			static Registry registry;
+			return registry;
+		}
+
+		// labels in exposition syntax without braces, e.g. kind="device"
+		Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "")
+		{
+			return add<Counter>(name, help, labels);
+		}
+
+		Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "")
+		{
+			return add<Gauge>(name, help, labels);
+		}
+
+		Histogram& histogram(const std::string& name, const std::string& help, std::vector<double> bounds)
+		{
+			return add<Histogram>(name, help, "", std::move(bounds));
+		}
+
+		void addCollector(std::function<void()> collector)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			collectors.push_back(std::move(collector));
+		}
+
+		// runs the collectors and renders every metric, families in registration order
+		std::string render()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (const auto& collector : collectors)
+			{
+				collector();
+			}
+
+			std::ostringstream out;
+			for (const Family& family : families)
+			{
+				out << "# HELP " << family.name << " " << family.help << "\n";
+				out << "# TYPE " << family.name << " " << family.series.front().metric->type() << "\n";
+				for (const Series& series : family.series)
+				{
+					series.metric->write(out, family.name, series.labels);
+				}
+				if (const auto* histogram = dynamic_cast<const Histogram*>(family.series.front().metric.get()))
+				{
+					// not part of the histogram type, a separate gauge family
+					out << "# HELP " << family.name << "_quantile Interpolated from the buckets of " << family.name
+						<< "\n# TYPE " << family.name << "_quantile gauge\n";
+					for (double q : {0.5, 0.9, 0.99})
+					{
+						out << family.name << "_quantile{quantile=\"" << q << "\"} "
+							<< Metric::number(histogram->quantile(q)) << "\n";
+					}
+				}
+			}
+			return out.str();
+		}
+
+	private:
+		struct Series
+		{
+			std::string labels;
+			std::unique_ptr<Metric> metric;
+		};
+
+		struct Family
+		{
+			std::string name;
+			std::string help;
+			std::vector<Series> series;
+		};
+
+		template <typename T, typename... Args>
+		T& add(const std::string& name, const std::string& help, const std::string& labels, Args&&... args)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto family = std::find_if(families.begin(), families.end(),
+				[&](const Family& existing) { return existing.name == name; });
+			if (family == families.end())
+			{
+				family = families.insert(families.end(), {name, help, {}});
+			}
+			for (const Series& series : family->series)
+			{
+				if (series.labels == labels)
+				{
+					T* existing = dynamic_cast<T*>(series.metric.get());
+					if (existing == nullptr)
+					{
+						throw std::runtime_error("Metric " + name + " registered with two types");
+					}
+					return *existing;
+				}
+			}
+			family->series.push_back({labels, std::make_unique<T>(std::forward<Args>(args)...)});
+			return static_cast<T&>(*family->series.back().metric);
+		}
+
+		std::mutex mutex;
+		std::vector<Family> families;
+		std::vector<std::function<void()>> collectors;
+	};
+
+	// Writes the registry to a textfile for node_exporter's textfile collector every interval, and optionally
+	// serves GET /metrics on 127.0.0.1:port. Both run on their own threads; the last state is written again
+	// when the exporter is destroyed.
+	class Exporter
+	{
+	public:
+		Exporter(Registry& registry, std::filesystem::path textfile, double interval, uint16_t port = 0)
+			: registry(registry), textfile(std::move(textfile)), interval(std::max(interval, 0.1))
+		{
+			// before any thread starts, a joinable thread destroyed by the unwinding would terminate the process
+			if (port != 0)
+			{
+				openListener(port);
+			}
+			if (!this->textfile.empty())
+			{
+				writer = std::thread([this] { writerLoop(); });
+			}
+			if (port != 0)
+			{
+				server = std::thread([this] { serverLoop(); });
+			}
+		}
+
+		~Exporter()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			if (writer.joinable())
+			{
+				writer.join();
+			}
+			if (server.joinable())
+			{
+				server.join();
+			}
+#ifndef _WIN32
+			if (listener >= 0)
+			{
+				close(listener);
+			}
+#endif
+		}
+
+		Exporter(const Exporter&) = delete;
+		Exporter& operator=(const Exporter&) = delete;
+
+	private:
+		void writerLoop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				const bool stop = wake.wait_for(lock, std::chrono::duration<double>(interval), [this] {
+					return stopping;
+				});
+				lock.unlock();
+				writeTextfile();
+				lock.lock();
+				if (stop)
+				{
+					return;
+				}
+			}
+		}
+
+		// renamed into place, the collector never reads a partial file
+		void writeTextfile()
+		{
+			std::filesystem::path temporary = textfile;
+			temporary += ".tmp";
+			{
+				std::ofstream out(temporary, std::ios::trunc);
+				out << registry.render();
+				if (!out)
+				{
+					return;
+				}
+			}
+			std::error_code error;
+			std::filesystem::rename(temporary, textfile, error);
+		}
+
+#ifdef _WIN32
+		void openListener(uint16_t)
+		{
+			throw std::runtime_error("The metrics HTTP endpoint is not supported on Windows, use the textfile");
+		}
+
+		void serverLoop()
+		{
+		}
+#else
+		// localhost only, the endpoint has no authentication
+		void openListener(uint16_t port)
+		{
+			listener = socket(AF_INET, SOCK_STREAM, 0);
+			const int reuse = 1;
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+				|| listen(listener, 8) != 0)
+			{
+				if (listener >= 0)
+				{
+					close(listener);
+				}
+				throw std::runtime_error("Cannot listen on 127.0.0.1:" + std::to_string(port) + " for metrics");
+			}
+		}
+
+		// one request per connection, polled so the destructor does not wait for a client
+		void serverLoop()
+		{
+			while (true)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (stopping)
+					{
+						return;
+					}
+				}
+				pollfd descriptor = {listener, POLLIN, 0};
+				if (poll(&descriptor, 1, 200) <= 0)
+				{
+					continue;
+				}
+				const int client = accept(listener, nullptr, nullptr);
+				if (client < 0)
+				{
+					continue;
+				}
+				timeval timeout = {1, 0};
+				setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				char request[1024];
+				const ssize_t received = recv(client, request, sizeof(request) - 1, 0);
+				const std::string line(request, received > 0 ? received : 0);
+
+				std::string status = "404 Not Found";
+				std::string body = "Not found, metrics are at /metrics\n";
+				if (line.rfind("GET /metrics ", 0) == 0 || line.rfind("GET / ", 0) == 0)
+				{
+					status = "200 OK";
+					body = registry.render();
+				}
+				const std::string response = "HTTP/1.1 " + status
+					+ "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size())
+					+ "\r\nConnection: close\r\n\r\n" + body;
+				size_t sent = 0;
+				while (sent < response.size())
+				{
+					const ssize_t written = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+					if (written <= 0)
+					{
+						break;
+					}
+					sent += written;
+				}
+				close(client);
+			}
+		}
+
+		int listener = -1;
+#endif
+
+		Registry& registry;
+		std::filesystem::path textfile;
+		double interval;
+		std::thread writer;
+		std::thread server;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+	};
+}
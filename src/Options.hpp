@@ -0,0 +1,319 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+namespace dhh::options
+{
+	struct Options
+	{
+		// 0 keeps the built-in three body preset
+		uint32_t bodyCount = 0;
+		std::string distribution = "uniform";  // of the generated bodies, see InitialConditions.hpp
+		uint64_t seed = 42;                    // same seed, same bodies, on any number of threads
+
+		// initial conditions from a file, see BodyLoader.hpp
+		std::filesystem::path loadFile;
+		std::string loadFormat;                // csv or binary, empty picks by extension
+		std::string loadColumns;               // column mapping, empty uses the CSV header or mass,x,y,z,vx,vy,vz
+		std::string loadUnits = "m,m/s,native";
+		std::string loadBinaryType = "f64";    // or f32
+		uint32_t loadRecordFields = 7;         // values per binary record
+		uint64_t loadHeaderBytes = 0;          // skipped at the start of a binary file
+		double stepLength = 0.0001;
+
+		// in-core kernel variant, applied as specialization constants of nbody.comp
+		uint32_t workgroupSize = 0;       // 0 rounds the body count up to a multiple of 32
+		bool leapfrog = false;            // kick-drift-kick instead of semi-implicit Euler
+		bool singlePrecisionForces = false;
+		double softening = 0;             // Plummer softening length
+
+		// out-of-core direct sum, the body set lives in host memory and source tiles are streamed to the device
+		bool outOfCore = false;
+		bool outOfCoreReport = false;
+		uint32_t tileSize = 1 << 16;
+		uint32_t blockSize = 1 << 18;
+		uint32_t stagingDepth = 2;
+		std::filesystem::path bodyFile;  // memory-mapped host storage, heap memory when empty
+		uint32_t reportSteps = 5;
+
+		// ensemble mode, many independent small systems integrated headless to termination
+		std::filesystem::path ensembleFile;    // parameter file, see loadEnsemble
+		uint32_t ensembleSystems = 0;          // without a file: perturbed copies of the three body preset
+		double ensembleSpread = 0.01;          // relative perturbation of the generated systems
+		std::filesystem::path ensembleOutput;  // final state and status per system
+		double ensembleTimeLimit = 10;
+		double ensembleEscapeRadius = 1e13;
+		double ensembleCollisionRadius = 1e9;
+		double ensembleCloseApproachRadius = 0;  // 0 records no close approaches
+		std::filesystem::path ensembleEvents;    // every escape, collision, time limit and close approach
+		uint32_t ensembleStepsPerDispatch = 1000;
+
+		// Vulkan device whose name contains this, e.g. llvmpipe for the software driver
+		std::string device;
+
+		// benchmark the out-of-core force kernel launch shapes and store the fastest for this device
+		bool autotune = false;
+
+		// compiled shaders and the pipeline cache are kept here between runs
+		std::filesystem::path cacheDirectory = "shader-cache";
+		bool noCache = false;
+
+		// builds with NBODY_RUNTIME_SHADERS: compile GLSL from this directory instead of using the embedded
+		// SPIR-V, and recreate the pipelines when a source file changes
+		std::filesystem::path shaderSource;
+		bool hotReload = false;
+
+		// checkpoint/restart, see Checkpoint.hpp
+		std::filesystem::path checkpointFile;  // written at exit, and periodically with checkpointInterval
+		double checkpointInterval = 0;         // wall-clock seconds between checkpoints, 0 only writes at exit
+		std::filesystem::path restartFile;     // replaces the initial state, and the integrator settings
+
+		// snapshot stream, see SnapshotWriter.hpp
+		std::filesystem::path outputFile;
+		uint32_t outputEvery = 10;  // simulation steps between snapshots
+		uint32_t outputQueue = 4;   // snapshots waiting for the writer before the simulation stalls
+		double outputPositionError = 0;  // > 0 writes a compressed trajectory instead, see Trajectory.hpp
+		double outputVelocityError = 0;
+
+		// Chebyshev ephemeris, see Ephemeris.hpp
+		std::filesystem::path ephemerisFile;
+		double ephemerisSegment = 1;           // simulated seconds per fitted segment
+		uint32_t ephemerisDegree = 10;         // of the polynomial per body and axis
+		std::filesystem::path ephemerisQuery;  // answers "body time" lines from stdin, then exits
+
+		// conserved quantities time series, see Diagnostics.hpp and ConservationReduction.hpp
+		std::filesystem::path conservationFile;
+		uint32_t conservationEvery = 1;  // simulation steps between samples
+
+		// query service on a Unix domain socket, see QueryService.hpp
+		std::filesystem::path serviceSocket;   // served by the running simulation
+		std::filesystem::path serviceConnect;  // sends serviceRequest to a running simulation, then exits
+		std::string serviceRequest = "diagnostics";
+
+		// replay of a recorded --output file instead of simulating, see Replay.hpp
+		std::filesystem::path replayFile;
+		double replaySpeed = 0;        // simulated seconds per second, 0 shows one recorded frame per step
+		double replayStart = 0;        // simulated time to start at
+		uint32_t replayPrefetch = 8;   // frames read ahead of the one shown
+
+		// steps per second on the simulation thread, independent of the frame rate; 0 runs unthrottled
+		double simulationRate = 60;
+
+		// GPU timestamps around every dispatch and render pass, min/avg/p99 per scope printed at exit
+		bool gpuTiming = false;
+
+		// builds with NBODY_TRACING: Chrome trace JSON of the CPU scopes (and GPU scopes with --gpu-timing)
+		std::filesystem::path traceFile;
+
+		// Prometheus metrics, written to a textfile-collector file and/or served on 127.0.0.1:port
+		std::filesystem::path metricsFile;
+		double metricsInterval = 5;  // seconds between textfile writes and conservation samples
+		uint16_t metricsPort = 0;    // 0 disables the HTTP endpoint
+
+		// memory accounting
+		double memoryLogInterval = 0;  // seconds between memory log lines, 0 disables them
+		bool memoryStats = false;      // dump per-subsystem and VMA statistics at exit
+		bool checkAllocations = false; // fail when the steady-state frame loop allocates from the heap
+	};
+
+	inline void printUsage()
+	{
+		std::cout << "Usage: N-Body [options]\n"
+			"  --bodies N           number of bodies, 0 uses the three body preset\n"
+			"  --distribution D     uniform, plummer, king, hernquist, disk (with a bulge) or zeldovich\n"
+			"  --seed S             random seed of the generated bodies\n"
+			"  --load PATH          read the initial bodies from a CSV or raw binary file\n"
+			"  --load-format F      csv or binary, by default binary for .bin, .raw, .f32 and .f64\n"
+			"  --load-columns SPEC  fields in column order (mass, x, y, z, vx, vy, vz, - skips a column) or\n"
+			"                       field=COLUMN by header name or index; default the header names or\n"
+			"                       mass,x,y,z,vx,vy,vz\n"
+			"  --load-units L,V,M   length (m, km, au, pc, kpc), velocity (m/s, km/s, au/day) and mass (native,\n"
+			"                       kg, msun) units of the file\n"
+			"  --load-binary-type T f64 or f32 binary values\n"
+			"  --load-record-fields N  values per binary record\n"
+			"  --load-header-bytes N   bytes skipped at the start of a binary file\n"
+			"  --step-length S      simulated seconds per step of the out-of-core solver\n"
+			"  --workgroup-size N   in-core workgroup size, at least the body count\n"
+			"  --leapfrog           in-core kick-drift-kick integrator instead of semi-implicit Euler\n"
+			"  --single-precision-forces  accumulate in-core forces in single precision\n"
+			"  --softening S        in-core Plummer softening length\n"
+			"  --out-of-core        stream source tiles from host memory instead of keeping all bodies on the GPU\n"
+			"  --out-of-core-report headless benchmark of out-of-core against in-core, then exit\n"
+			"  --tile-size N        source bodies per streamed tile\n"
+			"  --block-size N       target bodies resident on the GPU at a time\n"
+			"  --staging-depth N    tiles in flight, 2 is double buffering\n"
+			"  --body-file PATH     keep the out-of-core body set in a memory-mapped file\n"
+			"  --report-steps N     steps measured per report phase\n"
+			"  --ensemble PATH      integrate every system of an ensemble parameter file headless, then exit\n"
+			"  --ensemble-systems M run M perturbed copies of the three body preset as an ensemble\n"
+			"  --ensemble-spread F  relative perturbation of the generated ensemble\n"
+			"  --ensemble-output PATH        write status, time and final state per system\n"
+			"  --ensemble-time-limit T       stop a system at simulated time T\n"
+			"  --ensemble-escape-radius R    distance from the others' centre of mass counted as an escape\n"
+			"  --ensemble-collision-radius R pair distance counted as a collision\n"
+			"  --ensemble-close-approach R   record pairs coming closer than R as close approach events\n"
+			"  --ensemble-events PATH        write every event with system, time, bodies and distance\n"
+			"  --ensemble-steps-per-dispatch N steps per system between status checks\n"
+			"  --device NAME        use the Vulkan device whose name contains NAME, e.g. llvmpipe\n"
+			"  --autotune           benchmark force kernel launch shapes for this device (at --bodies N or a\n"
+			"                       default range) and store the fastest, then exit\n"
+			"  --cache-dir PATH     directory for compiled shaders, tuning results and the pipeline cache\n"
+			"  --no-cache           compile every shader and pipeline from scratch\n"
+			"  --shader-source DIR  compile the GLSL shaders in DIR at startup (runtime shader builds)\n"
+			"  --hot-reload         recreate the pipelines when a shader source changes (runtime shader builds)\n"
+			"  --checkpoint PATH    write the state to a checkpoint file at exit\n"
+			"  --checkpoint-interval S  also write the checkpoint every S seconds\n"
+			"  --restart PATH       continue from a checkpoint file\n"
+			"  --output PATH        stream the full state to PATH every --output-every steps\n"
+			"  --output-every K     simulation steps between snapshots\n"
+			"  --output-queue N     snapshots queued for the disk writer before the simulation waits\n"
+			"  --output-error E     write a compressed trajectory, positions within E metres\n"
+			"  --output-velocity-error V  and velocities within V m/s\n"
+			"  --ephemeris PATH     fit Chebyshev polynomials to every body's orbit and write them to PATH\n"
+			"  --ephemeris-segment S  simulated seconds per fitted segment\n"
+			"  --ephemeris-degree N polynomial degree per segment\n"
+			"  --ephemeris-query PATH  print position and velocity for each \"body time\" line on stdin, then exit\n"
+			"  --conservation PATH  write energy, momentum, angular momentum and centre of mass as CSV to PATH\n"
+			"  --conservation-every K  simulation steps between conservation samples\n"
+			"  --serve PATH         answer state, diagnostics and pause/step requests on the Unix socket PATH\n"
+			"  --connect PATH       send --request to the simulation serving PATH, print the reply and exit\n"
+			"  --request TEXT       snapshot, bodies I,J,..., region X0,Y0,Z0,X1,Y1,Z1, diagnostics, pause,\n"
+			"                       resume or step N\n"
+			"  --replay PATH        play back an --output file instead of simulating; Space pauses, Left/Right seek,\n"
+			"                       Up/Down change speed\n"
+			"  --replay-speed X     simulated seconds per second, 0 shows one recorded frame per --sim-rate step\n"
+			"  --replay-start T     simulated time to start the replay at\n"
+			"  --replay-prefetch N  frames read ahead of the one shown\n"
+			"  --sim-rate R         simulation steps per second, 0 steps as fast as the GPU allows\n"
+			"  --gpu-timing         time dispatches and render passes with GPU timestamps, print them at exit\n"
+			"  --trace PATH         write a Chrome trace of CPU (and --gpu-timing GPU) scopes at exit\n"
+			"  --metrics-file PATH  write Prometheus metrics to PATH (node_exporter textfile collector)\n"
+			"  --metrics-interval S seconds between metrics writes\n"
+			"  --metrics-port N     serve the metrics at http://127.0.0.1:N/metrics\n"
+			"  --memory-log-interval S  print current/peak memory usage every S seconds\n"
+			"  --memory-stats       dump memory usage by subsystem and VMA statistics at exit\n"
+			"  --check-allocations  count heap allocations after warm-up, exit code 1 if there were any\n";
+	}
+
+	inline Options parse(int argc, char* argv[])
+	{
+		Options options;
+
+		const std::map<std::string, bool*> flags = {
+			{"--out-of-core", &options.outOfCore},
+			{"--leapfrog", &options.leapfrog},
+			{"--single-precision-forces", &options.singlePrecisionForces},
+			{"--out-of-core-report", &options.outOfCoreReport},
+			{"--memory-stats", &options.memoryStats},
+			{"--check-allocations", &options.checkAllocations},
+			{"--no-cache", &options.noCache},
+			{"--autotune", &options.autotune},
+			{"--hot-reload", &options.hotReload},
+			{"--gpu-timing", &options.gpuTiming},
+		};
+
+		const std::map<std::string, std::function<void(const std::string&)>> values = {
+			{"--bodies", [&](const std::string& value) { options.bodyCount = std::stoul(value); }},
+			{"--distribution", [&](const std::string& value) { options.distribution = value; }},
+			{"--seed", [&](const std::string& value) { options.seed = std::stoull(value); }},
+			{"--load", [&](const std::string& value) { options.loadFile = value; }},
+			{"--load-format", [&](const std::string& value) { options.loadFormat = value; }},
+			{"--load-columns", [&](const std::string& value) { options.loadColumns = value; }},
+			{"--load-units", [&](const std::string& value) { options.loadUnits = value; }},
+			{"--load-binary-type", [&](const std::string& value) { options.loadBinaryType = value; }},
+			{"--load-record-fields", [&](const std::string& value) { options.loadRecordFields = std::stoul(value); }},
+			{"--load-header-bytes", [&](const std::string& value) { options.loadHeaderBytes = std::stoull(value); }},
+			{"--step-length", [&](const std::string& value) { options.stepLength = std::stod(value); }},
+			{"--workgroup-size", [&](const std::string& value) { options.workgroupSize = std::stoul(value); }},
+			{"--softening", [&](const std::string& value) { options.softening = std::stod(value); }},
+			{"--tile-size", [&](const std::string& value) { options.tileSize = std::stoul(value); }},
+			{"--block-size", [&](const std::string& value) { options.blockSize = std::stoul(value); }},
+			{"--staging-depth", [&](const std::string& value) { options.stagingDepth = std::stoul(value); }},
+			{"--body-file", [&](const std::string& value) { options.bodyFile = value; }},
+			{"--report-steps", [&](const std::string& value) { options.reportSteps = std::stoul(value); }},
+			{"--ensemble", [&](const std::string& value) { options.ensembleFile = value; }},
+			{"--ensemble-systems", [&](const std::string& value) { options.ensembleSystems = std::stoul(value); }},
+			{"--ensemble-spread", [&](const std::string& value) { options.ensembleSpread = std::stod(value); }},
+			{"--ensemble-output", [&](const std::string& value) { options.ensembleOutput = value; }},
+			{"--ensemble-time-limit", [&](const std::string& value) { options.ensembleTimeLimit = std::stod(value); }},
+			{"--ensemble-escape-radius",
+				[&](const std::string& value) { options.ensembleEscapeRadius = std::stod(value); }},
+			{"--ensemble-collision-radius",
+				[&](const std::string& value) { options.ensembleCollisionRadius = std::stod(value); }},
+			{"--ensemble-close-approach",
+				[&](const std::string& value) { options.ensembleCloseApproachRadius = std::stod(value); }},
+			{"--ensemble-events", [&](const std::string& value) { options.ensembleEvents = value; }},
+			{"--ensemble-steps-per-dispatch",
+				[&](const std::string& value) { options.ensembleStepsPerDispatch = std::stoul(value); }},
+			{"--device", [&](const std::string& value) { options.device = value; }},
+			{"--cache-dir", [&](const std::string& value) { options.cacheDirectory = value; }},
+			{"--trace", [&](const std::string& value) { options.traceFile = value; }},
+			{"--metrics-file", [&](const std::string& value) { options.metricsFile = value; }},
+			{"--metrics-interval", [&](const std::string& value) { options.metricsInterval = std::stod(value); }},
+			{"--metrics-port",
+				[&](const std::string& value) { options.metricsPort = static_cast<uint16_t>(std::stoul(value)); }},
+			{"--shader-source", [&](const std::string& value) { options.shaderSource = value; }},
+			{"--checkpoint", [&](const std::string& value) { options.checkpointFile = value; }},
+			{"--checkpoint-interval",
+				[&](const std::string& value) { options.checkpointInterval = std::stod(value); }},
+			{"--restart", [&](const std::string& value) { options.restartFile = value; }},
+			{"--output", [&](const std::string& value) { options.outputFile = value; }},
+			{"--output-every", [&](const std::string& value) { options.outputEvery = std::stoul(value); }},
+			{"--output-queue", [&](const std::string& value) { options.outputQueue = std::stoul(value); }},
+			{"--output-error", [&](const std::string& value) { options.outputPositionError = std::stod(value); }},
+			{"--output-velocity-error",
+				[&](const std::string& value) { options.outputVelocityError = std::stod(value); }},
+			{"--ephemeris", [&](const std::string& value) { options.ephemerisFile = value; }},
+			{"--ephemeris-segment", [&](const std::string& value) { options.ephemerisSegment = std::stod(value); }},
+			{"--ephemeris-degree", [&](const std::string& value) { options.ephemerisDegree = std::stoul(value); }},
+			{"--ephemeris-query", [&](const std::string& value) { options.ephemerisQuery = value; }},
+			{"--conservation", [&](const std::string& value) { options.conservationFile = value; }},
+			{"--conservation-every",
+				[&](const std::string& value) { options.conservationEvery = std::stoul(value); }},
+			{"--serve", [&](const std::string& value) { options.serviceSocket = value; }},
+			{"--connect", [&](const std::string& value) { options.serviceConnect = value; }},
+			{"--request", [&](const std::string& value) { options.serviceRequest = value; }},
+			{"--replay", [&](const std::string& value) { options.replayFile = value; }},
+			{"--replay-speed", [&](const std::string& value) { options.replaySpeed = std::stod(value); }},
+			{"--replay-start", [&](const std::string& value) { options.replayStart = std::stod(value); }},
+			{"--replay-prefetch", [&](const std::string& value) { options.replayPrefetch = std::stoul(value); }},
+			{"--sim-rate", [&](const std::string& value) { options.simulationRate = std::stod(value); }},
+			{"--memory-log-interval", [&](const std::string& value) { options.memoryLogInterval = std::stod(value); }},
+		};
+
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string name = argv[i];
+			if (name == "--help" || name == "-h")
+			{
+				printUsage();
+				std::exit(0);
+			}
+			if (flags.count(name))
+			{
+				*flags.at(name) = true;
+			}
+			else if (values.count(name))
+			{
+				if (i + 1 >= argc)
+				{
+					throw std::runtime_error("Missing value for " + name);
+				}
+				values.at(name)(argv[++i]);
+			}
+			else
+			{
+				printUsage();
+				throw std::runtime_error("Unknown option " + name);
+			}
+		}
+		return options;
+	}
+}
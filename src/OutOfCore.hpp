@@ -0,0 +1,683 @@
+#pragma once
+
+#include "Autotune.hpp"
+#include "Body.hpp"
+#include "Filesystem.hpp"
+#include "GpuProfiler.hpp"
+#include "Pipeline.hpp"
+#include "Shader.hpp"
+#include "Trace.hpp"
+#include "VulkanBase.h"
+#include "VulkanInitializer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::nbody
+{
+	struct OutOfCoreConfig
+	{
+		uint32_t tileSize = 1 << 16;   // source bodies per streamed tile
+		uint32_t blockSize = 1 << 18;  // target bodies resident while their accelerations are gathered
+		uint32_t stagingDepth = 2;     // tiles in flight, 2 is double buffering
+		double stepLength = 0.0001;
+		bool gpuTiming = false;        // timestamp scopes around the uploads and dispatches
+	};
+
+	struct OutOfCoreStats
+	{
+		double seconds = 0;
+		uint64_t interactions = 0;
+		uint64_t bytesStreamed = 0;
+
+		double interactionsPerSecond() const
+		{
+			return seconds > 0 ? interactions / seconds : 0;
+		}
+
+		double streamedBytesPerSecond() const
+		{
+			return seconds > 0 ? bytesStreamed / seconds : 0;
+		}
+	};
+
+	// Direct-sum solver for body sets that do not fit in device memory.
+	// The state lives in host memory (heap or a memory-mapped file). For every block of target bodies the
+	// source tiles are copied through a ring of staging/device buffers on the transfer queue while the compute
+	// queue consumes the previous tile, so copies overlap compute.
+	class OutOfCoreSolver
+	{
+	public:
+		enum class SweepMode
+		{
+			Streamed,      // normal step
+			TransferOnly,  // only stream the source tiles, for measuring copy throughput
+			ComputeOnly,   // reuse the tiles already resident, for measuring kernel throughput
+		};
+
+		OutOfCoreSolver(VulkanBase& base, const BodyArray& initial, const OutOfCoreConfig& config,
+			const std::filesystem::path& storageFile = {})
+			: base(base), device(base.device), config(validate(config)), count(initial.size())
+		{
+			// the kernels index bodies and skip the self interaction with 32-bit global indices
+			if (count > UINT32_MAX)
+			{
+				throw std::runtime_error("The out-of-core engine supports at most " + std::to_string(UINT32_MAX)
+					+ " bodies, got " + std::to_string(count));
+			}
+
+			// force kernel and launch shape from --autotune, the device's default on a device that was never tuned
+			const std::optional<TunedKernel> tuned = findTunedKernel(base.physicalDevice, count);
+			kernelTuned = tuned.has_value();
+			kernel = kernelTuned ? tuned->tuning : defaultKernel(base.physicalDevice);
+
+			// nothing larger than the body set itself is ever resident
+			const size_t largest = std::max<size_t>(count, 1);
+			this->config.blockSize = static_cast<uint32_t>(std::min<size_t>(this->config.blockSize, largest));
+			this->config.tileSize = static_cast<uint32_t>(std::min<size_t>(this->config.tileSize, largest));
+
+			createHostStorage(initial, storageFile);
+			createPipelines();
+			createCommandPools();
+			createBlockResources();
+			createSlots();
+			if (this->config.gpuTiming)
+			{
+				// one query slot per tile slot's compute command buffer, the last one for blockCmd
+				timing = std::make_unique<dhh::profile::GpuProfiler>(
+					base, "GPU out-of-core", static_cast<uint32_t>(slots.size()) + 1);
+			}
+		}
+
+		~OutOfCoreSolver()
+		{
+			vkDeviceWaitIdle(device);
+			for (auto& slot : slots)
+			{
+				vmaUnmapMemory(base.allocator, slot.stagingMemory);
+				base.destroyBuffer(slot.staging, slot.stagingMemory);
+				base.destroyBuffer(slot.tile, slot.tileMemory);
+				vkDestroySemaphore(device, slot.uploaded, nullptr);
+				vkDestroyFence(device, slot.fence, nullptr);
+			}
+			vmaUnmapMemory(base.allocator, blockUploadMemory);
+			vmaUnmapMemory(base.allocator, blockReadbackMemory);
+			base.destroyBuffer(blockUpload, blockUploadMemory);
+			base.destroyBuffer(blockReadback, blockReadbackMemory);
+			base.destroyBuffer(targets, targetsMemory);
+			base.destroyBuffer(accelerations, accelerationsMemory);
+			vkDestroyFence(device, blockFence, nullptr);
+			vkDestroyCommandPool(device, computePool, nullptr);
+			vkDestroyCommandPool(device, transferPool, nullptr);
+			delete tilePipe;
+			delete integratePipe;
+		}
+
+		OutOfCoreSolver(const OutOfCoreSolver&) = delete;
+		OutOfCoreSolver& operator=(const OutOfCoreSolver&) = delete;
+
+		void step()
+		{
+			lastStep = sweep(SweepMode::Streamed);
+			std::swap(current, next);
+
+			total.seconds += lastStep.seconds;
+			total.interactions += lastStep.interactions;
+			total.bytesStreamed += lastStep.bytesStreamed;
+		}
+
+		const Body* bodies() const
+		{
+			return current;
+		}
+
+		// streamed sweep of the latest step()
+		const OutOfCoreStats& lastStepStats() const
+		{
+			return lastStep;
+		}
+
+		// Times steps with every body resident in the device buffer and no tile streamed, when the body set fits
+		// in one block. Leaves the host state untouched.
+		OutOfCoreStats measureInCore(uint32_t steps)
+		{
+			const uint32_t blockCount = static_cast<uint32_t>(count);
+			uploadBlock(0, blockCount);
+
+			OutOfCoreStats stats;
+			const auto start = std::chrono::high_resolution_clock::now();
+			for (uint32_t i = 0; i < steps; ++i)
+			{
+				VkCommandBufferBeginInfo beginInfo =
+					dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+				vkBeginCommandBuffer(blockCmd, &beginInfo);
+				resetTiming(blockCmd, blockSlot());
+				{
+					dhh::profile::GpuScope scope(timing.get(), blockCmd, blockSlot(),
+						std::string("in-core ") + kernel.shaderName());
+					vkCmdBindPipeline(blockCmd, VK_PIPELINE_BIND_POINT_COMPUTE, tilePipe->pipeline);
+					vkCmdBindDescriptorSets(blockCmd, VK_PIPELINE_BIND_POINT_COMPUTE, tilePipe->pipelineLayout, 0,
+						1, &inCoreSet, 0, nullptr);
+					tilePipe->pushConstants(blockCmd, TileParams{blockCount, blockCount, 0, 0});
+					vkCmdDispatch(blockCmd, kernel.groupCount(blockCount), 1, 1);
+				}
+				computeBarrier(blockCmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+					VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+				recordIntegrate(blockCmd, blockCount);
+				computeBarrier(blockCmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+					VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+				vkCmdFillBuffer(blockCmd, accelerations, 0, sizeof(glm::dvec4) * blockCount, 0);
+				computeBarrier(blockCmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+					VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+					VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+				vkEndCommandBuffer(blockCmd);
+				submitBlockCmd();
+				stats.interactions += static_cast<uint64_t>(blockCount) * blockCount;
+			}
+			stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			return stats;
+		}
+
+		// null unless the config enabled GPU timing
+		const dhh::profile::GpuProfiler* gpuTiming() const
+		{
+			return timing.get();
+		}
+
+		size_t size() const
+		{
+			return count;
+		}
+
+		// Times the streamed step against its transfer-only and compute-only parts to derive the achieved
+		// overlap, and against a fully resident (in-core) step when the body set fits in one block
+		void report(uint32_t steps)
+		{
+			steps = std::max<uint32_t>(1, steps);
+			const auto average = [&](SweepMode mode) {
+				OutOfCoreStats stats;
+				for (uint32_t i = 0; i < steps; ++i)
+				{
+					const OutOfCoreStats sweepStats = sweep(mode);
+					stats.seconds += sweepStats.seconds;
+					stats.interactions += sweepStats.interactions;
+					stats.bytesStreamed += sweepStats.bytesStreamed;
+				}
+				return stats;
+			};
+
+			const size_t blocks = (count + config.blockSize - 1) / config.blockSize;
+			const size_t tiles = (count + config.tileSize - 1) / config.tileSize;
+			std::cout << "Out-of-core: " << count << " bodies, " << blocks << " block(s) x " << tiles
+				<< " tile(s), staging depth " << config.stagingDepth << "\n  kernel " << kernel
+				<< (kernelTuned ? " (tuned)" : " (default, run --autotune)") << "\n";
+
+			const OutOfCoreStats streamed = average(SweepMode::Streamed);
+			const OutOfCoreStats transferOnly = average(SweepMode::TransferOnly);
+			const OutOfCoreStats computeOnly = average(SweepMode::ComputeOnly);
+
+			printLine("streamed", streamed, steps);
+			printLine("transfer only", transferOnly, steps);
+			printLine("compute only", computeOnly, steps);
+
+			// 1 means the shorter of the two phases was completely hidden behind the longer one
+			const double hidden = transferOnly.seconds + computeOnly.seconds - streamed.seconds;
+			const double shorter = std::min(transferOnly.seconds, computeOnly.seconds);
+			const double overlap = shorter > 0 ? std::clamp(hidden / shorter, 0.0, 1.0) : 0.0;
+			std::cout << "  achieved overlap " << std::fixed << std::setprecision(1) << overlap * 100 << "%\n";
+
+			if (count <= config.blockSize)
+			{
+				const OutOfCoreStats inCore = measureInCore(steps);
+				printLine("in-core", inCore, steps);
+				std::cout << "  out-of-core / in-core interactions/s "
+					<< streamed.interactionsPerSecond() / inCore.interactionsPerSecond() << "\n";
+			}
+			else
+			{
+				std::cout << "  in-core: body set exceeds the block size, no resident reference\n";
+			}
+			std::cout << std::defaultfloat;
+		}
+
+	private:
+		struct TileSlot
+		{
+			VkBuffer staging;
+			VmaAllocation stagingMemory;
+			void* mapped;
+			VkBuffer tile;
+			VmaAllocation tileMemory;
+			VkCommandBuffer transferCmd;
+			VkCommandBuffer computeCmd;
+			VkSemaphore uploaded;
+			VkFence fence;  // signaled by the last submission that used the slot
+			bool inFlight = false;
+			VkDescriptorSet descriptorSet;
+		};
+
+		struct IntegrateParams
+		{
+			double stepLength;
+			uint32_t targetCount;
+			uint32_t padding;
+		};
+
+		VulkanBase& base;
+		VkDevice device;
+		OutOfCoreConfig config;
+		size_t count;
+		KernelTuning kernel;
+		bool kernelTuned;
+
+		dhh::memory::AlignedArray<Body> hostStorage;
+		dhh::filesystem::MappedFile mappedStorage;
+		Body* current;
+		Body* next;
+
+		dhh::shader::Pipeline* tilePipe;
+		dhh::shader::Pipeline* integratePipe;
+		VkDescriptorSet inCoreSet;
+
+		VkCommandPool computePool;
+		VkCommandPool transferPool;
+
+		VkBuffer targets;
+		VmaAllocation targetsMemory;
+		VkBuffer accelerations;
+		VmaAllocation accelerationsMemory;
+		VkBuffer blockUpload;
+		VmaAllocation blockUploadMemory;
+		void* blockUploadMapped;
+		VkBuffer blockReadback;
+		VmaAllocation blockReadbackMemory;
+		void* blockReadbackMapped;
+		VkCommandBuffer blockCmd;
+		VkFence blockFence;
+
+		std::vector<TileSlot> slots;
+		std::unique_ptr<dhh::profile::GpuProfiler> timing;
+
+	public:
+		OutOfCoreStats lastStep;
+		OutOfCoreStats total;
+
+	private:
+		static OutOfCoreConfig validate(OutOfCoreConfig config)
+		{
+			config.tileSize = std::max<uint32_t>(1, config.tileSize);
+			config.blockSize = std::max<uint32_t>(1, config.blockSize);
+			config.stagingDepth = std::max<uint32_t>(1, config.stagingDepth);
+			return config;
+		}
+
+		void createHostStorage(const BodyArray& initial, const std::filesystem::path& storageFile)
+		{
+			// current and next state, each step reads one half and writes the other
+			if (storageFile.empty())
+			{
+				// huge pages, the tiles are streamed linearly through the whole set every step
+				hostStorage.allocate(count * 2, true);
+				current = hostStorage.data();
+			}
+			else
+			{
+				mappedStorage.open(storageFile, true, count * 2 * sizeof(Body));
+				current = static_cast<Body*>(mappedStorage.data());
+			}
+			next = current + count;
+			std::copy(initial.begin(), initial.end(), current);
+		}
+
+		void createPipelines()
+		{
+			dhh::shader::Shader tileShader = dhh::shader::loadShader(kernel.shaderName());
+			tilePipe = new dhh::shader::Pipeline(
+				device, &tileShader, base.descriptorPool, base.pipelineCache, kernel.specialization());
+
+			dhh::shader::Shader integrateShader = dhh::shader::loadShader("integrate.comp");
+			integratePipe =
+				new dhh::shader::Pipeline(device, &integrateShader, base.descriptorPool, base.pipelineCache);
+		}
+
+		void createCommandPools()
+		{
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+			poolInfo.queueFamilyIndex = base.queueFamilyIndex.graphicsFamily.value();
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &computePool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create out-of-core compute command pool!");
+			}
+
+			poolInfo.queueFamilyIndex = base.queueFamilyIndex.transferFamily.value();
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferPool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create out-of-core transfer command pool!");
+			}
+		}
+
+		void createBlockResources()
+		{
+			const VkDeviceSize blockBytes = sizeof(Body) * config.blockSize;
+
+			base.createBuffer(blockBytes,
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+				VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+				VMA_MEMORY_USAGE_GPU_ONLY, targets, targetsMemory, dhh::memory::Tag::Bodies);
+			base.createBuffer(sizeof(glm::dvec4) * config.blockSize,
+				VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+				accelerations, accelerationsMemory, dhh::memory::Tag::Bodies);
+			base.createBuffer(blockBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, blockUpload,
+				blockUploadMemory, dhh::memory::Tag::Staging);
+			base.createBuffer(blockBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU,
+				blockReadback, blockReadbackMemory, dhh::memory::Tag::Staging);
+			vmaMapMemory(base.allocator, blockUploadMemory, &blockUploadMapped);
+			vmaMapMemory(base.allocator, blockReadbackMemory, &blockReadbackMapped);
+
+			VkCommandBufferAllocateInfo info =
+				dhh::vk::initializer::commandBufferAllocateInfo(computePool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+			vkAllocateCommandBuffers(device, &info, &blockCmd);
+
+			VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+			vkCreateFence(device, &fenceCreateInfo, nullptr, &blockFence);
+
+			VkDescriptorSet integrateSet = integratePipe->descriptorSets[0];
+			integratePipe->writeStorageBuffer(integrateSet, 0, targets);
+			integratePipe->writeStorageBuffer(integrateSet, 1, accelerations);
+
+			// the resident block is its own source tile
+			inCoreSet = tilePipe->allocateDescriptorSet(0);
+			tilePipe->writeStorageBuffer(inCoreSet, 0, targets);
+			tilePipe->writeStorageBuffer(inCoreSet, 1, targets);
+			tilePipe->writeStorageBuffer(inCoreSet, 2, accelerations);
+		}
+
+		void createSlots()
+		{
+			const VkDeviceSize tileBytes = sizeof(Body) * config.tileSize;
+			const std::vector<uint32_t> sharedFamilies = {
+				base.queueFamilyIndex.graphicsFamily.value(),
+				base.queueFamilyIndex.transferFamily.value(),
+			};
+
+			slots.resize(config.stagingDepth);
+			for (auto& slot : slots)
+			{
+				base.createBuffer(tileBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
+					slot.staging, slot.stagingMemory, dhh::memory::Tag::Staging);
+				vmaMapMemory(base.allocator, slot.stagingMemory, &slot.mapped);
+
+				// written on the transfer queue and read on the compute queue
+				base.createBuffer(tileBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					VMA_MEMORY_USAGE_GPU_ONLY, slot.tile, slot.tileMemory, dhh::memory::Tag::Bodies, sharedFamilies);
+
+				VkCommandBufferAllocateInfo info = dhh::vk::initializer::commandBufferAllocateInfo(
+					transferPool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+				vkAllocateCommandBuffers(device, &info, &slot.transferCmd);
+				info.commandPool = computePool;
+				vkAllocateCommandBuffers(device, &info, &slot.computeCmd);
+
+				VkSemaphoreCreateInfo semaphoreCreateInfo = dhh::vk::initializer::semaphoreCreateInfo();
+				vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &slot.uploaded);
+				VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+				vkCreateFence(device, &fenceCreateInfo, nullptr, &slot.fence);
+
+				slot.descriptorSet = tilePipe->allocateDescriptorSet(0);
+				tilePipe->writeStorageBuffer(slot.descriptorSet, 0, targets);
+				tilePipe->writeStorageBuffer(slot.descriptorSet, 1, slot.tile);
+				tilePipe->writeStorageBuffer(slot.descriptorSet, 2, accelerations);
+			}
+		}
+
+		void waitSlot(TileSlot& slot)
+		{
+			if (slot.inFlight)
+			{
+				NBODY_TRACE_SCOPE("waitSlot");
+				vkWaitForFences(device, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+				vkResetFences(device, 1, &slot.fence);
+				slot.inFlight = false;
+				if (timing)
+				{
+					timing->collect();
+				}
+			}
+		}
+
+		uint32_t blockSlot() const
+		{
+			return static_cast<uint32_t>(slots.size());
+		}
+
+		void resetTiming(VkCommandBuffer commandBuffer, uint32_t slot)
+		{
+			if (timing)
+			{
+				timing->reset(commandBuffer, slot);
+			}
+		}
+
+		void submitBlockCmd()
+		{
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &blockCmd;
+			{
+				auto lock = base.lockQueue(base.computeQueue);
+				vkQueueSubmit(base.computeQueue, 1, &submitInfo, blockFence);
+			}
+			vkWaitForFences(device, 1, &blockFence, VK_TRUE, UINT64_MAX);
+			vkResetFences(device, 1, &blockFence);
+			if (timing)
+			{
+				timing->submitted(blockSlot());
+				timing->collect();
+			}
+		}
+
+		static void computeBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStage,
+			VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+		{
+			VkMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = srcAccess;
+			barrier.dstAccessMask = dstAccess;
+			vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+		}
+
+		// copies the target block to the device and clears its acceleration accumulator
+		void uploadBlock(size_t blockStart, uint32_t blockCount)
+		{
+			NBODY_TRACE_SCOPE("uploadBlock");
+			const VkDeviceSize bytes = sizeof(Body) * blockCount;
+			memcpy(blockUploadMapped, current + blockStart, bytes);
+			vmaFlushAllocation(base.allocator, blockUploadMemory, 0, bytes);
+
+			VkCommandBufferBeginInfo beginInfo =
+				dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+			vkBeginCommandBuffer(blockCmd, &beginInfo);
+			resetTiming(blockCmd, blockSlot());
+			{
+				dhh::profile::GpuScope scope(timing.get(), blockCmd, blockSlot(), "block upload");
+				VkBufferCopy region = {0, 0, bytes};
+				vkCmdCopyBuffer(blockCmd, blockUpload, targets, 1, &region);
+				vkCmdFillBuffer(blockCmd, accelerations, 0, sizeof(glm::dvec4) * blockCount, 0);
+			}
+			computeBarrier(blockCmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+			vkEndCommandBuffer(blockCmd);
+			submitBlockCmd();
+		}
+
+		void recordIntegrate(VkCommandBuffer commandBuffer, uint32_t blockCount)
+		{
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, integratePipe->pipeline);
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, integratePipe->pipelineLayout, 0,
+				1, integratePipe->descriptorSets.data(), 0, nullptr);
+			integratePipe->pushConstants(commandBuffer, IntegrateParams{config.stepLength, blockCount, 0});
+			vkCmdDispatch(commandBuffer, (blockCount + 31) / 32, 1, 1);
+		}
+
+		// integrates the resident block and copies it back into the next state
+		void integrateBlock(size_t blockStart, uint32_t blockCount)
+		{
+			NBODY_TRACE_SCOPE("integrateBlock");
+			const VkDeviceSize bytes = sizeof(Body) * blockCount;
+
+			VkCommandBufferBeginInfo beginInfo =
+				dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+			vkBeginCommandBuffer(blockCmd, &beginInfo);
+			resetTiming(blockCmd, blockSlot());
+			{
+				dhh::profile::GpuScope scope(timing.get(), blockCmd, blockSlot(), "integrate.comp");
+				recordIntegrate(blockCmd, blockCount);
+			}
+			computeBarrier(blockCmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+			VkBufferCopy region = {0, 0, bytes};
+			vkCmdCopyBuffer(blockCmd, targets, blockReadback, 1, &region);
+			vkEndCommandBuffer(blockCmd);
+			submitBlockCmd();
+
+			vmaInvalidateAllocation(base.allocator, blockReadbackMemory, 0, bytes);
+			memcpy(next + blockStart, blockReadbackMapped, bytes);
+		}
+
+		void streamTile(TileSlot& slot, size_t tileStart, uint32_t tileCount, SweepMode mode)
+		{
+			NBODY_TRACE_SCOPE("streamTile");
+			const VkDeviceSize bytes = sizeof(Body) * tileCount;
+			memcpy(slot.mapped, current + tileStart, bytes);
+			vmaFlushAllocation(base.allocator, slot.stagingMemory, 0, bytes);
+
+			VkCommandBufferBeginInfo beginInfo =
+				dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+			vkBeginCommandBuffer(slot.transferCmd, &beginInfo);
+			VkBufferCopy region = {0, 0, bytes};
+			vkCmdCopyBuffer(slot.transferCmd, slot.staging, slot.tile, 1, &region);
+			vkEndCommandBuffer(slot.transferCmd);
+
+			const bool computeFollows = mode == SweepMode::Streamed;
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.transferCmd;
+			submitInfo.signalSemaphoreCount = computeFollows ? 1 : 0;
+			submitInfo.pSignalSemaphores = &slot.uploaded;
+			auto lock = base.lockQueue(base.transferQueue);
+			vkQueueSubmit(base.transferQueue, 1, &submitInfo, computeFollows ? VK_NULL_HANDLE : slot.fence);
+		}
+
+		void dispatchTile(TileSlot& slot, size_t blockStart, uint32_t blockCount, size_t tileStart,
+			uint32_t tileCount, SweepMode mode)
+		{
+			VkCommandBufferBeginInfo beginInfo =
+				dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+			const uint32_t slotIndex = static_cast<uint32_t>(&slot - slots.data());
+			vkBeginCommandBuffer(slot.computeCmd, &beginInfo);
+			resetTiming(slot.computeCmd, slotIndex);
+			{
+				dhh::profile::GpuScope scope(timing.get(), slot.computeCmd, slotIndex, kernel.shaderName());
+				vkCmdBindPipeline(slot.computeCmd, VK_PIPELINE_BIND_POINT_COMPUTE, tilePipe->pipeline);
+				vkCmdBindDescriptorSets(slot.computeCmd, VK_PIPELINE_BIND_POINT_COMPUTE, tilePipe->pipelineLayout,
+					0, 1, &slot.descriptorSet, 0, nullptr);
+				// the constructor limits count to 32 bits, so the global offsets fit
+				tilePipe->pushConstants(slot.computeCmd,
+					TileParams{blockCount, tileCount, static_cast<uint32_t>(blockStart),
+						static_cast<uint32_t>(tileStart)});
+				vkCmdDispatch(slot.computeCmd, kernel.groupCount(blockCount), 1, 1);
+			}
+			// the next tile accumulates into the same accelerations
+			computeBarrier(slot.computeCmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+			vkEndCommandBuffer(slot.computeCmd);
+
+			const bool waitUpload = mode == SweepMode::Streamed;
+			VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.waitSemaphoreCount = waitUpload ? 1 : 0;
+			submitInfo.pWaitSemaphores = &slot.uploaded;
+			submitInfo.pWaitDstStageMask = &waitStage;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.computeCmd;
+			auto lock = base.lockQueue(base.computeQueue);
+			vkQueueSubmit(base.computeQueue, 1, &submitInfo, slot.fence);
+			if (timing)
+			{
+				timing->submitted(slotIndex);
+			}
+		}
+
+		OutOfCoreStats sweep(SweepMode mode)
+		{
+			OutOfCoreStats stats;
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			for (size_t blockStart = 0; blockStart < count; blockStart += config.blockSize)
+			{
+				const uint32_t blockCount =
+					static_cast<uint32_t>(std::min<size_t>(config.blockSize, count - blockStart));
+				if (mode != SweepMode::TransferOnly)
+				{
+					uploadBlock(blockStart, blockCount);
+				}
+
+				size_t tileIndex = 0;
+				for (size_t tileStart = 0; tileStart < count; tileStart += config.tileSize, ++tileIndex)
+				{
+					const uint32_t tileCount =
+						static_cast<uint32_t>(std::min<size_t>(config.tileSize, count - tileStart));
+					TileSlot& slot = slots[tileIndex % slots.size()];
+
+					// the slot's staging and device buffers are free once its previous tile was consumed
+					waitSlot(slot);
+					if (mode != SweepMode::ComputeOnly)
+					{
+						streamTile(slot, tileStart, tileCount, mode);
+						stats.bytesStreamed += sizeof(Body) * tileCount;
+					}
+					if (mode != SweepMode::TransferOnly)
+					{
+						dispatchTile(slot, blockStart, blockCount, tileStart, tileCount, mode);
+						stats.interactions += static_cast<uint64_t>(blockCount) * tileCount;
+					}
+					slot.inFlight = true;
+				}
+
+				for (auto& slot : slots)
+				{
+					waitSlot(slot);
+				}
+				if (mode != SweepMode::TransferOnly)
+				{
+					integrateBlock(blockStart, blockCount);
+				}
+			}
+
+			stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			return stats;
+		}
+
+		static void printLine(const char* name, const OutOfCoreStats& stats, uint32_t steps)
+		{
+			std::cout << "  " << std::left << std::setw(14) << name << std::right << std::fixed
+				<< std::setprecision(3) << stats.seconds * 1000 / steps << " ms/step  " << std::scientific
+				<< std::setprecision(3) << stats.interactionsPerSecond() << " interactions/s  " << std::fixed
+				<< std::setprecision(2) << stats.streamedBytesPerSecond() / 1e9 << " GB/s streamed\n";
+		}
+	};
+}
@@ -1,21 +1,72 @@
 #pragma once
 
 #include "Shader.hpp"
+#include "ShaderCache.hpp"
 #include "VulkanInitializer.hpp"
 #include "VulkanTools.hpp"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <type_traits>
 #include <vector>
 
 
 namespace dhh::shader
 {
+    // Values of the specialization constants of a compute shader. Booleans must be set as VkBool32.
+    class Specialization
+    {
+    public:
+        template <typename T>
+        Specialization& set(uint32_t constantID, const T& value)
+        {
+            static_assert(std::is_arithmetic_v<T> && sizeof(T) >= 4, "specialization constants are 32 or 64 bit");
+            entries.push_back({constantID, static_cast<uint32_t>(data.size()), sizeof(T)});
+            const char* bytes = reinterpret_cast<const char*>(&value);
+            data.insert(data.end(), bytes, bytes + sizeof(T));
+            return *this;
+        }
+
+        // identifies the variant, equal for the same constants set in the same order
+        uint64_t key() const
+        {
+            return hashBytes(data.data(), data.size(), hashBytes(entries.data(), entries.size() * sizeof(entries[0])));
+        }
+
+        // points into this object, valid while it is alive and unchanged
+        VkSpecializationInfo info() const
+        {
+            VkSpecializationInfo info = {};
+            info.mapEntryCount        = static_cast<uint32_t>(entries.size());
+            info.pMapEntries          = entries.data();
+            info.dataSize             = data.size();
+            info.pData                = data.data();
+            return info;
+        }
+
+    private:
+        std::vector<VkSpecializationMapEntry> entries;
+        std::vector<char> data;
+    };
+
+    // Descriptor pools are externally synchronized and all pipelines allocate from the application's one pool, so
+    // pipelines can be created and destroyed on several threads
+    inline std::mutex& descriptorPoolMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
     class Pipeline
     {
     public:
         std::vector<Shader*> shaders;
 
-        explicit Pipeline(VkDevice device, Shader* shader, VkDescriptorPool pool)
-            : device(device), shaders({shader}), descriptorPool(pool)
+        // pipeline is the variant for specialization, others share the layout and descriptor sets (see variant())
+        explicit Pipeline(VkDevice device, Shader* shader, VkDescriptorPool pool,
+            VkPipelineCache pipelineCache = VK_NULL_HANDLE, const Specialization& specialization = {})
+            : device(device), shaders({shader}), descriptorPool(pool), pipelineCache(pipelineCache)
         {
             isComputePipeline = true;
             createShaderModules();
@@ -23,7 +74,7 @@ namespace dhh::shader
             gatherDescriptorInfo();
             createDescriptorSetLayouts();
             createPipelineLayout();
-            createComputePipeline();
+            pipeline = variant(specialization);
             allocateDescriptorSets();
         }
 
@@ -33,10 +84,11 @@ namespace dhh::shader
             std::vector<VkDynamicState> dynamicStates, VkPipelineRasterizationStateCreateInfo rasterizationState,
             VkPipelineDepthStencilStateCreateInfo depthStencilState, VkPipelineViewportStateCreateInfo viewportState,
             VkPipelineColorBlendAttachmentState colorBlendAttachmentState,
-            VkPipelineInputAssemblyStateCreateInfo inputAssemblyState)
-            : device(device), shaders(shaders), descriptorPool(pool), renderPass(renderPass),
-              multisampleState(multisampleState), dynamicStates(dynamicStates), rasterizationState(rasterizationState),
-              depthStencilState(depthStencilState), viewportState(viewportState),
+            VkPipelineInputAssemblyStateCreateInfo inputAssemblyState, VkPipelineCache pipelineCache = VK_NULL_HANDLE)
+            : device(device), shaders(shaders), descriptorPool(pool), pipelineCache(pipelineCache),
+              renderPass(renderPass), multisampleState(multisampleState), dynamicStates(dynamicStates),
+              rasterizationState(rasterizationState), depthStencilState(depthStencilState),
+              viewportState(viewportState),
               colorBlendAttachmentState(colorBlendAttachmentState), inputAssemblyState(inputAssemblyState)
 
         {
@@ -52,6 +104,39 @@ namespace dhh::shader
             allocateDescriptorSets();
         }
 
+        Pipeline(const Pipeline&) = delete;
+        Pipeline& operator=(const Pipeline&) = delete;
+
+        // The descriptor pool needs VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, sets from
+        // allocateDescriptorSet() are freed by their owner
+        ~Pipeline()
+        {
+            {
+                std::lock_guard<std::mutex> lock(descriptorPoolMutex());
+                vkFreeDescriptorSets(device, descriptorPool, descriptorSets.size(), descriptorSets.data());
+            }
+            if (isComputePipeline)
+            {
+                for (const auto& entry : variants)
+                {
+                    vkDestroyPipeline(device, entry.second, nullptr);
+                }
+            }
+            else
+            {
+                vkDestroyPipeline(device, pipeline, nullptr);
+            }
+            vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+            for (VkDescriptorSetLayout layout : descriptorSetLayouts)
+            {
+                vkDestroyDescriptorSetLayout(device, layout, nullptr);
+            }
+            for (const auto& module : shaderModules)
+            {
+                vkDestroyShaderModule(device, module.second, nullptr);
+            }
+        }
+
         VkPipelineMultisampleStateCreateInfo multisampleState;
         std::vector<VkDynamicState> dynamicStates;
         VkPipelineRasterizationStateCreateInfo rasterizationState;
@@ -60,11 +145,35 @@ namespace dhh::shader
         VkPipelineColorBlendAttachmentState colorBlendAttachmentState;
         VkPipelineInputAssemblyStateCreateInfo inputAssemblyState;
 
-        void createComputePipeline()
+        // Compute pipeline specialized with the given constants, created on first use and kept for the lifetime
+        // of this object. Not thread safe, variants are meant to be created during setup.
+        VkPipeline variant(const Specialization& specialization)
         {
+            if (!isComputePipeline)
+            {
+                throw std::runtime_error("Only compute pipelines have variants");
+            }
+            const uint64_t key = specialization.key();
+            auto found         = variants.find(key);
+            if (found != variants.end())
+            {
+                return found->second;
+            }
+
+            const VkSpecializationInfo specializationInfo = specialization.info();
+            VkPipelineShaderStageCreateInfo stage         = shaderStageCreateInfos[0];
+            stage.pSpecializationInfo                     = &specializationInfo;
             VkComputePipelineCreateInfo pipelineInfo =
-                dhh::vk::initializer::computePipelineCreateInfo(shaderStageCreateInfos[0], pipelineLayout);
-            vkCreateComputePipelines(device, 0, 1, &pipelineInfo, nullptr, &pipeline);
+                dhh::vk::initializer::computePipelineCreateInfo(stage, pipelineLayout);
+            VkPipeline created;
+            VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &created));
+            variants.emplace(key, created);
+            return created;
+        }
+
+        size_t variantCount() const
+        {
+            return variants.size();
         }
 
         void createGraphicsPipeline()
@@ -90,7 +199,7 @@ namespace dhh::shader
             pipelineInfo.pDepthStencilState  = &depthStencilState;
             pipelineInfo.pInputAssemblyState = &inputAssemblyState;
             pipelineInfo.pVertexInputState   = &vertexInputInfo;
-            vkCreateGraphicsPipelines(device, 0, 1, &pipelineInfo, NULL, &pipeline);
+            vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, NULL, &pipeline);
         }
 
         void getVertexInputInfos()
@@ -123,10 +232,24 @@ namespace dhh::shader
 
         void createPipelineLayout()
         {
+            // push constant ranges are shared by all stages of the pipeline
+            VkPushConstantRange pushConstantRange = {};
+            for (const auto& shader : shaders)
+            {
+                pushConstantRange.size = std::max(pushConstantRange.size, shader->pushConstantSize);
+                if (shader->pushConstantSize > 0)
+                {
+                    pushConstantRange.stageFlags |= getVulkanShaderType(shader->type);
+                }
+            }
+            pushConstantStages = pushConstantRange.stageFlags;
+
             VkPipelineLayoutCreateInfo info = {};
             info.sType                      = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
             info.setLayoutCount             = descriptorSetLayouts.size();
             info.pSetLayouts                = descriptorSetLayouts.data();
+            info.pushConstantRangeCount     = pushConstantRange.size > 0 ? 1 : 0;
+            info.pPushConstantRanges        = &pushConstantRange;
 
             vkCreatePipelineLayout(device, &info, nullptr, &pipelineLayout);
         }
@@ -140,9 +263,40 @@ namespace dhh::shader
             allocateInfo.descriptorPool              = descriptorPool;
             allocateInfo.descriptorSetCount          = descriptorSetLayouts.size();
             allocateInfo.pSetLayouts                 = descriptorSetLayouts.data();
+            std::lock_guard<std::mutex> lock(descriptorPoolMutex());
             VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocateInfo, descriptorSets.data()));
         }
 
+        // extra descriptor set for the given set index, for pipelines bound with several resource combinations
+        VkDescriptorSet allocateDescriptorSet(uint32_t set)
+        {
+            VkDescriptorSetAllocateInfo allocateInfo = {};
+            allocateInfo.sType                       = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            allocateInfo.descriptorPool              = descriptorPool;
+            allocateInfo.descriptorSetCount          = 1;
+            allocateInfo.pSetLayouts                 = &descriptorSetLayouts[set];
+            VkDescriptorSet descriptorSet;
+            std::lock_guard<std::mutex> lock(descriptorPoolMutex());
+            VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocateInfo, &descriptorSet));
+            return descriptorSet;
+        }
+
+        // binds a storage buffer to a binding of the given descriptor set
+        void writeStorageBuffer(VkDescriptorSet set, uint32_t binding, VkBuffer buffer,
+            VkDeviceSize offset = 0, VkDeviceSize range = VK_WHOLE_SIZE)
+        {
+            VkDescriptorBufferInfo bufferInfo = dhh::vk::initializer::descriptorBufferInfo(buffer, offset, range);
+            VkWriteDescriptorSet write        = dhh::vk::initializer::writeDescriptorSet(
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, binding, set, &bufferInfo);
+            vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+        }
+
+        template <typename T>
+        void pushConstants(VkCommandBuffer commandBuffer, const T& constants)
+        {
+            vkCmdPushConstants(commandBuffer, pipelineLayout, pushConstantStages, 0, sizeof(T), &constants);
+        }
+
         void createDescriptorSetLayouts()
         {
             // iterate descriptor group in one set, create decriptor set layout
@@ -170,13 +324,16 @@ namespace dhh::shader
         std::vector<VkVertexInputAttributeDescription> vertexInputAttributeDescriptions;
         VkPipeline pipeline;
         bool isComputePipeline;
+        VkShaderStageFlags pushConstantStages = 0;
 
 
     private:
         std::map<uint32_t, std::vector<VkDescriptorSetLayoutBinding>> bindings;  // map<set id, bindings group>
         VkDevice device;
         VkDescriptorPool descriptorPool;
+        VkPipelineCache pipelineCache;  // shared by all pipelines and persisted by VulkanBase
         VkRenderPass renderPass;
+        std::map<uint64_t, VkPipeline> variants;  // map<Specialization::key(), compute pipeline>
 
         /// A pipeline can only have at most one vertex shader or fragment shader, etc.
         void validateGraphicsPipelineShaders()
@@ -0,0 +1,724 @@
+#pragma once
+
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace dhh::nbody
+{
+	// Query protocol over a Unix domain socket, little-endian, any number of requests per connection:
+	//
+	//   client: QueryRequest (16 bytes), then payloadBytes of arguments
+	//   server: QueryResponse (48 bytes), then payloadBytes of results
+	//
+	//   Snapshot     no arguments                  count bodies
+	//   Subset       uint32 body indices           count bodies, in the order asked for
+	//   Region       double min[3], max[3]         count uint32 indices padded to 8 bytes, then count bodies
+	//   Diagnostics  no arguments                  QueryDiagnostics
+	//   Pause        no arguments                  nothing, the simulation stops before its next step
+	//   Resume       no arguments                  nothing
+	//   Step         argument = steps              nothing, a paused simulation runs that many steps
+	//
+	// Bodies are laid out as on the GPU (Body, 64 bytes) and come from the latest published state, which the
+	// response's step and time identify.
+
+	enum class QueryType : uint16_t
+	{
+		Snapshot = 1,
+		Subset = 2,
+		Region = 3,
+		Diagnostics = 4,
+		Pause = 5,
+		Resume = 6,
+		Step = 7,
+	};
+
+	enum class QueryStatus : uint32_t
+	{
+		Ok = 0,
+		BadRequest = 1,   // unknown type, version or payload
+		OutOfRange = 2,   // a body index past the body count
+		Unavailable = 3,  // no state published yet, or no control over the simulation
+	};
+
+	struct QueryRequest
+	{
+		static constexpr uint16_t CurrentVersion = 1;
+
+		uint16_t version;
+		QueryType type;
+		uint32_t argument;
+		uint64_t payloadBytes;
+	};
+
+	static_assert(sizeof(QueryRequest) == 16, "QueryRequest is part of the protocol");
+
+	struct QueryResponse
+	{
+		QueryStatus status;
+		QueryType type;
+		uint16_t reserved0;
+		uint64_t step;  // integration steps of the state the response is from
+		double time;    // simulated time of that state
+		uint64_t count;
+		uint64_t payloadBytes;
+		uint64_t reserved;
+	};
+
+	static_assert(sizeof(QueryResponse) == 48, "QueryResponse is part of the protocol");
+
+	// O(N) summary of the latest state, computed on the service thread
+	struct QueryDiagnostics
+	{
+		uint64_t bodyCount;
+		uint32_t paused;
+		uint32_t reserved0;
+		double totalMass;
+		double kineticEnergy;
+		double momentum[3];
+		double angularMomentum[3];  // about the origin
+		double centreOfMass[3];
+		uint64_t published;         // states the simulation handed to the service
+		uint64_t skipped;           // states not handed over because every buffer was in use by a response
+		uint8_t reserved[8];
+	};
+
+	static_assert(sizeof(QueryDiagnostics) == 128, "QueryDiagnostics is part of the protocol");
+
+	namespace query
+	{
+		constexpr uint64_t MaxPayloadBytes = 1ull << 26;
+
+#ifndef _WIN32
+		inline sockaddr_un socketAddress(const std::filesystem::path& path)
+		{
+			sockaddr_un address = {};
+			address.sun_family = AF_UNIX;
+			const std::string name = path.string();
+			if (name.size() >= sizeof(address.sun_path))
+			{
+				throw std::runtime_error("Socket path too long: " + name);
+			}
+			std::memcpy(address.sun_path, name.c_str(), name.size() + 1);
+			return address;
+		}
+
+		inline bool receiveAll(int socket, void* data, size_t bytes)
+		{
+			char* cursor = static_cast<char*>(data);
+			while (bytes > 0)
+			{
+				const ssize_t received = recv(socket, cursor, bytes, 0);
+				if (received <= 0)
+				{
+					return false;
+				}
+				cursor += received;
+				bytes -= received;
+			}
+			return true;
+		}
+
+		// sends every vector, in batches the kernel accepts, resuming after partial writes
+		inline bool sendAll(int socket, std::vector<iovec>& vectors)
+		{
+			constexpr size_t Batch = 512;
+			size_t first = 0;
+			while (first < vectors.size())
+			{
+				msghdr message = {};
+				message.msg_iov = vectors.data() + first;
+				message.msg_iovlen = std::min(Batch, vectors.size() - first);
+				ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+				if (sent < 0)
+				{
+					return false;
+				}
+				while (first < vectors.size() && static_cast<size_t>(sent) >= vectors[first].iov_len)
+				{
+					sent -= vectors[first].iov_len;
+					++first;
+				}
+				if (sent > 0)
+				{
+					vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + sent;
+					vectors[first].iov_len -= sent;
+				}
+			}
+			return true;
+		}
+#endif
+	}
+
+	// Pause/step/resume hooks into the simulation loop; a service without them answers Unavailable
+	struct QueryControl
+	{
+		std::function<void(bool)> pause;
+		std::function<void(uint32_t)> step;
+		std::function<bool()> paused;
+	};
+
+	// Serves the latest published state on a Unix domain socket from a thread of its own.
+	//
+	// The simulation thread copies its state into one of a few preallocated frames with publish() and makes it
+	// the latest. Responses pin the frame they answer from and send the bodies straight out of it with
+	// scatter/gather writes, so a response neither serializes nor copies the state. The lock is only held to pick
+	// or pin a frame, never during a copy or a send, and publish() does not wait for a response: when every other
+	// frame is still being sent to a slow client it skips the step and counts it.
+	class QueryService
+	{
+	public:
+		QueryService(const std::filesystem::path& path, size_t bodyCount, QueryControl control,
+			uint32_t frameCount = 4)
+			: path(path), bodyCount(bodyCount), control(std::move(control))
+		{
+			for (uint32_t i = 0; i < std::max(frameCount, 2u); ++i)
+			{
+				frames.emplace_back();
+				frames.back().bodies.allocate(bodyCount, bodyCount * sizeof(Body) >= 1 << 21);
+			}
+			openListener();
+			server = std::thread([this] { serverLoop(); });
+		}
+
+		~QueryService()
+		{
+			stopping = true;
+			if (server.joinable())
+			{
+				server.join();
+			}
+#ifndef _WIN32
+			for (int client : clients)
+			{
+				::close(client);
+			}
+			if (listener >= 0)
+			{
+				::close(listener);
+				std::error_code error;
+				std::filesystem::remove(path, error);
+			}
+#endif
+		}
+
+		QueryService(const QueryService&) = delete;
+		QueryService& operator=(const QueryService&) = delete;
+
+		// Simulation side: copies the state into a free frame and makes it the latest, without waiting
+		void publish(uint64_t step, double time, const Body* state, dhh::thread::ThreadPool& pool)
+		{
+			// responses only pin the latest frame, so one that is neither stays free while it is filled
+			Frame* free = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (Frame& frame : frames)
+				{
+					if (&frame != latest && frame.readers == 0)
+					{
+						free = &frame;
+						break;
+					}
+				}
+			}
+			if (free == nullptr)
+			{
+				skipped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			Frame& frame = *free;
+			frame.step = step;
+			frame.time = time;
+			Body* destination = frame.bodies.data();
+			pool.parallelFor(bodyCount, [state, destination](uint32_t, size_t begin, size_t end) {
+				std::memcpy(destination + begin, state + begin, (end - begin) * sizeof(Body));
+			});
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				latest = free;
+			}
+			published.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		uint64_t publishedFrames() const
+		{
+			return published.load(std::memory_order_relaxed);
+		}
+
+		uint64_t skippedFrames() const
+		{
+			return skipped.load(std::memory_order_relaxed);
+		}
+
+		uint64_t requests() const
+		{
+			return served.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct Frame
+		{
+			uint64_t step = 0;
+			double time = 0;
+			dhh::memory::AlignedArray<Body> bodies;
+			uint32_t readers = 0;  // responses being sent from the frame
+		};
+
+		static constexpr size_t MaxClients = 16;
+
+#ifdef _WIN32
+		void openListener()
+		{
+			throw std::runtime_error("The query service needs Unix domain sockets, not supported on Windows");
+		}
+
+		void serverLoop()
+		{
+		}
+#else
+		// a stale socket file from an earlier run is replaced, anything else at the path is an error
+		void openListener()
+		{
+			struct stat status;
+			if (lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+			{
+				::unlink(path.c_str());
+			}
+			const sockaddr_un address = query::socketAddress(path);
+			listener = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (listener < 0 || bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+				|| listen(listener, 8) != 0)
+			{
+				if (listener >= 0)
+				{
+					::close(listener);
+					listener = -1;
+				}
+				throw std::runtime_error("Cannot listen on " + path.string() + " for queries");
+			}
+		}
+
+		// polled, so the destructor does not wait for a client
+		void serverLoop()
+		{
+			std::vector<pollfd> descriptors;
+			while (!stopping)
+			{
+				descriptors.assign(1, {listener, POLLIN, 0});
+				for (int client : clients)
+				{
+					descriptors.push_back({client, POLLIN, 0});
+				}
+				if (poll(descriptors.data(), descriptors.size(), 200) <= 0)
+				{
+					continue;
+				}
+				for (size_t i = descriptors.size(); i-- > 1;)
+				{
+					if (descriptors[i].revents != 0 && !serve(descriptors[i].fd))
+					{
+						::close(descriptors[i].fd);
+						clients.erase(std::find(clients.begin(), clients.end(), descriptors[i].fd));
+					}
+				}
+				if (descriptors[0].revents & POLLIN)
+				{
+					const int client = accept(listener, nullptr, nullptr);
+					if (client >= 0 && clients.size() < MaxClients)
+					{
+						// a client that stops reading cannot hold the service for long
+						timeval timeout = {2, 0};
+						setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+						setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+						clients.push_back(client);
+					}
+					else if (client >= 0)
+					{
+						::close(client);
+					}
+				}
+			}
+		}
+
+		// answers one request, false when the connection is to be closed
+		bool serve(int client)
+		{
+			QueryRequest request;
+			if (!query::receiveAll(client, &request, sizeof(request)))
+			{
+				return false;
+			}
+			if (request.payloadBytes > query::MaxPayloadBytes)
+			{
+				return false;
+			}
+			arguments.resize(request.payloadBytes);
+			if (!query::receiveAll(client, arguments.data(), arguments.size()))
+			{
+				return false;
+			}
+			served.fetch_add(1, std::memory_order_relaxed);
+
+			const Frame* frame = pin();
+			QueryResponse response = {};
+			response.type = request.type;
+			if (frame)
+			{
+				response.step = frame->step;
+				response.time = frame->time;
+			}
+			vectors.clear();
+			vectors.push_back({&response, sizeof(response)});
+
+			if (request.version != QueryRequest::CurrentVersion)
+			{
+				response.status = QueryStatus::BadRequest;
+			}
+			else if (request.type == QueryType::Pause || request.type == QueryType::Resume
+				|| request.type == QueryType::Step)
+			{
+				// needs no state, so a client can pause the run before its first step
+				response.status = steer(request);
+			}
+			else if (!frame)
+			{
+				response.status = QueryStatus::Unavailable;
+			}
+			else
+			{
+				switch (request.type)
+				{
+				case QueryType::Snapshot:
+					response.count = bodyCount;
+					vectors.push_back({frame->bodies.data(), bodyCount * sizeof(Body)});
+					break;
+				case QueryType::Subset:
+					response.status = subset(*frame, response);
+					break;
+				case QueryType::Region:
+					response.status = region(*frame, response);
+					break;
+				case QueryType::Diagnostics:
+					diagnostics = summarize(*frame);
+					response.count = 1;
+					vectors.push_back({&diagnostics, sizeof(diagnostics)});
+					break;
+				default:
+					response.status = QueryStatus::BadRequest;
+				}
+			}
+
+			if (response.status != QueryStatus::Ok)
+			{
+				vectors.resize(1);
+				response.count = 0;
+			}
+			for (size_t i = 1; i < vectors.size(); ++i)
+			{
+				response.payloadBytes += vectors[i].iov_len;
+			}
+			const bool sent = query::sendAll(client, vectors);
+			unpin(frame);
+			return sent;
+		}
+
+		// keeps the latest frame from being refilled until unpin()
+		const Frame* pin()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (latest != nullptr)
+			{
+				++latest->readers;
+			}
+			return latest;
+		}
+
+		void unpin(const Frame* frame)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (frame != nullptr)
+			{
+				--const_cast<Frame*>(frame)->readers;
+			}
+		}
+
+		// one vector per run of consecutive indices
+		QueryStatus subset(const Frame& frame, QueryResponse& response)
+		{
+			if (arguments.size() % sizeof(uint32_t) != 0)
+			{
+				return QueryStatus::BadRequest;
+			}
+			indices.resize(arguments.size() / sizeof(uint32_t));
+			std::memcpy(indices.data(), arguments.data(), arguments.size());
+			if (std::any_of(indices.begin(), indices.end(), [this](uint32_t index) { return index >= bodyCount; }))
+			{
+				return QueryStatus::OutOfRange;
+			}
+			appendBodies(frame);
+			response.count = indices.size();
+			return QueryStatus::Ok;
+		}
+
+		QueryStatus region(const Frame& frame, QueryResponse& response)
+		{
+			if (arguments.size() != 6 * sizeof(double))
+			{
+				return QueryStatus::BadRequest;
+			}
+			double bounds[6];
+			std::memcpy(bounds, arguments.data(), sizeof(bounds));
+			indices.clear();
+			for (size_t i = 0; i < bodyCount; ++i)
+			{
+				const glm::dvec3& p = frame.bodies[i].position;
+				if (p.x >= bounds[0] && p.y >= bounds[1] && p.z >= bounds[2] && p.x <= bounds[3] && p.y <= bounds[4]
+					&& p.z <= bounds[5])
+				{
+					indices.push_back(static_cast<uint32_t>(i));
+				}
+			}
+			response.count = indices.size();
+			if (indices.size() % 2 != 0)
+			{
+				indices.push_back(0);
+			}
+			vectors.push_back({indices.data(), indices.size() * sizeof(uint32_t)});
+			indices.resize(response.count);
+			appendBodies(frame);
+			return QueryStatus::Ok;
+		}
+
+		void appendBodies(const Frame& frame)
+		{
+			for (size_t i = 0; i < indices.size(); ++i)
+			{
+				if (i > 0 && indices[i] == indices[i - 1] + 1)
+				{
+					vectors.back().iov_len += sizeof(Body);
+				}
+				else
+				{
+					vectors.push_back({frame.bodies.data() + indices[i], sizeof(Body)});
+				}
+			}
+		}
+
+		QueryStatus steer(const QueryRequest& request)
+		{
+			if (!control.pause || !control.step)
+			{
+				return QueryStatus::Unavailable;
+			}
+			if (request.type == QueryType::Step)
+			{
+				control.step(request.argument);
+			}
+			else
+			{
+				control.pause(request.type == QueryType::Pause);
+			}
+			return QueryStatus::Ok;
+		}
+
+		QueryDiagnostics summarize(const Frame& frame) const
+		{
+			QueryDiagnostics summary = {};
+			summary.bodyCount = bodyCount;
+			summary.paused = control.paused && control.paused();
+			glm::dvec3 momentum(0);
+			glm::dvec3 angularMomentum(0);
+			glm::dvec3 weightedPosition(0);
+			for (size_t i = 0; i < bodyCount; ++i)
+			{
+				const Body& body = frame.bodies[i];
+				summary.totalMass += body.mass;
+				summary.kineticEnergy += 0.5 * body.mass * glm::dot(body.velocity, body.velocity);
+				momentum += body.velocity * body.mass;
+				angularMomentum += glm::cross(body.position, body.velocity) * body.mass;
+				weightedPosition += body.position * body.mass;
+			}
+			const glm::dvec3 centre = summary.totalMass > 0 ? weightedPosition / summary.totalMass : glm::dvec3(0);
+			const glm::dvec3* vectors[3] = {&momentum, &angularMomentum, &centre};
+			double* fields[3] = {summary.momentum, summary.angularMomentum, summary.centreOfMass};
+			for (int v = 0; v < 3; ++v)
+			{
+				fields[v][0] = vectors[v]->x;
+				fields[v][1] = vectors[v]->y;
+				fields[v][2] = vectors[v]->z;
+			}
+			summary.published = published.load(std::memory_order_relaxed);
+			summary.skipped = skipped.load(std::memory_order_relaxed);
+			return summary;
+		}
+
+		int listener = -1;
+
+		// service thread only, reused between requests
+		std::vector<int> clients;
+		std::vector<char> arguments;
+		std::vector<uint32_t> indices;
+		std::vector<iovec> vectors;
+		QueryDiagnostics diagnostics;
+#endif
+
+		std::filesystem::path path;
+		size_t bodyCount;
+		QueryControl control;
+		std::vector<Frame> frames;
+		std::mutex mutex;        // guards latest and the readers of every frame
+		Frame* latest = nullptr;
+		std::atomic<uint64_t> published{0};
+		std::atomic<uint64_t> skipped{0};
+		std::atomic<uint64_t> served{0};
+		std::atomic<bool> stopping{false};
+		std::thread server;
+	};
+
+#ifndef _WIN32
+	// Blocking client of a QueryService, one request at a time
+	class QueryClient
+	{
+	public:
+		struct Reply
+		{
+			QueryResponse header;
+			std::vector<uint32_t> indices;  // Region only
+			std::vector<Body> bodies;
+			QueryDiagnostics diagnostics;
+		};
+
+		explicit QueryClient(const std::filesystem::path& path) : path(path)
+		{
+			const sockaddr_un address = query::socketAddress(path);
+			socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (socket < 0 || connect(socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+			{
+				if (socket >= 0)
+				{
+					::close(socket);
+				}
+				throw std::runtime_error("Cannot connect to query service " + path.string());
+			}
+		}
+
+		~QueryClient()
+		{
+			::close(socket);
+		}
+
+		QueryClient(const QueryClient&) = delete;
+		QueryClient& operator=(const QueryClient&) = delete;
+
+		Reply snapshot()
+		{
+			return request(QueryType::Snapshot, 0, nullptr, 0);
+		}
+
+		Reply subset(const std::vector<uint32_t>& indices)
+		{
+			return request(QueryType::Subset, 0, indices.data(), indices.size() * sizeof(uint32_t));
+		}
+
+		Reply region(const glm::dvec3& min, const glm::dvec3& max)
+		{
+			const double bounds[6] = {min.x, min.y, min.z, max.x, max.y, max.z};
+			return request(QueryType::Region, 0, bounds, sizeof(bounds));
+		}
+
+		Reply diagnostics()
+		{
+			return request(QueryType::Diagnostics, 0, nullptr, 0);
+		}
+
+		Reply pause(bool pause)
+		{
+			return request(pause ? QueryType::Pause : QueryType::Resume, 0, nullptr, 0);
+		}
+
+		Reply step(uint32_t steps)
+		{
+			return request(QueryType::Step, steps, nullptr, 0);
+		}
+
+		Reply request(QueryType type, uint32_t argument, const void* payload, size_t bytes)
+		{
+			QueryRequest request = {QueryRequest::CurrentVersion, type, argument, bytes};
+			std::vector<iovec> vectors = {{&request, sizeof(request)}};
+			if (bytes > 0)
+			{
+				vectors.push_back({const_cast<void*>(payload), bytes});
+			}
+			Reply reply = {};
+			if (!query::sendAll(socket, vectors) || !query::receiveAll(socket, &reply.header, sizeof(reply.header)))
+			{
+				fail("connection lost");
+			}
+			const uint64_t count = reply.header.count;
+			uint64_t remaining = reply.header.payloadBytes;
+			const auto receive = [&](void* data, uint64_t size) {
+				if (size > remaining || !query::receiveAll(socket, data, size))
+				{
+					fail("malformed response");
+				}
+				remaining -= size;
+			};
+			if (reply.header.status == QueryStatus::Ok)
+			{
+				if (type == QueryType::Diagnostics)
+				{
+					receive(&reply.diagnostics, sizeof(reply.diagnostics));
+				}
+				else if (type == QueryType::Snapshot || type == QueryType::Subset || type == QueryType::Region)
+				{
+					if (type == QueryType::Region)
+					{
+						reply.indices.resize(count + count % 2);
+						receive(reply.indices.data(), reply.indices.size() * sizeof(uint32_t));
+						reply.indices.resize(count);
+					}
+					reply.bodies.resize(count);
+					receive(reply.bodies.data(), count * sizeof(Body));
+				}
+			}
+			if (remaining != 0)
+			{
+				fail("malformed response");
+			}
+			return reply;
+		}
+
+	private:
+		[[noreturn]] void fail(const std::string& reason) const
+		{
+			throw std::runtime_error("Query service " + path.string() + ": " + reason);
+		}
+
+		std::filesystem::path path;
+		int socket = -1;
+	};
+#endif
+}
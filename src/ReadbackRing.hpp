@@ -0,0 +1,195 @@
+#pragma once
+
+#include "VulkanBase.h"
+#include "VulkanInitializer.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Copies a device buffer into a ring of host-visible buffers without waiting for the copies. Every slot has a
+	// command buffer recorded once and a fence; submit() queues the copy of the slot after the newest one, and
+	// poll() hands back the copies that finished, oldest first, by checking their fences. Copies are submitted to
+	// the queue that writes the source, the barriers around them order them against the dispatches before and
+	// after.
+	class ReadbackRing
+	{
+	public:
+		ReadbackRing(VulkanBase& base, VkQueue queue, uint32_t queueFamily, VkBuffer source, VkDeviceSize bytes,
+			uint32_t depth)
+			: base(base), device(base.device), queue(queue), bytes(bytes), slots(std::max(depth, 1u))
+		{
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = queueFamily;
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS)
+			{
+				throw std::runtime_error("failed to create readback command pool!");
+			}
+
+			for (Slot& slot : slots)
+			{
+				base.createBuffer(bytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, slot.buffer,
+					slot.memory, dhh::memory::Tag::Staging);
+				vmaMapMemory(base.allocator, slot.memory, &slot.mapped);
+
+				VkFenceCreateInfo fenceInfo = dhh::vk::initializer::fenceCreateInfo();
+				vkCreateFence(device, &fenceInfo, nullptr, &slot.fence);
+
+				VkCommandBufferAllocateInfo info =
+					dhh::vk::initializer::commandBufferAllocateInfo(pool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+				vkAllocateCommandBuffers(device, &info, &slot.commands);
+				record(slot, source);
+			}
+		}
+
+		~ReadbackRing()
+		{
+			for (Slot& slot : slots)
+			{
+				if (slot.inFlight)
+				{
+					vkWaitForFences(device, 1, &slot.fence, true, UINT64_MAX);
+				}
+				vmaUnmapMemory(base.allocator, slot.memory);
+				base.destroyBuffer(slot.buffer, slot.memory);
+				vkDestroyFence(device, slot.fence, nullptr);
+			}
+			vkDestroyCommandPool(device, pool, nullptr);
+		}
+
+		ReadbackRing(const ReadbackRing&) = delete;
+		ReadbackRing& operator=(const ReadbackRing&) = delete;
+
+		// Queues a copy of the source as it is after the work submitted so far, tagged with step and time. When
+		// every slot is in flight the oldest copy is waited for and handed to fn first; returns whether it had to.
+		template <typename F>
+		bool submit(uint64_t step, double time, F&& fn)
+		{
+			bool waited = false;
+			if (head - tail == slots.size())
+			{
+				Slot& oldest = slots[tail % slots.size()];
+				vkWaitForFences(device, 1, &oldest.fence, true, UINT64_MAX);
+				retire(fn);
+				waited = true;
+			}
+
+			Slot& slot = slots[head % slots.size()];
+			slot.step = step;
+			slot.time = time;
+			VkSubmitInfo submitInfo = {};
+			submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			submitInfo.commandBufferCount = 1;
+			submitInfo.pCommandBuffers = &slot.commands;
+			{
+				auto lock = base.lockQueue(queue);
+				vkQueueSubmit(queue, 1, &submitInfo, slot.fence);
+			}
+			slot.inFlight = true;
+			++head;
+			return waited;
+		}
+
+		// Calls fn(const void* data, step, time) for every copy that finished, oldest first, without waiting.
+		// Returns how many there were.
+		template <typename F>
+		uint32_t poll(F&& fn)
+		{
+			uint32_t retired = 0;
+			while (tail < head && vkGetFenceStatus(device, slots[tail % slots.size()].fence) == VK_SUCCESS)
+			{
+				retire(fn);
+				++retired;
+			}
+			return retired;
+		}
+
+		// Waits for every copy in flight and hands them to fn, e.g. before the simulation stops
+		template <typename F>
+		void drain(F&& fn)
+		{
+			while (tail < head)
+			{
+				vkWaitForFences(device, 1, &slots[tail % slots.size()].fence, true, UINT64_MAX);
+				retire(fn);
+			}
+		}
+
+		uint32_t inFlight() const
+		{
+			return static_cast<uint32_t>(head - tail);
+		}
+
+	private:
+		struct Slot
+		{
+			VkBuffer buffer;
+			VmaAllocation memory;
+			void* mapped;
+			VkCommandBuffer commands;
+			VkFence fence;
+			bool inFlight = false;
+			uint64_t step = 0;
+			double time = 0;
+		};
+
+		void record(Slot& slot, VkBuffer source)
+		{
+			VkCommandBufferBeginInfo beginInfo = dhh::vk::initializer::commandBufferBeginInfo();
+			vkBeginCommandBuffer(slot.commands, &beginInfo);
+
+			// the dispatches submitted before finished writing the source
+			VkBufferMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.buffer = source;
+			barrier.size = VK_WHOLE_SIZE;
+			barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+			vkCmdPipelineBarrier(slot.commands, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+			VkBufferCopy region = {0, 0, bytes};
+			vkCmdCopyBuffer(slot.commands, source, slot.buffer, 1, &region);
+
+			// the dispatches submitted after do not overwrite the source before it is copied, and the copy is
+			// visible to the host once the fence signals
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(slot.commands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+				0, 0, nullptr, 1, &barrier, 0, nullptr);
+			barrier.buffer = slot.buffer;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+			vkCmdPipelineBarrier(slot.commands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0,
+				nullptr, 1, &barrier, 0, nullptr);
+
+			vkEndCommandBuffer(slot.commands);
+		}
+
+		template <typename F>
+		void retire(F& fn)
+		{
+			Slot& slot = slots[tail % slots.size()];
+			vmaInvalidateAllocation(base.allocator, slot.memory, 0, bytes);
+			fn(static_cast<const void*>(slot.mapped), slot.step, slot.time);
+			vkResetFences(device, 1, &slot.fence);
+			slot.inFlight = false;
+			++tail;
+		}
+
+		VulkanBase& base;
+		VkDevice device;
+		VkQueue queue;
+		VkDeviceSize bytes;
+		VkCommandPool pool;
+		std::vector<Slot> slots;
+		uint64_t head = 0;  // copies submitted
+		uint64_t tail = 0;  // copies handed back
+	};
+}
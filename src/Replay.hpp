@@ -0,0 +1,316 @@
+#pragma once
+
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "SnapshotWriter.hpp"
+#include "ThreadPool.hpp"
+#include "Trajectory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// A recorded run, either a raw snapshot stream (SnapshotWriter.hpp) or a compressed trajectory
+	// (Trajectory.hpp), told apart by the magic. Frame lookups may be called from any thread, reads and prefetch
+	// hints only from one.
+	class RecordedRun
+	{
+	public:
+		explicit RecordedRun(const std::filesystem::path& path)
+		{
+			char magic[8] = {};
+			std::ifstream(path, std::ios::binary).read(magic, sizeof(magic));
+			if (std::memcmp(magic, SnapshotHeader::Magic, sizeof(magic)) == 0)
+			{
+				snapshots = std::make_unique<SnapshotReader>(path);
+			}
+			else if (std::memcmp(magic, TrajectoryHeader::Magic, sizeof(magic)) == 0)
+			{
+				trajectory = std::make_unique<TrajectoryReader>(path);
+			}
+			else
+			{
+				throw std::runtime_error(path.string() + " is neither a snapshot stream nor a trajectory");
+			}
+			if (frameCount() == 0)
+			{
+				throw std::runtime_error(path.string() + " has no complete frame");
+			}
+		}
+
+		size_t bodyCount() const
+		{
+			return snapshots ? snapshots->header().bodyCount : trajectory->header().bodyCount;
+		}
+
+		size_t frameCount() const
+		{
+			return snapshots ? snapshots->frameCount() : trajectory->frameCount();
+		}
+
+		double frameTime(size_t frame) const
+		{
+			return snapshots ? snapshots->frame(frame).time : trajectory->frame(frame).time;
+		}
+
+		uint64_t frameStep(size_t frame) const
+		{
+			return snapshots ? snapshots->frame(frame).step : trajectory->frame(frame).step;
+		}
+
+		// last frame at or before time, the first one before it
+		size_t frameAt(double time) const
+		{
+			return snapshots ? snapshots->frameAt(time) : trajectory->frameAt(time);
+		}
+
+		bool compressed() const
+		{
+			return trajectory != nullptr;
+		}
+
+		void prefetch(size_t frame) const
+		{
+			if (snapshots)
+			{
+				snapshots->prefetch(frame);
+			}
+			else
+			{
+				trajectory->prefetch(frame);
+			}
+		}
+
+		void read(size_t frame, Body* destination, dhh::thread::ThreadPool& pool)
+		{
+			if (snapshots)
+			{
+				snapshots->read(frame, destination, pool);
+			}
+			else
+			{
+				trajectory->read(frame, destination, pool);
+			}
+		}
+
+	private:
+		std::unique_ptr<SnapshotReader> snapshots;
+		std::unique_ptr<TrajectoryReader> trajectory;
+	};
+
+	// Reads the frames after the one being shown on a thread of its own, into a ring of depth frames allocated
+	// up front. acquire() moves the window to the frame asked for; frames before it are recycled, so skipping
+	// ahead at high playback speed or seeking does not read the frames in between. The OS is asked to page in
+	// the frame after the window while the window is decoded, so disk reads overlap decoding.
+	class ReplayPrefetcher
+	{
+	public:
+		struct Frame
+		{
+			size_t index = std::numeric_limits<size_t>::max();
+			uint64_t step = 0;
+			double time = 0;
+			dhh::memory::AlignedArray<Body> bodies;
+			bool ready = false;
+		};
+
+		struct Stats
+		{
+			uint64_t frames = 0;       // read or decoded
+			uint64_t waits = 0;        // acquire() calls that found their frame not ready
+			double waitSeconds = 0;
+		};
+
+		ReplayPrefetcher(RecordedRun& run, uint32_t depth, uint32_t threads)
+			: run(run), depth(std::max(depth, 1u)), pool(std::max(threads, 1u)), frames(this->depth + 1)
+		{
+			for (Frame& frame : frames)
+			{
+				frame.bodies.allocate(run.bodyCount(), run.bodyCount() * sizeof(Body) >= 1 << 21, &pool);
+			}
+			reader = std::thread([this] { prefetchLoop(); });
+		}
+
+		~ReplayPrefetcher()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			changed.notify_all();
+			if (reader.joinable())
+			{
+				reader.join();
+			}
+		}
+
+		ReplayPrefetcher(const ReplayPrefetcher&) = delete;
+		ReplayPrefetcher& operator=(const ReplayPrefetcher&) = delete;
+
+		// The frame with this index, waiting until it is read. It stays valid until the next call. Rethrows when
+		// the prefetcher failed to read a frame.
+		const Frame& acquire(size_t index)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			target = std::min(index, run.frameCount() - 1);
+			held = nullptr;
+			changed.notify_all();
+			const auto found = [this] {
+				return std::find_if(frames.begin(), frames.end(), [this](const Frame& frame) {
+					return frame.index == target && frame.ready;
+				});
+			};
+			if (found() == frames.end() && !failure)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				ready.wait(lock, [&] { return found() != frames.end() || failure; });
+				++stats.waits;
+				stats.waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+			if (failure)
+			{
+				std::rethrow_exception(failure);
+			}
+			held = &*found();
+			return *held;
+		}
+
+		Stats statistics() const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return stats;
+		}
+
+	private:
+		void prefetchLoop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stopping)
+			{
+				const size_t end = std::min(target + depth, run.frameCount());
+				size_t next = target;
+				while (next < end && std::any_of(frames.begin(), frames.end(), [next](const Frame& frame) {
+					return frame.index == next;
+				}))
+				{
+					++next;
+				}
+				const auto free = std::find_if(frames.begin(), frames.end(), [&](const Frame& frame) {
+					return &frame != held && (frame.index < target || frame.index >= end);
+				});
+				if (next == end || free == frames.end())
+				{
+					changed.wait(lock);
+					continue;
+				}
+
+				Frame& frame = *free;
+				frame.index = next;
+				frame.ready = false;
+				lock.unlock();
+				try
+				{
+					run.prefetch(end);
+					run.read(next, frame.bodies.data(), pool);
+					frame.step = run.frameStep(next);
+					frame.time = run.frameTime(next);
+				}
+				catch (...)
+				{
+					// e.g. a corrupt chunk; the consumer gets the error instead of waiting for the frame forever
+					lock.lock();
+					failure = std::current_exception();
+					ready.notify_all();
+					return;
+				}
+				lock.lock();
+				frame.ready = true;
+				++stats.frames;
+				ready.notify_all();
+			}
+		}
+
+		RecordedRun& run;
+		uint32_t depth;
+		dhh::thread::ThreadPool pool;
+		std::vector<Frame> frames;
+		std::thread reader;
+
+		mutable std::mutex mutex;
+		std::condition_variable changed;  // the consumer moved the window, or the prefetcher is stopping
+		std::condition_variable ready;    // a frame was read
+		size_t target = 0;                // frame the consumer asked for last
+		const Frame* held = nullptr;      // handed out by the last acquire()
+		bool stopping = false;
+		std::exception_ptr failure;       // of the read that stopped the prefetcher
+		Stats stats;
+	};
+
+	// Replay time, advanced by the player and steered from the input thread
+	class PlaybackClock
+	{
+	public:
+		PlaybackClock(double begin, double end, double start, double speed)
+			: begin(begin), end(end), time(std::clamp(start, begin, end)), speed(speed)
+		{
+		}
+
+		// advances by speed * seconds unless paused, stops at the end of the run
+		double advance(double seconds)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!paused)
+			{
+				time = std::clamp(time + speed * seconds, begin, end);
+			}
+			return time;
+		}
+
+		void seek(double offset)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			time = std::clamp(time + offset, begin, end);
+		}
+
+		void scaleSpeed(double factor)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			speed *= factor;
+		}
+
+		void togglePause()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			paused = !paused;
+		}
+
+		std::string describe() const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return "t = " + std::to_string(time) + " s of " + std::to_string(end) + " s, speed "
+				+ std::to_string(speed) + " simulated s/s" + (paused ? ", paused" : "");
+		}
+
+	private:
+		mutable std::mutex mutex;
+		double begin;
+		double end;
+		double time;
+		double speed;
+		bool paused = false;
+	};
+}
@@ -1,13 +1,29 @@
 #pragma once
 
+// Shaders are compiled to SPIR-V at build time and embedded with their reflection data (EmbeddedShaders.hpp).
+// NBODY_RUNTIME_SHADERS adds the developer path that compiles GLSL with shaderc at runtime for hot reload,
+// NBODY_SHADER_REFLECTION only the SPIRV-Cross reflection used by the build step.
+#if defined(NBODY_RUNTIME_SHADERS) && !defined(NBODY_SHADER_REFLECTION)
+#define NBODY_SHADER_REFLECTION
+#endif
+
+#include <EmbeddedShaders.hpp>
 #include <Filesystem.hpp>
+#include <ShaderCache.hpp>
+#ifdef NBODY_RUNTIME_SHADERS
 #include <shaderc/shaderc.hpp>
+#endif
+#ifdef NBODY_SHADER_REFLECTION
 #include <spirv_cross/spirv_reflect.hpp>
+#endif
 #include <vulkan/vulkan.h>
 
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <map>
 #include <optional>
+#include <string>
 
 namespace dhh::shader
 {
@@ -39,6 +55,7 @@ namespace dhh::shader
         return Table[Type];
     }
 
+#ifdef NBODY_SHADER_REFLECTION
     inline VkFormat getVulkanFormat(const spirv_cross::SPIRType& type)
     {
         VkFormat float_types[] = {
@@ -60,7 +77,9 @@ namespace dhh::shader
             throw std::runtime_error("Cannot find VK_Format");
         }
     }
+#endif
 
+#ifdef NBODY_RUNTIME_SHADERS
     inline std::filesystem::path findShaderDirectory()
     {
 #ifdef SHADER_DIR
@@ -90,18 +109,59 @@ namespace dhh::shader
             }
         }
     }
-
+#endif
 
     class Shader
     {
     public:
-        Shader(std::filesystem::path glslPath) : glslPath(glslPath), stageInputSize(0)
+        // SPIR-V compiled at build time, with the reflection results generated alongside it
+        explicit Shader(const EmbeddedShader& embedded) : glslPath(embedded.name), optimize(true), stageInputSize(0)
+        {
+            type = getShaderType(glslPath);
+            if (!deserialize(std::vector<char>(embedded.data, embedded.data + embedded.size)))
+            {
+                throw std::runtime_error(std::string("Corrupt embedded shader ") + embedded.name);
+            }
+            ShaderCache::instance().recordEmbedded();
+        }
+
+#ifdef NBODY_SHADER_REFLECTION
+        // Reflects SPIR-V compiled elsewhere, the build step uses it to generate the embedded shaders
+        Shader(const std::filesystem::path& name, std::vector<uint32_t> spirv)
+            : glslPath(name), optimize(true), spirv(std::move(spirv)), stageInputSize(0)
+        {
+            type = getShaderType(glslPath);
+            reflect();
+        }
+#endif
+
+#ifdef NBODY_RUNTIME_SHADERS
+        // The SPIR-V and reflection results are taken from the shader cache when the source, defines and compile
+        // options are unchanged since the last run
+        Shader(std::filesystem::path glslPath, const std::map<std::string, std::string>& defines = {},
+            bool optimize = false)
+            : glslPath(glslPath), defines(defines), optimize(optimize), stageInputSize(0)
         {
             glslText = dhh::filesystem::loadFile(glslPath, false);
             type     = getShaderType(glslPath);
-            spirv    = compile();
+
+            ShaderCache& cache          = ShaderCache::instance();
+            const std::string cacheName = glslPath.filename().string() + "-" + toHex(cacheKey()) + ".shader";
+            std::vector<char> cached;
+            if (cache.load(cacheName, cached) && deserialize(cached))
+            {
+                cache.recordHit();
+                return;
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            spirv            = compile(optimize);
             reflect();
+            cache.recordCompile(
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            cache.store(cacheName, serialize());
         }
+#endif
 
         std::vector<VkVertexInputBindingDescription> getVertexInputBindingDescription() const
         {
@@ -136,6 +196,22 @@ namespace dhh::shader
             return info;
         }
 
+        // SPIR-V and reflection results in the format of the shader cache and the embedded shaders
+        std::vector<char> serialize() const
+        {
+            std::vector<char> data;
+            const uint64_t counts[] = {spirv.size(), descriptorInfos.size(), vertexInputAttributeDescriptions.size(),
+                stageInputSize, pushConstantSize};
+            write(data, counts, 5);
+            write(data, spirv.data(), spirv.size());
+            for (const auto& info : descriptorInfos)
+            {
+                write(data, &info.second, 1);
+            }
+            write(data, vertexInputAttributeDescriptions.data(), vertexInputAttributeDescriptions.size());
+            return data;
+        }
+
         VkShaderModule createVulkanShaderModule(VkDevice device)
         {
             VkShaderModuleCreateInfo createInfo = {};
@@ -155,14 +231,89 @@ namespace dhh::shader
     public:
         ShaderType type;
         std::map<uint32_t, DescriptorInfo> descriptorInfos;  // multimap<Descriptor binding, DescriptorInfo>
+        uint32_t pushConstantSize = 0;
         std::filesystem::path glslPath;
 
     private:
+        // bump when the layout of serialize() changes
+        static constexpr uint32_t CacheFormatVersion = 1;
+
+        std::map<std::string, std::string> defines;
+        bool optimize;
         std::vector<char> glslText;
         std::vector<uint32_t> spirv;
         std::vector<VkVertexInputAttributeDescription> vertexInputAttributeDescriptions;
         size_t stageInputSize;
 
+#ifdef NBODY_RUNTIME_SHADERS
+        // everything that affects the compiled SPIR-V
+        uint64_t cacheKey() const
+        {
+            uint32_t spvVersion, spvRevision;
+            shaderc_get_spv_version(&spvVersion, &spvRevision);
+            const uint32_t header[] = {CacheFormatVersion, spvVersion, spvRevision, static_cast<uint32_t>(type),
+                optimize ? 1u : 0u};
+
+            uint64_t key = hashBytes(header, sizeof(header));
+            key          = hashBytes(glslText.data(), glslText.size(), key);
+            for (const auto& define : defines)
+            {
+                key = hashString(define.first, key);
+                key = hashString(define.second, key);
+            }
+            return key;
+        }
+#endif
+
+        template <typename T>
+        static void write(std::vector<char>& data, const T* values, size_t count)
+        {
+            const char* bytes = reinterpret_cast<const char*>(values);
+            data.insert(data.end(), bytes, bytes + sizeof(T) * count);
+        }
+
+        template <typename T>
+        static bool read(const std::vector<char>& data, size_t& offset, T* values, size_t count)
+        {
+            if (offset + sizeof(T) * count > data.size())
+            {
+                return false;
+            }
+            memcpy(values, data.data() + offset, sizeof(T) * count);
+            offset += sizeof(T) * count;
+            return true;
+        }
+
+        bool deserialize(const std::vector<char>& data)
+        {
+            size_t offset = 0;
+            uint64_t counts[5];
+            if (!read(data, offset, counts, 5))
+            {
+                return false;
+            }
+            std::vector<uint32_t> cachedSpirv(counts[0]);
+            std::vector<DescriptorInfo> cachedInfos(counts[1]);
+            std::vector<VkVertexInputAttributeDescription> cachedAttributes(counts[2]);
+            if (!read(data, offset, cachedSpirv.data(), cachedSpirv.size()) ||
+                !read(data, offset, cachedInfos.data(), cachedInfos.size()) ||
+                !read(data, offset, cachedAttributes.data(), cachedAttributes.size()) || offset != data.size())
+            {
+                return false;
+            }
+
+            spirv = std::move(cachedSpirv);
+            for (const auto& info : cachedInfos)
+            {
+                descriptorInfos.insert({info.binding, info});
+            }
+            vertexInputAttributeDescriptions = std::move(cachedAttributes);
+            stageInputSize                   = counts[3];
+            pushConstantSize                 = static_cast<uint32_t>(counts[4]);
+            return true;
+        }
+
+#ifdef NBODY_RUNTIME_SHADERS
         std::vector<uint32_t> compile(bool optimize = false)
         {
             shaderc::Compiler compiler;
@@ -171,15 +322,21 @@ namespace dhh::shader
             {
                 options.SetOptimizationLevel(shaderc_optimization_level_performance);
             }
-            shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(
-                glslText.data(), getShadercShaderType(type), glslPath.filename().string().c_str(), options);
+            for (const auto& define : defines)
+            {
+                options.AddMacroDefinition(define.first, define.second);
+            }
+            shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(glslText.data(), glslText.size(),
+                getShadercShaderType(type), glslPath.filename().string().c_str(), options);
             if (module.GetCompilationStatus() != shaderc_compilation_status_success)
             {
                 throw std::runtime_error(module.GetErrorMessage().c_str());
             }
             return {module.cbegin(), module.cend()};
         }
+#endif
 
+#ifdef NBODY_SHADER_REFLECTION
         void reflect()
         {
             spirv_cross::CompilerReflection compiler(spirv);
@@ -226,6 +383,13 @@ namespace dhh::shader
                 info.vkDescriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
                 descriptorInfos.insert({info.binding, info});
             }
+
+            // push constant block size, a shader has at most one push constant block
+            for (const spirv_cross::Resource& resource : shaderResources.push_constant_buffers)
+            {
+                const spirv_cross::SPIRType& blockType = compiler.get_type(resource.base_type_id);
+                pushConstantSize = static_cast<uint32_t>(compiler.get_declared_struct_size(blockType));
+            }
         }
 
         DescriptorInfo reflect_descriptor(
@@ -240,6 +404,7 @@ namespace dhh::shader
             info.stages         = getVulkanShaderType(type);
             return info;
         }
+#endif
 
         static ShaderType getShaderType(const std::filesystem::path& FilePath)
         {
@@ -257,6 +422,7 @@ namespace dhh::shader
             return table[extension];
         }
 
+#ifdef NBODY_RUNTIME_SHADERS
         static shaderc_shader_kind getShadercShaderType(ShaderType Type)
         {
             shaderc_shader_kind Table[] = {
@@ -267,5 +433,31 @@ namespace dhh::shader
             };
             return Table[Type];
         }
+#endif
     };
+
+    // Directory the GLSL sources are compiled from at runtime, empty uses the embedded SPIR-V
+    inline std::filesystem::path& runtimeSourceDirectory()
+    {
+        static std::filesystem::path directory;
+        return directory;
+    }
+
+    // Shader by file name, e.g. "nbody.comp"
+    inline Shader loadShader(const std::string& name)
+    {
+#ifdef NBODY_RUNTIME_SHADERS
+        if (!runtimeSourceDirectory().empty())
+        {
+            // optimized like the glslc -O build step
+            return Shader(runtimeSourceDirectory() / name, {}, true);
+        }
+#endif
+        const EmbeddedShader* embedded = findEmbeddedShader(name);
+        if (embedded == nullptr)
+        {
+            throw std::runtime_error("No embedded shader " + name);
+        }
+        return Shader(*embedded);
+    }
 }
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dhh::shader
+{
+    // 64-bit FNV-1a, chain calls through seed to hash several pieces
+    inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            seed = (seed ^ bytes[i]) * 1099511628211ull;
+        }
+        return seed;
+    }
+
+    inline uint64_t hashString(const std::string& text, uint64_t seed)
+    {
+        // the terminator separates consecutive strings
+        return hashBytes(text.c_str(), text.size() + 1, seed);
+    }
+
+    inline std::string toHex(uint64_t value)
+    {
+        std::ostringstream stream;
+        stream << std::hex << std::setw(16) << std::setfill('0') << value;
+        return stream.str();
+    }
+
+    // Directory of artifacts that are expensive to recreate at startup: SPIR-V compiled at runtime with its
+    // reflection data, and the serialized VkPipelineCache. Entries are immutable blobs named by the caller, usually
+    // after a hash of everything that went into them, so a stale entry is never looked up again. An empty directory
+    // disables the cache.
+    class ShaderCache
+    {
+    public:
+        static ShaderCache& instance()
+        {
+            static ShaderCache cache;
+            return cache;
+        }
+
+        void setDirectory(const std::filesystem::path& path)
+        {
+            cacheDirectory = path;
+            if (!cacheDirectory.empty())
+            {
+                std::error_code error;
+                std::filesystem::create_directories(cacheDirectory, error);
+                if (error)
+                {
+                    std::cerr << "Shader cache disabled, cannot create " << cacheDirectory << ": " << error.message()
+                              << "\n";
+                    cacheDirectory.clear();
+                }
+            }
+        }
+
+        const std::filesystem::path& directory() const
+        {
+            return cacheDirectory;
+        }
+
+        bool enabled() const
+        {
+            return !cacheDirectory.empty();
+        }
+
+        bool load(const std::string& name, std::vector<char>& data) const
+        {
+            if (!enabled())
+            {
+                return false;
+            }
+            std::ifstream file(cacheDirectory / name, std::ios::binary | std::ios::ate);
+            if (!file)
+            {
+                return false;
+            }
+            data.resize(static_cast<size_t>(file.tellg()));
+            file.seekg(0);
+            return static_cast<bool>(file.read(data.data(), data.size()));
+        }
+
+        // Written to a temporary file and renamed, so concurrent processes never see a partial entry
+        void store(const std::string& name, const std::vector<char>& data) const
+        {
+            if (!enabled())
+            {
+                return;
+            }
+            const std::filesystem::path path = cacheDirectory / name;
+            std::filesystem::path temporary  = path;
+            temporary += ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+            {
+                std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+                if (!file.write(data.data(), data.size()))
+                {
+                    return;
+                }
+            }
+            std::error_code error;
+            std::filesystem::rename(temporary, path, error);
+            if (error)
+            {
+                std::filesystem::remove(temporary, error);
+            }
+        }
+
+        // shader statistics for the startup report
+        void recordEmbedded()
+        {
+            ++embedded;
+        }
+
+        void recordHit()
+        {
+            ++hits;
+        }
+
+        void recordCompile(double seconds)
+        {
+            ++compiles;
+            compileMicroseconds += static_cast<uint64_t>(seconds * 1e6);
+        }
+
+        std::string summary() const
+        {
+            std::ostringstream stream;
+            stream << embedded << " shader(s) embedded, " << hits << " from cache, " << compiles << " compiled in "
+                   << std::fixed << std::setprecision(1) << compileMicroseconds / 1000.0 << " ms";
+            return stream.str();
+        }
+
+    private:
+        std::filesystem::path cacheDirectory;
+        std::atomic<uint32_t> embedded{0};
+        std::atomic<uint32_t> hits{0};
+        std::atomic<uint32_t> compiles{0};
+        std::atomic<uint64_t> compileMicroseconds{0};
+    };
+}
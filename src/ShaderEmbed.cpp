@@ -0,0 +1,75 @@
+// Build step: reflects the SPIR-V compiled by glslc and writes a C++ source embedding every shader with its
+// reflection data, so the application needs neither a GLSL compiler nor SPIRV-Cross at runtime.
+//
+// Usage: nbody-shader-embed <output.cpp> <shader.spv>...
+
+#define NBODY_SHADER_REFLECTION
+#include "Shader.hpp"
+
+#include <fstream>
+#include <iostream>
+
+static std::vector<uint32_t> loadSpirv(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open " + path.string());
+    }
+    const size_t size = static_cast<size_t>(file.tellg());
+    if (size % 4 != 0)
+    {
+        throw std::runtime_error(path.string() + " is not SPIR-V");
+    }
+    std::vector<uint32_t> words(size / 4);
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(words.data()), size);
+    return words;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: nbody-shader-embed <output.cpp> <shader.spv>...\n";
+        return 1;
+    }
+
+    try
+    {
+        std::ofstream output(argv[1]);
+        output << "// Generated by nbody-shader-embed, do not edit\n\n#include \"EmbeddedShaders.hpp\"\n\n"
+               << "namespace dhh::shader\n{\n";
+
+        std::vector<std::string> names;
+        for (int i = 2; i < argc; ++i)
+        {
+            // nbody.comp.spv is embedded as nbody.comp
+            const std::filesystem::path spirvPath = argv[i];
+            const std::string name                = spirvPath.stem().string();
+            const std::vector<char> data          = dhh::shader::Shader(name, loadSpirv(spirvPath)).serialize();
+
+            output << "    static const unsigned char shader" << names.size() << "[] = {";
+            for (size_t byte = 0; byte < data.size(); ++byte)
+            {
+                output << (byte % 24 == 0 ? "\n        " : " ")
+                       << static_cast<unsigned>(static_cast<unsigned char>(data[byte])) << ",";
+            }
+            output << "\n    };\n\n";
+            names.push_back(name);
+        }
+
+        output << "    const EmbeddedShader embeddedShaders[] = {\n";
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            output << "        {\"" << names[i] << "\", shader" << i << ", sizeof(shader" << i << ")},\n";
+        }
+        output << "    };\n\n    const size_t embeddedShaderCount = " << names.size() << ";\n}\n";
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
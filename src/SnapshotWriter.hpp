@@ -0,0 +1,392 @@
+#pragma once
+
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "Filesystem.hpp"
+#include "ThreadPool.hpp"
+#include "Trajectory.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Snapshot stream, little-endian:
+	//
+	//   SnapshotHeader                   64 bytes
+	//   frames                           frameBytes each
+	//
+	// A frame is a SnapshotFrameHeader followed by the bodies in the layout of the GPU buffers. Frames have a fixed
+	// size, so frame i is at headerBytes + i * frameBytes and a reader can seek without an index. A stream cut
+	// short by a crash loses at most the frame that was being written.
+
+	struct SnapshotHeader
+	{
+		static constexpr char Magic[8] = {'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P'};
+		static constexpr uint32_t CurrentVersion = 1;
+
+		char magic[8];
+		uint32_t version;
+		uint32_t headerBytes;
+		uint64_t bodyCount;
+		uint64_t frameBytes;
+		uint32_t bodyBytes;  // sizeof(Body)
+		uint32_t reserved0;
+		uint8_t reserved[24];
+	};
+
+	static_assert(sizeof(SnapshotHeader) == 64, "SnapshotHeader is part of the file format");
+
+	struct SnapshotFrameHeader
+	{
+		uint64_t step;  // integration steps since the initial state
+		double time;    // simulated time
+		uint64_t bodyCount;
+		uint64_t reserved;
+	};
+
+	static_assert(sizeof(SnapshotFrameHeader) == 32, "SnapshotFrameHeader is part of the file format");
+
+	inline uint64_t snapshotFrameBytes(uint64_t bodyCount)
+	{
+		return sizeof(SnapshotFrameHeader) + bodyCount * sizeof(Body);
+	}
+
+	// Writes snapshots to disk on a thread of its own. The producer fills the frame acquire() hands out and
+	// publishes it; the frames form a fixed ring of queueDepth slots allocated up front, so the steady state does
+	// not allocate. The producer only waits when every slot is still queued for writing, and each such wait is
+	// counted as a stall. With a TrajectoryConfig the frames are written as a compressed trajectory instead, coded
+	// on a pool of the writer's own so the simulation's workers stay free.
+	class SnapshotWriter
+	{
+	public:
+		struct Frame
+		{
+			SnapshotFrameHeader header;
+			dhh::memory::AlignedArray<Body> bodies;
+		};
+
+		struct Stats
+		{
+			uint64_t frames = 0;        // written to disk
+			uint64_t bytes = 0;         // including the stream header
+			uint64_t rawBytes = 0;      // the frames would take uncompressed
+			uint64_t stalls = 0;        // acquire() calls that had to wait for the writer
+			double stallSeconds = 0;    // time spent in those waits
+			uint32_t highWater = 0;     // most frames queued at once
+		};
+
+		SnapshotWriter(const std::filesystem::path& path, size_t bodyCount, uint32_t queueDepth,
+			const std::optional<TrajectoryConfig>& compression = std::nullopt)
+			: path(path), bodyCount(bodyCount), frames(std::max(queueDepth, 1u))
+		{
+			if (compression)
+			{
+				encodePool = std::make_unique<dhh::thread::ThreadPool>(
+					std::max(1u, std::thread::hardware_concurrency() / 2));
+				encoder = std::make_unique<TrajectoryEncoder>(bodyCount, *compression, *encodePool);
+			}
+			file.open(path, std::ios::binary | std::ios::trunc);
+			if (!file)
+			{
+				throw std::runtime_error("Cannot create snapshot stream " + path.string());
+			}
+			for (Frame& frame : frames)
+			{
+				frame.bodies.allocate(bodyCount, false);
+			}
+
+			// the trajectory encoder writes its own header with the first frame
+			if (!encoder)
+			{
+				SnapshotHeader header = {};
+				memcpy(header.magic, SnapshotHeader::Magic, sizeof(header.magic));
+				header.version = SnapshotHeader::CurrentVersion;
+				header.headerBytes = sizeof(SnapshotHeader);
+				header.bodyCount = bodyCount;
+				header.frameBytes = snapshotFrameBytes(bodyCount);
+				header.bodyBytes = sizeof(Body);
+				file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				stats.bytes = sizeof(header);
+			}
+
+			writer = std::thread([this] { writeLoop(); });
+		}
+
+		~SnapshotWriter()
+		{
+			stop();
+		}
+
+		SnapshotWriter(const SnapshotWriter&) = delete;
+		SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+		// Producer side: the next frame to fill, waits while the queue is full
+		Frame& acquire()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (head - tail == frames.size())
+			{
+				const auto start = std::chrono::steady_clock::now();
+				drained.wait(lock, [this] { return head - tail < frames.size() || failed; });
+				++stats.stalls;
+				stats.stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+			if (failed)
+			{
+				throw std::runtime_error("Cannot write snapshot stream " + path.string());
+			}
+			return frames[head % frames.size()];
+		}
+
+		// Producer side: queues the frame acquire() returned
+		void publish()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				++head;
+				stats.highWater = std::max(stats.highWater, static_cast<uint32_t>(head - tail));
+			}
+			queued.notify_one();
+		}
+
+		// Writes what is still queued and closes the file, throws when a write failed
+		void close()
+		{
+			stop();
+			if (failed)
+			{
+				throw std::runtime_error("Cannot write snapshot stream " + path.string());
+			}
+		}
+
+		Stats statistics() const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return stats;
+		}
+
+		const std::filesystem::path& filePath() const
+		{
+			return path;
+		}
+
+	private:
+		void writeLoop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				queued.wait(lock, [this] { return tail < head || stopping; });
+				if (tail == head)
+				{
+					break;
+				}
+				// the producer does not touch a queued frame, it is written outside the lock
+				Frame& frame = frames[tail % frames.size()];
+				lock.unlock();
+				const uint64_t bytes = write(frame);
+				const bool written = static_cast<bool>(file);
+				lock.lock();
+
+				++tail;
+				if (written)
+				{
+					++stats.frames;
+					stats.bytes += bytes;
+					stats.rawBytes += snapshotFrameBytes(bodyCount);
+				}
+				else
+				{
+					failed = true;
+				}
+				drained.notify_one();
+			}
+			if (encoder)
+			{
+				stats.bytes += encoder->finish(file);
+				failed = failed || !file;
+			}
+			file.close();
+		}
+
+		// returns the bytes written, the stream is left failed on error
+		uint64_t write(Frame& frame)
+		{
+			if (encoder)
+			{
+				try
+				{
+					return encoder->encode(frame.header.step, frame.header.time, frame.bodies.data(), file);
+				}
+				catch (const std::exception&)
+				{
+					file.setstate(std::ios::failbit);
+					return 0;
+				}
+			}
+			frame.header.bodyCount = bodyCount;
+			file.write(reinterpret_cast<const char*>(&frame.header), sizeof(frame.header));
+			file.write(reinterpret_cast<const char*>(frame.bodies.data()), bodyCount * sizeof(Body));
+			return snapshotFrameBytes(bodyCount);
+		}
+
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			queued.notify_one();
+			if (writer.joinable())
+			{
+				writer.join();
+			}
+		}
+
+		std::filesystem::path path;
+		size_t bodyCount;
+		std::ofstream file;
+		std::vector<Frame> frames;
+		std::unique_ptr<dhh::thread::ThreadPool> encodePool;
+		std::unique_ptr<TrajectoryEncoder> encoder;
+		std::thread writer;
+
+		mutable std::mutex mutex;
+		std::condition_variable queued;   // a frame was published, or the writer is stopping
+		std::condition_variable drained;  // a frame was written
+		uint64_t head = 0;                // frames published
+		uint64_t tail = 0;                // frames written
+		bool stopping = false;
+		bool failed = false;
+		Stats stats;
+	};
+
+	// Memory-mapped snapshot stream. Frames are read in place; a frame cut short at the end of the file is
+	// ignored, so a stream that is still being written can be opened.
+	class SnapshotReader
+	{
+	public:
+		explicit SnapshotReader(const std::filesystem::path& path) : path(path), file(path, false)
+		{
+			if (file.size() < sizeof(SnapshotHeader))
+			{
+				fail("too small for a header");
+			}
+			std::memcpy(&fileHeader, file.data(), sizeof(fileHeader));
+			if (std::memcmp(fileHeader.magic, SnapshotHeader::Magic, sizeof(fileHeader.magic)) != 0)
+			{
+				fail("not a snapshot stream");
+			}
+			if (fileHeader.version != SnapshotHeader::CurrentVersion)
+			{
+				fail("unsupported version " + std::to_string(fileHeader.version));
+			}
+			// a body count whose frame size wraps would pass the frameBytes check with a small frame
+			if (fileHeader.bodyBytes != sizeof(Body)
+				|| fileHeader.bodyCount > (SIZE_MAX - sizeof(SnapshotFrameHeader)) / sizeof(Body)
+				|| fileHeader.frameBytes != snapshotFrameBytes(fileHeader.bodyCount)
+				|| fileHeader.headerBytes < sizeof(SnapshotHeader) || fileHeader.headerBytes % alignof(Body) != 0
+				|| fileHeader.headerBytes > file.size())
+			{
+				fail("invalid header");
+			}
+			base = static_cast<const uint8_t*>(file.data());
+			frames = (file.size() - fileHeader.headerBytes) / fileHeader.frameBytes;
+		}
+
+		const SnapshotHeader& header() const
+		{
+			return fileHeader;
+		}
+
+		size_t frameCount() const
+		{
+			return frames;
+		}
+
+		SnapshotFrameHeader frame(size_t frame) const
+		{
+			SnapshotFrameHeader header;
+			std::memcpy(&header, base + offset(frame), sizeof(header));
+			return header;
+		}
+
+		// last frame at or before time, the first one before it
+		size_t frameAt(double time) const
+		{
+			size_t first = 0;
+			size_t count = frames;
+			while (count > 0)
+			{
+				const size_t half = count / 2;
+				if (frame(first + half).time <= time)
+				{
+					first += half + 1;
+					count -= half + 1;
+				}
+				else
+				{
+					count = half;
+				}
+			}
+			return first == 0 ? 0 : first - 1;
+		}
+
+		// the frame's bodies inside the mapping
+		const Body* bodies(size_t frame) const
+		{
+			if (frame >= frames)
+			{
+				fail("no frame " + std::to_string(frame));
+			}
+			return reinterpret_cast<const Body*>(base + offset(frame) + sizeof(SnapshotFrameHeader));
+		}
+
+		// asks the OS to start reading the frame
+		void prefetch(size_t frame) const
+		{
+			if (frame < frames)
+			{
+				file.prefetch(offset(frame), fileHeader.frameBytes);
+			}
+		}
+
+		void read(size_t frame, Body* destination, dhh::thread::ThreadPool& pool) const
+		{
+			const Body* source = bodies(frame);
+			pool.parallelFor(fileHeader.bodyCount, [source, destination](uint32_t, size_t begin, size_t end) {
+				std::memcpy(destination + begin, source + begin, (end - begin) * sizeof(Body));
+			});
+		}
+
+	private:
+		[[noreturn]] void fail(const std::string& reason) const
+		{
+			throw std::runtime_error("Snapshot stream " + path.string() + ": " + reason);
+		}
+
+		uint64_t offset(size_t frame) const
+		{
+			return fileHeader.headerBytes + frame * fileHeader.frameBytes;
+		}
+
+		std::filesystem::path path;
+		dhh::filesystem::MappedFile file;
+		SnapshotHeader fileHeader;
+		const uint8_t* base = nullptr;
+		size_t frames = 0;
+	};
+}
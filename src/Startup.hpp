@@ -0,0 +1,197 @@
+#pragma once
+
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace dhh::startup
+{
+	// Named intervals of the startup sequence, recorded from any thread and printed once the first step can run
+	class Timeline
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+
+		static Timeline& instance()
+		{
+			static Timeline timeline;
+			return timeline;
+		}
+
+		// Intervals are printed relative to the origin, normally the start of the process. The calling thread
+		// becomes thread 0.
+		void setOrigin(clock::time_point time)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			origin = time;
+			threadIndex(std::this_thread::get_id());
+		}
+
+		// phases also go to the trace when tracing
+		void record(const std::string& name, clock::time_point begin, clock::time_point end)
+		{
+			dhh::trace::Tracer& tracer = dhh::trace::Tracer::instance();
+			if (tracer.active())
+			{
+				tracer.record(tracer.intern(name), tracer.nanoseconds(begin), tracer.nanoseconds(end));
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			phases.push_back({name, begin, end, threadIndex(std::this_thread::get_id())});
+		}
+
+		template <typename F>
+		decltype(auto) time(const std::string& name, F&& fn)
+		{
+			struct Scope
+			{
+				Timeline& timeline;
+				const std::string& name;
+				clock::time_point begin = clock::now();
+				~Scope()
+				{
+					timeline.record(name, begin, clock::now());
+				}
+			} scope{*this, name};
+			return fn();
+		}
+
+		// one line per phase in start order, with the thread that ran it
+		void print(std::ostream& out) const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			std::vector<Phase> sorted = phases;
+			std::stable_sort(sorted.begin(), sorted.end(),
+				[](const Phase& a, const Phase& b) { return a.begin < b.begin; });
+			size_t width = 0;
+			for (const Phase& phase : sorted)
+			{
+				width = std::max(width, phase.name.size());
+			}
+
+			const auto milliseconds = [](clock::duration duration) {
+				return std::chrono::duration<double, std::milli>(duration).count();
+			};
+			const auto flags = out.flags();
+			out << std::fixed << std::setprecision(1);
+			for (const Phase& phase : sorted)
+			{
+				out << "  " << std::left << std::setw(width) << phase.name << std::right << std::setw(9)
+					<< milliseconds(phase.begin - origin) << " .. " << std::setw(7) << milliseconds(phase.end - origin)
+					<< " ms (" << milliseconds(phase.end - phase.begin) << " ms, thread " << phase.thread << ")\n";
+			}
+			out.flags(flags);
+		}
+
+	private:
+		// threads are numbered in the order they first record
+		uint32_t threadIndex(std::thread::id id)
+		{
+			auto found = std::find(threads.begin(), threads.end(), id);
+			if (found == threads.end())
+			{
+				found = threads.insert(threads.end(), id);
+			}
+			return static_cast<uint32_t>(found - threads.begin());
+		}
+
+		struct Phase
+		{
+			std::string name;
+			clock::time_point begin;
+			clock::time_point end;
+			uint32_t thread;
+		};
+
+		mutable std::mutex mutex;
+		clock::time_point origin = clock::now();
+		std::vector<std::thread::id> threads;
+		std::vector<Phase> phases;
+	};
+
+	// Runs independent startup work (shader loading, pipeline creation) on a few threads while the caller goes on
+	// with setup that needs it later. Every task is timed on the timeline, its result or exception is delivered
+	// through the returned future. Unlike ThreadPool, tasks are heterogeneous and submitted one by one.
+	class TaskGroup
+	{
+	public:
+		explicit TaskGroup(uint32_t threadCount = std::clamp(std::thread::hardware_concurrency(), 1u, 8u))
+		{
+			for (uint32_t i = 0; i < threadCount; ++i)
+			{
+				threads.emplace_back([this] { workerLoop(); });
+			}
+		}
+
+		// runs the tasks still queued before returning
+		~TaskGroup()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+		}
+
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+		// A task must not wait for a later task of the same group, which may be queued behind it
+		template <typename F>
+		std::future<std::invoke_result_t<F>> run(const std::string& name, F&& fn)
+		{
+			auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(fn));
+			std::future<std::invoke_result_t<F>> result = task->get_future();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queue.push_back([task, name] { Timeline::instance().time(name, [&] { (*task)(); }); });
+			}
+			wake.notify_one();
+			return result;
+		}
+
+	private:
+		void workerLoop()
+		{
+			dhh::trace::Tracer::instance().setThreadName("startup worker");
+			while (true)
+			{
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [this] { return stopping || !queue.empty(); });
+					if (queue.empty())
+					{
+						return;
+					}
+					task = std::move(queue.front());
+					queue.pop_front();
+				}
+				task();
+			}
+		}
+
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::deque<std::function<void()>> queue;
+		bool stopping = false;
+	};
+}
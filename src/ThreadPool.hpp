@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace dhh::thread
+{
+	// Fixed set of worker threads running one data-parallel loop at a time.
+	// Ranges are split statically by worker index, so for arrays of the same length a given worker always
+	// processes the same slice, which keeps first-touched pages local to that worker's NUMA node.
+	// Dispatching a loop does not allocate.
+	class ThreadPool
+	{
+	public:
+		explicit ThreadPool(uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency()))
+			: threadCount(std::max(1u, threadCount))
+		{
+			// the calling thread is worker 0
+			for (uint32_t worker = 1; worker < this->threadCount; ++worker)
+			{
+				threads.emplace_back([this, worker] { workerLoop(worker); });
+			}
+		}
+
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+				++generation;
+			}
+			wake.notify_all();
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		uint32_t size() const
+		{
+			return threadCount;
+		}
+
+		// Slice [begin, end) of count elements owned by the worker
+		static void slice(size_t count, uint32_t worker, uint32_t workers, size_t& begin, size_t& end)
+		{
+			begin = count * worker / workers;
+			end = count * (worker + 1) / workers;
+		}
+
+		// Calls fn(worker, begin, end) on every worker and returns when all of them are done
+		template <typename F>
+		void parallelFor(size_t count, F&& fn)
+		{
+			if (threadCount == 1 || count < threadCount)
+			{
+				fn(0u, size_t(0), count);
+				return;
+			}
+
+			struct Context
+			{
+				std::remove_reference_t<F>* fn;
+				size_t count;
+				uint32_t workers;
+			} context{&fn, count, threadCount};
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job = &context;
+				invoke = [](void* data, uint32_t worker) {
+					Context* context = static_cast<Context*>(data);
+					size_t begin, end;
+					slice(context->count, worker, context->workers, begin, end);
+					(*context->fn)(worker, begin, end);
+				};
+				pending = threadCount - 1;
+				++generation;
+			}
+			wake.notify_all();
+
+			invoke(job, 0);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this] { return pending == 0; });
+			job = nullptr;
+		}
+
+	private:
+		void workerLoop(uint32_t worker)
+		{
+			uint64_t seenGeneration = 0;
+			while (true)
+			{
+				void* currentJob;
+				void (*currentInvoke)(void*, uint32_t);
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&] { return generation != seenGeneration; });
+					seenGeneration = generation;
+					if (stopping)
+					{
+						return;
+					}
+					currentJob = job;
+					currentInvoke = invoke;
+				}
+
+				currentInvoke(currentJob, worker);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--pending == 0)
+				{
+					done.notify_one();
+				}
+			}
+		}
+
+		uint32_t threadCount;
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+		uint64_t generation = 0;
+		uint32_t pending = 0;
+		bool stopping = false;
+		void* job = nullptr;
+		void (*invoke)(void*, uint32_t) = nullptr;
+	};
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// NBODY_TRACE_SCOPE("name") traces the rest of the enclosing block when --trace is given. Builds without
+// NBODY_TRACING compile the scopes out entirely.
+#ifdef NBODY_TRACING
+#define NBODY_TRACE_CONCAT_(a, b) a##b
+#define NBODY_TRACE_CONCAT(a, b) NBODY_TRACE_CONCAT_(a, b)
+#define NBODY_TRACE_SCOPE(name) dhh::trace::Scope NBODY_TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define NBODY_TRACE_SCOPE(name) ((void)0)
+#endif
+
+namespace dhh::trace
+{
+	// Complete event, times in nanoseconds since the tracer started. Names must outlive the tracer, string
+	// literals or intern()ed strings.
+	struct Event
+	{
+		const char* name;
+		const char* track;  // timeline the event is shown on, null for the recording thread
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	// Ring of the last events of one thread. Only the owning thread writes, so recording takes no lock; the
+	// exporter reads the events published by count.
+	struct ThreadBuffer
+	{
+		ThreadBuffer(uint32_t id, size_t capacity) : id(id), events(capacity)
+		{
+		}
+
+		void push(const Event& event)
+		{
+			const uint64_t index = count.load(std::memory_order_relaxed);
+			events[index % events.size()] = event;
+			count.store(index + 1, std::memory_order_release);
+		}
+
+		uint32_t id;
+		std::string name;  // written and read under the tracer's lock
+		std::vector<Event> events;
+		std::atomic<uint64_t> count{0};
+	};
+
+	// Process-wide scoped tracer, written out as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+	// Every thread records into its own ring buffer, registered the first time the thread records. When a ring
+	// is full the oldest events are overwritten, so a long run keeps its last eventsPerThread events per thread.
+	class Tracer
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+
+		static Tracer& instance()
+		{
+			static Tracer tracer;
+			return tracer;
+		}
+
+		// event times are relative to origin, normally the start of the process
+		void start(clock::time_point origin, size_t eventsPerThread = 1 << 16)
+		{
+			this->origin = origin;
+			capacity = eventsPerThread;
+			enabled.store(true, std::memory_order_release);
+		}
+
+		bool active() const
+		{
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		uint64_t nanoseconds(clock::time_point time) const
+		{
+			return time < origin
+				? 0
+				: std::chrono::duration_cast<std::chrono::nanoseconds>(time - origin).count();
+		}
+
+		uint64_t now() const
+		{
+			return nanoseconds(clock::now());
+		}
+
+		void record(const char* name, uint64_t begin, uint64_t end, const char* track = nullptr)
+		{
+			if (active())
+			{
+				threadBuffer().push({name, track, begin, end});
+			}
+		}
+
+		// names the calling thread in the trace
+		void setThreadName(const std::string& name)
+		{
+			if (active())
+			{
+				ThreadBuffer& buffer = threadBuffer();
+				// the export reads the name under the lock, unlike the events it is not published atomically
+				std::lock_guard<std::mutex> lock(mutex);
+				buffer.name = name;
+			}
+		}
+
+		// Stable copy of a name built at runtime, for names that are not string literals. Takes a lock, keep it
+		// out of hot loops.
+		const char* intern(const std::string& name)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return names.insert(name).first->c_str();
+		}
+
+		// Call while the traced threads are idle, an event overwritten during the export may come out torn
+		bool writeChromeTrace(const std::filesystem::path& path) const
+		{
+			std::ofstream out(path, std::ios::trunc);
+			if (!out)
+			{
+				return false;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			out << std::fixed << std::setprecision(3);
+
+			// tracks other than threads (GPU queues) get ids after the threads
+			std::map<std::string, uint32_t> tracks;
+			const auto trackID = [&](const char* track) {
+				const auto found = tracks.find(track);
+				return found != tracks.end()
+					? found->second
+					: tracks[track] = static_cast<uint32_t>(buffers.size() + tracks.size()) + 1;
+			};
+
+			out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+			bool first = true;
+			const auto separator = [&]() -> std::ostream& {
+				out << (first ? "" : ",\n");
+				first = false;
+				return out;
+			};
+			for (const auto& buffer : buffers)
+			{
+				const uint64_t count = buffer->count.load(std::memory_order_acquire);
+				const uint64_t size = std::min<uint64_t>(count, buffer->events.size());
+				for (uint64_t i = count - size; i < count; ++i)
+				{
+					const Event& event = buffer->events[i % buffer->events.size()];
+					const uint32_t tid = event.track != nullptr ? trackID(event.track) : buffer->id;
+					separator() << "{\"name\":\"" << escape(event.name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+						<< tid << ",\"ts\":" << event.begin / 1000.0
+						<< ",\"dur\":" << (event.end - event.begin) / 1000.0 << "}";
+				}
+				const std::string name =
+					buffer->name.empty() ? "thread " + std::to_string(buffer->id) : buffer->name;
+				separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id
+					<< ",\"args\":{\"name\":\"" << escape(name.c_str()) << "\"}}";
+			}
+			for (const auto& track : tracks)
+			{
+				separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track.second
+					<< ",\"args\":{\"name\":\"" << escape(track.first.c_str()) << "\"}}";
+			}
+			out << "\n]}\n";
+			return static_cast<bool>(out);
+		}
+
+	private:
+		ThreadBuffer& threadBuffer()
+		{
+			thread_local ThreadBuffer* buffer = nullptr;
+			if (buffer == nullptr)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				// owned by the tracer, so the events of threads that already exited are still exported
+				const uint32_t id = static_cast<uint32_t>(buffers.size()) + 1;
+				buffers.push_back(std::make_unique<ThreadBuffer>(id, capacity));
+				buffer = buffers.back().get();
+			}
+			return *buffer;
+		}
+
+		static std::string escape(const char* text)
+		{
+			std::string escaped;
+			for (; *text != '\0'; ++text)
+			{
+				if (*text == '"' || *text == '\\')
+				{
+					escaped += '\\';
+				}
+				escaped += static_cast<unsigned char>(*text) < 0x20 ? ' ' : *text;
+			}
+			return escaped;
+		}
+
+		std::atomic<bool> enabled{false};
+		size_t capacity = 1 << 16;
+		clock::time_point origin = clock::now();
+		mutable std::mutex mutex;  // guards registration, thread names, interned names and export
+		std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+		std::set<std::string> names;
+	};
+
+	// Records the time between construction and destruction, see NBODY_TRACE_SCOPE
+	class Scope
+	{
+	public:
+		explicit Scope(const char* name)
+			: name(name), begin(Tracer::instance().active() ? Tracer::instance().now() : 0)
+		{
+		}
+
+		~Scope()
+		{
+			Tracer& tracer = Tracer::instance();
+			if (tracer.active())
+			{
+				tracer.record(name, begin, tracer.now());
+			}
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char* name;
+		uint64_t begin;
+	};
+
+	inline bool enabledAtBuild()
+	{
+#ifdef NBODY_TRACING
+		return true;
+#else
+		return false;
+#endif
+	}
+}
@@ -0,0 +1,805 @@
+#pragma once
+
+#include "Body.hpp"
+#include "Filesystem.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace dhh::nbody
+{
+	// Compressed trajectory, little-endian:
+	//
+	//   TrajectoryHeader                 128 bytes
+	//   masses                           bodyCount doubles, they do not change during a run
+	//   frames                           TrajectoryFrameHeader, uint32 size per chunk padded to 8 bytes, chunks
+	//   TrajectoryIndexEntry[frameCount] at indexOffset, appended when the stream is closed
+	//
+	// Positions and velocities are quantized to integer multiples of twice the error bound, so every value comes
+	// back within the bound (up to the rounding of the double it is reconstructed in). Bodies are split into
+	// chunks that are coded independently and in parallel. A keyframe stores each column of a chunk relative to
+	// the minimum over the chunk, the frames after it the change against the previous frame; both are Rice coded
+	// in blocks with their own parameter, so the code adapts to how far bodies move in different parts of the
+	// set. Decoding is exact in the integers, errors do not accumulate along the delta chain.
+
+	struct TrajectoryHeader
+	{
+		static constexpr char Magic[8] = {'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J'};
+		static constexpr uint32_t CurrentVersion = 1;
+		static constexpr uint32_t Columns = 6;  // position x, y, z, velocity x, y, z
+
+		char magic[8];
+		uint32_t version;
+		uint32_t headerBytes;
+		uint64_t bodyCount;
+		uint32_t chunkBodies;
+		uint32_t keyframeInterval;
+		double positionError;  // largest absolute error of a position component
+		double velocityError;  // and of a velocity component
+		uint64_t frameCount;   // 0 with indexOffset while the stream is open, readers then scan the frames
+		uint64_t indexOffset;
+		uint8_t reserved[64];
+	};
+
+	static_assert(sizeof(TrajectoryHeader) == 128, "TrajectoryHeader is part of the file format");
+
+	struct TrajectoryFrameHeader
+	{
+		uint64_t step;          // integration steps since the initial state
+		double time;            // simulated time
+		uint32_t keyframe;      // 1 when the chunks do not depend on the previous frame
+		uint32_t chunkCount;
+		uint64_t payloadBytes;  // chunk size table and chunks
+	};
+
+	static_assert(sizeof(TrajectoryFrameHeader) == 32, "TrajectoryFrameHeader is part of the file format");
+
+	struct TrajectoryIndexEntry
+	{
+		uint64_t offset;  // of the frame header
+		uint64_t step;
+		double time;
+		uint64_t keyframe;
+	};
+
+	struct TrajectoryConfig
+	{
+		double positionError = 0;
+		double velocityError = 0;
+		uint32_t chunkBodies = 1 << 12;
+		uint32_t keyframeInterval = 64;  // frames from one keyframe to the next, bounds the cost of a seek
+	};
+
+	namespace trajectory
+	{
+		constexpr uint32_t RiceBlock = 128;        // values sharing one Rice parameter
+		constexpr uint32_t RiceParameterBits = 6;
+		constexpr uint32_t EscapeQuotient = 32;    // larger quotients store the value verbatim
+		constexpr double QuantizedLimit = 4.0e18;  // |value / quantum| beyond this does not fit the integers
+
+		inline double component(const Body& body, uint32_t column)
+		{
+			switch (column)
+			{
+			case 0: return body.position.x;
+			case 1: return body.position.y;
+			case 2: return body.position.z;
+			case 3: return body.velocity.x;
+			case 4: return body.velocity.y;
+			default: return body.velocity.z;
+			}
+		}
+
+		// quantization step of a column, rounding to the nearest multiple stays within half of it
+		inline double quantum(const TrajectoryHeader& header, uint32_t column)
+		{
+			return 2 * (column < 3 ? header.positionError : header.velocityError);
+		}
+
+		inline uint64_t zigzag(int64_t value)
+		{
+			return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+		}
+
+		inline int64_t unzigzag(uint64_t value)
+		{
+			return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+		}
+
+		inline uint32_t bitWidth(uint64_t value)
+		{
+			uint32_t width = 0;
+			while (value != 0)
+			{
+				value >>= 1;
+				++width;
+			}
+			return width;
+		}
+
+		// trailing one bits of value
+		inline uint32_t trailingOnes(uint64_t value)
+		{
+			if (value == ~uint64_t(0))
+			{
+				return 64;
+			}
+#ifdef _WIN32
+			unsigned long index;
+			_BitScanForward64(&index, ~value);
+			return static_cast<uint32_t>(index);
+#else
+			return static_cast<uint32_t>(__builtin_ctzll(~value));
+#endif
+		}
+
+		// LSB-first bit stream into a byte vector that keeps its capacity from frame to frame
+		class BitWriter
+		{
+		public:
+			explicit BitWriter(std::vector<uint8_t>& bytes) : bytes(bytes)
+			{
+				bytes.clear();
+			}
+
+			void write(uint64_t value, uint32_t bits)
+			{
+				if (bits > 32)
+				{
+					write(value & 0xffffffffu, 32);
+					write(value >> 32, bits - 32);
+					return;
+				}
+				accumulator |= value << used;
+				used += bits;
+				if (used >= 32)
+				{
+					const size_t size = bytes.size();
+					bytes.resize(size + 4);
+					const uint32_t word = static_cast<uint32_t>(accumulator);
+					std::memcpy(bytes.data() + size, &word, sizeof(word));
+					accumulator >>= 32;
+					used -= 32;
+				}
+			}
+
+			// count one bits
+			void ones(uint32_t count)
+			{
+				for (; count >= 32; count -= 32)
+				{
+					write(0xffffffffu, 32);
+				}
+				write((uint64_t(1) << count) - 1, count);
+			}
+
+			// flushes the last bits and pads the stream to 8 bytes
+			void finish()
+			{
+				for (; used > 0; used = used > 8 ? used - 8 : 0)
+				{
+					bytes.push_back(static_cast<uint8_t>(accumulator));
+					accumulator >>= 8;
+				}
+				while (bytes.size() % 8 != 0)
+				{
+					bytes.push_back(0);
+				}
+			}
+
+		private:
+			std::vector<uint8_t>& bytes;
+			uint64_t accumulator = 0;
+			uint32_t used = 0;
+		};
+
+		// Reads what BitWriter wrote; reading past the end yields zeros and sets overrun()
+		class BitReader
+		{
+		public:
+			BitReader(const uint8_t* data, size_t size) : data(data), size(size)
+			{
+			}
+
+			uint64_t read(uint32_t bits)
+			{
+				if (bits > 32)
+				{
+					const uint64_t low = read(32);
+					return low | (read(bits - 32) << 32);
+				}
+				if (available < bits)
+				{
+					refill();
+				}
+				const uint64_t value = accumulator & ((uint64_t(1) << bits) - 1);
+				accumulator >>= bits;
+				available -= bits;
+				return value;
+			}
+
+			// One bits before the next zero bit, which is consumed too; at most limit (< 57) of them, then the zero
+			// is not consumed
+			uint32_t unary(uint32_t limit)
+			{
+				if (available < limit + 1)
+				{
+					refill();
+				}
+				const uint32_t count = std::min(trailingOnes(accumulator), limit);
+				const uint32_t consumed = count < limit ? count + 1 : count;
+				accumulator >>= consumed;
+				available -= consumed;
+				return count;
+			}
+
+			// whether more bits were consumed than there are, the refill itself may look past the end
+			bool overrun() const
+			{
+				return position * 8 - available > size * 8;
+			}
+
+		private:
+			// tops the accumulator up to at least 56 bits; the bits above those come from the same bytes, so later
+			// refills OR in identical values
+			void refill()
+			{
+				if (position + 8 <= size)
+				{
+					uint64_t word;
+					std::memcpy(&word, data + position, sizeof(word));
+					accumulator |= word << available;
+					const uint32_t loaded = (63 - available) / 8;
+					position += loaded;
+					available += loaded * 8;
+					return;
+				}
+				while (available <= 56)
+				{
+					accumulator |= uint64_t(position < size ? data[position] : 0) << available;
+					++position;
+					available += 8;
+				}
+			}
+
+		private:
+			const uint8_t* data;
+			size_t size;
+			size_t position = 0;
+			uint64_t accumulator = 0;
+			uint32_t available = 0;
+		};
+
+		// bits a block takes with Rice parameter k
+		inline uint64_t riceCost(const uint64_t* values, size_t count, uint32_t k)
+		{
+			uint64_t bits = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				const uint64_t quotient = values[i] >> k;
+				bits += quotient < EscapeQuotient ? quotient + 1 + k : EscapeQuotient + 6 + bitWidth(values[i]);
+			}
+			return bits;
+		}
+
+		// k near log2 of the block's mean is optimal for geometrically distributed values, its neighbours are
+		// tried as well
+		inline uint32_t riceParameter(const uint64_t* values, size_t count)
+		{
+			double sum = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				sum += static_cast<double>(values[i]);
+			}
+			const double mean = sum / count;
+			const uint32_t estimate = mean >= 1 ? std::min<uint32_t>(63, static_cast<uint32_t>(std::log2(mean))) : 0;
+			uint32_t best = estimate;
+			uint64_t bestCost = riceCost(values, count, estimate);
+			for (uint32_t k : {estimate - 1, estimate + 1})
+			{
+				if (k <= 63)
+				{
+					const uint64_t cost = riceCost(values, count, k);
+					if (cost < bestCost)
+					{
+						best = k;
+						bestCost = cost;
+					}
+				}
+			}
+			return best;
+		}
+
+		inline void writeRice(BitWriter& writer, const uint64_t* values, size_t count)
+		{
+			for (size_t block = 0; block < count; block += RiceBlock)
+			{
+				const size_t blockCount = std::min<size_t>(RiceBlock, count - block);
+				const uint32_t k = riceParameter(values + block, blockCount);
+				writer.write(k, RiceParameterBits);
+				for (size_t i = block; i < block + blockCount; ++i)
+				{
+					const uint64_t quotient = values[i] >> k;
+					if (quotient < EscapeQuotient)
+					{
+						writer.ones(static_cast<uint32_t>(quotient));
+						writer.write(0, 1);
+						writer.write(values[i] & ((uint64_t(1) << k) - 1), k);
+					}
+					else
+					{
+						const uint32_t width = bitWidth(values[i]);
+						writer.ones(EscapeQuotient);
+						writer.write(width - 1, 6);
+						writer.write(values[i], width);
+					}
+				}
+			}
+		}
+
+		inline void readRice(BitReader& reader, uint64_t* values, size_t count)
+		{
+			for (size_t block = 0; block < count; block += RiceBlock)
+			{
+				const size_t blockCount = std::min<size_t>(RiceBlock, count - block);
+				const uint32_t k = static_cast<uint32_t>(reader.read(RiceParameterBits));
+				for (size_t i = block; i < block + blockCount; ++i)
+				{
+					const uint32_t quotient = reader.unary(EscapeQuotient);
+					if (quotient < EscapeQuotient)
+					{
+						values[i] = (uint64_t(quotient) << k) | reader.read(k);
+					}
+					else
+					{
+						values[i] = reader.read(static_cast<uint32_t>(reader.read(6)) + 1);
+					}
+				}
+			}
+		}
+	}
+
+	// Appends frames to a trajectory stream. Every frame is coded chunk by chunk on the pool; the coded chunks
+	// and the quantized previous frame are kept between frames, so only the first frames allocate.
+	class TrajectoryEncoder
+	{
+	public:
+		TrajectoryEncoder(size_t bodyCount, const TrajectoryConfig& config, dhh::thread::ThreadPool& pool)
+			: pool(pool), chunkCount((bodyCount + config.chunkBodies - 1) / std::max(config.chunkBodies, 1u))
+		{
+			if (!(config.positionError > 0) || !(config.velocityError > 0) || config.chunkBodies == 0
+				|| config.keyframeInterval == 0)
+			{
+				throw std::runtime_error("Trajectory error bounds, chunk size and keyframe interval must be positive");
+			}
+			header = {};
+			std::memcpy(header.magic, TrajectoryHeader::Magic, sizeof(header.magic));
+			header.version = TrajectoryHeader::CurrentVersion;
+			header.headerBytes = sizeof(TrajectoryHeader);
+			header.bodyCount = bodyCount;
+			header.chunkBodies = config.chunkBodies;
+			header.keyframeInterval = config.keyframeInterval;
+			header.positionError = config.positionError;
+			header.velocityError = config.velocityError;
+
+			previous.resize(TrajectoryHeader::Columns * bodyCount);
+			chunks.resize(chunkCount);
+			for (Chunk& chunk : chunks)
+			{
+				chunk.values.resize(config.chunkBodies);
+			}
+			sizes.resize(alignedCount(chunkCount));
+		}
+
+		// Appends one frame to out; the first one is preceded by the header and the masses. Returns the bytes
+		// written, throws when a value does not fit the integers at the error bound.
+		uint64_t encode(uint64_t step, double time, const Body* bodies, std::ostream& out)
+		{
+			uint64_t written = 0;
+			if (index.empty())
+			{
+				origin = out.tellp();
+				out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				for (uint64_t i = 0; i < header.bodyCount; ++i)
+				{
+					out.write(reinterpret_cast<const char*>(&bodies[i].mass), sizeof(double));
+				}
+				written = sizeof(header) + header.bodyCount * sizeof(double);
+				offset = written;
+			}
+
+			const bool keyframe = index.size() % header.keyframeInterval == 0;
+			std::atomic<bool> overflow{false};
+			pool.parallelFor(chunkCount, [&](uint32_t, size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; ++chunk)
+				{
+					if (!encodeChunk(chunk, bodies, keyframe))
+					{
+						overflow.store(true, std::memory_order_relaxed);
+					}
+				}
+			});
+			if (overflow.load())
+			{
+				throw std::runtime_error("Trajectory: a value is too large or not finite for the error bound");
+			}
+
+			uint64_t payload = sizes.size() * sizeof(uint32_t);
+			for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+			{
+				sizes[chunk] = static_cast<uint32_t>(chunks[chunk].bytes.size());
+				payload += sizes[chunk];
+			}
+			const TrajectoryFrameHeader frame = {step, time, keyframe ? 1u : 0u, static_cast<uint32_t>(chunkCount),
+				payload};
+			out.write(reinterpret_cast<const char*>(&frame), sizeof(frame));
+			out.write(reinterpret_cast<const char*>(sizes.data()), sizes.size() * sizeof(uint32_t));
+			for (const Chunk& chunk : chunks)
+			{
+				out.write(reinterpret_cast<const char*>(chunk.bytes.data()), chunk.bytes.size());
+			}
+			index.push_back({offset, step, time, keyframe ? 1u : 0u});
+			offset += sizeof(frame) + payload;
+			return written + sizeof(frame) + payload;
+		}
+
+		// Appends the frame index and completes the header, out has to be seekable. Returns the bytes appended.
+		uint64_t finish(std::ostream& out)
+		{
+			if (index.empty())
+			{
+				return 0;
+			}
+			header.frameCount = index.size();
+			header.indexOffset = offset;
+			out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TrajectoryIndexEntry));
+			const std::ostream::pos_type end = out.tellp();
+			out.seekp(origin);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.seekp(end);
+			return index.size() * sizeof(TrajectoryIndexEntry);
+		}
+
+		uint64_t frames() const
+		{
+			return index.size();
+		}
+
+	private:
+		struct Chunk
+		{
+			std::vector<uint8_t> bytes;
+			std::vector<uint64_t> values;
+		};
+
+		static size_t alignedCount(size_t count)
+		{
+			// the size table is padded to 8 bytes
+			return (count + 1) / 2 * 2;
+		}
+
+		bool encodeChunk(size_t chunk, const Body* bodies, bool keyframe)
+		{
+			const size_t begin = chunk * header.chunkBodies;
+			const size_t count = std::min<size_t>(header.chunkBodies, header.bodyCount - begin);
+			uint64_t* values = chunks[chunk].values.data();
+			trajectory::BitWriter writer(chunks[chunk].bytes);
+			for (uint32_t column = 0; column < TrajectoryHeader::Columns; ++column)
+			{
+				const double quantum = trajectory::quantum(header, column);
+				int64_t* last = previous.data() + column * header.bodyCount + begin;
+				int64_t minimum = INT64_MAX;
+				for (size_t i = 0; i < count; ++i)
+				{
+					const double scaled = std::nearbyint(trajectory::component(bodies[begin + i], column) / quantum);
+					if (!(std::abs(scaled) < trajectory::QuantizedLimit))
+					{
+						return false;
+					}
+					const int64_t quantized = static_cast<int64_t>(scaled);
+					if (keyframe)
+					{
+						minimum = std::min(minimum, quantized);
+					}
+					else
+					{
+						values[i] = trajectory::zigzag(quantized - last[i]);
+					}
+					last[i] = quantized;
+				}
+				if (keyframe && count > 0)
+				{
+					writer.write(trajectory::zigzag(minimum), 64);
+					for (size_t i = 0; i < count; ++i)
+					{
+						values[i] = static_cast<uint64_t>(last[i] - minimum);
+					}
+				}
+				trajectory::writeRice(writer, values, count);
+			}
+			writer.finish();
+			return true;
+		}
+
+		dhh::thread::ThreadPool& pool;
+		size_t chunkCount;
+		TrajectoryHeader header;
+		std::vector<int64_t> previous;  // quantized last frame, column after column
+		std::vector<Chunk> chunks;
+		std::vector<uint32_t> sizes;
+		std::vector<TrajectoryIndexEntry> index;
+		std::ostream::pos_type origin;
+		uint64_t offset = 0;  // of the next frame, from the start of the trajectory
+	};
+
+	// Memory-mapped trajectory. Frames are decoded chunk by chunk on the pool; reading the frames in order decodes
+	// each once, a seek decodes from the keyframe before the target. A stream that was not closed is indexed by
+	// walking its frames, up to the last complete one.
+	class TrajectoryReader
+	{
+	public:
+		explicit TrajectoryReader(const std::filesystem::path& path) : path(path), file(path, false)
+		{
+			if (file.size() < sizeof(TrajectoryHeader))
+			{
+				fail("too small for a header");
+			}
+			std::memcpy(&fileHeader, file.data(), sizeof(fileHeader));
+			if (std::memcmp(fileHeader.magic, TrajectoryHeader::Magic, sizeof(fileHeader.magic)) != 0)
+			{
+				fail("not a trajectory");
+			}
+			if (fileHeader.version != TrajectoryHeader::CurrentVersion)
+			{
+				fail("unsupported version " + std::to_string(fileHeader.version));
+			}
+			// the masses follow the header, so they and the frames after them start within the file
+			if (fileHeader.chunkBodies == 0 || !(fileHeader.positionError > 0) || !(fileHeader.velocityError > 0)
+				|| fileHeader.headerBytes < sizeof(TrajectoryHeader) || fileHeader.headerBytes > file.size()
+				|| fileHeader.bodyCount > (file.size() - fileHeader.headerBytes) / sizeof(double))
+			{
+				fail("invalid header");
+			}
+			base = static_cast<const uint8_t*>(file.data());
+			masses = reinterpret_cast<const double*>(base + fileHeader.headerBytes);
+			chunkCount = (fileHeader.bodyCount + fileHeader.chunkBodies - 1) / fileHeader.chunkBodies;
+
+			if (fileHeader.indexOffset != 0)
+			{
+				if (fileHeader.indexOffset > file.size()
+					|| fileHeader.frameCount > (file.size() - fileHeader.indexOffset) / sizeof(TrajectoryIndexEntry))
+				{
+					fail("truncated index");
+				}
+				const auto* entries = reinterpret_cast<const TrajectoryIndexEntry*>(base + fileHeader.indexOffset);
+				index.assign(entries, entries + fileHeader.frameCount);
+			}
+			else
+			{
+				scanFrames();
+			}
+			for (const TrajectoryIndexEntry& entry : index)
+			{
+				validateFrame(entry);
+			}
+			if (!index.empty() && index.front().keyframe == 0)
+			{
+				fail("first frame is not a keyframe");
+			}
+			current.resize(TrajectoryHeader::Columns * fileHeader.bodyCount);
+			values.resize(chunkCount);
+		}
+
+		const TrajectoryHeader& header() const
+		{
+			return fileHeader;
+		}
+
+		size_t frameCount() const
+		{
+			return index.size();
+		}
+
+		const TrajectoryIndexEntry& frame(size_t frame) const
+		{
+			return index[frame];
+		}
+
+		// last frame at or before time, the first one before it
+		size_t frameAt(double time) const
+		{
+			const auto after = std::upper_bound(index.begin(), index.end(), time,
+				[](double t, const TrajectoryIndexEntry& entry) { return t < entry.time; });
+			return after == index.begin() ? 0 : static_cast<size_t>(after - index.begin()) - 1;
+		}
+
+		// asks the OS to start reading the frame, and the keyframe it is decoded from when that is not current
+		void prefetch(size_t frame) const
+		{
+			if (frame >= index.size())
+			{
+				return;
+			}
+			const int64_t next = decoded < static_cast<int64_t>(frame) ? decoded + 1 : 0;
+			size_t first = frame;
+			while (index[first].keyframe == 0 && static_cast<int64_t>(first) > next)
+			{
+				--first;
+			}
+			const uint64_t end = frame + 1 < index.size() ? index[frame + 1].offset : file.size();
+			file.prefetch(index[first].offset, end - index[first].offset);
+		}
+
+		// Decodes a frame into bodyCount bodies at destination
+		void read(size_t frame, Body* destination, dhh::thread::ThreadPool& pool)
+		{
+			if (frame >= index.size())
+			{
+				fail("no frame " + std::to_string(frame));
+			}
+			size_t keyframe = frame;
+			while (index[keyframe].keyframe == 0)
+			{
+				--keyframe;
+			}
+			const size_t first = decoded >= static_cast<int64_t>(keyframe) && decoded <= static_cast<int64_t>(frame)
+				? static_cast<size_t>(decoded) + 1
+				: keyframe;
+			for (size_t next = first; next <= frame; ++next)
+			{
+				decode(next, pool);
+			}
+
+			const double positionQuantum = trajectory::quantum(fileHeader, 0);
+			const double velocityQuantum = trajectory::quantum(fileHeader, 3);
+			const size_t count = fileHeader.bodyCount;
+			const int64_t* columns[TrajectoryHeader::Columns];
+			for (uint32_t column = 0; column < TrajectoryHeader::Columns; ++column)
+			{
+				columns[column] = current.data() + column * count;
+			}
+			pool.parallelFor(count, [&](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					destination[i].position = glm::dvec3(columns[0][i] * positionQuantum,
+						columns[1][i] * positionQuantum, columns[2][i] * positionQuantum);
+					destination[i].velocity = glm::dvec3(columns[3][i] * velocityQuantum,
+						columns[4][i] * velocityQuantum, columns[5][i] * velocityQuantum);
+					std::memcpy(&destination[i].mass, masses + i, sizeof(double));
+				}
+			});
+		}
+
+	private:
+		[[noreturn]] void fail(const std::string& reason) const
+		{
+			throw std::runtime_error("Trajectory " + path.string() + ": " + reason);
+		}
+
+		uint64_t firstFrameOffset() const
+		{
+			return fileHeader.headerBytes + fileHeader.bodyCount * sizeof(double);
+		}
+
+		uint64_t sizeTableBytes() const
+		{
+			return (chunkCount + 1) / 2 * 2 * sizeof(uint32_t);
+		}
+
+		void scanFrames()
+		{
+			uint64_t offset = firstFrameOffset();
+			while (offset + sizeof(TrajectoryFrameHeader) <= file.size())
+			{
+				TrajectoryFrameHeader frame;
+				std::memcpy(&frame, base + offset, sizeof(frame));
+				if (frame.payloadBytes > file.size() - offset - sizeof(frame))
+				{
+					break;
+				}
+				index.push_back({offset, frame.step, frame.time, frame.keyframe});
+				offset += sizeof(frame) + frame.payloadBytes;
+			}
+		}
+
+		void validateFrame(const TrajectoryIndexEntry& entry) const
+		{
+			TrajectoryFrameHeader frame;
+			if (entry.offset < firstFrameOffset() || entry.offset > file.size() - sizeof(frame))
+			{
+				fail("frame out of bounds");
+			}
+			std::memcpy(&frame, base + entry.offset, sizeof(frame));
+			if (frame.chunkCount != chunkCount || frame.payloadBytes < sizeTableBytes()
+				|| frame.payloadBytes > file.size() - entry.offset - sizeof(frame))
+			{
+				fail("frame at " + std::to_string(entry.offset) + " out of bounds");
+			}
+			uint64_t payload = sizeTableBytes();
+			for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+			{
+				uint32_t size;
+				std::memcpy(&size, base + entry.offset + sizeof(frame) + chunk * sizeof(uint32_t), sizeof(size));
+				payload += size;
+			}
+			if (payload != frame.payloadBytes)
+			{
+				fail("frame at " + std::to_string(entry.offset) + " has inconsistent chunk sizes");
+			}
+		}
+
+		void decode(size_t frame, dhh::thread::ThreadPool& pool)
+		{
+			const TrajectoryIndexEntry& entry = index[frame];
+			const uint8_t* sizeTable = base + entry.offset + sizeof(TrajectoryFrameHeader);
+			chunkOffsets.resize(chunkCount + 1);
+			chunkOffsets[0] = entry.offset + sizeof(TrajectoryFrameHeader) + sizeTableBytes();
+			for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+			{
+				uint32_t size;
+				std::memcpy(&size, sizeTable + chunk * sizeof(uint32_t), sizeof(size));
+				chunkOffsets[chunk + 1] = chunkOffsets[chunk] + size;
+			}
+
+			std::atomic<int64_t> corrupt{-1};
+			const bool keyframe = entry.keyframe != 0;
+			pool.parallelFor(chunkCount, [&](uint32_t, size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; ++chunk)
+				{
+					if (!decodeChunk(chunk, keyframe))
+					{
+						corrupt.store(static_cast<int64_t>(chunk), std::memory_order_relaxed);
+					}
+				}
+			});
+			if (corrupt.load() >= 0)
+			{
+				decoded = -1;
+				fail("frame " + std::to_string(frame) + " chunk " + std::to_string(corrupt.load()) + " is corrupt");
+			}
+			decoded = static_cast<int64_t>(frame);
+		}
+
+		bool decodeChunk(size_t chunk, bool keyframe)
+		{
+			const size_t begin = chunk * fileHeader.chunkBodies;
+			const size_t count = std::min<size_t>(fileHeader.chunkBodies, fileHeader.bodyCount - begin);
+			std::vector<uint64_t>& scratch = values[chunk];
+			scratch.resize(count);
+			trajectory::BitReader reader(base + chunkOffsets[chunk], chunkOffsets[chunk + 1] - chunkOffsets[chunk]);
+			for (uint32_t column = 0; column < TrajectoryHeader::Columns; ++column)
+			{
+				int64_t* state = current.data() + column * fileHeader.bodyCount + begin;
+				const int64_t minimum = keyframe && count > 0 ? trajectory::unzigzag(reader.read(64)) : 0;
+				trajectory::readRice(reader, scratch.data(), count);
+				for (size_t i = 0; i < count; ++i)
+				{
+					state[i] = keyframe ? minimum + static_cast<int64_t>(scratch[i])
+						: state[i] + trajectory::unzigzag(scratch[i]);
+				}
+			}
+			return !reader.overrun();
+		}
+
+		std::filesystem::path path;
+		dhh::filesystem::MappedFile file;
+		TrajectoryHeader fileHeader;
+		const uint8_t* base = nullptr;
+		const double* masses = nullptr;
+		size_t chunkCount = 0;
+		std::vector<TrajectoryIndexEntry> index;
+		std::vector<int64_t> current;  // quantized values of the decoded frame, column after column
+		int64_t decoded = -1;          // frame held in current, -1 for none
+		std::vector<uint64_t> chunkOffsets;
+		std::vector<std::vector<uint64_t>> values;
+	};
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace dhh::thread
+{
+	// Lock-free single producer / single consumer handoff of the latest value.
+	// The producer fills back() and publishes it, the consumer picks up the most recent published slot with
+	// consume(). Neither side ever waits: the producer overwrites a snapshot the consumer skipped, and the consumer
+	// keeps its current slot until a newer one is published.
+	template <typename T>
+	class TripleBuffer
+	{
+	public:
+		// Producer side: slot to fill next
+		T& back()
+		{
+			return slots[backIndex];
+		}
+
+		// Producer side: makes back() the latest snapshot and takes over the slot it replaces
+		void publish()
+		{
+			backIndex = middle.exchange(backIndex | FreshBit, std::memory_order_acq_rel) & IndexMask;
+		}
+
+		// Consumer side: whether consume() would pick up a new snapshot. Only the consumer clears the flag, so a true
+		// result stays true until it calls consume().
+		bool pending() const
+		{
+			return middle.load(std::memory_order_relaxed) & FreshBit;
+		}
+
+		// Consumer side: switches front() to the latest snapshot, false when nothing was published since the
+		// last call
+		bool consume()
+		{
+			if (!pending())
+			{
+				return false;
+			}
+			frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & IndexMask;
+			return true;
+		}
+
+		// Consumer side: snapshot picked up by the last successful consume()
+		const T& front() const
+		{
+			return slots[frontIndex];
+		}
+
+		// Both sides, before the producer starts: every slot, for preallocating snapshot storage
+		T& slot(uint32_t index)
+		{
+			return slots[index];
+		}
+
+	private:
+		static constexpr uint8_t IndexMask = 0x3;
+		static constexpr uint8_t FreshBit = 0x4;
+
+		T slots[3];
+		uint8_t backIndex = 0;
+		std::atomic<uint8_t> middle{1};
+		uint8_t frontIndex = 2;
+	};
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <vk_mem_alloc.h>
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+namespace dhh::memory
+{
+	// Subsystem an allocation belongs to
+	enum class Tag
+	{
+		Bodies,
+		Trails,
+		Staging,
+		Uniforms,
+		Attachments,
+		Other,
+		Count,
+	};
+
+	inline const char* tagName(Tag tag)
+	{
+		const char* names[] = {"bodies", "trails", "staging", "uniforms", "attachments", "other"};
+		return names[static_cast<size_t>(tag)];
+	}
+
+	inline std::string formatBytes(VkDeviceSize bytes)
+	{
+		std::ostringstream stream;
+		stream << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0) << " MiB";
+		return stream.str();
+	}
+
+	struct Usage
+	{
+		VkDeviceSize current = 0;
+		VkDeviceSize peak = 0;
+		uint32_t allocations = 0;
+
+		void add(VkDeviceSize size)
+		{
+			current += size;
+			peak = std::max(peak, current);
+			++allocations;
+		}
+
+		void remove(VkDeviceSize size)
+		{
+			current -= size;
+			--allocations;
+		}
+	};
+
+	// Accounts every allocation made through VulkanBase by tag, split into device-local and host memory
+	class MemoryTracker
+	{
+	public:
+		struct TagUsage
+		{
+			Usage device;
+			Usage host;
+		};
+
+		void setAllocator(VmaAllocator allocator, bool budgetAvailable)
+		{
+			this->allocator = allocator;
+			this->budgetAvailable = budgetAvailable;
+		}
+
+		bool hasBudget() const
+		{
+			return budgetAvailable;
+		}
+
+		void track(VmaAllocation allocation, Tag tag)
+		{
+			VmaAllocationInfo info;
+			vmaGetAllocationInfo(allocator, allocation, &info);
+			VkMemoryPropertyFlags flags;
+			vmaGetMemoryTypeProperties(allocator, info.memoryType, &flags);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			const Record record{tag, info.size, (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0};
+			records[allocation] = record;
+			usageOf(record).add(record.size);
+			(record.deviceLocal ? totalDevice : totalHost).add(record.size);
+		}
+
+		void untrack(VmaAllocation allocation)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			const auto found = records.find(allocation);
+			if (found == records.end())
+			{
+				return;
+			}
+			const Record record = found->second;
+			records.erase(found);
+			usageOf(record).remove(record.size);
+			(record.deviceLocal ? totalDevice : totalHost).remove(record.size);
+		}
+
+		TagUsage usage(Tag tag) const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return tags[static_cast<size_t>(tag)];
+		}
+
+		Usage deviceUsage() const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return totalDevice;
+		}
+
+		Usage hostUsage() const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return totalHost;
+		}
+
+		// Driver-reported usage and budget of the heap with the tightest remaining budget
+		void tightestHeap(VkDeviceSize& usage, VkDeviceSize& budget) const
+		{
+			const VkPhysicalDeviceMemoryProperties* properties;
+			vmaGetMemoryProperties(allocator, &properties);
+			VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+			vmaGetBudget(allocator, budgets);
+
+			usage = 0;
+			budget = 0;
+			VkDeviceSize leastRemaining = ~VkDeviceSize(0);
+			for (uint32_t heap = 0; heap < properties->memoryHeapCount; ++heap)
+			{
+				if (!(properties->memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+				{
+					continue;
+				}
+				const VkDeviceSize remaining =
+					budgets[heap].budget > budgets[heap].usage ? budgets[heap].budget - budgets[heap].usage : 0;
+				if (remaining < leastRemaining)
+				{
+					leastRemaining = remaining;
+					usage = budgets[heap].usage;
+					budget = budgets[heap].budget;
+				}
+			}
+		}
+
+		// One line summary for periodic logging
+		std::string logLine() const
+		{
+			const Usage device = deviceUsage();
+			const Usage host = hostUsage();
+			std::ostringstream stream;
+			stream << "Memory: device " << formatBytes(device.current) << " (peak " << formatBytes(device.peak)
+				<< "), host " << formatBytes(host.current) << " (peak " << formatBytes(host.peak) << ")";
+			VkDeviceSize heapUsage, heapBudget;
+			tightestHeap(heapUsage, heapBudget);
+			stream << ", heap " << formatBytes(heapUsage) << " / " << formatBytes(heapBudget)
+				<< (budgetAvailable ? "" : " (estimated)");
+			return stream.str();
+		}
+
+		// Per-tag table followed by the VMA statistics as JSON
+		void dump(std::ostream& out) const
+		{
+			out << "Memory by subsystem:\n";
+			out << "  " << std::left << std::setw(12) << "tag" << std::right << std::setw(14) << "device"
+				<< std::setw(14) << "device peak" << std::setw(14) << "host" << std::setw(14) << "host peak"
+				<< std::setw(8) << "count" << "\n";
+			for (size_t i = 0; i < static_cast<size_t>(Tag::Count); ++i)
+			{
+				const TagUsage tagUsage = usage(static_cast<Tag>(i));
+				out << "  " << std::left << std::setw(12) << tagName(static_cast<Tag>(i)) << std::right
+					<< std::setw(14) << formatBytes(tagUsage.device.current) << std::setw(14)
+					<< formatBytes(tagUsage.device.peak) << std::setw(14) << formatBytes(tagUsage.host.current)
+					<< std::setw(14) << formatBytes(tagUsage.host.peak) << std::setw(8)
+					<< tagUsage.device.allocations + tagUsage.host.allocations << "\n";
+			}
+			out << logLine() << "\n";
+
+			char* statsString;
+			vmaBuildStatsString(allocator, &statsString, VK_TRUE);
+			out << statsString << "\n";
+			vmaFreeStatsString(allocator, statsString);
+		}
+
+	private:
+		struct Record
+		{
+			Tag tag;
+			VkDeviceSize size;
+			bool deviceLocal;
+		};
+
+		Usage& usageOf(const Record& record)
+		{
+			TagUsage& tagUsage = tags[static_cast<size_t>(record.tag)];
+			return record.deviceLocal ? tagUsage.device : tagUsage.host;
+		}
+
+		VmaAllocator allocator = VK_NULL_HANDLE;
+		bool budgetAvailable = false;
+		mutable std::mutex mutex;
+		std::unordered_map<VmaAllocation, Record> records;
+		std::array<TagUsage, static_cast<size_t>(Tag::Count)> tags;
+		Usage totalDevice;
+		Usage totalHost;
+	};
+}
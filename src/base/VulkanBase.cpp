@@ -2,12 +2,15 @@
 
 #include <Filesystem.hpp>
 #include <Shader.hpp>
+#include <ShaderCache.hpp>
+#include <Startup.hpp>
 #include <Input.hpp>
 
 
 #define VMA_IMPLEMENTATION
 #include <vk_mem_alloc.h>
 
+#include <cstring>
 #include <iostream>
 #include <set>
 #include <array>
@@ -16,7 +19,11 @@
 
 void VulkanBase::init()
 {
-	initWindow();
+	dhh::startup::Timeline& timeline = dhh::startup::Timeline::instance();
+	if (!headless)
+	{
+		timeline.time("window", [this] { initWindow(); });
+	}
 	initVulkan();
 }
 
@@ -37,24 +44,39 @@ void VulkanBase::initWindow()
 
 void VulkanBase::initVulkan()
 {
-	createInstance();
-	if (enableValidation)
+	dhh::startup::Timeline& timeline = dhh::startup::Timeline::instance();
+	timeline.time("instance", [this] {
+		createInstance();
+		if (enableValidation)
+		{
+			setupDebugMessenger();
+		}
+	});
+	timeline.time("device", [this] {
+		pickPhysicalDevice();
+		findQueueFamilyIndex();
+		createLogicalDevice();
+		createPipelineCache();
+		createMemoryAllocator();
+		createCommandPool();
+		createDescriptorPool();
+	});
+	if (onDeviceCreated)
+	{
+		onDeviceCreated();
+	}
+	if (!headless)
 	{
-		setupDebugMessenger();
+		timeline.time("swapchain", [this] {
+			createSwapchain();
+			createSwapchainImageViews();
+			createRenderPass();
+			createDepthResources();
+			createFramebuffers();
+			createSyncObjects();
+			allocateCommandbuffers();
+		});
 	}
-	pickPhysicalDevice();
-	findQueueFamilyIndex();
-	createLogicalDevice();
-	createMemoryAllocator();
-	createSwapchain();
-	createSwapchainImageViews();
-	createRenderPass();
-	createDepthResources();
-	createFramebuffers();
-	createCommandPool();
-	createSyncObjects();
-	createDescriptorPool();
-	allocateCommandbuffers();
 }
 
 void VulkanBase::createInstance()
@@ -98,7 +120,11 @@ void VulkanBase::createInstance()
 	{
 		instanceCreateInfo.pNext = nullptr;
 	}
-	vkCreateInstance(&instanceCreateInfo, nullptr, &instance);
+	// no driver at all on machines without a GPU or software rasterizer, callers may fall back to the CPU
+	if (vkCreateInstance(&instanceCreateInfo, nullptr, &instance) != VK_SUCCESS)
+	{
+		throw std::runtime_error("No Vulkan driver, vkCreateInstance failed");
+	}
 }
 
 void VulkanBase::setupDebugMessenger()
@@ -126,12 +152,26 @@ void VulkanBase::pickPhysicalDevice()
 	vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
 	std::vector<VkPhysicalDevice> devices(deviceCount);
 	vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
+	physicalDevice = VK_NULL_HANDLE;
 	std::string deviceName;
-	std::string deviceType;
 	for (const auto& device : devices)
 	{
 		VkPhysicalDeviceProperties properties;
 		vkGetPhysicalDeviceProperties(device, &properties);
+		if (!preferredDevice.empty() && std::string(properties.deviceName).find(preferredDevice) == std::string::npos)
+		{
+			continue;
+		}
+
+		// every simulation shader works in double precision
+		VkPhysicalDeviceFeatures features;
+		vkGetPhysicalDeviceFeatures(device, &features);
+		if (!features.shaderFloat64)
+		{
+			std::cout << "Skipping " << properties.deviceName << ": no shaderFloat64\n";
+			continue;
+		}
+
 		physicalDevice = device;
 		deviceName = properties.deviceName;
 		if (properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
@@ -139,12 +179,17 @@ void VulkanBase::pickPhysicalDevice()
 			break;
 		}
 	}
+	if (physicalDevice == VK_NULL_HANDLE)
+	{
+		throw std::runtime_error(preferredDevice.empty() ? "No Vulkan device supports shaderFloat64"
+			: "No suitable Vulkan device matches " + preferredDevice);
+	}
 	std::cout << "GPU Picked: " << deviceName << "\n";
 }
 
 void VulkanBase::createLogicalDevice()
 {
-	float queuePriority = 1.f;
+	const float queuePriorities[] = { 1.f, 1.f };
 	std::set<uint32_t> uniqueQueueFamily = {
 		queueFamilyIndex.graphicsFamily.value(),
 		queueFamilyIndex.presentFamily.value(),
@@ -153,25 +198,44 @@ void VulkanBase::createLogicalDevice()
 
 	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 
+	uint32_t familyCount;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+	const uint32_t graphicsQueueCount =
+		std::min(families[queueFamilyIndex.graphicsFamily.value()].queueCount, 2u);
+
 	for (uint32_t queueIndex : uniqueQueueFamily)
 	{
 		VkDeviceQueueCreateInfo queueCreateInfo;
 		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
 		queueCreateInfo.flags = VK_NULL_HANDLE;
 		queueCreateInfo.pNext = nullptr;
-		queueCreateInfo.pQueuePriorities = &queuePriority;
-		queueCreateInfo.queueCount = 1;
+		queueCreateInfo.pQueuePriorities = queuePriorities;
+		queueCreateInfo.queueCount = queueIndex == queueFamilyIndex.graphicsFamily.value() ? graphicsQueueCount : 1;
 		queueCreateInfo.queueFamilyIndex = queueIndex;
 		queueCreateInfos.push_back(queueCreateInfo);
 	}
 
 	VkPhysicalDeviceFeatures features = {};
-	features.shaderFloat64 = VK_FALSE;
+	features.shaderFloat64 = VK_TRUE;  // bodies are simulated in double precision
 	features.fillModeNonSolid = VK_FALSE;
+	// the swapchain extension is only needed when presenting
+	std::vector<const char*> enabledExtensions;
+	if (!headless)
+	{
+		enabledExtensions = deviceExtensions;
+	}
+	memoryBudgetEnabled = isDeviceExtensionSupported(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	if (memoryBudgetEnabled)
+	{
+		enabledExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	}
+
 	VkDeviceCreateInfo deviceCreateInfo;
 	deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-	deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+	deviceCreateInfo.ppEnabledExtensionNames = enabledExtensions.data();
 	deviceCreateInfo.enabledLayerCount = 0;
 	deviceCreateInfo.ppEnabledLayerNames = nullptr;
 	deviceCreateInfo.flags = VK_NULL_HANDLE;
@@ -185,6 +249,7 @@ void VulkanBase::createLogicalDevice()
 	vkGetDeviceQueue(device, queueFamilyIndex.graphicsFamily.value(), 0, &graphicsQueue);
 	vkGetDeviceQueue(device, queueFamilyIndex.presentFamily.value(), 0, &presentQueue);
 	vkGetDeviceQueue(device, queueFamilyIndex.transferFamily.value(), 0, &transferQueue);
+	vkGetDeviceQueue(device, queueFamilyIndex.graphicsFamily.value(), graphicsQueueCount - 1, &computeQueue);
 }
 
 void VulkanBase::createMemoryAllocator()
@@ -192,8 +257,26 @@ void VulkanBase::createMemoryAllocator()
 	VmaAllocatorCreateInfo allocatorInfo = {};
 	allocatorInfo.physicalDevice = physicalDevice;
 	allocatorInfo.device = device;
+	allocatorInfo.instance = instance;
+	allocatorInfo.vulkanApiVersion = VK_API_VERSION_1_1;
+	if (memoryBudgetEnabled)
+	{
+		allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+	}
 
 	vmaCreateAllocator(&allocatorInfo, &allocator);
+	memoryTracker.setAllocator(allocator, memoryBudgetEnabled);
+}
+
+bool VulkanBase::isDeviceExtensionSupported(const char* extensionName)
+{
+	uint32_t extensionCount = 0;
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+	std::vector<VkExtensionProperties> extensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, extensions.data());
+	return std::any_of(extensions.begin(), extensions.end(), [&](const VkExtensionProperties& extension) {
+		return strcmp(extension.extensionName, extensionName) == 0;
+	});
 }
 
 void VulkanBase::createSwapchain()
@@ -304,7 +387,7 @@ void VulkanBase::createDepthResources()
 	createImage(windowWidth, windowHeight, 1, sampleCount, depthImageFormat, VK_IMAGE_TILING_OPTIMAL,
 		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
 		VMA_MEMORY_USAGE_GPU_ONLY,
-		depthImage, depthImageAllocation);
+		depthImage, depthImageAllocation, dhh::memory::Tag::Attachments);
 	depthImageView = createImageView(depthImage, depthImageFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
 }
 
@@ -374,16 +457,18 @@ void VulkanBase::createSyncObjects()
 
 void VulkanBase::createDescriptorPool()
 {
+	// sized for every pipeline of the application, each compute pipeline may own several sets
 	std::vector<VkDescriptorPoolSize> poolSizes = {
-		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1},
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 16},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 256},
 	};
 
 	VkDescriptorPoolCreateInfo poolCreateInfo;
 	poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolCreateInfo.pNext = nullptr;
-	poolCreateInfo.flags = VK_NULL_HANDLE;
-	poolCreateInfo.maxSets = static_cast<uint32_t>(swapchainImages.size());
+	// pipelines free their sets, so shader hot reload can recreate them
+	poolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+	poolCreateInfo.maxSets = 128;
 	poolCreateInfo.poolSizeCount = poolSizes.size();
 	poolCreateInfo.pPoolSizes = poolSizes.data();
 
@@ -429,11 +514,11 @@ void VulkanBase::createUniformBuffer(VkDeviceSize bufferSize)
 	for (size_t i = 0; i < swapchainImages.size(); i++)
 	{
 		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
-			uniformBuffers[i], uniformBufferAllocation[i]);
+			uniformBuffers[i], uniformBufferAllocation[i], dhh::memory::Tag::Uniforms);
 	}
 }
 
-void VulkanBase::drawFrame()
+uint32_t VulkanBase::drawFrame()
 {
 	vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
 	vkResetFences(device, 1, &inFlightFences[currentFrame]);
@@ -457,9 +542,12 @@ void VulkanBase::drawFrame()
 	submitInfo.signalSemaphoreCount = 1;
 	submitInfo.pSignalSemaphores = signalSemaphores;
 
-	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
 	{
-		throw std::runtime_error("failed to submit draw command buffer!");
+		auto lock = lockQueue(graphicsQueue);
+		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
+		{
+			throw std::runtime_error("failed to submit draw command buffer!");
+		}
 	}
 
 	VkPresentInfoKHR presentInfo = {};
@@ -470,9 +558,117 @@ void VulkanBase::drawFrame()
 	presentInfo.pSwapchains = &swapchain;
 	presentInfo.pImageIndices = &imageIndex;
 
-	vkQueuePresentKHR(presentQueue, &presentInfo);
+	{
+		auto lock = lockQueue(presentQueue);
+		vkQueuePresentKHR(presentQueue, &presentInfo);
+	}
 
 	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+	return imageIndex;
+}
+
+// Prefix of the serialized pipeline cache. The driver validates its own header too, this one also rejects data
+// from another driver version so an upgraded driver starts from an empty cache instead of a rejected one.
+struct PipelineCacheFileHeader
+{
+	char magic[4];
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+};
+
+static std::string pipelineCacheFileName(const VkPhysicalDeviceProperties& properties)
+{
+	return "pipeline-" + std::to_string(properties.vendorID) + "-" + std::to_string(properties.deviceID) + ".bin";
+}
+
+static PipelineCacheFileHeader pipelineCacheFileHeader(const VkPhysicalDeviceProperties& properties)
+{
+	PipelineCacheFileHeader header = {};
+	memcpy(header.magic, "NBPC", 4);
+	header.vendorID = properties.vendorID;
+	header.deviceID = properties.deviceID;
+	header.driverVersion = properties.driverVersion;
+	memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	return header;
+}
+
+void VulkanBase::createPipelineCache()
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	const PipelineCacheFileHeader expected = pipelineCacheFileHeader(properties);
+
+	std::vector<char> file;
+	const char* initialData = nullptr;
+	size_t initialSize = 0;
+	if (dhh::shader::ShaderCache::instance().load(pipelineCacheFileName(properties), file) &&
+		file.size() >= sizeof(PipelineCacheFileHeader))
+	{
+		PipelineCacheFileHeader header;
+		memcpy(&header, file.data(), sizeof(header));
+		const bool matches = memcmp(header.magic, expected.magic, 4) == 0 && header.vendorID == expected.vendorID &&
+			header.deviceID == expected.deviceID && header.driverVersion == expected.driverVersion &&
+			memcmp(header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+			header.dataSize == file.size() - sizeof(header);
+		if (matches)
+		{
+			initialData = file.data() + sizeof(header);
+			initialSize = static_cast<size_t>(header.dataSize);
+		}
+	}
+
+	VkPipelineCacheCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	createInfo.initialDataSize = initialSize;
+	createInfo.pInitialData = initialData;
+	if (vkCreatePipelineCache(device, &createInfo, nullptr, &pipelineCache) != VK_SUCCESS)
+	{
+		// a cache the driver refuses is not an error, start empty
+		createInfo.initialDataSize = 0;
+		createInfo.pInitialData = nullptr;
+		initialSize = 0;
+		vkCreatePipelineCache(device, &createInfo, nullptr, &pipelineCache);
+	}
+	pipelineCacheLoadedBytes = initialSize;
+}
+
+void VulkanBase::savePipelineCache()
+{
+	if (!dhh::shader::ShaderCache::instance().enabled() || pipelineCache == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	size_t dataSize = 0;
+	vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr);
+	std::vector<char> file(sizeof(PipelineCacheFileHeader) + dataSize);
+	if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, file.data() + sizeof(PipelineCacheFileHeader)) !=
+		VK_SUCCESS)
+	{
+		return;
+	}
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	PipelineCacheFileHeader header = pipelineCacheFileHeader(properties);
+	header.dataSize = dataSize;
+	memcpy(file.data(), &header, sizeof(header));
+	file.resize(sizeof(header) + dataSize);
+	dhh::shader::ShaderCache::instance().store(pipelineCacheFileName(properties), file);
+}
+
+std::unique_lock<std::mutex> VulkanBase::lockQueue(VkQueue queue)
+{
+	const bool rendering = queue == graphicsQueue || queue == presentQueue;
+	const bool simulating = queue == computeQueue || queue == transferQueue;
+	if (rendering && simulating)
+	{
+		return std::unique_lock<std::mutex>(queueMutex);
+	}
+	return std::unique_lock<std::mutex>();
 }
 
 VkBool32 VulkanBase::debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
@@ -487,8 +683,12 @@ VkBool32 VulkanBase::debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messag
 std::vector<const char*> VulkanBase::getRequiredExtensions()
 {
 	uint32_t extensionCount = 0;
-	const char** glfwRequiredExtensions = glfwGetRequiredInstanceExtensions(&extensionCount);
-	std::vector<const char*> requiredExtensions(glfwRequiredExtensions, glfwRequiredExtensions + extensionCount);
+	std::vector<const char*> requiredExtensions;
+	if (!headless)
+	{
+		const char** glfwRequiredExtensions = glfwGetRequiredInstanceExtensions(&extensionCount);
+		requiredExtensions.assign(glfwRequiredExtensions, glfwRequiredExtensions + extensionCount);
+	}
 
 	if (enableValidation)
 	{
@@ -524,23 +724,39 @@ void VulkanBase::findQueueFamilyIndex()
 		}
 	}
 
-	// Get window surface from GLFW
-	glfwCreateWindowSurface(instance, window, nullptr, &surface);
+	if (headless)
+	{
+		queueFamilyIndex.presentFamily = queueFamilyIndex.graphicsFamily;
+	}
+	else
+	{
+		// Get window surface from GLFW
+		glfwCreateWindowSurface(instance, window, nullptr, &surface);
+
+		/// Find queue family that support presentation
+		VkBool32 presentSupport;
+		for (size_t i = 0; i < queueFamilyProperties.size(); i++)
+		{
+			vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, static_cast<uint32_t>(i), surface, &presentSupport);
+			if (presentSupport)
+			{
+				queueFamilyIndex.presentFamily = i;
+				break;
+			}
+		}
+	}
 
-	/// Find queue family that support presentation
-	VkBool32 presentSupport;
+	/// Find Transfer queue family index, prefer a dedicated (DMA) family so copies can overlap compute
 	for (size_t i = 0; i < queueFamilyProperties.size(); i++)
 	{
-		vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, static_cast<uint32_t>(i), surface, &presentSupport);
-		if (presentSupport)
+		const VkQueueFlags flags = queueFamilyProperties[i].queueFlags;
+		if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
 		{
-			queueFamilyIndex.presentFamily = i;
+			queueFamilyIndex.transferFamily = i;
 			break;
 		}
 	}
-
-	/// Find Transfer queue family index
-	for (size_t i = 0; i < queueFamilyProperties.size(); i++)
+	for (size_t i = 0; i < queueFamilyProperties.size() && !queueFamilyIndex.transferFamily.has_value(); i++)
 	{
 		if (queueFamilyProperties[i].queueFlags & VK_QUEUE_TRANSFER_BIT)
 		{
@@ -590,27 +806,70 @@ VkSurfaceFormatKHR VulkanBase::chooseSurfaceFormat()
 }
 
 void VulkanBase::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, VkBuffer& buffer,
-	VmaAllocation& allocation)
+	VmaAllocation& allocation, dhh::memory::Tag tag, const std::vector<uint32_t>& queueFamilies)
 {
+	const std::set<uint32_t> uniqueQueueFamilies(queueFamilies.begin(), queueFamilies.end());
+	const std::vector<uint32_t> sharedQueueFamilies(uniqueQueueFamilies.begin(), uniqueQueueFamilies.end());
+
 	VkBufferCreateInfo bufferCreateInfo;
 	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferCreateInfo.pNext = nullptr;
 	bufferCreateInfo.flags = VK_NULL_HANDLE;
-	bufferCreateInfo.queueFamilyIndexCount = VK_NULL_HANDLE;
-	bufferCreateInfo.pQueueFamilyIndices = nullptr;
-	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	if (sharedQueueFamilies.size() > 1)
+	{
+		bufferCreateInfo.queueFamilyIndexCount = static_cast<uint32_t>(sharedQueueFamilies.size());
+		bufferCreateInfo.pQueueFamilyIndices = sharedQueueFamilies.data();
+		bufferCreateInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+	}
+	else
+	{
+		bufferCreateInfo.queueFamilyIndexCount = VK_NULL_HANDLE;
+		bufferCreateInfo.pQueueFamilyIndices = nullptr;
+		bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	}
 	bufferCreateInfo.size = size;
 	bufferCreateInfo.usage = usage;
 
 	VmaAllocationCreateInfo allocationCreateInfo = {};
 	allocationCreateInfo.usage = memoryUsage;
+	allocationCreateInfo.flags = VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
+
+	VkResult result =
+		vmaCreateBuffer(allocator, &bufferCreateInfo, &allocationCreateInfo, &buffer, &allocation, nullptr);
+	if (result != VK_SUCCESS)
+	{
+		throwAllocationFailure(result, size, tag);
+	}
+	memoryTracker.track(allocation, tag);
+}
+
+void VulkanBase::destroyBuffer(VkBuffer buffer, VmaAllocation allocation)
+{
+	memoryTracker.untrack(allocation);
+	vmaDestroyBuffer(allocator, buffer, allocation);
+}
 
-	vmaCreateBuffer(allocator, &bufferCreateInfo, &allocationCreateInfo, &buffer, &allocation, nullptr);
+void VulkanBase::destroyImage(VkImage image, VmaAllocation allocation)
+{
+	memoryTracker.untrack(allocation);
+	vmaDestroyImage(allocator, image, allocation);
+}
+
+void VulkanBase::throwAllocationFailure(VkResult result, VkDeviceSize size, dhh::memory::Tag tag)
+{
+	VkDeviceSize heapUsage, heapBudget;
+	memoryTracker.tightestHeap(heapUsage, heapBudget);
+	std::string reason = result == VK_ERROR_OUT_OF_DEVICE_MEMORY || result == VK_ERROR_OUT_OF_HOST_MEMORY
+		? "would exceed the memory budget"
+		: "failed with VkResult " + std::to_string(result);
+	throw std::runtime_error("Allocating " + dhh::memory::formatBytes(size) + " for " +
+		dhh::memory::tagName(tag) + " " + reason + " (device heap " + dhh::memory::formatBytes(heapUsage) +
+		" used of " + dhh::memory::formatBytes(heapBudget) + ")\n" + memoryTracker.logLine());
 }
 
 void VulkanBase::createImage(uint32_t width, uint32_t height, uint32_t mipLevelCount, VkSampleCountFlagBits sampleCount,
 	VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage,
-	VkImage& image, VmaAllocation& allocation)
+	VkImage& image, VmaAllocation& allocation, dhh::memory::Tag tag)
 {
 	VkImageCreateInfo imageCreateInfo;
 	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -633,8 +892,16 @@ void VulkanBase::createImage(uint32_t width, uint32_t height, uint32_t mipLevelC
 
 	VmaAllocationCreateInfo allocationCreateInfo = {};
 	allocationCreateInfo.usage = memoryUsage;
+	allocationCreateInfo.flags = VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT;
 
-	vmaCreateImage(allocator, &imageCreateInfo, &allocationCreateInfo, &image, &allocation, nullptr);
+	VkResult result =
+		vmaCreateImage(allocator, &imageCreateInfo, &allocationCreateInfo, &image, &allocation, nullptr);
+	if (result != VK_SUCCESS)
+	{
+		// the exact requirement is unknown without the image, report the 32 bit per texel estimate
+		throwAllocationFailure(result, static_cast<VkDeviceSize>(width) * height * 4, tag);
+	}
+	memoryTracker.track(allocation, tag);
 }
 
 VkShaderModule VulkanBase::createShaderModule(const std::string& filename)
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <Camera.hpp>
+#include "MemoryTracker.hpp"
 #define GLFW_INCLUDE_NONE
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <vk_mem_alloc.h>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <optional>
@@ -42,6 +45,8 @@ public:
 	const uint32_t appVersion = VK_MAKE_VERSION(0, 0, 1);
 	const uint32_t engineVersion = VK_MAKE_VERSION(0, 0, 1);
 	bool enableValidation = true;
+	bool headless = false;  // no window, surface or swapchain, for compute-only runs
+	std::string preferredDevice;  // part of the device name to pick, e.g. llvmpipe; empty prefers a discrete GPU
 	QueueFamilyIndex queueFamilyIndex;
 
 private:
@@ -78,6 +83,9 @@ public:
 	VkQueue graphicsQueue;
 	VkQueue transferQueue;
 	VkQueue presentQueue;
+	// second queue of the graphics family when it has one, so the simulation thread does not share the queue the
+	// renderer submits and presents on
+	VkQueue computeQueue;
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkDescriptorPool descriptorPool;
 	std::vector<VkDescriptorSet> descriptorSets;
@@ -85,13 +93,22 @@ public:
 	std::vector<VmaAllocation> uniformBufferAllocation;
 	size_t currentFrame = 0;
 	dhh::camera::Camera camera;
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;  // persisted in the shader cache directory
+	size_t pipelineCacheLoadedBytes = 0;             // 0 on a cold start
+	bool memoryBudgetEnabled = false;  // VK_EXT_memory_budget, VMA estimates the budget otherwise
+	dhh::memory::MemoryTracker memoryTracker;
+	// Called by init() once the device, allocator, pipeline cache and pools exist and before the swapchain is
+	// created, so work that only needs the device (compute pipelines) can start on other threads meanwhile
+	std::function<void()> onDeviceCreated;
 
+private:
+	std::mutex queueMutex;
 
 public:
 
 
-	explicit VulkanBase(bool enableValidation)
-		: enableValidation(enableValidation)
+	explicit VulkanBase(bool enableValidation, bool headless = false)
+		: enableValidation(enableValidation), headless(headless)
 	{
 	}
 
@@ -116,12 +133,26 @@ private:
 	void createCommandPool();
 	void createSyncObjects();
 	void createDescriptorPool();
+	void createPipelineCache();
 	void allocateCommandbuffers();
 	VkPresentModeKHR choosePresentMode();
 
 public:
-	void drawFrame();
+	// returns the swapchain image whose command buffer was submitted
+	uint32_t drawFrame();
+	// Writes the pipeline cache back to the shader cache directory, call before exiting
+	void savePipelineCache();
+	// Queues are externally synchronized. Returns a held lock when the queue is used by both the renderer
+	// (graphics, present) and the simulation (compute, transfer), an empty one otherwise.
+	std::unique_lock<std::mutex> lockQueue(VkQueue queue);
 	void createUniformBuffer(VkDeviceSize bufferSize);
+	// Buffers shared by more than one queue family are created with concurrent sharing.
+	// Every allocation is tagged for memory accounting and throws instead of exceeding the heap budget.
+	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage,
+		VkBuffer& buffer, VmaAllocation& allocation, dhh::memory::Tag tag,
+		const std::vector<uint32_t>& queueFamilies = {});
+	void destroyBuffer(VkBuffer buffer, VmaAllocation allocation);
+	void destroyImage(VkImage image, VmaAllocation allocation);
 
 protected:
 	static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
@@ -133,11 +164,11 @@ protected:
 	std::vector<const char*> getRequiredLayers();
 	VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlagBits aspectFlags, uint32_t mipLevels);
 	VkSurfaceFormatKHR chooseSurfaceFormat();
-	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage,
-		VkBuffer& buffer, VmaAllocation& allocation);
 	void createImage(uint32_t width, uint32_t height, uint32_t mipLevelCount, VkSampleCountFlagBits sampleCount,
 		VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VmaMemoryUsage memoryUsage,
-		VkImage& image, VmaAllocation& allocation);
+		VkImage& image, VmaAllocation& allocation, dhh::memory::Tag tag);
+	bool isDeviceExtensionSupported(const char* extensionName);
+	void throwAllocationFailure(VkResult result, VkDeviceSize size, dhh::memory::Tag tag);
 
 public:
 	VkShaderModule createShaderModule(const std::string& filename);
@@ -1,30 +1,132 @@
 #include "Input.hpp"
 
+#include "Allocator.hpp"
+#include "Autotune.hpp"
+#include "Body.hpp"
+#include "BodyLoader.hpp"
 #include "Camera.hpp"
+#include "Checkpoint.hpp"
+#include "ConservationReduction.hpp"
+#include "Diagnostics.hpp"
+#include "Ensemble.hpp"
+#include "Ephemeris.hpp"
+#include "GpuProfiler.hpp"
+#include "InitialConditions.hpp"
+#include "Metrics.hpp"
+#include "Options.hpp"
+#include "OutOfCore.hpp"
 #include "Pipeline.hpp"
+#include "QueryService.hpp"
+#include "ReadbackRing.hpp"
+#include "Replay.hpp"
 #include "Shader.hpp"
+#include "ShaderCache.hpp"
+#include "SnapshotWriter.hpp"
+#include "Startup.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "TripleBuffer.hpp"
 #include "VulkanBase.h"
 #include "VulkanInitializer.hpp"
 #include <glm/gtx/string_cast.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <string>
 
 
-struct Body
-{
-	glm::dvec3 position;
-	alignas(16) glm::dvec3 velocity;
-	alignas(8) double mass;
-};
+using dhh::nbody::Body;
 
 dhh::camera::Camera camera;
 
 
+dhh::nbody::OutOfCoreConfig outOfCoreConfig(const dhh::options::Options& options)
+{
+	dhh::nbody::OutOfCoreConfig config;
+	config.tileSize = options.tileSize;
+	config.blockSize = options.blockSize;
+	config.stagingDepth = options.stagingDepth;
+	config.stepLength = options.stepLength;
+	config.gpuTiming = options.gpuTiming;
+	return config;
+}
+
+dhh::nbody::EnsembleConfig ensembleConfig(const dhh::options::Options& options)
+{
+	dhh::nbody::EnsembleConfig config;
+	config.stepLength = options.stepLength;
+	config.timeLimit = options.ensembleTimeLimit;
+	config.escapeRadius = options.ensembleEscapeRadius;
+	config.collisionRadius = options.ensembleCollisionRadius;
+	config.closeApproachRadius = options.ensembleCloseApproachRadius;
+	config.stepsPerDispatch = options.ensembleStepsPerDispatch;
+	return config;
+}
+
+// --load: units as "length,velocity,mass", binary type and record layout
+dhh::nbody::LoadConfig loadConfig(const dhh::options::Options& options)
+{
+	dhh::nbody::LoadConfig config;
+	if (options.loadFormat == "csv" || options.loadFormat == "binary")
+	{
+		config.format = options.loadFormat == "csv" ? dhh::nbody::LoadFormat::Csv : dhh::nbody::LoadFormat::Binary;
+	}
+	else if (!options.loadFormat.empty())
+	{
+		throw std::runtime_error("Unknown --load-format " + options.loadFormat + ", expected csv or binary");
+	}
+	config.columns = options.loadColumns;
+
+	std::vector<std::string> units;
+	std::istringstream list(options.loadUnits);
+	for (std::string unit; std::getline(list, unit, ',');)
+	{
+		units.push_back(unit);
+	}
+	if (units.size() != 3)
+	{
+		throw std::runtime_error("--load-units expects length,velocity,mass, e.g. au,km/s,msun");
+	}
+	config.lengthUnit = dhh::nbody::load::lengthUnit(units[0]);
+	config.velocityUnit = dhh::nbody::load::velocityUnit(units[1]);
+	config.massUnit = dhh::nbody::load::massUnit(units[2]);
+
+	if (options.loadBinaryType != "f64" && options.loadBinaryType != "f32")
+	{
+		throw std::runtime_error("Unknown --load-binary-type " + options.loadBinaryType + ", expected f64 or f32");
+	}
+	config.singlePrecision = options.loadBinaryType == "f32";
+	config.recordFields = options.loadRecordFields;
+	config.headerBytes = options.loadHeaderBytes;
+	return config;
+}
+
+// Simulation state handed to the renderer, positions already scaled to render space
+struct Snapshot
+{
+	dhh::memory::AlignedArray<glm::vec3> positions;
+	uint64_t step = 0;
+	double time = 0;  // glfwGetTime() at publication
+};
+
 Body sun{ glm::vec3(-4.8569 * pow(10, 11), -3.8569 * pow(10, 11), 0), glm::vec3(0, 0, 0), 1.988435 * pow(10, 30) };
 
 
@@ -66,9 +168,19 @@ class Triangle : public VulkanBase
 		VkBuffer buffer;
 	} trajectoryBuffer;
 
-	std::vector<glm::vec3> trajectories;
+	const uint32_t trajectoryLength = 100000;
 	uint32_t trajectoryIndex = 0;
 
+	// the simulation thread steps at a fixed rate and publishes snapshots, the renderer interpolates between the
+	// last two it picked up
+	dhh::thread::TripleBuffer<Snapshot> snapshots;
+	Snapshot previous;
+	std::thread simulationThread;
+	std::atomic<bool> simulating{false};
+	std::atomic<bool> simulationFailed{false};  // the main loop stops, and rethrowSimulationFailure() reports it
+	std::exception_ptr simulationFailure;
+	VkFence computeFence;
+
 	struct Transforms
 	{
 		glm::mat4 proj;
@@ -76,30 +188,313 @@ class Triangle : public VulkanBase
 		glm::mat4 model;
 	};
 
+	dhh::options::Options options;
+	std::unique_ptr<dhh::nbody::OutOfCoreSolver> outOfCore;
+
+	// --gpu-timing: one query slot per swapchain command buffer, and one for the in-core compute command buffer
+	std::unique_ptr<dhh::profile::GpuProfiler> renderTiming;
+	std::unique_ptr<dhh::profile::GpuProfiler> computeTiming;
+
+	// --metrics-file / --metrics-port, updated by the simulation thread
+	struct Metrics
+	{
+		dhh::metrics::Counter& steps;
+		dhh::metrics::Counter& interactions;
+		dhh::metrics::Gauge& simulatedTime;
+		dhh::metrics::Gauge& kineticEnergy;
+		dhh::metrics::Gauge& potentialEnergy;
+		dhh::metrics::Gauge& totalEnergy;
+		dhh::metrics::Gauge& energyDrift;
+		dhh::metrics::Gauge& momentumDrift;
+		dhh::metrics::Gauge& angularMomentumDrift;
+		dhh::metrics::Gauge& centerOfMassDrift;
+	};
+	std::unique_ptr<Metrics> metrics;
+
+	// step length selection of nbody.comp, which the host mirrors to account simulated time
+	static constexpr uint32_t InCoreStepsPerDispatch = 600;
+	static constexpr double InCoreStepLength = 0.0001;
+	static constexpr double InCoreCloseStepLength = 0.00001;
+	static constexpr double InCoreCloseDistance = 50000000000.f;
+	double inCoreStepLength = InCoreStepLength;  // of the next dispatch
+	bool mirrorStepLength = false;               // only while simulatedTime is exported or written, an O(N²) scan
+
+	// simulation clock, carried over from --restart
+	uint64_t integrationSteps = 0;
+	double simulatedTime = 0;
+
+	// --checkpoint every --checkpoint-interval seconds
+	std::chrono::steady_clock::time_point nextCheckpoint;
+
+	// --output: the in-core state is copied into a readback ring every --output-every steps and the copies are
+	// queued for the writer thread once their fences signal, so the simulation only waits when that queue is full
+	static constexpr uint32_t ReadbackDepth = 3;
+	std::unique_ptr<dhh::nbody::SnapshotWriter> output;
+	std::unique_ptr<dhh::nbody::ReadbackRing> readback;
+	uint64_t readbackWaits = 0;  // copies still in flight when the ring was needed again
+
+	// --ephemeris: every published step is folded into the fit of the current segment
+	std::unique_ptr<dhh::nbody::EphemerisWriter> ephemeris;
+
+	// --replay: recorded frames are published instead of simulated ones, from the simulation thread
+	std::unique_ptr<dhh::nbody::RecordedRun> recording;
+	std::unique_ptr<dhh::nbody::ReplayPrefetcher> prefetcher;
+	std::unique_ptr<dhh::nbody::PlaybackClock> playback;
+	const Body* replayState = nullptr;  // of the frame shown last, held by the prefetcher
+	std::array<bool, 5> replayKeysDown{};
+
+	// --serve: the query service gets every published state, and can pause the loop and release single steps
+	std::unique_ptr<dhh::nbody::QueryService> service;
+	std::atomic<bool> paused{false};
+	std::mutex pauseMutex;
+	std::condition_variable pauseChanged;
+	uint64_t requestedSteps = 0;  // guarded by pauseMutex
+
+	// Conserved quantities for the metrics (every --metrics-interval) and --conservation (every
+	// --conservation-every steps). The in-core state is reduced on the GPU; on the host the O(N²) potential energy is
+	// only summed up to PotentialSampleLimit bodies, it would stall the simulation thread beyond.
+	static constexpr size_t PotentialSampleLimit = 1 << 14;
+	std::unique_ptr<dhh::nbody::ConservationReduction> conservation;
+	std::ofstream conservationLog;
+	std::optional<dhh::nbody::Conservation> initialConservation;
+	double initialConservationTime = 0;
+	std::chrono::steady_clock::time_point nextConservationSample;
+	std::vector<double> diagnosticPartials;
+
+	// shaders of the window mode pipelines, all of them are loaded before a hot reload replaces any pipeline
+	struct Shaders
+	{
+		dhh::shader::Shader vertex;
+		dhh::shader::Shader fragment;
+		dhh::shader::Shader compute;
+		dhh::shader::Shader cache;
+	};
+
+	// the same shaders while they are loaded in parallel
+	struct ShaderLoads
+	{
+		std::future<dhh::shader::Shader> vertex;
+		std::future<dhh::shader::Shader> fragment;
+		std::future<dhh::shader::Shader> compute;
+		std::future<dhh::shader::Shader> cache;
+
+		Shaders get()
+		{
+			return {vertex.get(), fragment.get(), compute.get(), cache.get()};
+		}
+	};
+
+	// hot reload polls the modification times of the shader sources
+	static constexpr double ShaderPollInterval = 0.5;
+	double lastShaderPoll = 0;
+	std::filesystem::file_time_type shaderSourceTime;
+
 public:
 	dhh::shader::Pipeline* trianglePipe;
 	dhh::shader::Pipeline* computePipe;
 	dhh::shader::Pipeline* cachePipe;
-	std::vector<Body> bodies;
-
-	Triangle() : VulkanBase(false)
+	dhh::nbody::BodyArray bodies;
+	dhh::thread::ThreadPool workers;  // used by the simulation thread only
+	std::atomic<uint64_t> simulatedSteps{0};
+	// --check-allocations: heap allocations of the simulation thread in Compute() after the first WarmupSteps
+	static constexpr uint64_t WarmupSteps = 60;
+	std::atomic<uint64_t> steadyStateStepAllocations{0};
+
+	// Shaders load while the window and the device come up, the compute pipelines are created while the swapchain
+	// is set up and the graphics pipeline while the buffers are allocated. Phases go to the startup timeline.
+	explicit Triangle(const dhh::options::Options& options) : VulkanBase(false), options(options)
 	{
+		dhh::startup::Timeline& timeline = dhh::startup::Timeline::instance();
+		dhh::startup::TaskGroup tasks;
+		ShaderLoads shaderLoads = loadShadersAsync(tasks);
+		// the body count specializes the compute pipeline, so the bodies exist before the device
+		timeline.time("initial states", [this] { fillBodyInitialStates(); });
+
+		std::future<void> computePipelines;
+		if (inCore())
+		{
+			onDeviceCreated = [&] {
+				computePipelines = tasks.run("compute pipelines",
+					[this, compute = std::move(shaderLoads.compute), cache = std::move(shaderLoads.cache)]() mutable {
+						dhh::shader::Shader computeShader = compute.get();
+						dhh::shader::Shader cacheShader = cache.get();
+						CreateComputePipeline(computeShader, cacheShader);
+					});
+			};
+		}
+		preferredDevice = options.device;
 		init();
-		fillBodyInitialStates();
-		createTrianglePipeline();
-		CreateComputePipeline();
-		CreateCameraBuffer();
-		WriteGraphicsDescriptorSet();
-		createComputeBuffer();
-		CreateVertexBuffer();
-		buildCommandBuffers();
-		writeComputeDescriptorSet();
-		BuildComputeCommandBuffers();
-		Compute();
+		onDeviceCreated = nullptr;
+		if (options.gpuTiming)
+		{
+			renderTiming = std::make_unique<dhh::profile::GpuProfiler>(
+				*this, "GPU render", static_cast<uint32_t>(commandBuffers.size()));
+			if (inCore())
+			{
+				computeTiming = std::make_unique<dhh::profile::GpuProfiler>(*this, "GPU compute", 1);
+			}
+		}
+
+		std::future<void> graphicsPipeline = tasks.run("graphics pipeline",
+			[this, vertex = std::move(shaderLoads.vertex), fragment = std::move(shaderLoads.fragment)]() mutable {
+				dhh::shader::Shader vertexShader = vertex.get();
+				dhh::shader::Shader fragmentShader = fragment.get();
+				createTrianglePipeline(vertexShader, fragmentShader);
+			});
+		timeline.time("buffers", [this] {
+			CreateCameraBuffer();
+			if (inCore())
+			{
+				createComputeBuffer();
+			}
+			CreateVertexBuffer();
+		});
+		if (options.outOfCore)
+		{
+			timeline.time("out-of-core solver", [this] { createOutOfCoreSolver(); });
+		}
+		graphicsPipeline.get();
+		if (computePipelines.valid())
+		{
+			computePipelines.get();
+		}
+
+		timeline.time("command buffers", [this] {
+			WriteGraphicsDescriptorSet();
+			buildCommandBuffers();
+			if (inCore())
+			{
+				writeComputeDescriptorSet();
+				BuildComputeCommandBuffers();
+			}
+		});
+		if (inCore() && (!options.conservationFile.empty() || !options.metricsFile.empty() || options.metricsPort != 0))
+		{
+			conservation = std::make_unique<dhh::nbody::ConservationReduction>(
+				*this, computeBuffer.buffer, static_cast<uint32_t>(bodies.size()), options.softening);
+		}
+		if (!options.conservationFile.empty())
+		{
+			createConservationLog();
+		}
+		if (!options.outputFile.empty())
+		{
+			createOutput();
+		}
+		if (!options.ephemerisFile.empty())
+		{
+			createEphemeris();
+		}
+		if (!options.serviceSocket.empty())
+		{
+			createService();
+		}
+		if (!options.metricsFile.empty() || options.metricsPort != 0)
+		{
+			registerMetrics();
+		}
+		mirrorStepLength = inCore() && (metrics || !options.checkpointFile.empty() || ephemeris || output || service
+			|| conservationLog.is_open());
+		createSnapshots();
+		if (options.hotReload)
+		{
+			shaderSourceTime = latestShaderChange();
+		}
+	}
+
+	~Triangle()
+	{
+		stopSimulation();
+	}
+
+	void startSimulation()
+	{
+		nextCheckpoint = std::chrono::steady_clock::now() + steadyDuration(options.checkpointInterval);
+		simulating = true;
+		simulationThread = std::thread([this] {
+			dhh::trace::Tracer::instance().setThreadName("simulation");
+			try
+			{
+				if (recording)
+				{
+					replayLoop();
+				}
+				else
+				{
+					simulationLoop();
+				}
+			}
+			catch (...)
+			{
+				// e.g. a corrupt frame of a --replay file
+				simulationFailure = std::current_exception();
+				simulationFailed = true;
+			}
+		});
+	}
+
+	// after stopSimulation()
+	void rethrowSimulationFailure()
+	{
+		if (simulationFailure)
+		{
+			std::rethrow_exception(std::exchange(simulationFailure, nullptr));
+		}
+	}
+
+	void stopSimulation()
+	{
+		{
+			std::lock_guard<std::mutex> lock(pauseMutex);
+			simulating = false;
+		}
+		pauseChanged.notify_all();
+		if (simulationThread.joinable())
+		{
+			simulationThread.join();
+		}
+	}
+
+	// final --checkpoint, after stopSimulation()
+	void saveCheckpoint()
+	{
+		withState([this](const Body* state) { writeCheckpoint(state); });
+		std::cout << "Checkpoint written to " << options.checkpointFile << "\n";
+	}
+
+	// closes the --output stream after stopSimulation() and prints what went to it
+	void finishOutput(std::ostream& out)
+	{
+		output->close();
+		const dhh::nbody::SnapshotWriter::Stats stats = output->statistics();
+		out << "Snapshots: " << stats.frames << " frames, " << dhh::memory::formatBytes(stats.bytes) << " to "
+			<< options.outputFile.string();
+		if (options.outputPositionError > 0 && stats.bytes > 0)
+		{
+			out << " (" << static_cast<double>(stats.rawBytes) / stats.bytes << "x smaller than raw frames)";
+		}
+		out << ", " << stats.stalls << " stalls (" << stats.stallSeconds
+			<< " s waiting for the writer), queue high water " << stats.highWater << "/" << options.outputQueue;
+		if (readback)
+		{
+			out << ", " << readbackWaits << " readback waits";
+		}
+		out << "\n";
+	}
+
+	// fits the last segment and closes --ephemeris after stopSimulation()
+	void finishEphemeris(std::ostream& out)
+	{
+		ephemeris->close();
+		const dhh::nbody::EphemerisHeader& header = ephemeris->header();
+		out << "Ephemeris: " << header.segmentCount << " segments of " << header.segmentLength << " s covering t = "
+			<< header.startTime << " to " << header.endTime << " s, written to " << options.ephemerisFile.string()
+			<< "\n";
 	}
 
 	void updateTransform()
 	{
+		NBODY_TRACE_SCOPE("updateTransform");
 		dhh::input::processKeyboard(window, camera);
 
 		void* data;
@@ -115,7 +510,7 @@ public:
 	void CreateCameraBuffer()
 	{
 		createBuffer(sizeof(glm::mat4) * 4, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
-			cameraBuffer.buffer, cameraBuffer.memory);
+			cameraBuffer.buffer, cameraBuffer.memory, dhh::memory::Tag::Uniforms);
 	}
 
 	void WriteGraphicsDescriptorSet()
@@ -129,8 +524,39 @@ public:
 		vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
 	}
 
+	// the in-core compute pipeline and buffer exist: neither out-of-core nor replaying
+	bool inCore() const
+	{
+		return !options.outOfCore && options.replayFile.empty();
+	}
+
 	void fillBodyInitialStates()
 	{
+		if (!options.replayFile.empty())
+		{
+			openReplay();
+			return;
+		}
+		if (!options.restartFile.empty())
+		{
+			restart();
+			return;
+		}
+		if (!options.loadFile.empty())
+		{
+			const dhh::nbody::LoadStats stats =
+				dhh::nbody::BodyLoader(options.loadFile, loadConfig(options)).load(bodies, workers);
+			std::cout << "Loaded " << stats.bodies << " bodies from " << options.loadFile << " in " << stats.seconds
+				<< " s, " << stats.bytesPerSecond() / (1024 * 1024) << " MiB/s\n";
+			return;
+		}
+		if (options.bodyCount > 0)
+		{
+			dhh::nbody::fillBodies(dhh::nbody::parseDistribution(options.distribution), options.bodyCount, bodies,
+				options.seed, &workers);
+			return;
+		}
+
 		// bodies.push_back(earth);
 		// bodies.push_back(sun);
 		/*bodies.push_back(mercury);
@@ -165,11 +591,149 @@ public:
 				1 * pow(10, 30)
 		});*/
 
+		fillPresetBodies(bodies);
+	}
+
+	// State, clock and integrator settings from --restart; the mapped columns are gathered straight into the
+	// bodies, which the buffer setup then uploads
+	void restart()
+	{
+		const dhh::nbody::CheckpointReader checkpoint(options.restartFile);
+		const dhh::nbody::CheckpointState state = checkpoint.state();
+		bodies.resize(checkpoint.header().bodyCount);
+		checkpoint.read(bodies.data(), workers);
+
+		integrationSteps = state.step;
+		simulatedTime = state.time;
+		options.leapfrog = state.integrator == dhh::nbody::CheckpointIntegrator::Leapfrog;
+		options.softening = state.softening;
+		if (options.outOfCore)
+		{
+			options.stepLength = state.stepLength;
+		}
+		std::cout << "Restarted " << bodies.size() << " bodies from " << options.restartFile << " at step "
+			<< state.step << ", t = " << state.time << " s\n";
+	}
+
+	// --replay: the bodies start as the first frame shown, later frames are read ahead on the prefetcher's threads
+	void openReplay()
+	{
+		recording = std::make_unique<dhh::nbody::RecordedRun>(options.replayFile);
+		const size_t frames = recording->frameCount();
+		const double begin = recording->frameTime(0);
+		const double end = recording->frameTime(frames - 1);
+		const double tickRate = options.simulationRate > 0 ? options.simulationRate : 60;
+		const double speed =
+			options.replaySpeed > 0 ? options.replaySpeed : frames > 1 ? (end - begin) / (frames - 1) * tickRate : 1;
+		playback = std::make_unique<dhh::nbody::PlaybackClock>(begin, end, options.replayStart, speed);
+
+		bodies.resize(recording->bodyCount());
+		recording->read(recording->frameAt(options.replayStart), bodies.data(), workers);
+		replayState = bodies.data();
+		prefetcher = std::make_unique<dhh::nbody::ReplayPrefetcher>(*recording, options.replayPrefetch,
+			std::max(1u, std::thread::hardware_concurrency() / 2));
+		std::cout << "Replaying " << frames << " frames of " << bodies.size() << " bodies from "
+			<< options.replayFile.string() << (recording->compressed() ? " (compressed)" : "") << ", "
+			<< playback->describe() << "\n";
+	}
+
+	static void fillPresetBodies(dhh::nbody::BodyArray& bodies)
+	{
 		bodies.push_back({ glm::dvec3(1 * pow(10, 11), 3 * pow(10, 11), 0), glm::dvec3(0), 3 * pow(10, 31) });
 		bodies.push_back({ glm::dvec3(-2 * pow(10, 11), -1 * pow(10, 11), 0), glm::dvec3(0), 4 * pow(10, 31) });
 		bodies.push_back({ glm::dvec3(1 * pow(10, 11), -1 * pow(10, 11), 0), glm::dvec3(0), 5 * pow(10, 31) });
 	}
 
+	static void fillRandomBodies(uint32_t count, dhh::nbody::BodyArray& bodies)
+	{
+		dhh::nbody::fillUniformCloud(count, bodies);
+	}
+
+	void createOutOfCoreSolver()
+	{
+		outOfCore = std::make_unique<dhh::nbody::OutOfCoreSolver>(
+			*this, bodies, outOfCoreConfig(options), options.bodyFile);
+	}
+
+	void createOutput()
+	{
+		if (options.outputEvery == 0)
+		{
+			throw std::runtime_error("--output-every must be at least 1");
+		}
+		std::optional<dhh::nbody::TrajectoryConfig> compression;
+		if (options.outputPositionError > 0)
+		{
+			compression.emplace();
+			compression->positionError = options.outputPositionError;
+			compression->velocityError = options.outputVelocityError;
+		}
+		output = std::make_unique<dhh::nbody::SnapshotWriter>(
+			options.outputFile, bodies.size(), options.outputQueue, compression);
+		if (!outOfCore)
+		{
+			// the copies go to the queue the dispatches run on, computeQueue is of the graphics family
+			readback = std::make_unique<dhh::nbody::ReadbackRing>(*this, computeQueue,
+				queueFamilyIndex.graphicsFamily.value(), computeBuffer.buffer, sizeof(Body) * bodies.size(),
+				ReadbackDepth);
+		}
+	}
+
+	void createEphemeris()
+	{
+		// a segment needs about degree / 2 samples, each of them constrains position and velocity
+		const double sampleInterval = outOfCore ? options.stepLength : InCoreStepsPerDispatch * InCoreStepLength;
+		const uint32_t samples = (options.ephemerisDegree + 2) / 2;
+		if (options.ephemerisSegment < sampleInterval * samples)
+		{
+			throw std::runtime_error("--ephemeris-segment must be at least " + std::to_string(sampleInterval * samples)
+				+ " simulated seconds for degree " + std::to_string(options.ephemerisDegree));
+		}
+		dhh::nbody::EphemerisConfig config;
+		config.segmentLength = options.ephemerisSegment;
+		config.degree = options.ephemerisDegree;
+		ephemeris =
+			std::make_unique<dhh::nbody::EphemerisWriter>(options.ephemerisFile, bodies.size(), config, workers);
+	}
+
+	void createConservationLog()
+	{
+		if (options.conservationEvery == 0)
+		{
+			throw std::runtime_error("--conservation-every must be at least 1");
+		}
+		conservationLog.open(options.conservationFile, std::ios::trunc);
+		if (!conservationLog)
+		{
+			throw std::runtime_error("Cannot write conservation diagnostics to " + options.conservationFile.string());
+		}
+		conservationLog << std::setprecision(17)
+			<< "step,time,kinetic,potential,total,energy_drift,px,py,pz,lx,ly,lz,cx,cy,cz\n";
+	}
+
+	void createService()
+	{
+		dhh::nbody::QueryControl control;
+		control.pause = [this](bool pause) {
+			{
+				std::lock_guard<std::mutex> lock(pauseMutex);
+				paused = pause;
+				requestedSteps = 0;
+			}
+			pauseChanged.notify_all();
+		};
+		control.step = [this](uint32_t steps) {
+			{
+				std::lock_guard<std::mutex> lock(pauseMutex);
+				requestedSteps += paused ? steps : 0;
+			}
+			pauseChanged.notify_all();
+		};
+		control.paused = [this] { return paused.load(); };
+		service = std::make_unique<dhh::nbody::QueryService>(options.serviceSocket, bodies.size(), control);
+		std::cout << "Serving queries on " << options.serviceSocket.string() << "\n";
+	}
+
 	void writeComputeDescriptorSet()
 	{
 		VkDescriptorBufferInfo bufferInfo =
@@ -186,12 +750,447 @@ public:
 		vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
 	}
 
-	void Compute()
+	void createSnapshots()
 	{
-		VkFence completeFence;
+		// slots are first touched by the workers that convert into them
+		for (uint32_t i = 0; i < 3; ++i)
+		{
+			snapshots.slot(i).positions.allocate(bodies.size(), true, &workers);
+		}
+		publishSnapshot(0);
+		snapshots.consume();
 
-		VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
-		vkCreateFence(device, &fenceCreateInfo, nullptr, &completeFence);
+		const Snapshot& initial = snapshots.front();
+		previous.positions.allocate(bodies.size(), true);
+		std::copy(initial.positions.begin(), initial.positions.end(), previous.positions.begin());
+		previous.time = initial.time;
+	}
+
+	// Fixed-step loop on its own thread, so neither vsync nor a slow frame holds back the physics
+	void simulationLoop()
+	{
+		using clock = std::chrono::steady_clock;
+		const auto period = std::chrono::duration_cast<clock::duration>(
+			std::chrono::duration<double>(options.simulationRate > 0 ? 1 / options.simulationRate : 0));
+		auto deadline = clock::now();
+		uint64_t step = 0;
+		while (simulating)
+		{
+			if (paused.load(std::memory_order_relaxed))
+			{
+				if (!waitForStep())
+				{
+					continue;
+				}
+				deadline = clock::now();
+			}
+			NBODY_TRACE_SCOPE("step");
+			const uint64_t allocationsBefore = dhh::memory::heapAllocationCount();
+			Compute();
+			advanceClock();
+			if (step >= WarmupSteps)
+			{
+				steadyStateStepAllocations.fetch_add(
+					dhh::memory::heapAllocationCount() - allocationsBefore, std::memory_order_relaxed);
+			}
+			publishSnapshot(++step);
+			simulatedSteps.store(step, std::memory_order_relaxed);
+			if (output)
+			{
+				streamOutput(step);
+			}
+
+			if (options.simulationRate > 0)
+			{
+				deadline += period;
+				const auto now = clock::now();
+				if (deadline < now - period * 4)
+				{
+					// fell behind, e.g. a step took longer than the period; do not try to catch up in a burst
+					deadline = now;
+				}
+				std::this_thread::sleep_until(deadline);
+			}
+		}
+		if (readback)
+		{
+			readback->drain([this](const void* data, uint64_t step, double time) {
+				queueSnapshot(static_cast<const Body*>(data), step, time);
+			});
+		}
+	}
+
+	// --replay, instead of simulationLoop(): every tick advances the playback clock and publishes the frame at its
+	// time once the prefetcher has read it
+	void replayLoop()
+	{
+		using clock = std::chrono::steady_clock;
+		const double tickRate = options.simulationRate > 0 ? options.simulationRate : 60;
+		const auto period =
+			std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / tickRate));
+		auto deadline = clock::now();
+		auto last = deadline;
+		size_t shown = recording->frameAt(options.replayStart);
+		uint64_t published = 0;
+		while (simulating)
+		{
+			if (paused.load(std::memory_order_relaxed))
+			{
+				// a --serve pause holds the playback clock too, a step request plays one tick
+				if (!waitForStep())
+				{
+					last = clock::now();
+					continue;
+				}
+				deadline = clock::now();
+				last = deadline - period;
+			}
+			const auto now = clock::now();
+			const double time = playback->advance(std::chrono::duration<double>(now - last).count());
+			const size_t frame = recording->frameAt(time);
+			last = now;
+			if (frame != shown)
+			{
+				NBODY_TRACE_SCOPE("replayFrame");
+				const dhh::nbody::ReplayPrefetcher::Frame& next = prefetcher->acquire(frame);
+				replayState = next.bodies.data();
+				integrationSteps = next.step;
+				simulatedTime = next.time;
+				publishSnapshot(++published);
+				simulatedSteps.store(published, std::memory_order_relaxed);
+				shown = frame;
+			}
+
+			deadline += period;
+			if (deadline < clock::now() - period * 4)
+			{
+				deadline = clock::now();
+			}
+			std::this_thread::sleep_until(deadline);
+		}
+	}
+
+	// --replay keys, from the render loop: Space pauses, Left/Right seek by a twentieth of the run, Up/Down double
+	// and halve the speed
+	void processReplayKeys()
+	{
+		const int keys[] = {GLFW_KEY_SPACE, GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP, GLFW_KEY_DOWN};
+		const double span = recording->frameTime(recording->frameCount() - 1) - recording->frameTime(0);
+		for (size_t i = 0; i < replayKeysDown.size(); ++i)
+		{
+			const bool down = glfwGetKey(window, keys[i]) == GLFW_PRESS;
+			const bool pressed = down && !replayKeysDown[i];
+			replayKeysDown[i] = down;
+			if (!pressed)
+			{
+				continue;
+			}
+			switch (keys[i])
+			{
+			case GLFW_KEY_SPACE:
+				playback->togglePause();
+				break;
+			case GLFW_KEY_LEFT:
+			case GLFW_KEY_RIGHT:
+				playback->seek((keys[i] == GLFW_KEY_LEFT ? -span : span) / 20);
+				break;
+			default:
+				playback->scaleSpeed(keys[i] == GLFW_KEY_UP ? 2 : 0.5);
+			}
+			std::cout << "Replay " << playback->describe() << "\n";
+		}
+	}
+
+	// prints how often the replay waited for the disk, after stopSimulation()
+	void finishReplay(std::ostream& out)
+	{
+		const dhh::nbody::ReplayPrefetcher::Stats stats = prefetcher->statistics();
+		out << "Replay: " << stats.frames << " frames read, " << stats.waits << " waits for the prefetcher ("
+			<< stats.waitSeconds << " s)\n";
+	}
+
+	// While paused: true once a step was requested, false when the simulation resumes or stops
+	bool waitForStep()
+	{
+		std::unique_lock<std::mutex> lock(pauseMutex);
+		pauseChanged.wait(lock, [this] { return !paused || requestedSteps > 0 || !simulating; });
+		if (requestedSteps == 0 || !simulating)
+		{
+			return false;
+		}
+		--requestedSteps;
+		return true;
+	}
+
+	// --output, after every step: hands finished readbacks to the writer and starts a copy every --output-every
+	// steps
+	void streamOutput(uint64_t step)
+	{
+		NBODY_TRACE_SCOPE("streamOutput");
+		const bool due = step % options.outputEvery == 0;
+		if (!readback)
+		{
+			// the out-of-core state already lives in host memory
+			if (due)
+			{
+				queueSnapshot(outOfCore->bodies(), integrationSteps, simulatedTime);
+			}
+			return;
+		}
+
+		const auto queue = [this](const void* data, uint64_t step, double time) {
+			queueSnapshot(static_cast<const Body*>(data), step, time);
+		};
+		readback->poll(queue);
+		if (due && readback->submit(integrationSteps, simulatedTime, queue))
+		{
+			++readbackWaits;
+		}
+	}
+
+	// copies a state into the writer's next frame, waits only while the writer's queue is full
+	void queueSnapshot(const Body* state, uint64_t step, double time)
+	{
+		dhh::nbody::SnapshotWriter::Frame& frame = output->acquire();
+		frame.header.step = step;
+		frame.header.time = time;
+		Body* destination = frame.bodies.data();
+		workers.parallelFor(bodies.size(), [state, destination](uint32_t, size_t begin, size_t end) {
+			memcpy(destination + begin, state + begin, (end - begin) * sizeof(Body));
+		});
+		output->publish();
+	}
+
+	static std::chrono::steady_clock::duration steadyDuration(double seconds)
+	{
+		return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	}
+
+	// Calls fn(const Body*) with the current state, mapped while the call lasts. Only when no step is running.
+	template <typename F>
+	void withState(F&& fn)
+	{
+		if (replayState != nullptr)
+		{
+			fn(replayState);
+			return;
+		}
+		if (outOfCore)
+		{
+			// the out-of-core state already lives in host memory
+			fn(outOfCore->bodies());
+			return;
+		}
+		void* data;
+		vmaMapMemory(allocator, computeBuffer.memory, &data);
+		fn(static_cast<const Body*>(data));
+		vmaUnmapMemory(allocator, computeBuffer.memory);
+	}
+
+	void publishSnapshot(uint64_t step)
+	{
+		NBODY_TRACE_SCOPE("publishSnapshot");
+		const double scale = 1 / 300000000000.f;
+		withState([&](const Body* state) {
+			Snapshot& snapshot = snapshots.back();
+			workers.parallelFor(bodies.size(), [&](uint32_t, size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i)
+				{
+					snapshot.positions[i] = state[i].position * scale;
+				}
+			});
+			snapshot.step = step;
+			snapshot.time = glfwGetTime();
+			snapshots.publish();
+
+			if (mirrorStepLength)
+			{
+				updateInCoreStepLength(state);
+			}
+			if (metrics || conservationLog.is_open())
+			{
+				sampleConservation(step, state);
+			}
+			if (ephemeris)
+			{
+				ephemeris->sample(simulatedTime, state);
+			}
+			if (service)
+			{
+				service->publish(integrationSteps, simulatedTime, state, workers);
+			}
+			if (options.checkpointInterval > 0 && !options.checkpointFile.empty()
+				&& std::chrono::steady_clock::now() >= nextCheckpoint)
+			{
+				writeCheckpoint(state);
+				nextCheckpoint += steadyDuration(options.checkpointInterval);
+			}
+		});
+	}
+
+	// --checkpoint, from the simulation thread or once it has stopped
+	void writeCheckpoint(const Body* state)
+	{
+		NBODY_TRACE_SCOPE("writeCheckpoint");
+		dhh::nbody::CheckpointState checkpoint;
+		checkpoint.step = integrationSteps;
+		checkpoint.time = simulatedTime;
+		if (outOfCore)
+		{
+			checkpoint.stepLength = options.stepLength;
+		}
+		else
+		{
+			checkpoint.stepLength = inCoreStepLength;
+			checkpoint.softening = options.softening;
+			checkpoint.integrator =
+				options.leapfrog ? dhh::nbody::CheckpointIntegrator::Leapfrog : dhh::nbody::CheckpointIntegrator::Euler;
+		}
+		dhh::nbody::writeCheckpoint(options.checkpointFile, state, bodies.size(), checkpoint, workers);
+	}
+
+	// Registered with the process-wide registry. The collector reads this object, so the exporter must not outlive
+	// it.
+	void registerMetrics()
+	{
+		dhh::metrics::Registry& registry = dhh::metrics::Registry::instance();
+		metrics = std::make_unique<Metrics>(Metrics{
+			registry.counter("nbody_steps_total", "Integration steps"),
+			registry.counter("nbody_pair_interactions_total", "Pairwise force evaluations"),
+			registry.gauge("nbody_simulated_time_seconds", "Simulated time"),
+			registry.gauge("nbody_energy", "Energy of the bodies", "kind=\"kinetic\""),
+			registry.gauge("nbody_energy", "Energy of the bodies", "kind=\"potential\""),
+			registry.gauge("nbody_energy", "Energy of the bodies", "kind=\"total\""),
+			registry.gauge("nbody_energy_drift_ratio", "Relative change of the total energy since the start"),
+			registry.gauge("nbody_momentum_drift", "Magnitude of the change of the total momentum since the start"),
+			registry.gauge("nbody_angular_momentum_drift_ratio",
+				"Relative change of the total angular momentum since the start"),
+			registry.gauge("nbody_center_of_mass_drift_meters",
+				"Distance of the centre of mass from its uniform motion since the start"),
+		});
+
+		if (output)
+		{
+			dhh::metrics::Counter& outputFrames =
+				registry.counter("nbody_output_frames_total", "Snapshots written to the --output stream");
+			dhh::metrics::Counter& outputStalls = registry.counter(
+				"nbody_output_stalls_total", "Snapshots that waited for room in the writer queue");
+			registry.addCollector([this, &outputFrames, &outputStalls] {
+				const dhh::nbody::SnapshotWriter::Stats stats = output->statistics();
+				outputFrames.add(stats.frames - outputFrames.value());
+				outputStalls.add(stats.stalls - outputStalls.value());
+			});
+		}
+
+		dhh::metrics::Gauge& stepRate =
+			registry.gauge("nbody_steps_per_second", "Integration steps per second since the previous export");
+		dhh::metrics::Gauge& interactionRate = registry.gauge(
+			"nbody_pair_interactions_per_second", "Pairwise force evaluations per second since the previous export");
+		dhh::metrics::Gauge& deviceMemory =
+			registry.gauge("nbody_memory_bytes", "Vulkan memory allocated by the application", "kind=\"device\"");
+		dhh::metrics::Gauge& hostMemory =
+			registry.gauge("nbody_memory_bytes", "Vulkan memory allocated by the application", "kind=\"host\"");
+		registry.addCollector([this, &stepRate, &interactionRate, &deviceMemory, &hostMemory,
+			last = std::chrono::steady_clock::now(), lastSteps = uint64_t(0),
+			lastInteractions = uint64_t(0)]() mutable {
+			const auto now = std::chrono::steady_clock::now();
+			const double seconds = std::chrono::duration<double>(now - last).count();
+			const uint64_t steps = metrics->steps.value();
+			const uint64_t interactions = metrics->interactions.value();
+			if (seconds > 0)
+			{
+				stepRate.set((steps - lastSteps) / seconds);
+				interactionRate.set((interactions - lastInteractions) / seconds);
+			}
+			last = now;
+			lastSteps = steps;
+			lastInteractions = interactions;
+
+			deviceMemory.set(static_cast<double>(memoryTracker.deviceUsage().current));
+			hostMemory.set(static_cast<double>(memoryTracker.hostUsage().current));
+		});
+	}
+
+	// after every Compute(), on the simulation thread
+	void advanceClock()
+	{
+		const uint64_t count = bodies.size();
+		const uint64_t steps = outOfCore ? 1 : InCoreStepsPerDispatch;
+		integrationSteps += steps;
+		simulatedTime += outOfCore ? options.stepLength : InCoreStepsPerDispatch * inCoreStepLength;
+		if (metrics)
+		{
+			// the acceleration is evaluated once per step by every integrator
+			metrics->steps.add(steps);
+			metrics->interactions.add(
+				outOfCore ? outOfCore->lastStepStats().interactions : steps * count * (count - 1));
+			metrics->simulatedTime.set(simulatedTime);
+		}
+	}
+
+	// the step length nbody.comp picks for the next dispatch from the state of the latest step
+	void updateInCoreStepLength(const Body* state)
+	{
+		const double closest = dhh::nbody::minimumSeparation(state, bodies.size(), workers, diagnosticPartials);
+		inCoreStepLength = closest < InCoreCloseDistance ? InCoreCloseStepLength : InCoreStepLength;
+	}
+
+	// conserved quantities once per metrics interval and every --conservation-every published steps
+	void sampleConservation(uint64_t step, const Body* state)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const bool exported = metrics && now >= nextConservationSample;
+		const bool logged = conservationLog.is_open() && step % options.conservationEvery == 0;
+		if (!exported && !logged)
+		{
+			return;
+		}
+		NBODY_TRACE_SCOPE("sampleConservation");
+		const dhh::nbody::Conservation sample = conservation ? conservation->sample()
+			: dhh::nbody::conservation(state, bodies.size(), outOfCore ? 0 : options.softening,
+				bodies.size() <= PotentialSampleLimit, workers, diagnosticPartials);
+		if (!initialConservation)
+		{
+			initialConservation = sample;
+			initialConservationTime = simulatedTime;
+		}
+		const dhh::nbody::ConservationDrift drift(
+			*initialConservation, sample, simulatedTime - initialConservationTime);
+
+		if (exported)
+		{
+			nextConservationSample = now + steadyDuration(options.metricsInterval);
+			metrics->kineticEnergy.set(sample.kinetic);
+			if (!std::isnan(sample.potential))
+			{
+				metrics->potentialEnergy.set(sample.potential);
+				metrics->totalEnergy.set(sample.energy());
+				metrics->energyDrift.set(drift.energy);
+			}
+			metrics->momentumDrift.set(drift.momentum);
+			metrics->angularMomentumDrift.set(drift.angularMomentum);
+			metrics->centerOfMassDrift.set(drift.centerOfMass);
+		}
+		if (logged)
+		{
+			conservationLog << integrationSteps << ',' << simulatedTime << ',' << sample.kinetic << ','
+				<< sample.potential << ',' << sample.energy() << ',' << drift.energy;
+			for (const glm::dvec3* vector : {&sample.momentum, &sample.angularMomentum, &sample.centerOfMass})
+			{
+				conservationLog << ',' << vector->x << ',' << vector->y << ',' << vector->z;
+			}
+			conservationLog << '\n';
+		}
+	}
+
+	void Compute()
+	{
+		NBODY_TRACE_SCOPE("Compute");
+		if (outOfCore)
+		{
+			outOfCore->step();
+			return;
+		}
 
 		VkSubmitInfo submitInfo = {};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -199,42 +1198,55 @@ public:
 		submitInfo.pCommandBuffers = &computeCmdBuf;
 
 		auto now = std::chrono::high_resolution_clock::now();
-		vkQueueSubmit(graphicsQueue, 1, &submitInfo, completeFence);
-		vkWaitForFences(device, 1, &completeFence, true, UINT64_MAX);
-		vkResetFences(device, 1, &completeFence);
+		{
+			auto lock = lockQueue(computeQueue);
+			vkQueueSubmit(computeQueue, 1, &submitInfo, computeFence);
+		}
+		vkWaitForFences(device, 1, &computeFence, true, UINT64_MAX);
+		vkResetFences(device, 1, &computeFence);
+		if (computeTiming)
+		{
+			computeTiming->submitted(0);
+			computeTiming->collect();
+		}
 
 		// std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(
 		//	std::chrono::high_resolution_clock::now() - now).count() << std::endl;
-
-		void* data;
-		vmaMapMemory(allocator, computeBuffer.memory, &data);
-		std::vector<Body> fuck(bodies.size());
-		memcpy(fuck.data(), data, sizeof(Body) * bodies.size());
-		vmaUnmapMemory(allocator, computeBuffer.memory);
-
-		//std::cout << glm::to_string(fuck[0].position) << "\n";
-		//std::cout << glm::to_string(fuck[1].position) << "\n";
-		//std::cout << glm::to_string(fuck[2].position) << "\n";
 	}
 
 	VkCommandBuffer computeCmdBuf;
 
 	void BuildComputeCommandBuffers()
 	{
+		VkFenceCreateInfo fenceCreateInfo = dhh::vk::initializer::fenceCreateInfo();
+		vkCreateFence(device, &fenceCreateInfo, nullptr, &computeFence);
+
 		VkCommandBufferAllocateInfo info =
 			dhh::vk::initializer::commandBufferAllocateInfo(commandPool, 1, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
 		vkAllocateCommandBuffers(device, &info, &computeCmdBuf);
+		recordComputeCommandBuffer();
+	}
+
+	void recordComputeCommandBuffer()
+	{
 		VkCommandBufferBeginInfo beginInfo =
 			dhh::vk::initializer::commandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 		vkBeginCommandBuffer(computeCmdBuf, &beginInfo);
+		if (computeTiming)
+		{
+			computeTiming->reset(computeCmdBuf, 0);
+		}
 
 		// calculate
 		for (int i = 0; i < 1; ++i)
 		{
-			vkCmdBindPipeline(computeCmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipe->pipeline);
-			vkCmdBindDescriptorSets(computeCmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipe->pipelineLayout, 0, 1,
-				computePipe->descriptorSets.data(), 0, nullptr);
-			vkCmdDispatch(computeCmdBuf, 1, 1, 1);
+			{
+				dhh::profile::GpuScope scope(computeTiming.get(), computeCmdBuf, 0, "nbody.comp");
+				vkCmdBindPipeline(computeCmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipe->pipeline);
+				vkCmdBindDescriptorSets(computeCmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, computePipe->pipelineLayout,
+					0, 1, computePipe->descriptorSets.data(), 0, nullptr);
+				vkCmdDispatch(computeCmdBuf, 1, 1, 1);
+			}
 
 			VkBufferMemoryBarrier barrier = {};
 			barrier.buffer = computeBuffer.buffer;
@@ -261,8 +1273,10 @@ public:
 
 	void createComputeBuffer()
 	{
-		createBuffer(sizeof(Body) * bodies.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
-			computeBuffer.buffer, computeBuffer.memory);
+		// copied into the readback ring with --output
+		createBuffer(sizeof(Body) * bodies.size(),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+			computeBuffer.buffer, computeBuffer.memory, dhh::memory::Tag::Bodies);
 		void* data;
 		vmaMapMemory(allocator, computeBuffer.memory, &data);
 		memcpy(data, bodies.data(), sizeof(Body) * bodies.size());
@@ -272,31 +1286,66 @@ public:
 	void CreateVertexBuffer()
 	{
 		createBuffer(sizeof(glm::vec3) * bodies.size(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
-			vertices.buffer, vertices.memory);
-		createBuffer(sizeof(glm::vec3) * 100000, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_ONLY,
-			trajectoryBuffer.buffer, trajectoryBuffer.memory);
-		trajectories.resize(100000);
+			vertices.buffer, vertices.memory, dhh::memory::Tag::Bodies);
+		createBuffer(sizeof(glm::vec3) * trajectoryLength, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VMA_MEMORY_USAGE_CPU_ONLY, trajectoryBuffer.buffer, trajectoryBuffer.memory, dhh::memory::Tag::Trails);
+		void* data;
+		vmaMapMemory(allocator, trajectoryBuffer.memory, &data);
+		memset(data, 0, sizeof(glm::vec3) * trajectoryLength);
+		vmaUnmapMemory(allocator, trajectoryBuffer.memory);
 	}
 
-	void CreateComputePipeline()
+	static ShaderLoads loadShadersAsync(dhh::startup::TaskGroup& tasks)
 	{
-		std::filesystem::path shaders_directory = dhh::shader::findShaderDirectory();
-
-		dhh::shader::Shader computeShader(shaders_directory / "nbody.comp");
-		computePipe = new dhh::shader::Pipeline(device, { &computeShader }, descriptorPool);
+		const auto load = [&tasks](const char* name) {
+			return tasks.run(std::string("load ") + name, [name] { return dhh::shader::loadShader(name); });
+		};
+		return {load("shader.vert"), load("shader.frag"), load("nbody.comp"), load("cache.comp")};
+	}
 
-		dhh::shader::Shader cacheShader(shaders_directory / "cache.comp");
-		cachePipe = new dhh::shader::Pipeline(device, { &cacheShader }, descriptorPool);
+	static Shaders loadShaders()
+	{
+		dhh::startup::TaskGroup tasks;
+		return loadShadersAsync(tasks).get();
 	}
 
-	void createTrianglePipeline()
+	// nbody.comp keeps every body in one workgroup, the body count and the tunables are specialization constants
+	dhh::shader::Specialization computeSpecialization() const
 	{
-		std::filesystem::path shaders_directory = dhh::shader::findShaderDirectory();
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		const uint32_t maxWorkgroupSize =
+			std::min(properties.limits.maxComputeWorkGroupSize[0], properties.limits.maxComputeWorkGroupInvocations);
+		const uint32_t count = static_cast<uint32_t>(bodies.size());
+		const uint32_t workgroupSize = options.workgroupSize > 0
+			? options.workgroupSize
+			: static_cast<uint32_t>(dhh::memory::alignUp(count, 32));
+		if (workgroupSize < count || workgroupSize > maxWorkgroupSize)
+		{
+			throw std::runtime_error("In-core workgroup of " + std::to_string(workgroupSize) + " cannot hold "
+				+ std::to_string(count) + " bodies (device limit " + std::to_string(maxWorkgroupSize)
+				+ "), use --out-of-core for larger N");
+		}
 
-		dhh::shader::Shader vertexShader(shaders_directory / "shader.vert");
-		dhh::shader::Shader fragmentShader(shaders_directory / "shader.frag");
+		return dhh::shader::Specialization()
+			.set(0, workgroupSize)
+			.set(1, count)
+			.set(2, options.leapfrog ? 1u : 0u)
+			.set(3, static_cast<VkBool32>(options.singlePrecisionForces))
+			.set(4, options.softening);
+	}
 
-		trianglePipe = new dhh::shader::Pipeline(device, { &vertexShader, &fragmentShader }, descriptorPool, renderPass,
+	void CreateComputePipeline(dhh::shader::Shader& compute, dhh::shader::Shader& cache)
+	{
+		computePipe =
+			new dhh::shader::Pipeline(device, &compute, descriptorPool, pipelineCache, computeSpecialization());
+		cachePipe = new dhh::shader::Pipeline(device, { &cache }, descriptorPool, pipelineCache);
+	}
+
+	void createTrianglePipeline(dhh::shader::Shader& vertex, dhh::shader::Shader& fragment)
+	{
+		trianglePipe = new dhh::shader::Pipeline(device, { &vertex, &fragment }, descriptorPool,
+			renderPass,
 			dhh::vk::initializer::pipelineMultisampleStateCreateInfo(VK_SAMPLE_COUNT_1_BIT),
 			{ VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR },
 			dhh::vk::initializer::pipelineRasterizationStateCreateInfo(
@@ -307,7 +1356,8 @@ public:
 				| VK_COLOR_COMPONENT_B_BIT
 				| VK_COLOR_COMPONENT_A_BIT,
 				false),
-			dhh::vk::initializer::pipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_POINT_LIST));
+			dhh::vk::initializer::pipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_POINT_LIST),
+			pipelineCache);
 	}
 
 
@@ -328,6 +1378,12 @@ public:
 				clearValues, framebuffers[i], renderPass, windowWidth, windowHeight);
 
 			vkBeginCommandBuffer(commandBuffers[i], &cmdBufInfo);
+			uint32_t renderPassScope = 0;
+			if (renderTiming)
+			{
+				renderTiming->reset(commandBuffers[i], i);
+				renderPassScope = renderTiming->begin(commandBuffers[i], i, "render pass");
+			}
 
 			// Start the first sub pass specified in our default render pass setup by the base class
 			// This will clear the color and depth attachment
@@ -369,9 +1425,13 @@ public:
 
 			// draw trajectory
 			vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, &trajectoryBuffer.buffer, offsets);
-			vkCmdDraw(commandBuffers[i], trajectories.size(), 1, 0, 0);
+			vkCmdDraw(commandBuffers[i], trajectoryLength, 1, 0, 0);
 
 			vkCmdEndRenderPass(commandBuffers[i]);
+			if (renderTiming)
+			{
+				renderTiming->end(commandBuffers[i], i, renderPassScope);
+			}
 
 			// Ending the render pass will add an implicit barrier transitioning the frame buffer color attachment to
 			// VK_IMAGE_LAYOUT_PRESENT_SRC_KHR for presenting it to the windowing system
@@ -380,50 +1440,530 @@ public:
 		}
 	}
 
+	// Hot reload: recompiles the shaders when a source changed since the last poll and swaps in new pipelines. A
+	// shader that fails to compile leaves the running pipelines in place.
+	void reloadShadersIfChanged()
+	{
+		const double now = glfwGetTime();
+		if (now - lastShaderPoll < ShaderPollInterval)
+		{
+			return;
+		}
+		lastShaderPoll = now;
+
+		const std::filesystem::file_time_type latest = latestShaderChange();
+		if (latest == shaderSourceTime)
+		{
+			return;
+		}
+		shaderSourceTime = latest;
+
+		try
+		{
+			Shaders shaders = loadShaders();
+			replacePipelines(shaders);
+			std::cout << "Reloaded shaders from " << dhh::shader::runtimeSourceDirectory() << "\n";
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Shader reload failed: " << e.what() << "\n";
+		}
+	}
+
+	std::filesystem::file_time_type latestShaderChange() const
+	{
+		std::filesystem::file_time_type latest;
+		for (const char* name : {"shader.vert", "shader.frag", "nbody.comp", "cache.comp"})
+		{
+			std::error_code error;
+			const auto time = std::filesystem::last_write_time(dhh::shader::runtimeSourceDirectory() / name, error);
+			if (!error)
+			{
+				latest = std::max(latest, time);
+			}
+		}
+		return latest;
+	}
+
+	// Every command buffer of the pool records the old pipelines, so they are all re-recorded while the device
+	// is idle and the simulation thread is stopped
+	void replacePipelines(Shaders& shaders)
+	{
+		stopSimulation();
+		vkDeviceWaitIdle(device);
+
+		delete trianglePipe;
+		createTrianglePipeline(shaders.vertex, shaders.fragment);
+		WriteGraphicsDescriptorSet();
+		if (inCore())
+		{
+			delete computePipe;
+			delete cachePipe;
+			CreateComputePipeline(shaders.compute, shaders.cache);
+			writeComputeDescriptorSet();
+		}
+
+		vkResetCommandPool(device, commandPool, 0);
+		buildCommandBuffers();
+		if (inCore())
+		{
+			recordComputeCommandBuffer();
+		}
+		startSimulation();
+	}
+
+	void renderFrame()
+	{
+		NBODY_TRACE_SCOPE("drawFrame");
+		const uint32_t image = drawFrame();
+		if (renderTiming)
+		{
+			renderTiming->submitted(image);
+			renderTiming->collect();
+		}
+	}
+
+	void printGpuTiming(std::ostream& out) const
+	{
+		const dhh::profile::GpuProfiler* timings[] = {
+			renderTiming.get(), computeTiming.get(), outOfCore ? outOfCore->gpuTiming() : nullptr};
+		for (const dhh::profile::GpuProfiler* timing : timings)
+		{
+			if (timing != nullptr)
+			{
+				timing->print(out);
+			}
+		}
+	}
+
+	// Interpolates between the last two snapshots, trails get one point per picked up snapshot
 	void UpdateVertexBuffer()
 	{
-		const double scale = 1 / 300000000000.f;
+		NBODY_TRACE_SCOPE("UpdateVertexBuffer");
 		void* data;
-		vmaMapMemory(allocator, computeBuffer.memory, &data);
-		std::vector<Body> fuck(bodies.size());
-		memcpy(fuck.data(), data, sizeof(Body) * bodies.size());
-		vmaUnmapMemory(allocator, computeBuffer.memory);
-
-		std::vector<glm::vec3> positions(bodies.size());
-		for (int i = 0; i < bodies.size(); ++i)
+		if (snapshots.pending())
 		{
-			positions[i] = fuck[i].position * scale;
-			trajectories[trajectoryIndex * 3 + i] = positions[i];
-			/*trajectories[trajectoryIndex * 6 + i * 2 + 1] = glm::vec3(1,0,0);*/
+			// the front slot goes back to the simulation thread on consume(), keep a copy to blend from
+			const Snapshot& latest = snapshots.front();
+			std::copy(latest.positions.begin(), latest.positions.end(), previous.positions.begin());
+			previous.step = latest.step;
+			previous.time = latest.time;
+			snapshots.consume();
+
+			const Snapshot& fresh = snapshots.front();
+			vmaMapMemory(allocator, trajectoryBuffer.memory, &data);
+			glm::vec3* trajectory = static_cast<glm::vec3*>(data);
+			const size_t trajectoryBase = size_t(trajectoryIndex) * bodies.size();
+			for (size_t i = 0; i < bodies.size(); ++i)
+			{
+				trajectory[(trajectoryBase + i) % trajectoryLength] = fresh.positions[i];
+			}
+			vmaUnmapMemory(allocator, trajectoryBuffer.memory);
+			++trajectoryIndex;
 		}
-		++trajectoryIndex;
+
+		// render one snapshot interval behind the simulation, so there is always a later state to blend towards
+		const Snapshot& current = snapshots.front();
+		const double interval = current.time - previous.time;
+		const float alpha =
+			interval > 0 ? static_cast<float>(std::clamp((glfwGetTime() - current.time) / interval, 0.0, 1.0)) : 1.f;
 
 		vmaMapMemory(allocator, vertices.memory, &data);
-		memcpy(data, positions.data(), sizeof(glm::vec3) * bodies.size());
+		glm::vec3* positions = static_cast<glm::vec3*>(data);
+		for (size_t i = 0; i < bodies.size(); ++i)
+		{
+			positions[i] = glm::mix(previous.positions[i], current.positions[i], alpha);
+		}
 		vmaUnmapMemory(allocator, vertices.memory);
-
-		vmaMapMemory(allocator, trajectoryBuffer.memory, &data);
-		memcpy(data, trajectories.data(), sizeof(glm::vec3) * trajectories.size());
-		vmaUnmapMemory(allocator, trajectoryBuffer.memory);
 	}
 };
 
 
+// Time from process start until the first step can run, with where the shaders and pipelines came from and the
+// phases in between
+static void reportStartup(const VulkanBase& base, std::chrono::steady_clock::time_point start)
+{
+	const double milliseconds =
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Startup " << std::fixed << std::setprecision(1) << milliseconds << " ms: "
+		<< dhh::shader::ShaderCache::instance().summary() << ", pipeline cache "
+		<< (base.pipelineCacheLoadedBytes > 0 ? "warm (" + std::to_string(base.pipelineCacheLoadedBytes) + " bytes)"
+			: std::string("cold")) << std::defaultfloat << "\n";
+	dhh::startup::Timeline::instance().print(std::cout);
+}
+
+static void writeTrace(const dhh::options::Options& options)
+{
+	if (options.traceFile.empty())
+	{
+		return;
+	}
+	if (dhh::trace::Tracer::instance().writeChromeTrace(options.traceFile))
+	{
+		std::cout << "Trace written to " << options.traceFile << "\n";
+	}
+	else
+	{
+		std::cerr << "Cannot write trace " << options.traceFile << "\n";
+	}
+}
+
+// Tunes the out-of-core force kernel at --bodies N, or over a range of body counts, and merges the winners into
+// the device's tuning file
+static int autotune(VulkanBase& base, const dhh::options::Options& options)
+{
+	const std::vector<uint32_t> bodyCounts =
+		options.bodyCount > 0 ? std::vector<uint32_t>{options.bodyCount} : std::vector<uint32_t>{1024, 4096, 16384};
+
+	std::vector<dhh::nbody::TunedKernel> results = dhh::nbody::loadTuning(base.physicalDevice);
+	dhh::nbody::Autotuner tuner(base);
+	for (uint32_t bodyCount : bodyCounts)
+	{
+		dhh::nbody::BodyArray bodies;
+		Triangle::fillRandomBodies(bodyCount, bodies);
+		const dhh::nbody::TunedKernel best = tuner.tune(bodies, std::cout);
+		std::cout << bodyCount << " bodies: " << best.tuning << "\n";
+
+		results.erase(std::remove_if(results.begin(), results.end(),
+			[&](const dhh::nbody::TunedKernel& result) { return result.bodyCount == bodyCount; }), results.end());
+		results.push_back(best);
+	}
+	std::sort(results.begin(), results.end(), [](const auto& a, const auto& b) { return a.bodyCount < b.bodyCount; });
+	dhh::nbody::saveTuning(base.physicalDevice, results);
+	base.savePipelineCache();
+	std::cout << "Tuning written to " << dhh::nbody::tuningPath(base.physicalDevice) << "\n";
+	return 0;
+}
+
+// --ephemeris-query: one "body time" pair per input line, answered with the position and velocity at that time
+static int queryEphemeris(const std::filesystem::path& path, std::istream& in, std::ostream& out)
+{
+	const dhh::nbody::EphemerisReader ephemeris(path);
+	std::cerr << ephemeris.header().bodyCount << " bodies, t = " << ephemeris.startTime() << " to "
+		<< ephemeris.endTime() << " s\n";
+	out << std::setprecision(17);
+	size_t body;
+	double time;
+	while (in >> body >> time)
+	{
+		glm::dvec3 position;
+		glm::dvec3 velocity;
+		ephemeris.state(body, time, position, velocity);
+		out << body << " " << time << " " << position.x << " " << position.y << " " << position.z << " "
+			<< velocity.x << " " << velocity.y << " " << velocity.z << "\n";
+	}
+	return 0;
+}
+
+#ifndef _WIN32
+// --connect: one request to a running --serve instance, printed as text
+static int connectService(const dhh::options::Options& options)
+{
+	std::istringstream words(options.serviceRequest);
+	std::string command;
+	words >> command;
+	std::vector<double> numbers;
+	std::string list;
+	words >> list;
+	std::replace(list.begin(), list.end(), ',', ' ');
+	std::istringstream values(list);
+	for (double value; values >> value;)
+	{
+		numbers.push_back(value);
+	}
+
+	dhh::nbody::QueryClient client(options.serviceConnect);
+	dhh::nbody::QueryClient::Reply reply;
+	if (command == "snapshot")
+	{
+		reply = client.snapshot();
+	}
+	else if (command == "bodies" && !numbers.empty())
+	{
+		reply = client.subset(std::vector<uint32_t>(numbers.begin(), numbers.end()));
+	}
+	else if (command == "region" && numbers.size() == 6)
+	{
+		reply = client.region(glm::dvec3(numbers[0], numbers[1], numbers[2]),
+			glm::dvec3(numbers[3], numbers[4], numbers[5]));
+	}
+	else if (command == "diagnostics")
+	{
+		reply = client.diagnostics();
+	}
+	else if (command == "pause" || command == "resume")
+	{
+		reply = client.pause(command == "pause");
+	}
+	else if (command == "step")
+	{
+		reply = client.step(numbers.empty() ? 1 : static_cast<uint32_t>(numbers[0]));
+	}
+	else
+	{
+		std::cerr << "--request is one of snapshot, bodies I,J,..., region X0,Y0,Z0,X1,Y1,Z1, diagnostics, pause, "
+			"resume, step N\n";
+		return 1;
+	}
+
+	if (reply.header.status != dhh::nbody::QueryStatus::Ok)
+	{
+		std::cerr << "Request failed with status " << static_cast<uint32_t>(reply.header.status) << "\n";
+		return 1;
+	}
+	std::cout << "step " << reply.header.step << ", t = " << reply.header.time << " s\n" << std::setprecision(17);
+	if (command == "diagnostics")
+	{
+		const dhh::nbody::QueryDiagnostics& d = reply.diagnostics;
+		std::cout << "bodies " << d.bodyCount << (d.paused ? ", paused" : "") << "\nmass " << d.totalMass
+			<< "\nkinetic energy " << d.kineticEnergy << "\nmomentum " << d.momentum[0] << " " << d.momentum[1] << " "
+			<< d.momentum[2] << "\nangular momentum " << d.angularMomentum[0] << " " << d.angularMomentum[1] << " "
+			<< d.angularMomentum[2] << "\ncentre of mass " << d.centreOfMass[0] << " " << d.centreOfMass[1] << " "
+			<< d.centreOfMass[2] << "\nstates published " << d.published << ", skipped " << d.skipped << "\n";
+	}
+	for (size_t i = 0; i < reply.bodies.size(); ++i)
+	{
+		const uint64_t index = command == "region" ? reply.indices[i]
+			: command == "bodies" ? static_cast<uint64_t>(numbers[i]) : i;
+		const Body& body = reply.bodies[i];
+		std::cout << index << " " << body.position.x << " " << body.position.y << " " << body.position.z << " "
+			<< body.velocity.x << " " << body.velocity.y << " " << body.velocity.z << " " << body.mass << "\n";
+	}
+	return 0;
+}
+#endif
+
 int main(int argc, char* argv[])
 {
 	try
 	{
-		Triangle app;
+		const auto processStart = std::chrono::steady_clock::now();
+		dhh::startup::Timeline::instance().setOrigin(processStart);
+		const dhh::options::Options options = dhh::options::parse(argc, argv);
+		if (!options.traceFile.empty())
+		{
+			if (!dhh::trace::enabledAtBuild())
+			{
+				std::cerr << "--trace needs a build with NBODY_TRACING\n";
+				return 1;
+			}
+			dhh::trace::Tracer::instance().start(processStart);
+			dhh::trace::Tracer::instance().setThreadName("main");
+		}
+		dhh::shader::ShaderCache::instance().setDirectory(options.noCache ? "" : options.cacheDirectory);
+		if (options.hotReload || !options.shaderSource.empty())
+		{
+#ifdef NBODY_RUNTIME_SHADERS
+			dhh::shader::runtimeSourceDirectory() =
+				options.shaderSource.empty() ? dhh::shader::findShaderDirectory() : options.shaderSource;
+#else
+			std::cerr << "--shader-source and --hot-reload need a build with NBODY_RUNTIME_SHADERS\n";
+			return 1;
+#endif
+		}
+
+		if (!options.ephemerisQuery.empty())
+		{
+			return queryEphemeris(options.ephemerisQuery, std::cin, std::cout);
+		}
+
+		if (!options.serviceConnect.empty())
+		{
+#ifndef _WIN32
+			return connectService(options);
+#else
+			std::cerr << "--connect needs Unix domain sockets, not supported on Windows\n";
+			return 1;
+#endif
+		}
+
+		if (options.autotune)
+		{
+			VulkanBase context(false, true);
+			context.preferredDevice = options.device;
+			context.init();
+			return autotune(context, options);
+		}
+
+		if (options.outOfCoreReport)
+		{
+			VulkanBase context(false, true);
+			context.preferredDevice = options.device;
+			context.init();
+
+			dhh::nbody::BodyArray bodies;
+			Triangle::fillRandomBodies(options.bodyCount > 0 ? options.bodyCount : 1 << 16, bodies);
+
+			dhh::nbody::OutOfCoreSolver solver(context, bodies, outOfCoreConfig(options), options.bodyFile);
+			reportStartup(context, processStart);
+			context.savePipelineCache();
+			solver.report(options.reportSteps);
+			if (solver.gpuTiming() != nullptr)
+			{
+				solver.gpuTiming()->print(std::cout);
+			}
+			writeTrace(options);
+			if (options.memoryStats)
+			{
+				context.memoryTracker.dump(std::cout);
+			}
+			return 0;
+		}
+
+		if (!options.ensembleFile.empty() || options.ensembleSystems > 0)
+		{
+			VulkanBase context(false, true);
+			context.preferredDevice = options.device;
+			context.init();
+
+			dhh::nbody::Ensemble ensemble;
+			if (!options.ensembleFile.empty())
+			{
+				ensemble = dhh::nbody::loadEnsemble(options.ensembleFile);
+			}
+			else
+			{
+				dhh::nbody::BodyArray preset;
+				Triangle::fillPresetBodies(preset);
+				ensemble = dhh::nbody::perturbEnsemble(preset, options.ensembleSystems, options.ensembleSpread);
+			}
+
+			dhh::nbody::EnsembleSolver solver(context, ensemble, ensembleConfig(options));
+			reportStartup(context, processStart);
+			context.savePipelineCache();
+			solver.run();
+			solver.report(std::cout);
+			writeTrace(options);
+			if (!options.ensembleOutput.empty())
+			{
+				dhh::nbody::saveEnsemble(options.ensembleOutput, solver.result(), solver.systemStates());
+			}
+			if (!options.ensembleEvents.empty())
+			{
+				dhh::nbody::saveEnsembleEvents(options.ensembleEvents, solver.events());
+			}
+			return 0;
+		}
+
+		if (!options.replayFile.empty() && (options.outOfCore || !options.restartFile.empty()
+			|| !options.checkpointFile.empty() || !options.outputFile.empty() || !options.ephemerisFile.empty()))
+		{
+			std::cerr << "--replay cannot be combined with --out-of-core, --restart, --checkpoint, --output or "
+				"--ephemeris\n";
+			return 1;
+		}
+		if (!options.loadFile.empty() && (!options.replayFile.empty() || !options.restartFile.empty()))
+		{
+			std::cerr << "--load cannot be combined with --replay or --restart\n";
+			return 1;
+		}
+
+		Triangle app(options);
+		reportStartup(app, processStart);
+		app.savePipelineCache();
+		app.startSimulation();
+
+		// declared after the app, so it is destroyed (and writes the final state) first
+		dhh::metrics::Histogram* frameSeconds = nullptr;
+		std::unique_ptr<dhh::metrics::Exporter> metricsExporter;
+		if (!options.metricsFile.empty() || options.metricsPort != 0)
+		{
+			dhh::metrics::Registry& registry = dhh::metrics::Registry::instance();
+			frameSeconds = &registry.histogram("nbody_frame_seconds", "Wall-clock time per rendered frame",
+				dhh::metrics::Histogram::exponentialBounds(0.001, 1.5, 16));
+			metricsExporter = std::make_unique<dhh::metrics::Exporter>(
+				registry, options.metricsFile, options.metricsInterval, options.metricsPort);
+		}
 
 		int anchor = 0;
 		double years = 0;
-		while (glfwWindowShouldClose(app.window) != GLFW_TRUE)
+		const double startTime = glfwGetTime();
+		double lastMemoryLog = startTime;
+		double lastFrame = startTime;
+		uint64_t frame = 0;
+		uint64_t steadyStateAllocations = 0;
+		const uint64_t warmupFrames = 60;
+		while (glfwWindowShouldClose(app.window) != GLFW_TRUE && !app.simulationFailed)
 		{
+			const uint64_t allocationsBefore = dhh::memory::heapAllocationCount();
 			app.updateTransform();
 			app.UpdateVertexBuffer();
-			app.drawFrame();
-			app.Compute();
-			glfwPollEvents();
+			app.renderFrame();
+			{
+				NBODY_TRACE_SCOPE("glfwPollEvents");
+				glfwPollEvents();
+			}
+			if (options.hotReload)
+			{
+				app.reloadShadersIfChanged();
+			}
+			if (!options.replayFile.empty())
+			{
+				app.processReplayKeys();
+			}
+			if (frameSeconds != nullptr)
+			{
+				const double now = glfwGetTime();
+				frameSeconds->observe(now - lastFrame);
+				lastFrame = now;
+			}
+			if (++frame > warmupFrames)
+			{
+				steadyStateAllocations += dhh::memory::heapAllocationCount() - allocationsBefore;
+			}
+
+			if (options.memoryLogInterval > 0 && glfwGetTime() - lastMemoryLog >= options.memoryLogInterval)
+			{
+				lastMemoryLog = glfwGetTime();
+				std::cout << app.memoryTracker.logLine() << "\n";
+			}
+		}
+		app.stopSimulation();
+		app.rethrowSimulationFailure();
+		if (!options.checkpointFile.empty())
+		{
+			app.saveCheckpoint();
+		}
+		if (!options.outputFile.empty())
+		{
+			app.finishOutput(std::cout);
+		}
+		if (!options.replayFile.empty())
+		{
+			app.finishReplay(std::cout);
+		}
+		if (!options.ephemerisFile.empty())
+		{
+			app.finishEphemeris(std::cout);
+		}
+		writeTrace(options);
+
+		const double elapsed = glfwGetTime() - startTime;
+		std::cout << "Simulated " << app.simulatedSteps << " steps (" << app.simulatedSteps / elapsed
+			<< " steps/s), rendered " << frame << " frames (" << frame / elapsed << " fps)\n";
+
+		app.printGpuTiming(std::cout);
+		if (options.memoryStats)
+		{
+			app.memoryTracker.dump(std::cout);
+		}
+
+		if (options.checkAllocations)
+		{
+			if (!dhh::memory::heapAllocationCountEnabled())
+			{
+				std::cerr << "--check-allocations needs a build with NBODY_COUNT_ALLOCATIONS\n";
+				return 1;
+			}
+			// counted per thread: the render thread's frames and the simulation thread's steps, not the exporter,
+			// writer or trace threads
+			const uint64_t measuredFrames = frame > warmupFrames ? frame - warmupFrames : 0;
+			const uint64_t measuredSteps =
+				app.simulatedSteps > Triangle::WarmupSteps ? app.simulatedSteps - Triangle::WarmupSteps : 0;
+			const uint64_t stepAllocations = app.steadyStateStepAllocations;
+			std::cout << "Steady-state heap allocations: " << steadyStateAllocations << " in " << measuredFrames
+				<< " frames, " << stepAllocations << " in " << measuredSteps << " steps\n";
+			return steadyStateAllocations == 0 && stepAllocations == 0 ? 0 : 1;
 		}
 	}
 	catch (std::exception& e)
@@ -0,0 +1,185 @@
+#include "Allocator.hpp"
+#include "Body.hpp"
+#include "HostSolver.hpp"
+#include "ThreadPool.hpp"
+#include "TripleBuffer.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs the host side of the steady-state loop, counting heap allocations per thread (NBODY_COUNT_ALLOCATIONS):
+// HostSolver steps on a thread pool, a producer thread filling and publishing snapshots through the TripleBuffer
+// and the consumer copying them into a reused AlignedArray, the way the simulation thread and UpdateVertexBuffer()
+// do. A thread that allocates all the time, like the metrics exporter rendering its text, runs alongside and must
+// not change the result. Exits with 1 if a measured thread allocated after warm-up.
+
+namespace
+{
+	constexpr size_t BodyCount = 1000;
+	constexpr uint64_t WarmupSteps = 10;
+	constexpr uint64_t MeasuredSteps = 200;
+
+	struct Snapshot
+	{
+		dhh::memory::AlignedArray<glm::vec3> positions;
+		uint64_t step = 0;
+	};
+
+	dhh::nbody::BodyArray makeBodies()
+	{
+		dhh::nbody::BodyArray bodies(BodyCount);
+		for (size_t i = 0; i < bodies.size(); ++i)
+		{
+			const double angle = 0.01 * static_cast<double>(i);
+			const double radius = 1e11 * (1 + 0.001 * static_cast<double>(i));
+			bodies[i].position = glm::dvec3(radius * std::cos(angle), radius * std::sin(angle), 1e9 * (i % 7));
+			bodies[i].velocity = glm::dvec3(-3e4 * std::sin(angle), 3e4 * std::cos(angle), 0);
+			bodies[i].mass = 1e24 * (1 + i % 5);
+		}
+		return bodies;
+	}
+
+	// allocations of every pool worker so far, each read on the worker itself
+	void workerAllocations(dhh::thread::ThreadPool& pool, std::vector<uint64_t>& counts)
+	{
+		pool.parallelFor(pool.size(), [&counts](uint32_t worker, size_t, size_t) {
+			counts[worker] = dhh::memory::heapAllocationCount();
+		});
+	}
+}
+
+int main()
+{
+	if (!dhh::memory::heapAllocationCountEnabled())
+	{
+		std::cout << "nbody-allocation-check needs a build with NBODY_COUNT_ALLOCATIONS\n";
+		return 1;
+	}
+
+	// the counter has to see an allocation, or every check below passes trivially
+	const uint64_t probeBefore = dhh::memory::heapAllocationCount();
+	delete new std::string(64, 'x');
+	if (dhh::memory::heapAllocationCount() == probeBefore)
+	{
+		std::cout << "operator new is not counted\n";
+		return 1;
+	}
+
+	std::atomic<bool> running{true};
+	std::thread noise([&running] {
+		std::vector<std::string> lines;
+		while (running)
+		{
+			lines.push_back(std::string(200, 'm'));
+			if (lines.size() > 64)
+			{
+				lines.clear();
+				lines.shrink_to_fit();
+			}
+		}
+	});
+
+	dhh::thread::ThreadPool pool(4);
+	const dhh::nbody::BodyArray bodies = makeBodies();
+	dhh::nbody::HostSolver solver(bodies, 60, pool);
+	dhh::nbody::BodyArray state(BodyCount);
+
+	dhh::thread::TripleBuffer<Snapshot> snapshots;
+	for (uint32_t slot = 0; slot < 3; ++slot)
+	{
+		snapshots.slot(slot).positions.allocate(BodyCount, true);
+	}
+	Snapshot previous;
+	previous.positions.allocate(BodyCount, true);
+
+	uint64_t solverAllocations = 0;
+	std::vector<uint64_t> workersBefore(pool.size());
+	std::vector<uint64_t> workersAfter(pool.size());
+	for (uint64_t step = 0; step < WarmupSteps + MeasuredSteps; ++step)
+	{
+		if (step == WarmupSteps)
+		{
+			workerAllocations(pool, workersBefore);
+		}
+		const uint64_t before = dhh::memory::heapAllocationCount();
+		solver.step();
+		solver.read(state.data());
+		if (step >= WarmupSteps)
+		{
+			solverAllocations += dhh::memory::heapAllocationCount() - before;
+		}
+	}
+	workerAllocations(pool, workersAfter);
+	uint64_t poolAllocations = 0;
+	for (uint32_t worker = 0; worker < pool.size(); ++worker)
+	{
+		poolAllocations += workersAfter[worker] - workersBefore[worker];
+	}
+
+	// the producer publishes from the solved state, the consumer picks up snapshots while it comes
+	std::atomic<uint64_t> producerAllocations{0};
+	std::atomic<bool> producing{true};
+	std::thread producer([&] {
+		uint64_t allocations = 0;
+		for (uint64_t step = 1; step <= WarmupSteps + MeasuredSteps; ++step)
+		{
+			const uint64_t before = dhh::memory::heapAllocationCount();
+			Snapshot& snapshot = snapshots.back();
+			for (size_t i = 0; i < BodyCount; ++i)
+			{
+				snapshot.positions[i] = glm::vec3(state[i].position * (1 / 3e11));
+			}
+			snapshot.step = step;
+			snapshots.publish();
+			if (step > WarmupSteps)
+			{
+				allocations += dhh::memory::heapAllocationCount() - before;
+			}
+			std::this_thread::yield();
+		}
+		producerAllocations = allocations;
+		producing = false;
+	});
+
+	uint64_t consumerAllocations = 0;
+	uint64_t consumed = 0;
+	uint64_t lastStep = 0;
+	while (producing || snapshots.pending())
+	{
+		const uint64_t before = dhh::memory::heapAllocationCount();
+		if (snapshots.pending())
+		{
+			const Snapshot& latest = snapshots.front();
+			std::copy(latest.positions.begin(), latest.positions.end(), previous.positions.begin());
+			previous.step = latest.step;
+			snapshots.consume();
+			lastStep = snapshots.front().step;
+			++consumed;
+		}
+		if (lastStep > WarmupSteps)
+		{
+			consumerAllocations += dhh::memory::heapAllocationCount() - before;
+		}
+	}
+	producer.join();
+	running = false;
+	noise.join();
+
+	std::cout << "Heap allocations after warm-up: solver " << solverAllocations << ", pool workers "
+		<< poolAllocations << ", snapshot producer " << producerAllocations << ", consumer " << consumerAllocations
+		<< " (" << consumed << " snapshots)\n";
+	if (lastStep != WarmupSteps + MeasuredSteps)
+	{
+		std::cout << "The last snapshot consumed was step " << lastStep << "\n";
+		return 1;
+	}
+	return solverAllocations + poolAllocations + producerAllocations + consumerAllocations == 0 ? 0 : 1;
+}
@@ -0,0 +1,679 @@
+#include "BodyLoader.hpp"
+#include "Diagnostics.hpp"
+#include "HostSolver.hpp"
+#include "InitialConditions.hpp"
+#include "OutOfCore.hpp"
+#include "ShaderCache.hpp"
+#include "ThreadPool.hpp"
+#include "Trajectory.hpp"
+#include "VulkanBase.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Headless benchmark of the solver engines over a sweep of body counts and distributions. Every engine starts
+// from the same state at rest, so the velocities after the first step are the accelerations times the step
+// length; they are compared against a double precision direct sum on a sample of bodies. Without a Vulkan
+// device (or with --engines cpu) only the CPU engine runs. The CPU engine's run is also recorded as a compressed
+// trajectory, to measure the compression ratio and the coding throughput against disk bandwidth. With
+// --loader-rows the initial condition loader is timed on a CSV and a binary file of that many bodies.
+
+namespace
+{
+	struct BenchOptions
+	{
+		std::vector<uint32_t> bodyCounts = {1024, 4096, 16384};
+		std::vector<std::string> engines = {"cpu", "gpu-streamed", "gpu-resident"};
+		std::vector<std::string> distributions = {"uniform", "plummer"};
+		uint32_t steps = 5;       // timed steps per run, after the first one
+		double stepLength = 0.0001;
+		uint32_t threads = 0;     // CPU engine workers, 0 uses every hardware thread
+		std::string device;       // Vulkan device whose name contains this, e.g. llvmpipe
+		std::filesystem::path cacheDirectory = "shader-cache";
+		double trajectoryError = 1e-6;   // error bound relative to the RMS position and speed, 0 skips the trajectory
+		uint32_t trajectoryFrames = 16;  // frames recorded, one per step
+		uint32_t loaderRows = 0;         // bodies in the loader benchmark files, 0 skips it
+		std::filesystem::path jsonFile;
+		std::filesystem::path csvFile;
+	};
+
+	// one engine at one body count and distribution
+	struct Result
+	{
+		std::string engine;
+		std::string distribution;
+		uint32_t bodies = 0;
+		uint32_t steps = 0;
+		double seconds = 0;
+		uint64_t deviceBytes = 0;
+		uint64_t hostBytes = 0;
+		// relative |a - reference| / |reference| over the sampled bodies, NaN when the engine cannot be read back
+		double maxForceError = std::numeric_limits<double>::quiet_NaN();
+		double rmsForceError = std::numeric_limits<double>::quiet_NaN();
+
+		double stepsPerSecond() const
+		{
+			return seconds > 0 ? steps / seconds : 0;
+		}
+
+		double interactionsPerSecond() const
+		{
+			return stepsPerSecond() * bodies * (bodies - 1.0);
+		}
+	};
+
+	// compressed trajectory of one body count and distribution
+	struct TrajectoryResult
+	{
+		std::string distribution;
+		uint32_t bodies = 0;
+		uint32_t frames = 0;
+		double positionError = 0;  // bounds
+		double velocityError = 0;
+		uint64_t rawBytes = 0;     // positions and velocities as doubles
+		uint64_t compressedBytes = 0;
+		double encodeSeconds = 0;  // including the write into the page cache
+		double decodeSeconds = 0;
+		double worstError = 0;     // largest error over the bound, at most 1 up to rounding
+
+		double ratio() const
+		{
+			return compressedBytes > 0 ? static_cast<double>(rawBytes) / compressedBytes : 0;
+		}
+
+		double encodeBytesPerSecond() const
+		{
+			return encodeSeconds > 0 ? rawBytes / encodeSeconds : 0;
+		}
+
+		double decodeBytesPerSecond() const
+		{
+			return decodeSeconds > 0 ? rawBytes / decodeSeconds : 0;
+		}
+	};
+
+	// one initial condition file loaded by BodyLoader
+	struct LoaderResult
+	{
+		std::string format;
+		uint32_t rows = 0;
+		uint64_t bytes = 0;
+		double seconds = 0;
+		bool exact = false;  // every body read back bit for bit
+
+		double rowsPerSecond() const
+		{
+			return seconds > 0 ? rows / seconds : 0;
+		}
+
+		double bytesPerSecond() const
+		{
+			return seconds > 0 ? bytes / seconds : 0;
+		}
+	};
+
+	// double precision accelerations of up to SampleCount bodies spread over the set
+	struct Reference
+	{
+		static constexpr size_t SampleCount = 256;
+
+		Reference(const dhh::nbody::BodyArray& bodies, dhh::thread::ThreadPool& pool)
+		{
+			const size_t samples = std::min(SampleCount, bodies.size());
+			indices.resize(samples);
+			accelerations.resize(samples);
+			pool.parallelFor(samples, [&](uint32_t, size_t begin, size_t end) {
+				for (size_t k = begin; k < end; ++k)
+				{
+					indices[k] = k * bodies.size() / samples;
+					accelerations[k] =
+						dhh::nbody::referenceAcceleration(bodies.data(), bodies.size(), indices[k]);
+				}
+			});
+		}
+
+		// velocity(i) after one step from rest, divided by the step length, is the engine's acceleration
+		void compare(const std::function<glm::dvec3(size_t)>& velocity, double stepLength, Result& result) const
+		{
+			double maximum = 0;
+			double squares = 0;
+			for (size_t k = 0; k < indices.size(); ++k)
+			{
+				const glm::dvec3 acceleration = velocity(indices[k]) / stepLength;
+				const double magnitude = glm::length(accelerations[k]);
+				const double error = magnitude > 0 ? glm::length(acceleration - accelerations[k]) / magnitude : 0;
+				maximum = std::max(maximum, error);
+				squares += error * error;
+			}
+			result.maxForceError = maximum;
+			result.rmsForceError = indices.empty() ? 0 : std::sqrt(squares / indices.size());
+		}
+
+		std::vector<size_t> indices;
+		std::vector<glm::dvec3> accelerations;
+	};
+
+	template <typename T>
+	std::vector<T> splitList(const std::string& value, const std::function<T(const std::string&)>& convert)
+	{
+		std::vector<T> items;
+		std::istringstream stream(value);
+		std::string item;
+		while (std::getline(stream, item, ','))
+		{
+			if (!item.empty())
+			{
+				items.push_back(convert(item));
+			}
+		}
+		return items;
+	}
+
+	void printUsage()
+	{
+		std::cout << "Usage: nbody-bench [options]\n"
+			"  --bodies N,N,...       body counts to sweep (default 1024,4096,16384)\n"
+			"  --engines E,E,...      cpu, gpu-streamed, gpu-resident (default all)\n"
+			"  --distributions D,...  uniform, plummer, king, hernquist, disk, zeldovich\n"
+			"                         (default uniform,plummer)\n"
+			"  --steps N              timed steps per run after the first (default 5)\n"
+			"  --step-length S        simulated seconds per step\n"
+			"  --threads N            CPU engine threads, 0 uses every hardware thread\n"
+			"  --device NAME          use the Vulkan device whose name contains NAME, e.g. llvmpipe\n"
+			"  --cache-dir PATH       directory for compiled shaders, tuning results and the pipeline cache\n"
+			"  --trajectory-error R   compressed trajectory error bound relative to the RMS position and speed\n"
+			"                         (default 1e-6), 0 skips the trajectory\n"
+			"  --trajectory-frames N  frames recorded for the trajectory (default 16)\n"
+			"  --loader-rows N        time loading N bodies from CSV and binary initial condition files\n"
+			"  --json PATH            write the results as JSON\n"
+			"  --csv PATH             write the results as CSV\n";
+	}
+
+	BenchOptions parse(int argc, char* argv[])
+	{
+		BenchOptions options;
+		const auto toCount = [](const std::string& value) { return static_cast<uint32_t>(std::stoul(value)); };
+		const auto toString = [](const std::string& value) { return value; };
+
+		const std::map<std::string, std::function<void(const std::string&)>> values = {
+			{"--bodies", [&](const std::string& value) { options.bodyCounts = splitList<uint32_t>(value, toCount); }},
+			{"--engines", [&](const std::string& value) { options.engines = splitList<std::string>(value, toString); }},
+			{"--distributions",
+				[&](const std::string& value) { options.distributions = splitList<std::string>(value, toString); }},
+			{"--steps", [&](const std::string& value) { options.steps = std::stoul(value); }},
+			{"--step-length", [&](const std::string& value) { options.stepLength = std::stod(value); }},
+			{"--threads", [&](const std::string& value) { options.threads = std::stoul(value); }},
+			{"--device", [&](const std::string& value) { options.device = value; }},
+			{"--cache-dir", [&](const std::string& value) { options.cacheDirectory = value; }},
+			{"--trajectory-error", [&](const std::string& value) { options.trajectoryError = std::stod(value); }},
+			{"--trajectory-frames", [&](const std::string& value) { options.trajectoryFrames = std::stoul(value); }},
+			{"--loader-rows", [&](const std::string& value) { options.loaderRows = std::stoul(value); }},
+			{"--json", [&](const std::string& value) { options.jsonFile = value; }},
+			{"--csv", [&](const std::string& value) { options.csvFile = value; }},
+		};
+
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string name = argv[i];
+			if (name == "--help" || name == "-h")
+			{
+				printUsage();
+				std::exit(0);
+			}
+			if (!values.count(name))
+			{
+				printUsage();
+				throw std::runtime_error("Unknown option " + name);
+			}
+			if (i + 1 >= argc)
+			{
+				throw std::runtime_error("Missing value for " + name);
+			}
+			values.at(name)(argv[++i]);
+		}
+		for (const std::string& engine : options.engines)
+		{
+			if (engine != "cpu" && engine != "gpu-streamed" && engine != "gpu-resident")
+			{
+				throw std::runtime_error("Unknown engine " + engine);
+			}
+		}
+		options.steps = std::max<uint32_t>(1, options.steps);
+		return options;
+	}
+
+	template <typename F>
+	double secondsOf(F&& fn)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		fn();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	Result runCpu(const dhh::nbody::BodyArray& bodies, const Reference& reference, const BenchOptions& options,
+		dhh::thread::ThreadPool& pool)
+	{
+		Result result;
+		dhh::nbody::HostSolver solver(bodies, options.stepLength, pool);
+		result.hostBytes = solver.bytes();
+
+		solver.step();
+		reference.compare([&](size_t i) { return solver.velocity(i); }, options.stepLength, result);
+		result.seconds = secondsOf([&] {
+			for (uint32_t i = 0; i < options.steps; ++i)
+			{
+				solver.step();
+			}
+		});
+		return result;
+	}
+
+	// Out-of-core solver streaming every source tile each step; the first step also warms up the pipelines
+	Result runGpuStreamed(VulkanBase& base, const dhh::nbody::BodyArray& bodies, const Reference& reference,
+		const BenchOptions& options)
+	{
+		Result result;
+		dhh::nbody::OutOfCoreConfig config;
+		config.stepLength = options.stepLength;
+		const VkDeviceSize deviceBefore = base.memoryTracker.deviceUsage().current;
+		const VkDeviceSize hostBefore = base.memoryTracker.hostUsage().current;
+		dhh::nbody::OutOfCoreSolver solver(base, bodies, config);
+		result.deviceBytes = base.memoryTracker.deviceUsage().current - deviceBefore;
+		// plus the current and next state in host memory
+		result.hostBytes = base.memoryTracker.hostUsage().current - hostBefore
+			+ 2 * bodies.size() * sizeof(dhh::nbody::Body);
+
+		solver.step();
+		reference.compare([&](size_t i) { return solver.bodies()[i].velocity; }, options.stepLength, result);
+		result.seconds = secondsOf([&] {
+			for (uint32_t i = 0; i < options.steps; ++i)
+			{
+				solver.step();
+			}
+		});
+		return result;
+	}
+
+	// The same force kernel with every body resident, nothing is read back so there is no force error
+	Result runGpuResident(VulkanBase& base, const dhh::nbody::BodyArray& bodies, const BenchOptions& options)
+	{
+		Result result;
+		dhh::nbody::OutOfCoreConfig config;
+		config.stepLength = options.stepLength;
+		const VkDeviceSize deviceBefore = base.memoryTracker.deviceUsage().current;
+		const VkDeviceSize hostBefore = base.memoryTracker.hostUsage().current;
+		dhh::nbody::OutOfCoreSolver solver(base, bodies, config);
+		result.deviceBytes = base.memoryTracker.deviceUsage().current - deviceBefore;
+		result.hostBytes = base.memoryTracker.hostUsage().current - hostBefore
+			+ 2 * bodies.size() * sizeof(dhh::nbody::Body);
+
+		solver.measureInCore(1);
+		result.seconds = solver.measureInCore(options.steps).seconds;
+		return result;
+	}
+
+	// Records the CPU engine's run one frame per step, the bounds relative to the RMS over the last frame; the
+	// trajectory goes to a temporary file that is removed afterwards
+	TrajectoryResult runTrajectory(const dhh::nbody::BodyArray& bodies, const BenchOptions& options,
+		dhh::thread::ThreadPool& pool)
+	{
+		const size_t count = bodies.size();
+		dhh::nbody::HostSolver solver(bodies, options.stepLength, pool);
+		std::vector<dhh::nbody::BodyArray> frames(options.trajectoryFrames, dhh::nbody::BodyArray(count));
+		for (dhh::nbody::BodyArray& frame : frames)
+		{
+			solver.step();
+			solver.read(frame.data());
+		}
+
+		double positions = 0;
+		double speeds = 0;
+		for (const dhh::nbody::Body& body : frames.back())
+		{
+			positions += glm::dot(body.position, body.position);
+			speeds += glm::dot(body.velocity, body.velocity);
+		}
+		dhh::nbody::TrajectoryConfig config;
+		config.positionError = options.trajectoryError * std::max(std::sqrt(positions / count), 1.0);
+		config.velocityError = options.trajectoryError * std::max(std::sqrt(speeds / count), 1.0);
+
+		TrajectoryResult result;
+		result.frames = options.trajectoryFrames;
+		result.positionError = config.positionError;
+		result.velocityError = config.velocityError;
+		result.rawBytes = uint64_t(result.frames) * count * 6 * sizeof(double);
+
+		const std::filesystem::path path = std::filesystem::temp_directory_path() / "nbody-bench-trajectory.trj";
+		result.encodeSeconds = secondsOf([&] {
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			dhh::nbody::TrajectoryEncoder encoder(count, config, pool);
+			for (uint32_t frame = 0; frame < result.frames; ++frame)
+			{
+				encoder.encode(frame + 1, (frame + 1) * options.stepLength, frames[frame].data(), out);
+			}
+			encoder.finish(out);
+			if (!out)
+			{
+				throw std::runtime_error("Cannot write " + path.string());
+			}
+		});
+		result.compressedBytes = std::filesystem::file_size(path);
+
+		dhh::nbody::TrajectoryReader reader(path);
+		dhh::nbody::BodyArray decoded(count);
+		for (uint32_t frame = 0; frame < result.frames; ++frame)
+		{
+			result.decodeSeconds += secondsOf([&] { reader.read(frame, decoded.data(), pool); });
+			for (size_t i = 0; i < count; ++i)
+			{
+				const glm::dvec3 position = decoded[i].position - frames[frame][i].position;
+				const glm::dvec3 velocity = decoded[i].velocity - frames[frame][i].velocity;
+				result.worstError = std::max({result.worstError,
+					std::max({std::abs(position.x), std::abs(position.y), std::abs(position.z)}) / config.positionError,
+					std::max({std::abs(velocity.x), std::abs(velocity.y), std::abs(velocity.z)})
+						/ config.velocityError});
+			}
+		}
+		std::filesystem::remove(path);
+		return result;
+	}
+
+	// Writes a Plummer sphere as CSV with a header and round-trip precision, and as raw doubles, to temporary
+	// files, then loads and removes each one. The files are still in the page cache, so this measures parsing.
+	std::vector<LoaderResult> runLoader(const BenchOptions& options, dhh::thread::ThreadPool& pool)
+	{
+		dhh::nbody::BodyArray bodies;
+		dhh::nbody::fillBodies(dhh::nbody::Distribution::Plummer, options.loaderRows, bodies, 42, &pool);
+		const std::filesystem::path directory = std::filesystem::temp_directory_path();
+		const std::filesystem::path csv = directory / "nbody-bench-bodies.csv";
+		const std::filesystem::path binary = directory / "nbody-bench-bodies.bin";
+		{
+			std::FILE* file = std::fopen(csv.string().c_str(), "w");
+			if (file == nullptr)
+			{
+				throw std::runtime_error("Cannot write " + csv.string());
+			}
+			std::fprintf(file, "mass,x,y,z,vx,vy,vz\n");
+			for (const dhh::nbody::Body& body : bodies)
+			{
+				std::fprintf(file, "%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n", body.mass, body.position.x,
+					body.position.y, body.position.z, body.velocity.x, body.velocity.y, body.velocity.z);
+			}
+			std::fclose(file);
+
+			std::ofstream out(binary, std::ios::binary | std::ios::trunc);
+			for (const dhh::nbody::Body& body : bodies)
+			{
+				const double record[7] = {body.mass, body.position.x, body.position.y, body.position.z,
+					body.velocity.x, body.velocity.y, body.velocity.z};
+				out.write(reinterpret_cast<const char*>(record), sizeof(record));
+			}
+			if (!out)
+			{
+				throw std::runtime_error("Cannot write " + binary.string());
+			}
+		}
+
+		std::vector<LoaderResult> results;
+		for (const std::filesystem::path& path : {csv, binary})
+		{
+			dhh::nbody::BodyArray loaded;
+			const dhh::nbody::LoadStats stats = dhh::nbody::BodyLoader(path, {}).load(loaded, pool);
+			LoaderResult result;
+			result.format = path == csv ? "csv" : "binary";
+			result.rows = static_cast<uint32_t>(stats.bodies);
+			result.bytes = stats.bytes;
+			result.seconds = stats.seconds;
+			result.exact = loaded.size() == bodies.size()
+				&& std::memcmp(loaded.data(), bodies.data(), bodies.size() * sizeof(dhh::nbody::Body)) == 0;
+			results.push_back(result);
+			std::filesystem::remove(path);
+		}
+		return results;
+	}
+
+	std::string jsonNumber(double value)
+	{
+		if (!std::isfinite(value))
+		{
+			return "null";
+		}
+		std::ostringstream stream;
+		stream << std::setprecision(6) << value;
+		return stream.str();
+	}
+
+	void writeJson(const std::filesystem::path& path, const std::vector<Result>& results,
+		const std::vector<TrajectoryResult>& trajectories, const std::vector<LoaderResult>& loaders,
+		const std::string& device, const BenchOptions& options, uint32_t threads)
+	{
+		std::ofstream out(path, std::ios::trunc);
+		out << "{\n  \"device\": " << (device.empty() ? "null" : "\"" + device + "\"") << ",\n  \"threads\": "
+			<< threads << ",\n  \"step_length\": " << jsonNumber(options.stepLength) << ",\n  \"results\": [";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result& result = results[i];
+			out << (i == 0 ? "\n" : ",\n") << "    {\"engine\": \"" << result.engine << "\", \"distribution\": \""
+				<< result.distribution << "\", \"bodies\": " << result.bodies << ", \"steps\": " << result.steps
+				<< ", \"seconds\": " << jsonNumber(result.seconds)
+				<< ", \"steps_per_second\": " << jsonNumber(result.stepsPerSecond())
+				<< ", \"interactions_per_second\": " << jsonNumber(result.interactionsPerSecond())
+				<< ", \"device_bytes\": " << result.deviceBytes << ", \"host_bytes\": " << result.hostBytes
+				<< ", \"max_force_error\": " << jsonNumber(result.maxForceError)
+				<< ", \"rms_force_error\": " << jsonNumber(result.rmsForceError) << "}";
+		}
+		out << "\n  ],\n  \"trajectory\": [";
+		for (size_t i = 0; i < trajectories.size(); ++i)
+		{
+			const TrajectoryResult& result = trajectories[i];
+			out << (i == 0 ? "\n" : ",\n") << "    {\"distribution\": \"" << result.distribution
+				<< "\", \"bodies\": " << result.bodies << ", \"frames\": " << result.frames
+				<< ", \"position_error\": " << jsonNumber(result.positionError)
+				<< ", \"velocity_error\": " << jsonNumber(result.velocityError)
+				<< ", \"raw_bytes\": " << result.rawBytes << ", \"compressed_bytes\": " << result.compressedBytes
+				<< ", \"ratio\": " << jsonNumber(result.ratio())
+				<< ", \"encode_bytes_per_second\": " << jsonNumber(result.encodeBytesPerSecond())
+				<< ", \"decode_bytes_per_second\": " << jsonNumber(result.decodeBytesPerSecond())
+				<< ", \"worst_error\": " << jsonNumber(result.worstError) << "}";
+		}
+		out << "\n  ],\n  \"loader\": [";
+		for (size_t i = 0; i < loaders.size(); ++i)
+		{
+			const LoaderResult& result = loaders[i];
+			out << (i == 0 ? "\n" : ",\n") << "    {\"format\": \"" << result.format << "\", \"rows\": " << result.rows
+				<< ", \"bytes\": " << result.bytes << ", \"seconds\": " << jsonNumber(result.seconds)
+				<< ", \"rows_per_second\": " << jsonNumber(result.rowsPerSecond())
+				<< ", \"bytes_per_second\": " << jsonNumber(result.bytesPerSecond())
+				<< ", \"exact\": " << (result.exact ? "true" : "false") << "}";
+		}
+		out << "\n  ]\n}\n";
+		if (!out)
+		{
+			throw std::runtime_error("Cannot write " + path.string());
+		}
+	}
+
+	void writeCsv(const std::filesystem::path& path, const std::vector<Result>& results)
+	{
+		std::ofstream out(path, std::ios::trunc);
+		out << "engine,distribution,bodies,steps,seconds,steps_per_second,interactions_per_second,device_bytes,"
+			"host_bytes,max_force_error,rms_force_error\n";
+		const auto number = [](double value) { return std::isfinite(value) ? jsonNumber(value) : std::string(); };
+		for (const Result& result : results)
+		{
+			out << result.engine << "," << result.distribution << "," << result.bodies << "," << result.steps << ","
+				<< number(result.seconds) << "," << number(result.stepsPerSecond()) << ","
+				<< number(result.interactionsPerSecond()) << "," << result.deviceBytes << "," << result.hostBytes
+				<< "," << number(result.maxForceError) << "," << number(result.rmsForceError) << "\n";
+		}
+		if (!out)
+		{
+			throw std::runtime_error("Cannot write " + path.string());
+		}
+	}
+
+	void printTrajectory(const TrajectoryResult& result)
+	{
+		const auto flags = std::cout.flags();
+		std::cout << "  " << std::left << std::setw(13) << "trajectory" << std::right << std::fixed
+			<< std::setprecision(2) << result.ratio() << "x smaller, encode " << std::setprecision(0)
+			<< result.encodeBytesPerSecond() / (1024.0 * 1024.0) << " MiB/s, decode "
+			<< result.decodeBytesPerSecond() / (1024.0 * 1024.0) << " MiB/s, worst error " << std::setprecision(3)
+			<< result.worstError << " of the bound\n";
+		std::cout.flags(flags);
+	}
+
+	void printLoader(const LoaderResult& result)
+	{
+		const auto flags = std::cout.flags();
+		std::cout << "  " << std::left << std::setw(13) << result.format << std::right << std::scientific
+			<< std::setprecision(3) << std::setw(11) << result.rowsPerSecond() << " rows/s " << std::fixed
+			<< std::setprecision(0) << std::setw(8) << result.bytesPerSecond() / (1024.0 * 1024.0) << " MiB/s"
+			<< (result.exact ? "" : ", bodies differ from the ones written") << "\n";
+		std::cout.flags(flags);
+	}
+
+	void printResult(const Result& result)
+	{
+		const auto flags = std::cout.flags();
+		std::cout << "  " << std::left << std::setw(13) << result.engine << std::right << std::scientific
+			<< std::setprecision(3) << std::setw(11) << result.stepsPerSecond() << " steps/s " << std::setw(11)
+			<< result.interactionsPerSecond() << " interactions/s  force error max " << result.maxForceError
+			<< " rms " << result.rmsForceError << std::fixed << std::setprecision(1) << "  "
+			<< result.deviceBytes / (1024.0 * 1024.0) << " MiB device, " << result.hostBytes / (1024.0 * 1024.0)
+			<< " MiB host\n";
+		std::cout.flags(flags);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		const BenchOptions options = parse(argc, argv);
+		dhh::shader::ShaderCache::instance().setDirectory(options.cacheDirectory);
+		dhh::thread::ThreadPool pool(
+			options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+
+		const bool wantsGpu = std::any_of(options.engines.begin(), options.engines.end(),
+			[](const std::string& engine) { return engine != "cpu"; });
+		std::unique_ptr<VulkanBase> gpu;
+		std::string deviceName;
+		if (wantsGpu)
+		{
+			try
+			{
+				auto base = std::make_unique<VulkanBase>(false, true);
+				base->preferredDevice = options.device;
+				base->init();
+				VkPhysicalDeviceProperties properties;
+				vkGetPhysicalDeviceProperties(base->physicalDevice, &properties);
+				deviceName = properties.deviceName;
+				gpu = std::move(base);
+			}
+			catch (std::exception& e)
+			{
+				std::cout << "GPU engines skipped: " << e.what() << "\n";
+			}
+		}
+		std::cout << "CPU engine on " << pool.size() << " thread(s)\n";
+
+		std::vector<Result> results;
+		std::vector<TrajectoryResult> trajectories;
+		for (const std::string& distributionName : options.distributions)
+		{
+			const dhh::nbody::Distribution distribution = dhh::nbody::parseDistribution(distributionName);
+			for (uint32_t bodyCount : options.bodyCounts)
+			{
+				dhh::nbody::BodyArray bodies;
+				dhh::nbody::fillBodies(distribution, bodyCount, bodies, 42, &pool);
+				for (dhh::nbody::Body& body : bodies)
+				{
+					body.velocity = glm::dvec3(0);
+				}
+				const Reference reference(bodies, pool);
+				std::cout << distributionName << ", " << bodyCount << " bodies\n";
+
+				for (const std::string& engine : options.engines)
+				{
+					if (engine != "cpu" && !gpu)
+					{
+						continue;
+					}
+					if (engine == "gpu-resident" && bodyCount > dhh::nbody::OutOfCoreConfig{}.blockSize)
+					{
+						std::cout << "  " << engine << ": body set exceeds the block size, skipped\n";
+						continue;
+					}
+
+					Result result = engine == "cpu" ? runCpu(bodies, reference, options, pool)
+						: engine == "gpu-streamed" ? runGpuStreamed(*gpu, bodies, reference, options)
+						: runGpuResident(*gpu, bodies, options);
+					result.engine = engine;
+					result.distribution = distributionName;
+					result.bodies = bodyCount;
+					result.steps = options.steps;
+					printResult(result);
+					results.push_back(result);
+				}
+
+				if (options.trajectoryError > 0 && options.trajectoryFrames > 0)
+				{
+					TrajectoryResult trajectory = runTrajectory(bodies, options, pool);
+					trajectory.distribution = distributionName;
+					trajectory.bodies = bodyCount;
+					printTrajectory(trajectory);
+					trajectories.push_back(trajectory);
+				}
+			}
+		}
+
+		std::vector<LoaderResult> loaders;
+		if (options.loaderRows > 0)
+		{
+			std::cout << "loader, " << options.loaderRows << " bodies\n";
+			loaders = runLoader(options, pool);
+			for (const LoaderResult& loader : loaders)
+			{
+				printLoader(loader);
+			}
+		}
+
+		if (gpu)
+		{
+			gpu->savePipelineCache();
+		}
+		if (!options.jsonFile.empty())
+		{
+			writeJson(options.jsonFile, results, trajectories, loaders, deviceName, options, pool.size());
+			std::cout << "Results written to " << options.jsonFile << "\n";
+		}
+		if (!options.csvFile.empty())
+		{
+			writeCsv(options.csvFile, results);
+			std::cout << "Results written to " << options.csvFile << "\n";
+		}
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+}
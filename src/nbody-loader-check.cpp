@@ -0,0 +1,170 @@
+#include "BodyLoader.hpp"
+#include "ThreadPool.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks the number parser of BodyLoader.hpp against std::strtod on the boundaries of its exact fast path (a
+// mantissa of 2^53, powers of ten beyond 1e22, 19 or more digits, runs of leading zeros, the eight-digit SWAR
+// blocks) and on random round-tripped doubles, then loads a small CSV with a header, comments, blank lines and
+// CRLF line endings. Prints every mismatch and exits with 1 if there was any.
+
+namespace
+{
+	int failures = 0;
+
+	// parseNumber and strtod must agree on the value, bit for bit, and on where the number ends
+	void checkNumber(const std::string& text)
+	{
+		const char* p = text.data();
+		double value = -1;
+		const bool parsed = dhh::nbody::load::parseNumber(p, text.data() + text.size(), value);
+
+		char* expectedEnd = nullptr;
+		const double expected = std::strtod(text.c_str(), &expectedEnd);
+		const bool expectedParsed = expectedEnd != text.c_str();
+		if (parsed != expectedParsed || (parsed && (p != expectedEnd || std::memcmp(&value, &expected, 8) != 0)))
+		{
+			++failures;
+			std::cout << "parseNumber(\"" << text << "\") = " << std::hexfloat << value << " ending at "
+				<< p - text.data() << ", strtod " << expected << " ending at " << expectedEnd - text.c_str()
+				<< std::defaultfloat << "\n";
+		}
+	}
+
+	void checkBoundaries()
+	{
+		const std::vector<std::string> numbers = {
+			// mantissa around 2^53 = 9007199254740992
+			"9007199254740991", "9007199254740992", "9007199254740993", "9007199254740995", "-9007199254740993",
+			"900719925474099.3", "0.9007199254740993", "9007199254740993e-5",
+			// powers of ten on and beyond the exact table
+			"1e22", "1e23", "1e-22", "1e-23", "123456789e22", "123456789e-22", "3e23", "7e-23", "1.5e22",
+			"12345678901234567e22", "1.7976931348623157e308", "2.2250738585072014e-308", "4.9e-324",
+			// out of range: infinity and zero
+			"1e309", "-1e309", "1e400", "1e-400", "123e99999",
+			// 19 and more significant digits, some of them in SWAR blocks
+			"1234567890123456789", "12345678901234567890", "1234567890123456789012345", "0.1234567890123456789",
+			"9999999999999999999", "18446744073709551615", "18446744073709551616", "1.00000000000000000001",
+			"99999999999999999999.5", "3.14159265358979323846264338327950288",
+			// runs of leading zeros, in and across eight-digit blocks
+			"0000000000000000000000001.5", "00000001", "000000012345678", "0.000000001234",
+			"0.0000000000000000000000012345678901234567", "0.00000000000000000000001", "000000000000000000000000",
+			"0.0000000000000000000000000000000000000000000000000000000000000000000000001e70",
+			"00000000000000000000123456789012345678", "-0.0", "0e999",
+			// short, signed and partial forms
+			"0", "7", ".5", "5.", "-.25", "+42", "+1.5e3", "1e", "1e+", "1.5e-", "2E5", "12345678", "123456789",
+			"1234567812345678", "12345678.12345678", "-", ".", "+", "e5", "1.2.3", "12,34", "1e0001",
+		};
+		for (const std::string& number : numbers)
+		{
+			checkNumber(number);
+		}
+		// longer than the parser's stack buffer
+		checkNumber("0." + std::string(150, '0') + "123456789012345678901234567890e140");
+		checkNumber(std::string(200, '9') + "e-300");
+	}
+
+	// shortest and 17-digit forms of random doubles over the whole exponent range
+	void checkRandom()
+	{
+		std::mt19937_64 generator(42);
+		char buffer[64];
+		for (int i = 0; i < 200000; ++i)
+		{
+			uint64_t bits = generator();
+			double value;
+			std::memcpy(&value, &bits, sizeof(value));
+			if (!std::isfinite(value))
+			{
+				continue;
+			}
+			const char* formats[] = {"%.17g", "%.6g", "%.15e", "%.3f"};
+			std::snprintf(buffer, sizeof(buffer), formats[i % 4], value);
+			checkNumber(buffer);
+
+			// typical coordinates: a few digits at a moderate scale
+			std::snprintf(buffer, sizeof(buffer), "%.*e", static_cast<int>(generator() % 18),
+				std::ldexp(static_cast<double>(generator() >> 11), static_cast<int>(generator() % 200) - 150));
+			checkNumber(buffer);
+		}
+	}
+
+	void checkCsv()
+	{
+		const std::filesystem::path path = std::filesystem::temp_directory_path() / "nbody-loader-check.csv";
+		{
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			file << "# exported initial conditions\r\n"
+				"\r\n"
+				"x,y,z,vx,vy,vz,mass\r\n"
+				"# first body\r\n"
+				"1.5,-2.25,3e10,0.000000001,00000002,-0.5,1e22\r\n"
+				"\r\n"
+				"  9007199254740993, 1e-23 ,12345678901234567890, .5, 5., -0, 6.6743e-11  # trailing comment\r\n"
+				"1e23,0000000000000000000000001.5,-1.7976931348623157e308,1,2,3,4";
+		}
+		dhh::nbody::BodyArray bodies;
+		dhh::thread::ThreadPool pool(3);
+		dhh::nbody::BodyLoader(path, dhh::nbody::LoadConfig{}).load(bodies, pool);
+		std::filesystem::remove(path);
+
+		const char* rows[][7] = {
+			{"1e22", "1.5", "-2.25", "3e10", "0.000000001", "2", "-0.5"},
+			{"6.6743e-11", "9007199254740993", "1e-23", "12345678901234567890", ".5", "5.", "-0"},
+			{"4", "1e23", "1.5", "-1.7976931348623157e308", "1", "2", "3"},
+		};
+		if (bodies.size() != 3)
+		{
+			++failures;
+			std::cout << "CSV: " << bodies.size() << " bodies instead of 3\n";
+			return;
+		}
+		for (size_t i = 0; i < bodies.size(); ++i)
+		{
+			const double loaded[7] = {bodies[i].mass, bodies[i].position.x, bodies[i].position.y,
+				bodies[i].position.z, bodies[i].velocity.x, bodies[i].velocity.y, bodies[i].velocity.z};
+			for (size_t field = 0; field < 7; ++field)
+			{
+				const double expected = std::strtod(rows[i][field], nullptr);
+				if (std::memcmp(&loaded[field], &expected, sizeof(double)) != 0)
+				{
+					++failures;
+					std::cout << "CSV: body " << i << " " << dhh::nbody::load::FieldNames[field] << " = "
+						<< loaded[field] << ", expected " << rows[i][field] << "\n";
+				}
+			}
+		}
+	}
+}
+
+int main()
+{
+	try
+	{
+		checkBoundaries();
+		checkRandom();
+		checkCsv();
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << e.what() << "\n";
+		return 1;
+	}
+	if (failures > 0)
+	{
+		std::cout << failures << " mismatches\n";
+		return 1;
+	}
+	std::cout << "Loader number parsing matches strtod\n";
+	return 0;
+}
@@ -0,0 +1,220 @@
+#include "Body.hpp"
+#include "QueryService.hpp"
+#include "ThreadPool.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Starts a QueryService on a socket in the temporary directory with recording control hooks, publishes a known
+// state and queries it through QueryClient: Snapshot, Subset and Region must return the published bodies bit for
+// bit, Diagnostics their sums, and Pause, Step and Resume must reach the hooks, also before the first publish.
+// Prints every mismatch and exits with 1 if there was any.
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool condition, const std::string& what)
+	{
+		if (!condition)
+		{
+			++failures;
+			std::cout << what << "\n";
+		}
+	}
+
+	bool sameBody(const dhh::nbody::Body& a, const dhh::nbody::Body& b)
+	{
+		return std::memcmp(&a, &b, sizeof(dhh::nbody::Body)) == 0;
+	}
+
+	bool close(double value, double expected)
+	{
+		return std::abs(value - expected) <= 1e-12 * std::max(std::abs(expected), 1.0);
+	}
+
+	dhh::nbody::BodyArray makeBodies(size_t count)
+	{
+		dhh::nbody::BodyArray bodies(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			const double t = static_cast<double>(i);
+			bodies[i].position = glm::dvec3(std::cos(t) * (1 + t), std::sin(t) * (1 + t), t * 0.5 - 20);
+			bodies[i].velocity = glm::dvec3(-std::sin(t), std::cos(t), 0.25 * (i % 3));
+			bodies[i].mass = 1 + static_cast<double>(i % 7);
+		}
+		return bodies;
+	}
+
+	// every request type against a service that has published bodies as step 42
+	void checkQueries(dhh::nbody::QueryClient& client, const dhh::nbody::BodyArray& bodies)
+	{
+		using dhh::nbody::QueryStatus;
+
+		const auto snapshot = client.snapshot();
+		check(snapshot.header.status == QueryStatus::Ok, "Snapshot: not Ok");
+		check(snapshot.header.step == 42 && snapshot.header.time == 1.5, "Snapshot: wrong step or time");
+		check(snapshot.bodies.size() == bodies.size(), "Snapshot: " + std::to_string(snapshot.bodies.size())
+			+ " bodies instead of " + std::to_string(bodies.size()));
+		for (size_t i = 0; i < std::min(snapshot.bodies.size(), bodies.size()); ++i)
+		{
+			check(sameBody(snapshot.bodies[i], bodies[i]), "Snapshot: body " + std::to_string(i) + " differs");
+		}
+
+		// out of order, repeated and consecutive indices, the last ones merged into one vector by the service
+		const std::vector<uint32_t> indices = {7, 3, 3, 50, 51, 52, 0, static_cast<uint32_t>(bodies.size() - 1)};
+		const auto subset = client.subset(indices);
+		check(subset.header.status == QueryStatus::Ok && subset.bodies.size() == indices.size(), "Subset: not Ok");
+		for (size_t i = 0; i < std::min(subset.bodies.size(), indices.size()); ++i)
+		{
+			check(sameBody(subset.bodies[i], bodies[indices[i]]), "Subset: body " + std::to_string(indices[i])
+				+ " differs");
+		}
+		const auto outOfRange = client.subset({1, static_cast<uint32_t>(bodies.size())});
+		check(outOfRange.header.status == QueryStatus::OutOfRange && outOfRange.bodies.empty(),
+			"Subset: an index past the body count was not OutOfRange");
+
+		const glm::dvec3 min(-10, -10, -20);
+		const glm::dvec3 max(10, 10, 0);
+		std::vector<uint32_t> inside;
+		for (size_t i = 0; i < bodies.size(); ++i)
+		{
+			const glm::dvec3& p = bodies[i].position;
+			if (p.x >= min.x && p.y >= min.y && p.z >= min.z && p.x <= max.x && p.y <= max.y && p.z <= max.z)
+			{
+				inside.push_back(static_cast<uint32_t>(i));
+			}
+		}
+		const auto region = client.region(min, max);
+		check(region.header.status == QueryStatus::Ok, "Region: not Ok");
+		check(region.indices == inside, "Region: " + std::to_string(region.indices.size()) + " indices, expected "
+			+ std::to_string(inside.size()));
+		check(region.bodies.size() == region.indices.size(), "Region: body and index counts differ");
+		for (size_t i = 0; i < std::min(region.bodies.size(), region.indices.size()); ++i)
+		{
+			check(region.indices[i] < bodies.size() && sameBody(region.bodies[i], bodies[region.indices[i]]),
+				"Region: body " + std::to_string(region.indices[i]) + " differs");
+		}
+		const auto empty = client.region(glm::dvec3(1e6), glm::dvec3(2e6));
+		check(empty.header.status == QueryStatus::Ok && empty.indices.empty() && empty.bodies.empty(),
+			"Region: a box without bodies returned some");
+
+		double mass = 0;
+		double kinetic = 0;
+		glm::dvec3 momentum(0);
+		glm::dvec3 angularMomentum(0);
+		glm::dvec3 weighted(0);
+		for (const dhh::nbody::Body& body : bodies)
+		{
+			mass += body.mass;
+			kinetic += 0.5 * body.mass * glm::dot(body.velocity, body.velocity);
+			momentum += body.velocity * body.mass;
+			angularMomentum += glm::cross(body.position, body.velocity) * body.mass;
+			weighted += body.position * body.mass;
+		}
+		const glm::dvec3 centre = weighted / mass;
+		const auto diagnostics = client.diagnostics();
+		const dhh::nbody::QueryDiagnostics& d = diagnostics.diagnostics;
+		check(diagnostics.header.status == QueryStatus::Ok, "Diagnostics: not Ok");
+		check(d.bodyCount == bodies.size() && close(d.totalMass, mass) && close(d.kineticEnergy, kinetic),
+			"Diagnostics: wrong body count, mass or kinetic energy");
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			check(close(d.momentum[axis], momentum[axis]) && close(d.angularMomentum[axis], angularMomentum[axis])
+				&& close(d.centreOfMass[axis], centre[axis]), "Diagnostics: wrong vector sums, axis "
+				+ std::to_string(axis));
+		}
+		check(d.published == 1 && d.skipped == 0, "Diagnostics: wrong published or skipped count");
+	}
+}
+
+int main()
+{
+#ifdef _WIN32
+	std::cout << "The query service needs Unix domain sockets\n";
+	return 0;
+#else
+	using dhh::nbody::QueryStatus;
+
+	std::atomic<int> pauses{0};
+	std::atomic<int> resumes{0};
+	std::atomic<uint32_t> steps{0};
+	std::atomic<bool> paused{false};
+	dhh::nbody::QueryControl control;
+	control.pause = [&](bool pause) {
+		(pause ? pauses : resumes).fetch_add(1);
+		paused = pause;
+	};
+	control.step = [&](uint32_t count) { steps.fetch_add(count); };
+	control.paused = [&] { return paused.load(); };
+
+	const std::filesystem::path path =
+		std::filesystem::temp_directory_path() / ("nbody-query-check-" + std::to_string(getpid()) + ".sock");
+	try
+	{
+		const dhh::nbody::BodyArray bodies = makeBodies(1000);
+		dhh::thread::ThreadPool pool(3);
+		dhh::nbody::QueryService service(path, bodies.size(), control);
+		dhh::nbody::QueryClient client(path);
+
+		// nothing published yet: steering works, the data queries are unavailable
+		check(client.pause(true).header.status == QueryStatus::Ok, "Pause before the first publish: not Ok");
+		check(pauses == 1 && paused, "Pause did not reach the hook");
+		check(client.snapshot().header.status == QueryStatus::Unavailable,
+			"Snapshot before the first publish: not Unavailable");
+
+		service.publish(42, 1.5, bodies.data(), pool);
+		checkQueries(client, bodies);
+		check(client.diagnostics().diagnostics.paused == 1, "Diagnostics: not paused");
+
+		check(client.step(5).header.status == QueryStatus::Ok && client.step(2).header.status == QueryStatus::Ok,
+			"Step: not Ok");
+		check(steps == 7, "Step: the hook got " + std::to_string(steps.load()) + " steps instead of 7");
+		check(client.pause(false).header.status == QueryStatus::Ok, "Resume: not Ok");
+		check(resumes == 1 && !paused, "Resume did not reach the hook");
+		check(client.diagnostics().diagnostics.paused == 0, "Diagnostics: still paused after Resume");
+
+		const auto unknown = client.request(static_cast<dhh::nbody::QueryType>(99), 0, nullptr, 0);
+		check(unknown.header.status == QueryStatus::BadRequest, "Unknown request type: not BadRequest");
+
+		// a second client on the same service
+		dhh::nbody::QueryClient second(path);
+		check(second.snapshot().bodies.size() == bodies.size(), "Second client: wrong snapshot");
+		check(service.requests() == 15, "Service counted " + std::to_string(service.requests())
+			+ " requests instead of 15");
+
+		// without hooks the service cannot steer
+		const std::filesystem::path plainPath = path.string() + "-plain";
+		dhh::nbody::QueryService plain(plainPath, bodies.size(), dhh::nbody::QueryControl{});
+		dhh::nbody::QueryClient plainClient(plainPath);
+		check(plainClient.pause(true).header.status == QueryStatus::Unavailable,
+			"Pause without hooks: not Unavailable");
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << e.what() << "\n";
+		return 1;
+	}
+	check(!std::filesystem::exists(path), "The socket file was not removed");
+	if (failures > 0)
+	{
+		std::cout << failures << " failures\n";
+		return 1;
+	}
+	std::cout << "Query service answers match the published state\n";
+	return 0;
+#endif
+}